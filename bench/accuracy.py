@@ -0,0 +1,234 @@
+"""
+Measure the error of the sizes that snapshots estimate from sampled blocks,
+to choose a sample rate:
+
+    python bench/accuracy.py -o results.jsonl
+    python bench/accuracy.py --sample-rate 1048576 --distribution mixed
+
+Every distribution of block sizes below is allocated from a stack of its
+own, with the same sizes in every trial. Each trial profiles them at a
+sample rate and compares the estimate of statistics("lineno") for each
+stack with the true size. Every sample rate and distribution writes one
+JSON object per line with:
+
+- true_size: the true size of the distribution's live blocks, in bytes.
+- mean_size: the mean of the estimates.
+- bias: the mean relative error of the estimates.
+- rms_error: the root mean square of the relative errors.
+- p50_error, p90_error, max_error: percentiles of the absolute relative
+  errors.
+- missed: the fraction of trials in which no block of the stack was
+  sampled.
+- coverage: the fraction of trials in which Statistic.size_interval()
+  contained the true size, which should be about the confidence.
+- interval_width: the mean width of those intervals, relative to the true
+  size.
+"""
+import argparse
+import json
+import math
+import random
+import sys
+
+import mprofile
+
+# Distributions
+# -------------
+# Each returns the payload sizes of bytes objects totaling about total
+# bytes. Every block is allocated separately, so the small ones take most
+# of the time.
+
+
+def _log_uniform(rng, low, high):
+    return int(math.exp(rng.uniform(math.log(low), math.log(high))))
+
+
+def small(rng, total):
+    """Objects of 16 to 512 bytes, like most Python objects."""
+    return _fill(total, lambda: rng.randint(16, 512))
+
+
+def medium(rng, total):
+    """Buffers of 512 bytes to 64 KiB, spread evenly over the octaves."""
+    return _fill(total, lambda: _log_uniform(rng, 512, 64 * 1024))
+
+
+def large(rng, total):
+    """Arrays of 1 to 8 MiB, which are sampled at nearly every rate."""
+    return _fill(total, lambda: _log_uniform(rng, 1 << 20, 8 << 20))
+
+
+def mixed(rng, total):
+    """
+    Mostly small objects, with one in ten up to 1 MiB. Their average size
+    misrepresents both, which biases the scaling of their samples.
+    """
+
+    def size():
+        if rng.random() < 0.1:
+            return _log_uniform(rng, 4096, 1 << 20)
+        return rng.randint(16, 512)
+
+    return _fill(total, size)
+
+
+def pareto(rng, total):
+    """A heavy tail of sizes from 64 bytes, capped at 16 MiB."""
+    return _fill(total, lambda: min(int(64 * rng.paretovariate(1.2)), 16 << 20))
+
+
+def _fill(total, size):
+    sizes = []
+    while total > 0:
+        sizes.append(size())
+        total -= sizes[-1]
+    return sizes
+
+
+DISTRIBUTIONS = {
+    "small": small,
+    "medium": medium,
+    "large": large,
+    "mixed": mixed,
+    "pareto": pareto,
+}
+
+_LEAVES_FILENAME = "accuracy_leaves.py"
+
+
+def _leaves(names):
+    """
+    Compiles a function for each distribution, which allocates a block from
+    a line of its own: the line of the n-th is 2 * n + 2.
+    """
+    src = "".join(
+        "def leaf_%d(n):\n    return bytes(n)\n" % i for i in range(len(names))
+    )
+    code = {}
+    exec(compile(src, _LEAVES_FILENAME, "exec"), code)
+    return [code["leaf_%d" % i] for i in range(len(names))]
+
+
+def _percentile(values, q):
+    values = sorted(values)
+    return values[min(int(q * len(values)), len(values) - 1)]
+
+
+def run(sample_rate, names, sizes, trials, confidence):
+    """
+    Profiles every distribution trials times at sample_rate, and yields the
+    results of each.
+    """
+    leaves = _leaves(names)
+    # bytes(n) allocates a single block of the payload and a header.
+    header = sys.getsizeof(b"")
+    true_sizes = [sum(s) + header * len(s) for s in sizes]
+    estimates = [[] for _ in names]
+    intervals = [[] for _ in names]
+    for _ in range(trials):
+        mprofile.start(max_frames=1, sample_rate=sample_rate)
+        kept = []
+        for leaf, leaf_sizes in zip(leaves, sizes):
+            kept.append([leaf(n) for n in leaf_sizes])
+        snapshot = mprofile.take_snapshot()
+        mprofile.stop()
+        del kept
+
+        found = {}
+        for stat in snapshot.statistics("lineno"):
+            frame = stat.traceback[0]
+            if frame.filename == _LEAVES_FILENAME:
+                found[(frame.lineno - 2) // 2] = stat
+        for i in range(len(names)):
+            stat = found.get(i)
+            if stat is None:
+                estimates[i].append(0)
+                intervals[i].append((0, 0))
+            else:
+                estimates[i].append(stat.size)
+                intervals[i].append(stat.size_interval(confidence))
+
+    for i, name in enumerate(names):
+        truth = true_sizes[i]
+        errors = [float(e - truth) / truth for e in estimates[i]]
+        abs_errors = [abs(e) for e in errors]
+        yield {
+            "sample_rate": sample_rate,
+            "distribution": name,
+            "blocks": len(sizes[i]),
+            "true_size": truth,
+            "trials": trials,
+            "confidence": confidence,
+            "mean_size": sum(estimates[i]) / float(trials),
+            "bias": sum(errors) / trials,
+            "rms_error": math.sqrt(sum(e * e for e in errors) / trials),
+            "p50_error": _percentile(abs_errors, 0.5),
+            "p90_error": _percentile(abs_errors, 0.9),
+            "max_error": max(abs_errors),
+            "missed": sum(1 for e in estimates[i] if e == 0) / float(trials),
+            "coverage": sum(1 for low, high in intervals[i] if low <= truth <= high)
+            / float(trials),
+            "interval_width": sum(high - low for low, high in intervals[i])
+            / float(trials * truth),
+        }
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(
+        description="Measure the error of sampled size estimates."
+    )
+    parser.add_argument(
+        "-o", "--output", help="path to write the results to, or stdout"
+    )
+    parser.add_argument(
+        "--distribution",
+        action="append",
+        choices=sorted(DISTRIBUTIONS),
+        help="a distribution of block sizes, by default all of them",
+    )
+    parser.add_argument(
+        "--sample-rate",
+        action="append",
+        type=int,
+        help="a sample rate, by default 128KiB, 512KiB, 1MiB and 4MiB",
+    )
+    parser.add_argument(
+        "--size",
+        type=int,
+        default=32 << 20,
+        help="the total size of each distribution, by default 32MiB",
+    )
+    parser.add_argument(
+        "--trials", type=int, default=100, help="the trials at each sample rate"
+    )
+    parser.add_argument(
+        "--confidence",
+        type=float,
+        default=0.95,
+        help="the confidence of the intervals, by default 0.95",
+    )
+    parser.add_argument(
+        "--seed", type=int, default=1, help="the seed of the block sizes"
+    )
+    args = parser.parse_args(argv)
+
+    names = args.distribution or sorted(DISTRIBUTIONS)
+    rng = random.Random(args.seed)
+    sizes = [DISTRIBUTIONS[name](rng, args.size) for name in names]
+    sample_rates = args.sample_rate or [128 << 10, 512 << 10, 1 << 20, 4 << 20]
+    out = open(args.output, "w") if args.output else sys.stdout
+    try:
+        for sample_rate in sample_rates:
+            for result in run(
+                sample_rate, names, sizes, args.trials, args.confidence
+            ):
+                out.write(json.dumps(result, sort_keys=True) + "\n")
+                out.flush()
+    finally:
+        if out is not sys.stdout:
+            out.close()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,245 @@
+"""
+Measure the end-to-end overhead of the profiler on a few self-contained
+workloads, without a profiler, with tracemalloc, and with mprofile at
+several sample rates and traceback limits:
+
+    python bench/overhead.py -o results.jsonl
+    python bench/overhead.py --python python3.8 --python python3.11 \\
+        --workload churn --sample-rate 131072 --max-frames 128
+
+Each run is a fresh interpreter, so that the peak RSS of one run is not
+inherited by the next. Every run writes one JSON object per line with the
+interpreter, workload and profiler settings, and:
+
+- wall_s: the wall time of each repeat of the workload, in seconds.
+- maxrss_kb: the peak resident set size of the process, in KiB.
+- profiler_memory: the memory used by the profiler after the last repeat,
+  as reported by get_tracemalloc_memory().
+
+Every interpreter must be able to import mprofile.
+"""
+import argparse
+import json
+import os
+import subprocess
+import sys
+import threading
+import time
+
+# Workloads
+# ---------
+# Each takes a fraction of a second without a profiler, and up to tens of
+# times as long when every allocation is traced.
+
+
+def churn():
+    """Many small, short-lived objects: dicts, lists, strings and ints."""
+    cache = {}
+    for i in range(200000):
+        key = i % 5000
+        cache[key] = {"id": i, "name": str(i), "tags": [i, i + 1, (i, key)]}
+    return len(cache)
+
+
+def buffers():
+    """Large, short-lived buffers, which are sampled nearly every time."""
+    kept = []
+    for i in range(30000):
+        buf = bytearray(64 * 1024 + i)
+        buf[0] = 1
+        kept.append(bytes(buf[: 1024 * (i % 64)]))
+        if len(kept) > 100:
+            del kept[: len(kept) // 2]
+    return len(kept)
+
+
+def _recurse(depth):
+    if depth == 0:
+        return [object() for _ in range(10)]
+    return _recurse(depth - 1)
+
+
+def recursion():
+    """Allocations under deep stacks, where capturing the stack dominates."""
+    n = 0
+    for _ in range(6000):
+        n += len(_recurse(200))
+    return n
+
+
+def raw_threads():
+    """
+    RAW domain allocations made without the GIL from several threads, as C
+    extensions do. These are made through ctypes, which releases the GIL.
+    """
+    import ctypes
+
+    api = ctypes.CDLL(None)
+    raw_malloc = api.PyMem_RawMalloc
+    raw_malloc.argtypes = [ctypes.c_size_t]
+    raw_malloc.restype = ctypes.c_void_p
+    raw_free = api.PyMem_RawFree
+    raw_free.argtypes = [ctypes.c_void_p]
+    raw_free.restype = None
+
+    def run():
+        for i in range(50000):
+            raw_free(raw_malloc(256 + i % 4096))
+
+    threads = [threading.Thread(target=run) for _ in range(4)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    return len(threads)
+
+
+WORKLOADS = {
+    "churn": churn,
+    "buffers": buffers,
+    "recursion": recursion,
+    "raw_threads": raw_threads,
+}
+
+
+def run_child(config):
+    """Runs one configuration in this process, and prints its results."""
+    workload = WORKLOADS[config["workload"]]
+    profiler = config["profiler"]
+    if profiler == "tracemalloc":
+        import tracemalloc as profiler_module
+
+        profiler_module.start(config["max_frames"])
+    elif profiler == "mprofile":
+        import mprofile as profiler_module
+
+        profiler_module.start(
+            max_frames=config["max_frames"], sample_rate=config["sample_rate"]
+        )
+    else:
+        profiler_module = None
+
+    wall_s = []
+    for _ in range(config["repeats"]):
+        start = time.perf_counter()
+        workload()
+        wall_s.append(time.perf_counter() - start)
+
+    profiler_memory = 0
+    if profiler_module is not None:
+        profiler_memory = profiler_module.get_tracemalloc_memory()
+        profiler_module.stop()
+    json.dump({"wall_s": wall_s, "profiler_memory": profiler_memory}, sys.stdout)
+
+
+def run(python, config):
+    """Runs one configuration in a new process of the given interpreter."""
+    env = dict(os.environ)
+    if python == sys.executable:
+        # Find mprofile where this process did, e.g. in bazel's runfiles.
+        env["PYTHONPATH"] = os.pathsep.join(p for p in sys.path if p)
+    proc = subprocess.Popen(
+        [python, os.path.abspath(__file__), "--child", json.dumps(config)],
+        stdout=subprocess.PIPE,
+        env=env,
+    )
+    out = proc.stdout.read()
+    proc.stdout.close()
+    # wait4 returns the resource usage of this child alone.
+    _, status, rusage = os.wait4(proc.pid, 0)
+    proc.returncode = 0
+    if status != 0:
+        raise RuntimeError("%s failed on %s" % (python, json.dumps(config)))
+
+    result = dict(config)
+    result.update(json.loads(out))
+    result["python"] = python
+    result["maxrss_kb"] = rusage.ru_maxrss
+    return result
+
+
+def python_version(python):
+    return subprocess.check_output(
+        [python, "-c", "import platform; print(platform.python_version())"],
+        universal_newlines=True,
+    ).strip()
+
+
+def configs(args):
+    for workload in args.workload:
+        base = {"workload": workload, "repeats": args.repeats}
+        yield dict(base, profiler="none", sample_rate=0, max_frames=0)
+        for max_frames in args.max_frames:
+            yield dict(
+                base, profiler="tracemalloc", sample_rate=0, max_frames=max_frames
+            )
+            for sample_rate in args.sample_rate:
+                yield dict(
+                    base,
+                    profiler="mprofile",
+                    sample_rate=sample_rate,
+                    max_frames=max_frames,
+                )
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(
+        description="Measure the overhead of profiling a few workloads."
+    )
+    parser.add_argument(
+        "-o", "--output", help="path to write the results to, or stdout"
+    )
+    parser.add_argument(
+        "--python",
+        action="append",
+        help="an interpreter to run the workloads with, by default this one",
+    )
+    parser.add_argument(
+        "--workload",
+        action="append",
+        choices=sorted(WORKLOADS),
+        help="a workload to run, by default all of them",
+    )
+    parser.add_argument(
+        "--sample-rate",
+        action="append",
+        type=int,
+        help="an mprofile sample rate, by default 1, 1024, 128KiB and 1MiB",
+    )
+    parser.add_argument(
+        "--max-frames",
+        action="append",
+        type=int,
+        help="a traceback limit, by default 1 and 128",
+    )
+    parser.add_argument(
+        "--repeats", type=int, default=3, help="the repeats of each workload"
+    )
+    parser.add_argument("--child", help=argparse.SUPPRESS)
+    args = parser.parse_args(argv)
+
+    if args.child is not None:
+        run_child(json.loads(args.child))
+        return 0
+
+    args.python = args.python or [sys.executable]
+    args.workload = args.workload or sorted(WORKLOADS)
+    args.sample_rate = args.sample_rate or [1, 1024, 128 * 1024, 1024 * 1024]
+    args.max_frames = args.max_frames or [1, 128]
+    out = open(args.output, "w") if args.output else sys.stdout
+    try:
+        for python in args.python:
+            version = python_version(python)
+            for config in configs(args):
+                result = run(python, config)
+                result["python_version"] = version
+                out.write(json.dumps(result, sort_keys=True) + "\n")
+                out.flush()
+    finally:
+        if out is not sys.stdout:
+            out.close()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
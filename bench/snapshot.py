@@ -0,0 +1,156 @@
+"""
+Measure take_snapshot() and Snapshot.statistics() on large profiles:
+
+    python bench/snapshot.py -o results.jsonl --pointers 1000000 --stacks 100000
+
+Each run is a fresh interpreter that traces every allocation, and allocates
+the given number of objects spread over the given number of distinct
+stacks of (about) the given depth. Every run writes one JSON object per
+line with its settings and:
+
+- take_snapshot_s: the wall time of take_snapshot().
+- statistics_s: the wall time of statistics(key_type) for each key type.
+- peak_bytes: the most memory allocated at once by take_snapshot() and
+  statistics(), as traced by mprofile itself. This misses peaks that are
+  below the peak of the population.
+- maxrss_kb: the peak resident set size of the process, in KiB.
+
+src/snapshot_bench.cc measures the native half of take_snapshot() alone.
+"""
+import argparse
+import itertools
+import json
+import os
+import subprocess
+import sys
+import time
+
+KEY_TYPES = ("filename", "lineno", "traceback")
+
+
+def _descend(depth, leaf, n):
+    if depth > 1:
+        return _descend(depth - 1, leaf, n)
+    return leaf(n)
+
+
+def populate(num_pointers, num_stacks, depth):
+    """Allocates num_pointers objects from num_stacks leaf functions."""
+    src = "".join(
+        "def leaf_%d(n):\n    return [object() for _ in range(n)]\n" % k
+        for k in range(num_stacks)
+    )
+    leaves = {}
+    exec(compile(src, "snapshot_leaves.py", "exec"), leaves)
+    kept = []
+    for k in range(num_stacks):
+        n = num_pointers // num_stacks + (k < num_pointers % num_stacks)
+        kept.append(_descend(depth - 1, leaves["leaf_%d" % k], n))
+    return kept
+
+
+def run_child(config):
+    """Runs one configuration in this process, and prints its results."""
+    import mprofile
+
+    mprofile.start(sample_rate=1)
+    kept = populate(config["pointers"], config["stacks"], config["depth"])
+
+    traced = mprofile.get_traced_memory()[0]
+    start = time.perf_counter()
+    snapshot = mprofile.take_snapshot()
+    take_snapshot_s = time.perf_counter() - start
+    statistics_s = {}
+    for key_type in KEY_TYPES:
+        start = time.perf_counter()
+        snapshot.statistics(key_type)
+        statistics_s[key_type] = time.perf_counter() - start
+    del snapshot
+    peak_bytes = max(0, mprofile.get_traced_memory()[1] - traced)
+
+    mprofile.stop()
+    del kept
+    json.dump(
+        {
+            "take_snapshot_s": take_snapshot_s,
+            "statistics_s": statistics_s,
+            "peak_bytes": peak_bytes,
+        },
+        sys.stdout,
+    )
+
+
+def run(config):
+    """Runs one configuration in a new process."""
+    env = dict(os.environ)
+    # Find mprofile where this process did, e.g. in bazel's runfiles.
+    env["PYTHONPATH"] = os.pathsep.join(p for p in sys.path if p)
+    proc = subprocess.Popen(
+        [sys.executable, os.path.abspath(__file__), "--child", json.dumps(config)],
+        stdout=subprocess.PIPE,
+        env=env,
+    )
+    out = proc.stdout.read()
+    proc.stdout.close()
+    # wait4 returns the resource usage of this child alone.
+    _, status, rusage = os.wait4(proc.pid, 0)
+    proc.returncode = 0
+    if status != 0:
+        raise RuntimeError("failed on %s" % json.dumps(config))
+
+    result = dict(config)
+    result.update(json.loads(out))
+    result["maxrss_kb"] = rusage.ru_maxrss
+    return result
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(
+        description="Measure snapshots of large profiles."
+    )
+    parser.add_argument(
+        "-o", "--output", help="path to write the results to, or stdout"
+    )
+    parser.add_argument(
+        "--pointers",
+        action="append",
+        type=int,
+        help="a number of live objects, by default 10^4, 10^5 and 10^6",
+    )
+    parser.add_argument(
+        "--stacks",
+        action="append",
+        type=int,
+        help="a number of distinct stacks, by default 1000",
+    )
+    parser.add_argument(
+        "--depth",
+        action="append",
+        type=int,
+        help="a depth of the stacks, by default 16",
+    )
+    parser.add_argument("--child", help=argparse.SUPPRESS)
+    args = parser.parse_args(argv)
+
+    if args.child is not None:
+        run_child(json.loads(args.child))
+        return 0
+
+    out = open(args.output, "w") if args.output else sys.stdout
+    try:
+        for pointers, stacks, depth in itertools.product(
+            args.pointers or [10 ** 4, 10 ** 5, 10 ** 6],
+            args.stacks or [1000],
+            args.depth or [16],
+        ):
+            config = {"pointers": pointers, "stacks": stacks, "depth": depth}
+            out.write(json.dumps(run(config), sort_keys=True) + "\n")
+            out.flush()
+    finally:
+        if out is not sys.stdout:
+            out.close()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -4,15 +4,35 @@ try:
 except ImportError:
     from collections import Iterable, Sequence  # noqa
 
+import collections
+import contextlib
 import fnmatch
 from functools import total_ordering
 import linecache
 import math
 import os.path
+import threading
 
 # Import types and functions implemented in C
 from mprofile._profiler import *
-from mprofile._profiler import _get_object_traceback, _get_traces
+from mprofile._profiler import (
+    _compare_traces,
+    _dump_traces,
+    _get_baseline_traces,
+    _get_label_set,
+    _get_object_traceback,
+    _get_peak_traces,
+    _get_sampling,
+    _get_timeline,
+    _get_traces,
+    _label_totals,
+    _reset_label_set,
+    _reset_region,
+    _set_label_set,
+    _set_region,
+    _top_stacks,
+)
+from mprofile._profile_file import LazyTraces, ProfileFile
 
 
 # setup.py reads the version information from here to set package version
@@ -41,12 +61,16 @@ class Statistic(object):
     Statistic difference on memory allocations between two Snapshot instance.
     """
 
-    __slots__ = ("traceback", "size", "count")
+    __slots__ = ("traceback", "size", "count", "size_stderr", "count_stderr")
 
-    def __init__(self, traceback, size, count):
+    def __init__(self, traceback, size, count, size_stderr=0.0, count_stderr=0.0):
         self.traceback = traceback
         self.size = size
         self.count = count
+        # The standard errors of size and count, when they are estimated
+        # from sampled blocks (see _sample_variance), or else 0.
+        self.size_stderr = size_stderr
+        self.count_stderr = count_stderr
 
     def __hash__(self):
         return hash((self.traceback, self.size, self.count))
@@ -76,6 +100,21 @@ class Statistic(object):
             self.count,
         )
 
+    def size_interval(self, confidence=0.95):
+        """
+        Get a confidence interval (low, high) for the true size, when it is
+        estimated from a sample. The interval is (size, size) if every
+        block was traced.
+        """
+        return _interval(self.size, self.size_stderr, confidence)
+
+    def count_interval(self, confidence=0.95):
+        """
+        Get a confidence interval (low, high) for the true number of
+        blocks, like size_interval().
+        """
+        return _interval(self.count, self.count_stderr, confidence)
+
     def _sort_key(self):
         return (self.size, self.count, self.traceback)
 
@@ -141,30 +180,6 @@ class StatisticDiff(object):
         )
 
 
-def _compare_grouped_stats(old_group, new_group):
-    statistics = []
-    for traceback, stat in new_group.items():
-        previous = old_group.pop(traceback, None)
-        if previous is not None:
-            stat = StatisticDiff(
-                traceback,
-                stat.size,
-                stat.size - previous.size,
-                stat.count,
-                stat.count - previous.count,
-            )
-        else:
-            stat = StatisticDiff(
-                traceback, stat.size, stat.size, stat.count, stat.count
-            )
-        statistics.append(stat)
-
-    for traceback, stat in old_group.items():
-        stat = StatisticDiff(traceback, 0, -stat.size, 0, -stat.count)
-        statistics.append(stat)
-    return statistics
-
-
 @total_ordering
 class Frame(object):
     """
@@ -299,8 +314,14 @@ class Trace(object):
     __slots__ = ("_trace",)
 
     def __init__(self, trace):
-        # trace is a tuple: (size, traceback), see Traceback constructor
-        # for the format of the traceback tuple
+        # trace is a tuple: (size, traceback) or (size, traceback, count),
+        # see Traceback constructor for the format of the traceback tuple.
+        # Traces loaded from a profile aggregate count sampled blocks.
+        # Labeled blocks are (size, traceback, 1, label_set), and blocks
+        # sampled in a region or at a rate of their own (with
+        # start(sampling="count") or "stratified") are (size, traceback, 1,
+        # label_set, sample_rate). Totals that are already estimated, from a
+        # profile or a peak snapshot, have a sample_rate of 1.
         self._trace = trace
 
     @property
@@ -311,6 +332,17 @@ class Trace(object):
     def size(self):
         return self._trace[0]
 
+    @property
+    def count(self):
+        return _trace_count(self._trace)
+
+    @property
+    def labels(self):
+        """The labels that were set when the memory block was allocated."""
+        if len(self._trace) > 3:
+            return dict(_label_sets[self._trace[3]])
+        return {}
+
     def __eq__(self, other):
         return self._trace == other._trace
 
@@ -327,6 +359,64 @@ class Trace(object):
         )
 
 
+def _trace_count(trace):
+    return trace[2] if len(trace) > 2 else 1
+
+
+def _scale_sample(size, count, sample_rate):
+    """
+    Estimate the total size and number of blocks from a sample of count
+    blocks with the given total size.
+    """
+    if count == 0 or size == 0 or sample_rate <= 1:
+        return size, count
+    avg_size = float(size) / count
+    scale = 1.0 / (1.0 - math.exp(-avg_size / sample_rate))
+    return scale * size, scale * count
+
+
+def _sample_variance(size, count, sample_rate):
+    """
+    Estimate the variances of the estimates of _scale_sample. Each block of
+    size s is sampled with probability p = 1 - exp(-s / sample_rate), and
+    counted 1 / p times, so a sample of blocks of the average size has a
+    variance of count * avg_size^2 * (1 - p) / p^2.
+    """
+    if count == 0 or size == 0 or sample_rate <= 1:
+        return 0.0, 0.0
+    avg_size = float(size) / count
+    unsampled = math.exp(-avg_size / sample_rate)
+    count_var = count * unsampled / (1.0 - unsampled) ** 2
+    return count_var * avg_size * avg_size, count_var
+
+
+def _normal_quantile(confidence):
+    """
+    Find the z such that a normal variable is within z standard deviations
+    of its mean with the given probability.
+    """
+    if not 0 < confidence < 1:
+        raise ValueError("confidence must be between 0 and 1")
+    low, high = 0.0, 40.0
+    for _ in range(100):
+        mid = (low + high) / 2
+        if math.erf(mid / math.sqrt(2)) < confidence:
+            low = mid
+        else:
+            high = mid
+    return high
+
+
+def _interval(estimate, stderr, confidence):
+    z = _normal_quantile(confidence)
+    return max(estimate - z * stderr, 0), estimate + z * stderr
+
+
+def _add_variance(total, variance):
+    total[0] += variance[0]
+    total[1] += variance[1]
+
+
 class _Traces(Sequence):
     def __init__(self, traces):
         Sequence.__init__(self)
@@ -408,6 +498,25 @@ class Snapshot(object):
         self.traceback_limit = traceback_limit
         self.sample_rate = sample_rate
 
+    def dump(self, filename):
+        """
+        Write the snapshot into a file. Traces with the same traceback are
+        combined.
+        """
+        _dump_traces(
+            self.traces._traces, self.traceback_limit, self.sample_rate, filename
+        )
+
+    @staticmethod
+    def load(filename):
+        """
+        Load a snapshot from a file written by Snapshot.dump(), dump_profile()
+        or merge_profiles(). The file is mapped into memory, and traces are
+        only decoded when they are accessed.
+        """
+        profile = ProfileFile(filename)
+        return Snapshot(LazyTraces(profile), profile.max_frames, profile.sample_rate)
+
     def _filter_trace(self, include_filters, exclude_filters, trace):
         traceback = trace[1]
         if include_filters:
@@ -451,7 +560,8 @@ class Snapshot(object):
             new_traces = self.traces._traces[:]
         return Snapshot(new_traces, self.traceback_limit, self.sample_rate)
 
-    def _group_by(self, key_type, cumulative):
+    @staticmethod
+    def _check_key_type(key_type, cumulative):
         if key_type not in ("traceback", "filename", "lineno"):
             raise ValueError("unknown key_type: %r" % (key_type,))
         if cumulative and key_type not in ("lineno", "filename"):
@@ -459,11 +569,26 @@ class Snapshot(object):
                 "cumulative mode cannot by used " "with key type %r" % key_type
             )
 
+    def _group_by(self, key_type, cumulative):
+        self._check_key_type(key_type, cumulative)
+
         stats = {}
+        # Blocks sampled in a region are scaled one at a time by the region's
+        # sample rate, and added to the others once they have been scaled.
+        # The variances of their estimates are summed in region_variances.
+        region_stats = {}
+        region_variances = collections.defaultdict(lambda: [0.0, 0.0])
         tracebacks = {}
         if not cumulative:
             for trace in self.traces._traces:
-                size, trace_traceback = trace
+                size, trace_traceback = trace[:2]
+                count = _trace_count(trace)
+                target = stats
+                variance = None
+                if len(trace) > 4:
+                    variance = _sample_variance(size, count, trace[4])
+                    size, count = _scale_sample(size, count, trace[4])
+                    target = region_stats
                 try:
                     traceback = tracebacks[trace_traceback]
                 except KeyError:
@@ -476,16 +601,25 @@ class Snapshot(object):
                         frames = (("", trace_traceback[0][1], 0, 0),)
                     traceback = Traceback(frames)
                     tracebacks[trace_traceback] = traceback
+                if variance is not None:
+                    _add_variance(region_variances[traceback], variance)
                 try:
-                    stat = stats[traceback]
+                    stat = target[traceback]
                     stat.size += size
-                    stat.count += 1
+                    stat.count += count
                 except KeyError:
-                    stats[traceback] = Statistic(traceback, size, 1)
+                    target[traceback] = Statistic(traceback, size, count)
         else:
             # cumulative statistics
             for trace in self.traces._traces:
-                size, trace_traceback = trace
+                size, trace_traceback = trace[:2]
+                count = _trace_count(trace)
+                target = stats
+                variance = None
+                if len(trace) > 4:
+                    variance = _sample_variance(size, count, trace[4])
+                    size, count = _scale_sample(size, count, trace[4])
+                    target = region_stats
                 for frame in trace_traceback:
                     try:
                         traceback = tracebacks[frame]
@@ -496,13 +630,30 @@ class Snapshot(object):
                             frames = (("", frame[1], 0, 0),)
                         traceback = Traceback(frames)
                         tracebacks[frame] = traceback
+                    if variance is not None:
+                        _add_variance(region_variances[traceback], variance)
                     try:
-                        stat = stats[traceback]
+                        stat = target[traceback]
                         stat.size += size
-                        stat.count += 1
+                        stat.count += count
                     except KeyError:
-                        stats[traceback] = Statistic(traceback, size, 1)
-        return self._scale_heap_samples(stats)
+                        target[traceback] = Statistic(traceback, size, count)
+        stats = self._scale_heap_samples(stats)
+        for traceback, region_stat in region_stats.items():
+            size = int(region_stat.size)
+            count = int(region_stat.count)
+            size_var, count_var = region_variances[traceback]
+            try:
+                stat = stats[traceback]
+                stat.size += size
+                stat.count += count
+                size_var += stat.size_stderr ** 2
+                count_var += stat.count_stderr ** 2
+            except KeyError:
+                stat = stats[traceback] = Statistic(traceback, size, count)
+            stat.size_stderr = math.sqrt(size_var)
+            stat.count_stderr = math.sqrt(count_var)
+        return stats
 
     def _scale_heap_samples(self, stats):
         for tb, stat in stats.items():
@@ -510,14 +661,14 @@ class Snapshot(object):
         return stats
 
     def _scale_heap_sample(self, stat):
-        if stat.count == 0 or stat.size == 0:
-            return stat
-        if self.sample_rate <= 1:
-            return stat
-        avg_size = float(stat.size) / stat.count
-        scale = 1.0 / (1.0 - math.exp(-avg_size / self.sample_rate))
-        stat.size = int(scale * stat.size)
-        stat.count = int(scale * stat.count)
+        size_var, count_var = _sample_variance(
+            stat.size, stat.count, self.sample_rate
+        )
+        size, count = _scale_sample(stat.size, stat.count, self.sample_rate)
+        stat.size = int(size)
+        stat.count = int(count)
+        stat.size_stderr = math.sqrt(size_var)
+        stat.count_stderr = math.sqrt(count_var)
         return stat
 
     def statistics(self, key_type, cumulative=False):
@@ -530,29 +681,307 @@ class Snapshot(object):
         statistics.sort(reverse=True, key=Statistic._sort_key)
         return statistics
 
-    def compare_to(self, old_snapshot, key_type, cumulative=False):
+    def compare_to(self, old_snapshot, key_type, cumulative=False, limit=None):
         """
         Compute the differences with an old snapshot old_snapshot. Get
         statistics as a sorted list of StatisticDiff instances, grouped by
-        group_by.
+        group_by. If limit is given, only the limit largest differences are
+        returned.
+
+        Both snapshots are grouped and diffed natively, so this is much
+        faster than comparing the results of statistics().
         """
-        new_group = self._group_by(key_type, cumulative)
-        old_group = old_snapshot._group_by(key_type, cumulative)
-        statistics = _compare_grouped_stats(old_group, new_group)
-        statistics.sort(reverse=True, key=StatisticDiff._sort_key)
-        return statistics
+        self._check_key_type(key_type, cumulative)
+        if limit is not None and limit < 0:
+            raise ValueError("limit must be non-negative")
+        diffs = _compare_traces(
+            self.traces._traces,
+            self.sample_rate,
+            old_snapshot.traces._traces,
+            old_snapshot.sample_rate,
+            key_type,
+            cumulative,
+            -1 if limit is None else limit,
+        )
+        return [
+            StatisticDiff(Traceback(traceback), size, size_diff, count, count_diff)
+            for traceback, size, size_diff, count, count_diff in diffs
+        ]
 
 
-def take_snapshot():
+def _snapshot_sample_rate():
+    # Samples that are weighted individually have a rate of their own.
+    if _get_sampling() != "bytes":
+        return 0
+    # Outside of regions, nothing is sampled with a negative sample rate.
+    return max(get_sample_rate(), 0)
+
+
+def take_snapshot(labels=None, since=None, until=None):
     """
     Take a snapshot of traces of memory blocks allocated by Python.
+
+    If labels is a dict, only the memory blocks that were allocated with
+    (at least) those labels are included. If since is an epoch returned by
+    mark(), only the blocks allocated after that mark are included, and if
+    until is, only those allocated before it. A block that is moved by
+    realloc keeps the epoch in which it was first allocated.
+    """
+    if not is_tracing():
+        raise RuntimeError(
+            "the mprofile module must be tracing memory "
+            "allocations to take a snapshot"
+        )
+    label_sets = None if labels is None else _matching_label_sets(labels)
+    traces = _get_traces(label_sets, since, until)
+    traceback_limit = get_traceback_limit()
+    return Snapshot(traces, traceback_limit, _snapshot_sample_rate())
+
+
+def take_baseline_snapshot():
+    """
+    Take a snapshot of traces of memory blocks that were inherited from the
+    parent process, when profiling was started with fork_policy="freeze".
+    """
+    traces = _get_baseline_traces()
+    if traces is None:
+        raise RuntimeError(
+            "there is no baseline: the process has not been forked "
+            "while tracing with fork_policy='freeze'"
+        )
+    traceback_limit = get_traceback_limit()
+    return Snapshot(traces, traceback_limit, _snapshot_sample_rate())
+
+
+def load_profile(path):
+    """
+    Load a heap profile written by dump_profile() or merge_profiles() as a
+    Snapshot.
+    """
+    return Snapshot.load(path)
+
+
+def get_peak_snapshot():
+    """
+    Take a snapshot of the traces of memory blocks that were live when the
+    traced memory was at its peak. This requires profiling to be started
+    with peak_hysteresis: the snapshot is taken whenever the traced memory
+    exceeds the previous peak by more than peak_hysteresis bytes.
     """
     if not is_tracing():
         raise RuntimeError(
             "the mprofile module must be tracing memory "
             "allocations to take a snapshot"
         )
-    traces = _get_traces()
+    traces = _get_peak_traces()
+    if traces is None:
+        raise RuntimeError(
+            "peak snapshots are not enabled: pass peak_hysteresis to start()"
+        )
     traceback_limit = get_traceback_limit()
-    sample_rate = get_sample_rate()
-    return Snapshot(traces, traceback_limit, sample_rate)
+    return Snapshot(traces, traceback_limit, _snapshot_sample_rate())
+
+
+Timeline = collections.namedtuple(
+    "Timeline", ("time_ns", "traced", "peak", "allocs", "frees")
+)
+
+
+def get_timeline():
+    """
+    Get the traced memory over time, as recorded when profiling was started
+    with timeline_interval. This returns a Timeline of equal-length arrays
+    (memoryviews of unsigned 64-bit integers), oldest point first:
+
+    - time_ns: the time of each point, as returned by time.monotonic_ns()
+    - traced: the traced memory at that time, like get_traced_memory()[0]
+    - peak: the largest traced memory since the previous point
+    - allocs, frees: the number of sampled allocations and frees since the
+      previous point
+
+    Points are recorded by the sampled allocations and frees themselves, at
+    most once per timeline_interval seconds, and only the last
+    timeline_size points are kept.
+    """
+    if not is_tracing():
+        raise RuntimeError(
+            "the mprofile module must be tracing memory "
+            "allocations to get the timeline"
+        )
+    data = _get_timeline()
+    if data is None:
+        raise RuntimeError(
+            "the timeline is not enabled: pass timeline_interval to start()"
+        )
+    columns = memoryview(data).cast("Q")
+    n = len(columns) // len(Timeline._fields)
+    return Timeline(
+        *(columns[i * n : (i + 1) * n] for i in range(len(Timeline._fields)))
+    )
+
+
+def library_patterns():
+    """
+    Get the filename patterns of the standard library and installed packages,
+    so that start(exclude=library_patterns()) attributes their allocations
+    to the application code that called them.
+    """
+    import glob
+    import site
+    import sysconfig
+
+    paths = sysconfig.get_paths()
+    dirs = set(
+        paths[name]
+        for name in ("stdlib", "platstdlib", "purelib", "platlib")
+        if name in paths
+    )
+    if hasattr(site, "getsitepackages"):
+        dirs.update(site.getsitepackages())
+    return sorted(os.path.join(glob.escape(d), "*") for d in dirs)
+
+
+# The interned label sets: _label_sets[i] is the tuple of sorted (key, value)
+# pairs of label set i, and _label_set_ids maps them back to i. The empty
+# set is 0.
+_label_sets = [()]
+_label_set_ids = {(): 0}
+_label_sets_lock = threading.Lock()
+_MAX_LABEL_SETS = 1 << 16
+
+
+def _intern_label_set(items):
+    with _label_sets_lock:
+        label_set = _label_set_ids.get(items)
+        if label_set is None:
+            if len(_label_sets) >= _MAX_LABEL_SETS:
+                raise ValueError("too many distinct label sets")
+            label_set = len(_label_sets)
+            _label_sets.append(items)
+            _label_set_ids[items] = label_set
+        return label_set
+
+
+def _matching_label_sets(labels):
+    items = set(labels.items())
+    return [i for i, label_set in enumerate(_label_sets) if items <= set(label_set)]
+
+
+def get_labels():
+    """
+    Get the labels that are currently attached to new allocations, as a dict.
+    """
+    return dict(_label_sets[_get_label_set()])
+
+
+@contextlib.contextmanager
+def labels(**labels):
+    """
+    Attach key/value labels to the memory blocks allocated in the with
+    block, like pprof labels, so that memory can be attributed to the
+    request (or other unit of work) that allocated it rather than only its
+    stack. Nested labels are added to the enclosing ones.
+
+    Labels are kept in a contextvars context, so each asyncio task has its
+    own. Before Python 3.7, they are per thread.
+    """
+    for value in labels.values():
+        if not isinstance(value, str):
+            raise TypeError("label values must be strings")
+    merged = get_labels()
+    merged.update(labels)
+    token = _set_label_set(_intern_label_set(tuple(sorted(merged.items()))))
+    try:
+        yield
+    finally:
+        _reset_label_set(token)
+
+
+@contextlib.contextmanager
+def region(sample_rate=None, enabled=True):
+    """
+    Sample the memory blocks allocated by the calling thread in the with
+    block at sample_rate, rather than the rate profiling was started with,
+    or sample none of them if enabled is False. region() with neither
+    samples at the rate profiling was started with, even inside another
+    region.
+
+    This lets one code path be profiled at full fidelity with
+    region(sample_rate=1) while the rest of the process is sampled sparsely,
+    or not at all when profiling was started with a negative sample_rate.
+    Other threads are not affected, and there is no extra cost for the
+    allocations of threads outside of a region.
+
+    Every estimate scales the blocks sampled in a region by the region's
+    sample rate: snapshots, label_statistics(), top(), get_peak_snapshot(),
+    compare_to() and saved profiles. Their estimated sizes and counts are
+    kept apart from the blocks that were sampled at the rate profiling was
+    started with, so they are never scaled a second time.
+    A process can use at most 15 distinct region sample rates, counting
+    enabled=False as one.
+    """
+    if not enabled:
+        period = -1
+    elif sample_rate is None:
+        period = None
+    elif sample_rate < 0:
+        raise ValueError("sample_rate must be non-negative")
+    else:
+        period = sample_rate
+    token = _set_region(period)
+    try:
+        yield
+    finally:
+        _reset_region(token)
+
+
+LabelStatistic = collections.namedtuple("LabelStatistic", ("labels", "size", "count"))
+
+
+def label_statistics(key=None):
+    """
+    Get the estimated live memory of each set of labels, as a list of
+    LabelStatistic sorted from the biggest to the smallest. If key is not
+    None, memory is grouped by the value of that label alone.
+
+    This is computed natively from the live allocations, without building a
+    snapshot.
+    """
+    if not is_tracing():
+        raise RuntimeError(
+            "the mprofile module must be tracing memory "
+            "allocations to get label statistics"
+        )
+    totals = {}
+    for label_set, size, count in _label_totals():
+        items = _label_sets[label_set]
+        if key is not None:
+            items = tuple((k, v) for k, v in items if k == key)
+        total_size, total_count = totals.get(items, (0, 0))
+        totals[items] = (total_size + size, total_count + count)
+    statistics = [
+        LabelStatistic(dict(items), size, count)
+        for items, (size, count) in totals.items()
+    ]
+    statistics.sort(key=lambda stat: (stat.size, stat.count), reverse=True)
+    return statistics
+
+
+def top(n=10):
+    """
+    Get the n tracebacks with the most live memory, as a sorted list of
+    Statistic instances, like take_snapshot().statistics("traceback")[:n].
+
+    The profiler keeps running totals for each traceback, so this is much
+    cheaper than taking a snapshot.
+    """
+    if not is_tracing():
+        raise RuntimeError(
+            "the mprofile module must be tracing memory allocations to get top stacks"
+        )
+    statistics = [
+        Statistic(Traceback(frames), size, count)
+        for frames, size, count in _top_stacks(n)
+    ]
+    statistics.sort(reverse=True, key=Statistic._sort_key)
+    return statistics
@@ -0,0 +1,208 @@
+"""
+Lazy reader for the heap profile files written by Snapshot.dump(),
+dump_profile() and merge_profiles(). See src/profile.cc for the format.
+
+The file is mmapped, and the Python tuples for a trace are only built when
+it is accessed, so opening even a very large profile is cheap.
+"""
+import mmap
+import struct
+
+try:
+    from collections.abc import Sequence
+except ImportError:
+    from collections import Sequence
+
+_MAGIC = b"MPROFILE"
+_BYTE_ORDER_MARK = 0x01020304
+_FORMAT_VERSION = 2
+# Version 1 profiles have no scaled part.
+_MIN_FORMAT_VERSION = 1
+# magic, byte_order, version, sample_rate, max_frames, reserved, num_strings,
+# string_data_size, num_frames, num_samples
+_HEADER = struct.Struct("=8sIIQIIQQQQ")
+
+
+class _Reader(object):
+    def __init__(self, buf, filename):
+        self._buf = memoryview(buf)
+        self._filename = filename
+        self._pos = 0
+
+    def read(self, fmt, n):
+        """Returns the next column of n values with the given format."""
+        size = n * struct.calcsize(fmt)
+        if self._pos + size > len(self._buf):
+            raise ValueError("%s: invalid profile: wrong file size" % self._filename)
+        column = self._buf[self._pos : self._pos + size].cast(fmt)
+        self._pos += size + (8 - size % 8) % 8
+        return column
+
+    def done(self):
+        return self._pos >= len(self._buf)
+
+
+class ProfileFile(object):
+    """
+    The columns of a profile file. Strings and frame tuples are decoded on
+    first use and then shared by all traces that reference them.
+    """
+
+    def __init__(self, filename):
+        with open(filename, "rb") as f:
+            try:
+                self._mmap = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+            except ValueError:
+                # Empty files cannot be mapped.
+                self._mmap = b""
+
+        if len(self._mmap) < _HEADER.size:
+            raise ValueError("%s: invalid profile: bad magic number" % filename)
+        (
+            magic,
+            byte_order,
+            version,
+            self.sample_rate,
+            self.max_frames,
+            _,
+            num_strings,
+            string_data_size,
+            num_frames,
+            num_samples,
+        ) = _HEADER.unpack_from(self._mmap)
+        if magic != _MAGIC:
+            raise ValueError("%s: invalid profile: bad magic number" % filename)
+        if byte_order != _BYTE_ORDER_MARK:
+            raise ValueError(
+                "%s: invalid profile: written on a machine of different "
+                "byte order" % filename
+            )
+        if not _MIN_FORMAT_VERSION <= version <= _FORMAT_VERSION:
+            raise ValueError("%s: invalid profile: unsupported version" % filename)
+
+        r = _Reader(self._mmap, filename)
+        r.read("B", _HEADER.size)
+        self._string_offsets = r.read("Q", num_strings + 1)
+        self._string_data = r.read("B", string_data_size)
+        self.frame_hash = r.read("Q", num_frames)
+        self.frame_parent = r.read("I", num_frames)
+        self._frame_filename = r.read("I", num_frames)
+        self._frame_name = r.read("I", num_frames)
+        self._frame_firstlineno = r.read("i", num_frames)
+        self._frame_lineno = r.read("i", num_frames)
+        self.sample_frame = r.read("I", num_samples)
+        self.sample_size = r.read("Q", num_samples)
+        self.sample_count = r.read("Q", num_samples)
+        if version >= 2:
+            self.sample_scaled_size = r.read("Q", num_samples)
+            self.sample_scaled_count = r.read("Q", num_samples)
+            # Samples with both a sampled and a scaled part have a second
+            # trace for the scaled part, after all of the others.
+            self._scaled_parts = [
+                i
+                for i, count in enumerate(self.sample_scaled_count)
+                if count and self.sample_count[i]
+            ]
+        else:
+            self.sample_scaled_size = self.sample_scaled_count = None
+            self._scaled_parts = []
+        if not r.done():
+            raise ValueError("%s: invalid profile: wrong file size" % filename)
+
+        self._filename = filename
+        self._strings = {}
+        self._frames = {}
+
+    def __len__(self):
+        return len(self.sample_frame) + len(self._scaled_parts)
+
+    def string(self, i):
+        try:
+            return self._strings[i]
+        except KeyError:
+            start = self._string_offsets[i]
+            end = self._string_offsets[i + 1]
+            s = self._string_data[start:end].tobytes().decode("utf-8", "replace")
+            self._strings[i] = s
+            return s
+
+    def frame(self, i):
+        """Returns the frame tuple (name, filename, firstlineno, lineno)."""
+        try:
+            return self._frames[i]
+        except KeyError:
+            frame = (
+                self.string(self._frame_name[i]),
+                self.string(self._frame_filename[i]),
+                self._frame_firstlineno[i],
+                self._frame_lineno[i],
+            )
+            self._frames[i] = frame
+            return frame
+
+    def traceback(self, leaf):
+        """Returns the traceback tuple ending at the given frame, leaf first."""
+        frames = []
+        i = leaf
+        while i != 0xFFFFFFFF:
+            frames.append(self.frame(i))
+            parent = self.frame_parent[i]
+            if parent != 0xFFFFFFFF and parent >= i:
+                raise ValueError("%s: invalid profile: bad frame" % self._filename)
+            i = parent
+        return tuple(frames)
+
+    def trace(self, i):
+        """
+        Returns the i-th trace tuple: (size, traceback, count) for the
+        sampled part of a sample, or (size, traceback, count, 0, 1) for a
+        part that is already scaled, so that it is not scaled again.
+        """
+        n = len(self.sample_frame)
+        if i >= n:
+            i = self._scaled_parts[i - n]
+        elif self.sample_count[i] or not self._is_scaled(i):
+            return (
+                self.sample_size[i],
+                self.traceback(self.sample_frame[i]),
+                self.sample_count[i],
+            )
+        return (
+            self.sample_scaled_size[i],
+            self.traceback(self.sample_frame[i]),
+            self.sample_scaled_count[i],
+            0,
+            1,
+        )
+
+    def _is_scaled(self, i):
+        return (
+            self.sample_scaled_count is not None and self.sample_scaled_count[i] != 0
+        )
+
+
+class LazyTraces(Sequence):
+    """A sequence of the trace tuples in a profile file."""
+
+    def __init__(self, profile):
+        Sequence.__init__(self)
+        self._profile = profile
+
+    def __len__(self):
+        return len(self._profile)
+
+    def __getitem__(self, index):
+        if isinstance(index, slice):
+            return [self._profile.trace(i) for i in range(len(self))[index]]
+        if index < 0:
+            index += len(self)
+        if not 0 <= index < len(self):
+            raise IndexError("trace index out of range")
+        return self._profile.trace(index)
+
+    def __iter__(self):
+        for i in range(len(self)):
+            yield self._profile.trace(i)
+
+    def __eq__(self, other):
+        return list(self) == list(other)
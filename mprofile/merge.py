@@ -0,0 +1,30 @@
+"""
+Merge the heap profiles written by mprofile.dump_profile() in many
+processes, such as the workers of a prefork server, into one profile:
+
+    python -m mprofile.merge -o merged.mprof /dev/shm/worker-*.mprof
+
+The merged profile can be read with mprofile.load_profile().
+"""
+import argparse
+import sys
+
+from mprofile._profiler import merge_profiles
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(
+        prog="python -m mprofile.merge",
+        description="Merge heap profiles from many processes into one.",
+    )
+    parser.add_argument(
+        "-o", "--output", required=True, help="path to write the merged profile"
+    )
+    parser.add_argument("profiles", nargs="+", help="profiles to merge")
+    args = parser.parse_args(argv)
+    merge_profiles(args.profiles, args.output)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
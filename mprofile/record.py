@@ -0,0 +1,40 @@
+"""
+Record every allocation that a script makes through the Python allocators
+in an allocation log, for replaying through the profiler's data structures
+with the replay benchmarks (see src/replay_bench.cc):
+
+    python -m mprofile.record -o workload.alog script.py [args...]
+
+The log holds the address, size, thread and stack of each allocation, and
+can be large: a few bytes for every allocation and free.
+"""
+import argparse
+import runpy
+import sys
+
+from mprofile._profiler import _start_recording, _stop_recording
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(
+        prog="python -m mprofile.record",
+        description="Record the allocations of a script in an allocation log.",
+    )
+    parser.add_argument(
+        "-o", "--output", required=True, help="path to write the allocation log"
+    )
+    parser.add_argument("script", help="the script to run")
+    parser.add_argument("args", nargs=argparse.REMAINDER, help="its arguments")
+    args = parser.parse_args(argv)
+
+    sys.argv = [args.script] + args.args
+    _start_recording(args.output)
+    try:
+        runpy.run_path(args.script, run_name="__main__")
+    finally:
+        _stop_recording()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -1,22 +1,210 @@
 
 #include <Python.h>
 
+#include <errno.h>
+
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
+#include "diff.h"
 #include "heap.h"
+#include "labels.h"
 #include "log.h"
 #include "malloc_patch.h"
+#include "profile.h"
+#include "region.h"
+#include "sampling.h"
 #include "scoped_object.h"
 #include "third_party/google/tcmalloc/sampler.h"
+#include "third_party/greg7mdp/parallel-hashmap/phmap.h"
 
 namespace {
 
-bool StartProfilerWithParams(uint64_t max_frames, uint64_t sample_rate) {
+// Parses the name of a live set implementation, as passed to start().
+bool ParseLiveSetType(const char *name, LiveSetType *type) {
+  if (name == nullptr || std::strcmp(name, "address_map") == 0) {
+    *type = LiveSetType::kAddressMap;
+  } else if (std::strcmp(name, "flat_hash_map") == 0) {
+    *type = LiveSetType::kFlatHashMap;
+  } else {
+    PyErr_Format(PyExc_ValueError,
+                 "unknown live_set '%s', must be 'address_map' or "
+                 "'flat_hash_map'.",
+                 name);
+    return false;
+  }
+  return true;
+}
+
+// Parses the name of a fork policy, as passed to start().
+bool ParseForkPolicy(const char *name, ForkPolicy *policy) {
+  if (name == nullptr || std::strcmp(name, "inherit") == 0) {
+    *policy = ForkPolicy::kInherit;
+  } else if (std::strcmp(name, "reset") == 0) {
+    *policy = ForkPolicy::kReset;
+  } else if (std::strcmp(name, "freeze") == 0) {
+    *policy = ForkPolicy::kFreeze;
+  } else {
+    PyErr_Format(PyExc_ValueError,
+                 "unknown fork_policy '%s', must be 'inherit', 'reset' or "
+                 "'freeze'.",
+                 name);
+    return false;
+  }
+  return true;
+}
+
+// Parses the name of a sampling mode, as passed to start().
+bool ParseSamplingMode(const char *name, SamplingMode *mode) {
+  if (name == nullptr || std::strcmp(name, "bytes") == 0) {
+    *mode = SamplingMode::kBytes;
+  } else if (std::strcmp(name, "count") == 0) {
+    *mode = SamplingMode::kCount;
+  } else if (std::strcmp(name, "stratified") == 0) {
+    *mode = SamplingMode::kStratified;
+  } else {
+    PyErr_Format(PyExc_ValueError,
+                 "unknown sampling '%s', must be 'bytes', 'count' or "
+                 "'stratified'.",
+                 name);
+    return false;
+  }
+  return true;
+}
+
+// Parses the strata passed to start(), which are None or a sequence of
+// (min_size, sample_rate) pairs. SetSamplingConfig checks their values.
+bool ParseStrata(PyObject *o, std::vector<SizeBand> *bands) {
+  if (o == nullptr || o == Py_None) {
+    return true;
+  }
+
+  PyObjectRef seq(PySequence_Fast(o, "strata must be a sequence"));
+  if (seq == nullptr) {
+    return false;
+  }
+  const Py_ssize_t n = PySequence_Fast_GET_SIZE(seq.get());
+  for (Py_ssize_t i = 0; i < n; i++) {
+    PyObject *item = PySequence_Fast_GET_ITEM(seq.get(), i);
+    Py_ssize_t min_size;
+    long long sample_rate;
+    if (!PyTuple_Check(item)) {
+      PyErr_SetString(PyExc_TypeError,
+                      "strata must be (min_size, sample_rate) pairs");
+      return false;
+    }
+    if (!PyArg_ParseTuple(item,
+                          "nL;strata must be (min_size, sample_rate) pairs",
+                          &min_size, &sample_rate)) {
+      return false;
+    }
+    if (min_size < 0) {
+      PyErr_SetString(PyExc_ValueError, "min_size must be non-negative");
+      return false;
+    }
+    bands->push_back({static_cast<std::size_t>(min_size), sample_rate});
+  }
+  return true;
+}
+
+// Parses the peak_hysteresis passed to start(), which is None (-1) to
+// disable peak checkpoints or a number of bytes.
+bool ParsePeakHysteresis(PyObject *o, Py_ssize_t *hysteresis) {
+  if (o == nullptr || o == Py_None) {
+    *hysteresis = -1;
+    return true;
+  }
+
+  *hysteresis = PyNumber_AsSsize_t(o, PyExc_OverflowError);
+  if (*hysteresis == -1 && PyErr_Occurred()) {
+    return false;
+  }
+  if (*hysteresis < 0) {
+    PyErr_SetString(PyExc_ValueError, "peak_hysteresis must be non-negative");
+    return false;
+  }
+  return true;
+}
+
+// The number of points kept by the timeline, unless start() is given a
+// timeline_size.
+const Py_ssize_t kDefaultTimelineSize = 4096;
+
+// Parses the timeline_interval passed to start(), which is None (-1) to
+// disable the timeline or a number of seconds.
+bool ParseTimelineInterval(PyObject *o, double *interval) {
+  if (o == nullptr || o == Py_None) {
+    *interval = -1;
+    return true;
+  }
+
+  *interval = PyFloat_AsDouble(o);
+  if (*interval == -1 && PyErr_Occurred()) {
+    return false;
+  }
+  if (!(*interval >= 0)) {
+    PyErr_SetString(PyExc_ValueError,
+                    "timeline_interval must be non-negative");
+    return false;
+  }
+  return true;
+}
+
+// Parses the include or exclude filename patterns passed to start(), which
+// are None or a sequence of strings.
+bool ParsePatterns(PyObject *o, const char *arg,
+                   std::vector<std::string> *patterns) {
+  if (o == nullptr || o == Py_None) {
+    return true;
+  }
+  if (PyUnicode_Check(o)) {
+    PyErr_Format(PyExc_TypeError, "%s must be a sequence of strings", arg);
+    return false;
+  }
+
+  PyObjectRef seq(PySequence_Fast(o, "patterns must be a sequence"));
+  if (seq == nullptr) {
+    return false;
+  }
+  const Py_ssize_t n = PySequence_Fast_GET_SIZE(seq.get());
+  for (Py_ssize_t i = 0; i < n; i++) {
+    PyObject *item = PySequence_Fast_GET_ITEM(seq.get(), i);
+    if (!PyUnicode_Check(item)) {
+      PyErr_Format(PyExc_TypeError, "%s must be a sequence of strings", arg);
+      return false;
+    }
+    Py_ssize_t size;
+    const char *data = PyUnicode_AsUTF8AndSize(item, &size);
+    if (data == nullptr) {
+      return false;
+    }
+    patterns->emplace_back(data, size);
+  }
+  return true;
+}
+
+bool StartProfilerWithParams(uint64_t max_frames, int64_t sample_rate,
+                             LiveSetType live_set_type, bool huge_pages,
+                             ForkPolicy fork_policy,
+                             Py_ssize_t peak_hysteresis,
+                             double timeline_interval,
+                             Py_ssize_t timeline_size,
+                             std::shared_ptr<FrameFilter> frame_filter,
+                             const SamplingConfig &sampling) {
   if (IsHeapProfilerAttached()) {
     PyErr_SetString(PyExc_RuntimeError, "The profiler is already running.");
     return false;
   }
+  if (IsAllocationLogActive()) {
+    PyErr_SetString(PyExc_RuntimeError,
+                    "The profiler can't be started while recording.");
+    return false;
+  }
 
   if (max_frames < 0 || max_frames > kMaxFramesToCapture) {
     PyErr_SetString(PyExc_ValueError,
@@ -24,24 +212,130 @@ bool StartProfilerWithParams(uint64_t max_frames, uint64_t sample_rate) {
     return false;
   }
 
-  Sampler::SetSamplePeriod(sample_rate);
-  AttachHeapProfiler(
-      std::unique_ptr<HeapProfiler>(new HeapProfiler(max_frames)));
+  if (timeline_size <= 0) {
+    PyErr_SetString(PyExc_ValueError, "timeline_size must be positive");
+    return false;
+  }
+
+  // A negative sample rate only samples the allocations made in regions.
+  const int64_t period = std::max<int64_t>(sample_rate, -1);
+  // Check the config first, so that an error leaves the period alone.
+  if (!CheckSamplingConfig(sampling, period)) {
+    return false;
+  }
+  Sampler::SetSamplePeriod(period);
+  if (!SetSamplingConfig(sampling)) {
+    return false;
+  }
+  // Other threads pick up the new period at their next slow path.
+  ThreadSampler().ResetSamplingPoint();
+  std::unique_ptr<HeapProfiler> profiler(
+      new HeapProfiler(max_frames, live_set_type, huge_pages));
+  profiler->SetFrameFilter(std::move(frame_filter));
+  if (peak_hysteresis >= 0) {
+    profiler->EnablePeakCheckpoints(peak_hysteresis);
+  }
+  if (timeline_interval >= 0) {
+    // Intervals of more than 30 years are as good as infinite.
+    const double interval_ns = std::min(timeline_interval, 1e9) * 1e9;
+    profiler->EnableTimeline(timeline_size,
+                             static_cast<uint64_t>(interval_ns));
+  }
+  AttachHeapProfiler(std::move(profiler), fork_policy);
   return true;
 }
 
 PyObject *StartProfiler(PyObject *self, PyObject *args, PyObject *kwds) {
-  static const char *kwlist[] = {"max_frames", "sample_rate", nullptr};
+  static const char *kwlist[] = {"max_frames",
+                                 "sample_rate",
+                                 "live_set",
+                                 "huge_pages",
+                                 "fork_policy",
+                                 "peak_hysteresis",
+                                 "timeline_interval",
+                                 "timeline_size",
+                                 "include",
+                                 "exclude",
+                                 "collapse_recursion",
+                                 "root_frames",
+                                 "sampling",
+                                 "strata",
+                                 nullptr};
   uint64_t max_frames = kMaxFramesToCapture;
-  uint64_t sample_rate = 0;
+  int64_t sample_rate = 0;
+  const char *live_set = nullptr;
+  int huge_pages = 0;
+  const char *fork_policy = nullptr;
+  PyObject *py_peak_hysteresis = nullptr;
+  PyObject *py_timeline_interval = nullptr;
+  Py_ssize_t timeline_size = kDefaultTimelineSize;
+  PyObject *py_include = nullptr;
+  PyObject *py_exclude = nullptr;
+  int collapse_recursion = 0;
+  Py_ssize_t root_frames = 0;
+  const char *sampling_mode = nullptr;
+  PyObject *py_strata = nullptr;
   // NB: PyArg_ParseTupleAndKeywords raises a Py exception on error.
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|LL",
-                                   const_cast<char **>(kwlist), &max_frames,
-                                   &sample_rate)) {
+  if (!PyArg_ParseTupleAndKeywords(
+          args, kwds, "|LLzpzOOnOOpnzO", const_cast<char **>(kwlist),
+          &max_frames, &sample_rate, &live_set, &huge_pages, &fork_policy,
+          &py_peak_hysteresis, &py_timeline_interval, &timeline_size,
+          &py_include, &py_exclude, &collapse_recursion, &root_frames,
+          &sampling_mode, &py_strata)) {
+    return nullptr;
+  }
+
+  LiveSetType live_set_type;
+  if (!ParseLiveSetType(live_set, &live_set_type)) {
+    return nullptr;
+  }
+
+  ForkPolicy policy;
+  if (!ParseForkPolicy(fork_policy, &policy)) {
+    return nullptr;
+  }
+
+  Py_ssize_t peak_hysteresis;
+  if (!ParsePeakHysteresis(py_peak_hysteresis, &peak_hysteresis)) {
+    return nullptr;
+  }
+
+  double timeline_interval;
+  if (!ParseTimelineInterval(py_timeline_interval, &timeline_interval)) {
+    return nullptr;
+  }
+
+  SamplingConfig sampling;
+  if (!ParseSamplingMode(sampling_mode, &sampling.mode) ||
+      !ParseStrata(py_strata, &sampling.bands)) {
+    return nullptr;
+  }
+
+  std::vector<std::string> include;
+  std::vector<std::string> exclude;
+  if (!ParsePatterns(py_include, "include", &include) ||
+      !ParsePatterns(py_exclude, "exclude", &exclude)) {
+    return nullptr;
+  }
+  if (root_frames < 0 || static_cast<uint64_t>(root_frames) > max_frames) {
+    PyErr_SetString(PyExc_ValueError,
+                    "root_frames must be in range 0-max_frames.");
     return nullptr;
   }
+  // Stacks are captured without a filter unless one is needed.
+  std::shared_ptr<FrameFilter> frame_filter;
+  if (!include.empty() || !exclude.empty() || collapse_recursion ||
+      root_frames != 0) {
+    frame_filter = std::make_shared<FrameFilter>(
+        std::move(include), std::move(exclude), collapse_recursion,
+        static_cast<int>(std::min<Py_ssize_t>(root_frames,
+                                              kMaxFramesToCapture)));
+  }
 
-  if (!StartProfilerWithParams(max_frames, sample_rate)) {
+  if (!StartProfilerWithParams(max_frames, sample_rate, live_set_type,
+                               huge_pages, policy, peak_hysteresis,
+                               timeline_interval, timeline_size,
+                               std::move(frame_filter), sampling)) {
     return nullptr;
   }
 
@@ -53,6 +347,28 @@ PyObject *StopProfiler(PyObject *self, PyObject *args) {
   Py_RETURN_NONE;
 }
 
+PyObject *PauseProfiler(PyObject *self, PyObject *args) {
+  if (!PauseHeapProfiler()) {
+    return nullptr;
+  }
+  Py_RETURN_NONE;
+}
+
+PyObject *ResumeProfiler(PyObject *self, PyObject *args) {
+  if (!ResumeHeapProfiler()) {
+    return nullptr;
+  }
+  Py_RETURN_NONE;
+}
+
+PyObject *IsPaused(PyObject *self, PyObject *args) {
+  if (IsHeapProfilerPaused()) {
+    Py_RETURN_TRUE;
+  } else {
+    Py_RETURN_FALSE;
+  }
+}
+
 PyObject *IsTracing(PyObject *self, PyObject *args) {
   if (IsHeapProfilerAttached()) {
     Py_RETURN_TRUE;
@@ -71,6 +387,14 @@ PyObject *ClearTraces(PyObject *self, PyObject *args) {
   Py_RETURN_NONE;
 }
 
+PyObject *CollectStacks(PyObject *self, PyObject *args) {
+  if (CollectHeapProfilerTraces()) {
+    Py_RETURN_TRUE;
+  } else {
+    Py_RETURN_FALSE;
+  }
+}
+
 PyObject *GetTracemallocMemory(PyObject *self, PyObject *args) {
   if (!IsHeapProfilerAttached()) {
     return PyLong_FromLong(0);
@@ -87,12 +411,208 @@ PyObject *GetTracedMemory(PyObject *self, PyObject *args) {
   return Py_BuildValue("NN", size_obj, peak_size_obj);
 }
 
+// Parses a label set id, as passed to _set_label_set().
+bool ParseLabelSet(PyObject *o, LabelSetId *id) {
+  const long value = PyLong_AsLong(o);
+  if (value == -1 && PyErr_Occurred()) {
+    return false;
+  }
+  if (value < 0 || value >= kMaxLabelSets) {
+    PyErr_SetString(PyExc_ValueError, "invalid label set");
+    return false;
+  }
+  *id = static_cast<LabelSetId>(value);
+  return true;
+}
+
+// Parses an epoch, as returned by mark(), or None for default.
+bool ParseEpoch(PyObject *o, Epoch default_epoch, Epoch *epoch) {
+  if (o == Py_None) {
+    *epoch = default_epoch;
+    return true;
+  }
+  const long long value = PyLong_AsLongLong(o);
+  if (value == -1 && PyErr_Occurred()) {
+    return false;
+  }
+  if (value < 0 || value > kMaxEpoch) {
+    PyErr_SetString(PyExc_ValueError, "invalid epoch");
+    return false;
+  }
+  *epoch = static_cast<Epoch>(value);
+  return true;
+}
+
 PyObject *TakeSnapshot(PyObject *self, PyObject *args) {
+  PyObject *py_label_sets = Py_None;
+  PyObject *py_since = Py_None;
+  PyObject *py_until = Py_None;
+  if (!PyArg_ParseTuple(args, "|OOO", &py_label_sets, &py_since,
+                        &py_until)) {
+    return nullptr;
+  }
+
+  // Only the allocations made from the epoch since up to the epoch until.
+  Epoch min_epoch;
+  Epoch max_epoch;
+  if (!ParseEpoch(py_since, 0, &min_epoch) ||
+      !ParseEpoch(py_until, kMaxEpoch, &max_epoch)) {
+    return nullptr;
+  }
+
   if (!IsHeapProfilerAttached()) {
     return PyList_New(0);
   }
 
-  return GetHeapProfile();
+  if (py_label_sets == Py_None) {
+    return GetHeapProfile(nullptr, min_epoch, max_epoch);
+  }
+
+  // Only the allocations with one of the given label sets.
+  std::vector<bool> label_sets(kMaxLabelSets);
+  PyObjectRef seq(
+      PySequence_Fast(py_label_sets, "label sets must be a sequence"));
+  if (seq == nullptr) {
+    return nullptr;
+  }
+  for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(seq.get()); i++) {
+    LabelSetId id;
+    if (!ParseLabelSet(PySequence_Fast_GET_ITEM(seq.get(), i), &id)) {
+      return nullptr;
+    }
+    label_sets[id] = true;
+  }
+  return GetHeapProfile(&label_sets, min_epoch, max_epoch);
+}
+
+PyObject *Mark(PyObject *self, PyObject *args) {
+  const Epoch epoch = HeapProfiler::Mark();
+  if (epoch == 0) {
+    PyErr_SetString(PyExc_OverflowError, "too many marks");
+    return nullptr;
+  }
+  return PyLong_FromUnsignedLong(epoch);
+}
+
+PyObject *TakeBaselineSnapshot(PyObject *self, PyObject *args) {
+  PyObject *traces = GetBaselineHeapProfile();
+  if (traces == nullptr && !PyErr_Occurred()) {
+    Py_RETURN_NONE;
+  }
+
+  return traces;
+}
+
+PyObject *SetLabels(PyObject *self, PyObject *args) {
+  PyObject *py_id;
+  if (!PyArg_ParseTuple(args, "O", &py_id)) {
+    return nullptr;
+  }
+
+  LabelSetId id;
+  if (!ParseLabelSet(py_id, &id)) {
+    return nullptr;
+  }
+  return SetLabelSet(id);
+}
+
+PyObject *ResetLabels(PyObject *self, PyObject *args) {
+  PyObject *token;
+  if (!PyArg_ParseTuple(args, "O", &token)) {
+    return nullptr;
+  }
+
+  if (!ResetLabelSet(token)) {
+    return nullptr;
+  }
+  Py_RETURN_NONE;
+}
+
+PyObject *GetLabels(PyObject *self, PyObject *args) {
+  return PyLong_FromLong(CurrentLabelSet());
+}
+
+PyObject *SetRegion(PyObject *self, PyObject *args) {
+  PyObject *py_period;
+  if (!PyArg_ParseTuple(args, "O", &py_period)) {
+    return nullptr;
+  }
+
+  // None is the global sample period, and a negative period samples
+  // nothing.
+  int id = 0;
+  if (py_period != Py_None) {
+    const long long period = PyLong_AsLongLong(py_period);
+    if (period == -1 && PyErr_Occurred()) {
+      return nullptr;
+    }
+    id = InternRegion(std::max<int64_t>(period, -1));
+    if (id < 0) {
+      PyErr_SetString(PyExc_ValueError,
+                      "too many distinct region sample rates");
+      return nullptr;
+    }
+  }
+  return PyLong_FromLong(SetThreadRegion(id));
+}
+
+PyObject *ResetRegion(PyObject *self, PyObject *args) {
+  int token;
+  if (!PyArg_ParseTuple(args, "i", &token)) {
+    return nullptr;
+  }
+  if (!IsValidRegion(token)) {
+    PyErr_SetString(PyExc_ValueError, "invalid region token");
+    return nullptr;
+  }
+
+  SetThreadRegion(token);
+  Py_RETURN_NONE;
+}
+
+PyObject *LabelTotals(PyObject *self, PyObject *args) {
+  if (!IsHeapProfilerAttached()) {
+    PyErr_SetString(PyExc_RuntimeError, "The heap profiler is not started.");
+    return nullptr;
+  }
+
+  return GetHeapLabelTotals();
+}
+
+PyObject *TopStacks(PyObject *self, PyObject *args) {
+  Py_ssize_t n;
+  if (!PyArg_ParseTuple(args, "n", &n)) {
+    return nullptr;
+  }
+  if (n < 0) {
+    PyErr_SetString(PyExc_ValueError, "n must be non-negative");
+    return nullptr;
+  }
+
+  if (!IsHeapProfilerAttached()) {
+    PyErr_SetString(PyExc_RuntimeError, "The heap profiler is not started.");
+    return nullptr;
+  }
+
+  return GetTopHeapStacks(n);
+}
+
+PyObject *TakePeakSnapshot(PyObject *self, PyObject *args) {
+  PyObject *traces = GetPeakHeapProfile();
+  if (traces == nullptr && !PyErr_Occurred()) {
+    Py_RETURN_NONE;
+  }
+
+  return traces;
+}
+
+PyObject *GetTimeline(PyObject *self, PyObject *args) {
+  PyObject *timeline = GetHeapTimeline();
+  if (timeline == nullptr && !PyErr_Occurred()) {
+    Py_RETURN_NONE;
+  }
+
+  return timeline;
 }
 
 PyObject *GetSampleRate(PyObject *self, PyObject *args) {
@@ -101,7 +621,18 @@ PyObject *GetSampleRate(PyObject *self, PyObject *args) {
     return nullptr;
   }
 
-  return PyLong_FromLong(Sampler::GetSamplePeriod());
+  return PyLong_FromLongLong(Sampler::GetSamplePeriod());
+}
+
+PyObject *GetSampling(PyObject *self, PyObject *args) {
+  switch (GetSamplingMode()) {
+    case SamplingMode::kCount:
+      return PyUnicode_FromString("count");
+    case SamplingMode::kStratified:
+      return PyUnicode_FromString("stratified");
+    default:
+      return PyUnicode_FromString("bytes");
+  }
 }
 
 PyObject *GetTracebackLimit(PyObject *self, PyObject *args) {
@@ -128,6 +659,439 @@ PyObject *GetObjectTraceback(PyObject *self, PyObject *args) {
   return GetTrace(ptr);
 }
 
+// Raises the error from reading or writing a profile: an OSError if it
+// was an I/O error, or a ValueError if the file is not a valid profile.
+void SetProfileError(const std::string &error, PyObject *path) {
+  if (errno != 0) {
+    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+  } else {
+    PyErr_SetString(PyExc_ValueError, error.c_str());
+  }
+}
+
+PyObject *DumpProfile(PyObject *self, PyObject *args) {
+  PyObject *py_path;
+  if (!PyArg_ParseTuple(args, "O&", PyUnicode_FSConverter, &py_path)) {
+    return nullptr;
+  }
+  PyObjectRef path_ref(py_path);
+
+  Profile profile;
+  if (!ExportHeapProfile(&profile)) {
+    return nullptr;
+  }
+
+  const std::string path(PyBytes_AS_STRING(py_path));
+  std::string error;
+  bool ok;
+  Py_BEGIN_ALLOW_THREADS;
+  ok = WriteProfile(profile, path, &error);
+  Py_END_ALLOW_THREADS;
+  if (!ok) {
+    SetProfileError(error, py_path);
+    return nullptr;
+  }
+
+  Py_RETURN_NONE;
+}
+
+PyObject *StartRecording(PyObject *self, PyObject *args) {
+  PyObject *py_path;
+  if (!PyArg_ParseTuple(args, "O&", PyUnicode_FSConverter, &py_path)) {
+    return nullptr;
+  }
+  PyObjectRef path_ref(py_path);
+
+  if (IsHeapProfilerAttached()) {
+    PyErr_SetString(PyExc_RuntimeError,
+                    "Allocations can't be recorded while profiling.");
+    return nullptr;
+  }
+  if (IsAllocationLogActive()) {
+    PyErr_SetString(PyExc_RuntimeError, "Allocations are already recorded.");
+    return nullptr;
+  }
+
+  std::string error;
+  if (!StartAllocationLog(PyBytes_AS_STRING(py_path), &error)) {
+    SetProfileError(error, py_path);
+    return nullptr;
+  }
+
+  Py_RETURN_NONE;
+}
+
+PyObject *StopRecording(PyObject *self, PyObject *args) {
+  std::string error;
+  if (!StopAllocationLog(&error)) {
+    PyErr_SetString(PyExc_OSError, error.c_str());
+    return nullptr;
+  }
+
+  Py_RETURN_NONE;
+}
+
+PyObject *MergeProfileFiles(PyObject *self, PyObject *args) {
+  PyObject *py_paths;
+  PyObject *py_output_path;
+  if (!PyArg_ParseTuple(args, "OO&", &py_paths, PyUnicode_FSConverter,
+                        &py_output_path)) {
+    return nullptr;
+  }
+  PyObjectRef output_path_ref(py_output_path);
+
+  PyObjectRef paths_seq(
+      PySequence_Fast(py_paths, "paths must be a sequence of paths"));
+  if (paths_seq == nullptr) {
+    return nullptr;
+  }
+
+  std::vector<PyObjectRef> path_refs;
+  std::vector<std::string> paths;
+  const Py_ssize_t n = PySequence_Fast_GET_SIZE(paths_seq.get());
+  for (Py_ssize_t i = 0; i < n; i++) {
+    PyObject *py_path;
+    if (!PyUnicode_FSConverter(
+            PySequence_Fast_GET_ITEM(paths_seq.get(), i), &py_path)) {
+      return nullptr;
+    }
+    path_refs.emplace_back(py_path);
+    paths.emplace_back(PyBytes_AS_STRING(py_path));
+  }
+
+  // Nothing below touches Python objects, so workers can keep running
+  // while their profiles are merged.
+  std::vector<Profile> profiles(paths.size());
+  std::vector<const Profile *> inputs;
+  Profile merged;
+  std::string error;
+  PyObject *error_path = nullptr;
+  bool ok = true;
+  Py_BEGIN_ALLOW_THREADS;
+  for (std::size_t i = 0; ok && i < paths.size(); i++) {
+    ok = ReadProfile(paths[i], &profiles[i], &error);
+    if (!ok) {
+      error_path = path_refs[i].get();
+    }
+    inputs.push_back(&profiles[i]);
+  }
+  if (ok) {
+    errno = 0;
+    ok = MergeProfiles(inputs, &merged, &error);
+  }
+  if (ok) {
+    ok = WriteProfile(merged, PyBytes_AS_STRING(py_output_path), &error);
+    error_path = py_output_path;
+  }
+  Py_END_ALLOW_THREADS;
+  if (!ok) {
+    SetProfileError(error, error_path);
+    return nullptr;
+  }
+
+  Py_RETURN_NONE;
+}
+
+// How Snapshot.statistics groups traces.
+enum class KeyType {
+  kTraceback,
+  kFilename,
+  kLineno,
+};
+
+bool ParseKeyType(const char *name, KeyType *type) {
+  if (std::strcmp(name, "traceback") == 0) {
+    *type = KeyType::kTraceback;
+  } else if (std::strcmp(name, "filename") == 0) {
+    *type = KeyType::kFilename;
+  } else if (std::strcmp(name, "lineno") == 0) {
+    *type = KeyType::kLineno;
+  } else {
+    PyErr_Format(PyExc_ValueError, "unknown key_type: '%s'", name);
+    return false;
+  }
+  return true;
+}
+
+// Adds the key frame of a (single frame) filename or lineno key to the
+// profile. Filename keys use a synthetic frame with just the filename.
+uint32_t AddKeyFrame(const ProfileFrame &f, KeyType key_type,
+                     ProfileBuilder *builder) {
+  if (key_type == KeyType::kFilename) {
+    return builder->AddFrame(kNoParentFrame, f.filename,
+                             builder->AddString("", 0), 0, 0);
+  }
+  return builder->AddFrame(kNoParentFrame, f.filename, f.name, f.firstlineno,
+                           f.lineno);
+}
+
+// The fractions of the traces that were scaled before they were added to a
+// profile, carried over to the next one so the totals stay unbiased.
+struct ScaledRemainder {
+  double size = 0;
+  double count = 0;
+};
+
+// Adds a trace tuple of a Snapshot, (size, traceback) or
+// (size, traceback, count), to the profile, grouped by the given key like
+// Snapshot._group_by.
+bool AddPyTrace(PyObject *trace, KeyType key_type, bool cumulative,
+                ScaledRemainder *remainder, ProfileBuilder *builder,
+                phmap::flat_hash_map<PyObject *, uint32_t> *strings) {
+  unsigned long long size;
+  PyObject *traceback;
+  unsigned long long count = 1;
+  // Labels are not kept in profiles. A trace with a sample rate of its own
+  // is an estimate scaled by that rate, which is kept apart from the traces
+  // that are scaled by the sample rate of the profile.
+  unsigned int label_set;
+  unsigned long long trace_sample_rate = 0;
+  if (!PyArg_ParseTuple(trace, "KO|KIK;invalid trace", &size, &traceback,
+                        &count, &label_set, &trace_sample_rate)) {
+    return false;
+  }
+  unsigned long long scaled_size = 0;
+  unsigned long long scaled_count = 0;
+  if (PyTuple_GET_SIZE(trace) > 4) {
+    double scale = 1;
+    if (count > 0) {
+      scale = SampleWeight(static_cast<double>(size) / count,
+                           trace_sample_rate);
+    }
+    const double estimated_size = scale * size + remainder->size;
+    const double estimated_count = scale * count + remainder->count;
+    scaled_size = static_cast<unsigned long long>(estimated_size);
+    scaled_count = static_cast<unsigned long long>(estimated_count);
+    remainder->size = estimated_size - scaled_size;
+    remainder->count = estimated_count - scaled_count;
+    size = 0;
+    count = 0;
+  }
+
+  PyObjectRef py_frames(PySequence_Fast(traceback, "invalid traceback"));
+  if (py_frames == nullptr) {
+    return false;
+  }
+
+  // The frames of the traceback, leaf first.
+  const Py_ssize_t num_frames = PySequence_Fast_GET_SIZE(py_frames.get());
+  std::vector<ProfileFrame> frames(num_frames);
+  for (Py_ssize_t i = 0; i < num_frames; i++) {
+    PyObject *name;
+    PyObject *filename;
+    if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(py_frames.get(), i),
+                          "UUii;invalid frame", &name, &filename,
+                          &frames[i].firstlineno, &frames[i].lineno)) {
+      return false;
+    }
+
+    const int64_t filename_id = AddProfileString(filename, builder, strings);
+    const int64_t name_id = AddProfileString(name, builder, strings);
+    if (filename_id < 0 || name_id < 0) {
+      return false;
+    }
+    frames[i].filename = filename_id;
+    frames[i].name = name_id;
+  }
+
+  if (frames.empty()) {
+    return true;
+  }
+
+  if (cumulative) {
+    for (const ProfileFrame &f : frames) {
+      builder->AddSample(AddKeyFrame(f, key_type, builder), size, count,
+                         scaled_size, scaled_count);
+    }
+  } else if (key_type == KeyType::kTraceback) {
+    // Frames are added from the root.
+    uint32_t frame = kNoParentFrame;
+    for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+      frame = builder->AddFrame(frame, it->filename, it->name,
+                                it->firstlineno, it->lineno);
+    }
+    builder->AddSample(frame, size, count, scaled_size, scaled_count);
+  } else {
+    builder->AddSample(AddKeyFrame(frames[0], key_type, builder), size,
+                       count, scaled_size, scaled_count);
+  }
+  return true;
+}
+
+// Builds a profile from the traces of a Snapshot, with one sample for each
+// key. Returns false with a Python exception set on failure.
+bool NewProfileFromPyTraces(PyObject *py_traces, KeyType key_type,
+                            bool cumulative, Profile *profile) {
+  PyObjectRef traces(PySequence_Fast(py_traces, "traces must be a sequence"));
+  if (traces == nullptr) {
+    return false;
+  }
+
+  ProfileBuilder builder(profile);
+  // The traces of a snapshot share most of their strings, so only convert
+  // each one once. The strings are kept alive by traces.
+  phmap::flat_hash_map<PyObject *, uint32_t> strings;
+  ScaledRemainder remainder;
+  const Py_ssize_t n = PySequence_Fast_GET_SIZE(traces.get());
+  for (Py_ssize_t i = 0; i < n; i++) {
+    if (!AddPyTrace(PySequence_Fast_GET_ITEM(traces.get(), i), key_type,
+                    cumulative, &remainder, &builder, &strings)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+PyObject *DumpTraces(PyObject *self, PyObject *args) {
+  PyObject *py_traces;
+  unsigned int max_frames;
+  unsigned long long sample_rate;
+  PyObject *py_path;
+  if (!PyArg_ParseTuple(args, "OIKO&", &py_traces, &max_frames, &sample_rate,
+                        PyUnicode_FSConverter, &py_path)) {
+    return nullptr;
+  }
+  PyObjectRef path_ref(py_path);
+
+  Profile profile;
+  profile.sample_rate = sample_rate;
+  profile.max_frames = max_frames;
+  if (!NewProfileFromPyTraces(py_traces, KeyType::kTraceback, false,
+                              &profile)) {
+    return nullptr;
+  }
+
+  const std::string path(PyBytes_AS_STRING(py_path));
+  std::string error;
+  bool ok;
+  Py_BEGIN_ALLOW_THREADS;
+  ok = WriteProfile(profile, path, &error);
+  Py_END_ALLOW_THREADS;
+  if (!ok) {
+    SetProfileError(error, py_path);
+    return nullptr;
+  }
+
+  Py_RETURN_NONE;
+}
+
+// Creates the Python strings of a profile on first use.
+class PyStringCache {
+ public:
+  explicit PyStringCache(const Profile *profile)
+      : profile_(profile), strings_(profile->strings.size()) {}
+
+  // Returns a borrowed reference, or nullptr with a Python exception set.
+  PyObject *Get(uint32_t i) {
+    if (strings_[i] == nullptr) {
+      const std::string &s = profile_->strings[i];
+      strings_[i].reset(PyUnicode_DecodeUTF8(s.data(), s.size(), "replace"));
+    }
+    return strings_[i].get();
+  }
+
+ private:
+  const Profile *profile_;
+  std::vector<PyObjectRef> strings_;
+};
+
+// Builds the traceback tuple of a stack, leaf first.
+PyObjectRef NewPyTraceback(const Profile &profile, uint32_t leaf,
+                           PyStringCache *strings) {
+  std::vector<PyObjectRef> frames;
+  for (uint32_t i = leaf; i != kNoParentFrame; i = profile.frames[i].parent) {
+    const ProfileFrame &f = profile.frames[i];
+    PyObject *name = strings->Get(f.name);
+    PyObject *filename = strings->Get(f.filename);
+    if (name == nullptr || filename == nullptr) {
+      return nullptr;
+    }
+    frames.emplace_back(
+        Py_BuildValue("(OOii)", name, filename, f.firstlineno, f.lineno));
+    if (frames.back() == nullptr) {
+      return nullptr;
+    }
+  }
+
+  PyObjectRef py_frames(PyTuple_New(frames.size()));
+  if (py_frames == nullptr) {
+    return nullptr;
+  }
+  for (std::size_t i = 0; i < frames.size(); i++) {
+    PyTuple_SET_ITEM(py_frames.get(), i, frames[i].release());
+  }
+  return py_frames;
+}
+
+PyObject *CompareTraces(PyObject *self, PyObject *args) {
+  PyObject *new_traces;
+  unsigned long long new_sample_rate;
+  PyObject *old_traces;
+  unsigned long long old_sample_rate;
+  const char *key_type_name;
+  int cumulative;
+  Py_ssize_t limit;
+  if (!PyArg_ParseTuple(args, "OKOKspn", &new_traces, &new_sample_rate,
+                        &old_traces, &old_sample_rate, &key_type_name,
+                        &cumulative, &limit)) {
+    return nullptr;
+  }
+
+  KeyType key_type;
+  if (!ParseKeyType(key_type_name, &key_type)) {
+    return nullptr;
+  }
+  if (limit == 0) {
+    return PyList_New(0);
+  }
+
+  Profile new_profile;
+  new_profile.sample_rate = new_sample_rate;
+  Profile old_profile;
+  old_profile.sample_rate = old_sample_rate;
+  if (!NewProfileFromPyTraces(new_traces, key_type, cumulative,
+                              &new_profile) ||
+      !NewProfileFromPyTraces(old_traces, key_type, cumulative,
+                              &old_profile)) {
+    return nullptr;
+  }
+
+  std::vector<StackDiff> diffs;
+  Py_BEGIN_ALLOW_THREADS;
+  // A negative limit returns all of the differences.
+  diffs =
+      DiffProfiles(new_profile, old_profile, std::max<Py_ssize_t>(limit, 0));
+  Py_END_ALLOW_THREADS;
+
+  PyObjectRef result(PyList_New(diffs.size()));
+  if (result == nullptr) {
+    return nullptr;
+  }
+
+  PyStringCache new_strings(&new_profile);
+  PyStringCache old_strings(&old_profile);
+  for (std::size_t i = 0; i < diffs.size(); i++) {
+    const StackDiff &d = diffs[i];
+    PyStringCache *strings =
+        (d.profile == &new_profile) ? &new_strings : &old_strings;
+    PyObjectRef traceback(NewPyTraceback(*d.profile, d.frame, strings));
+    if (traceback == nullptr) {
+      return nullptr;
+    }
+
+    PyObject *diff = Py_BuildValue(
+        "(OLLLL)", traceback.get(), static_cast<long long>(d.size),
+        static_cast<long long>(d.size_diff), static_cast<long long>(d.count),
+        static_cast<long long>(d.count_diff));
+    if (diff == nullptr) {
+      return nullptr;
+    }
+    PyList_SET_ITEM(result.get(), i, diff);
+  }
+
+  return result.release();
+}
+
 int GetEnvFrames() {
   char *p = std::getenv("MPROFILEFRAMES");
   if (p == NULL || *p == '\0') {
@@ -145,6 +1109,10 @@ int GetEnvFrames() {
 
 PyObject *MProfileAtexit(PyObject *self) {
   DetachHeapProfiler();
+  std::string error;
+  if (!StopAllocationLog(&error)) {
+    LogWarning("mprofile: Failed to write allocation log: %s", error.c_str());
+  }
   Py_RETURN_NONE;
 }
 
@@ -192,12 +1160,17 @@ bool MProfileInit(PyObject *self) {
   }
 
   char *endptr = p;
-  int sample_rate = strtol(p, &endptr, 10);
-  if (*endptr != '\0' || sample_rate < 0) {
+  errno = 0;
+  const long long sample_rate = strtoll(p, &endptr, 10);
+  if (*endptr != '\0' || sample_rate < 0 || errno == ERANGE) {
     Py_FatalError("MPROFILERATE: invalid sample rate");
   }
 
-  if (!StartProfilerWithParams(GetEnvFrames(), sample_rate)) {
+  if (!StartProfilerWithParams(GetEnvFrames(), sample_rate,
+                               LiveSetType::kAddressMap, false,
+                               ForkPolicy::kInherit, -1, -1,
+                               kDefaultTimelineSize, nullptr,
+                               SamplingConfig())) {
     return false;
   }
 
@@ -208,14 +1181,45 @@ PyMethodDef ProfilerMethods[] = {
     {"start", (PyCFunction)StartProfiler, METH_VARARGS | METH_KEYWORDS,
      "Start memory profiling."},
     {"stop", StopProfiler, METH_VARARGS, "Stop memory profiling."},
+    {"pause", PauseProfiler, METH_VARARGS,
+     "Stop sampling new allocations, keeping the traced ones."},
+    {"resume", ResumeProfiler, METH_VARARGS,
+     "Resume sampling new allocations after pause()."},
+    {"is_paused", IsPaused, METH_VARARGS,
+     "True/False if memory profiler is active but paused."},
     {"is_tracing", IsTracing, METH_VARARGS,
      "True/False if memory profiler is active."},
     {"clear_traces", ClearTraces, METH_VARARGS,
      "Clear all current traces to reclaim memory."},
     {"_get_traces", TakeSnapshot, METH_VARARGS,
      "Get snapshot of live heap allocations."},
+    {"mark", Mark, METH_VARARGS,
+     "Start a new epoch of allocations, and return its id."},
+    {"_get_baseline_traces", TakeBaselineSnapshot, METH_VARARGS,
+     "Get snapshot of heap allocations inherited from the parent process."},
+    {"_get_peak_traces", TakePeakSnapshot, METH_VARARGS,
+     "Get snapshot of heap allocations at the traced memory peak."},
+    {"_get_timeline", GetTimeline, METH_VARARGS,
+     "Get the recorded timeline of the traced memory."},
+    {"_set_label_set", SetLabels, METH_VARARGS,
+     "Set the current label set, returning a token to reset it."},
+    {"_reset_label_set", ResetLabels, METH_VARARGS,
+     "Restore the label set that was current before _set_label_set."},
+    {"_get_label_set", GetLabels, METH_VARARGS, "Get the current label set."},
+    {"_set_region", SetRegion, METH_VARARGS,
+     "Set the sample period of the current thread, returning a token."},
+    {"_reset_region", ResetRegion, METH_VARARGS,
+     "Restore the sample period that was current before _set_region."},
+    {"_label_totals", LabelTotals, METH_VARARGS,
+     "Get the live memory of each label set."},
+    {"_top_stacks", TopStacks, METH_VARARGS,
+     "Get the stacks with the most live memory."},
+    {"_collect_stacks", CollectStacks, METH_VARARGS,
+     "Release the stacks that no live allocation refers to."},
     {"get_sample_rate", GetSampleRate, METH_VARARGS,
      "Get the current sample rate for allocations."},
+    {"_get_sampling", GetSampling, METH_VARARGS,
+     "Get the sampling mode that profiling was started with."},
     {"get_traceback_limit", GetTracebackLimit, METH_VARARGS,
      "Get the max number of frames that will be stored in a traceback."},
     {"get_tracemalloc_memory", GetTracemallocMemory, METH_VARARGS,
@@ -224,6 +1228,18 @@ PyMethodDef ProfilerMethods[] = {
      "Get the total memory traced by mprofile module (in bytes)."},
     {"_get_object_traceback", GetObjectTraceback, METH_VARARGS,
      "Get the traceback where a particular object was allocated."},
+    {"dump_profile", DumpProfile, METH_VARARGS,
+     "Write the current heap profile to a file."},
+    {"merge_profiles", MergeProfileFiles, METH_VARARGS,
+     "Merge the heap profiles in a list of files into one file."},
+    {"_dump_traces", DumpTraces, METH_VARARGS,
+     "Write the traces of a snapshot to a heap profile file."},
+    {"_compare_traces", CompareTraces, METH_VARARGS,
+     "Diff the traces of two snapshots, grouped by key."},
+    {"_start_recording", StartRecording, METH_VARARGS,
+     "Record every allocation in an allocation log file."},
+    {"_stop_recording", StopRecording, METH_VARARGS,
+     "Stop recording allocations and close the log."},
 
     // Private, used as an atexit handler to disable heap profiler.
     {"_atexit", (PyCFunction)MProfileAtexit, METH_NOARGS},
@@ -0,0 +1,262 @@
+// Copyright 2019 Timothy Palpant
+
+#include "alloc_log.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+
+namespace {
+
+// File format
+// -----------
+// A log is an 8-byte magic number followed by a stream of entries, each a
+// tag byte and a list of unsigned LEB128 varints:
+//
+//   kMalloc:  thread, ptr, size, stack
+//   kRealloc: thread, ptr, old_ptr, size, stack
+//   kFree:    thread, ptr
+//   kStack:   num_frames, frame[num_frames]  (from the root down)
+//
+// Each ptr and old_ptr is the zigzag-encoded difference from the previous
+// one in the stream. Stacks are numbered from 1 in the order they appear.
+const char kMagic[8] = {'M', 'P', 'A', 'L', 'L', 'O', 'C', '1'};
+const uint8_t kStackTag = 3;
+
+// Flush the buffer to the file once it holds this many bytes.
+const std::size_t kFlushSize = 1 << 20;
+
+// Stacks deeper than this are not valid.
+const uint64_t kMaxStackDepth = 1 << 16;
+
+uint64_t ZigZag(uint64_t delta) {
+  return (delta << 1) ^ (0 - (delta >> 63));
+}
+
+uint64_t UnZigZag(uint64_t value) { return (value >> 1) ^ (0 - (value & 1)); }
+
+// Reads varints from a buffer, failing at its end.
+class VarintReader {
+ public:
+  VarintReader(const std::string &data, std::size_t pos)
+      : p_(data.data() + pos), end_(data.data() + data.size()) {}
+
+  bool done() const { return p_ == end_; }
+
+  bool ReadByte(uint8_t *value) {
+    if (p_ == end_) {
+      return false;
+    }
+    *value = static_cast<uint8_t>(*p_++);
+    return true;
+  }
+
+  bool Read(uint64_t *value) {
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64 && p_ != end_; shift += 7) {
+      const uint8_t byte = static_cast<uint8_t>(*p_++);
+      result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        *value = result;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  template <class T>
+  bool Read(T *value) {
+    uint64_t v;
+    if (!Read(&v) || v > static_cast<T>(~T(0))) {
+      return false;
+    }
+    *value = static_cast<T>(v);
+    return true;
+  }
+
+  bool ReadPointer(uint64_t *last, uint64_t *ptr) {
+    uint64_t delta;
+    if (!Read(&delta)) {
+      return false;
+    }
+    *last += UnZigZag(delta);
+    *ptr = *last;
+    return true;
+  }
+
+ private:
+  const char *p_;
+  const char *const end_;
+};
+
+bool ReadFile(const std::string &path, std::string *contents) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if (f == nullptr) {
+    return false;
+  }
+
+  char buf[64 * 1024];
+  std::size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    contents->append(buf, n);
+  }
+  const bool ok = !ferror(f);
+  fclose(f);
+  return ok;
+}
+
+bool InvalidLog(const std::string &path, const char *reason,
+                std::string *error) {
+  errno = 0;
+  *error = path + ": invalid allocation log: " + reason;
+  return false;
+}
+
+}  // namespace
+
+AllocLogWriter::~AllocLogWriter() {
+  if (file_ != nullptr) {
+    fclose(file_);
+  }
+}
+
+bool AllocLogWriter::Open(const std::string &path, std::string *error) {
+  file_ = fopen(path.c_str(), "wb");
+  if (file_ == nullptr) {
+    *error = path + ": " + strerror(errno);
+    return false;
+  }
+  // The writer does its own buffering. An unbuffered file also has nothing
+  // to flush in a forked child, which abandons the writer.
+  setvbuf(file_, nullptr, _IONBF, 0);
+  path_ = path;
+  buffer_.assign(kMagic, sizeof(kMagic));
+  return true;
+}
+
+void AllocLogWriter::PutVarint(uint64_t value) {
+  while (value >= 0x80) {
+    buffer_.push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  buffer_.push_back(static_cast<char>(value));
+}
+
+void AllocLogWriter::PutPointer(uint64_t ptr) {
+  PutVarint(ZigZag(ptr - last_ptr_));
+  last_ptr_ = ptr;
+}
+
+void AllocLogWriter::AddStack(const std::vector<uint32_t> &frames) {
+  buffer_.push_back(static_cast<char>(kStackTag));
+  PutVarint(frames.size());
+  for (uint32_t frame : frames) {
+    PutVarint(frame);
+  }
+  MaybeFlush();
+}
+
+void AllocLogWriter::Add(const AllocRecord &record) {
+  buffer_.push_back(static_cast<char>(record.op));
+  PutVarint(record.thread);
+  PutPointer(record.ptr);
+  if (record.op == AllocOp::kRealloc) {
+    PutPointer(record.old_ptr);
+  }
+  if (record.op != AllocOp::kFree) {
+    PutVarint(record.size);
+    PutVarint(record.stack);
+  }
+  MaybeFlush();
+}
+
+void AllocLogWriter::MaybeFlush() {
+  if (buffer_.size() < kFlushSize) {
+    return;
+  }
+  if (ok_ && fwrite(buffer_.data(), buffer_.size(), 1, file_) != 1) {
+    ok_ = false;
+    saved_errno_ = errno;
+  }
+  buffer_.clear();
+}
+
+bool AllocLogWriter::Close(std::string *error) {
+  if (file_ == nullptr) {
+    return true;
+  }
+  if (ok_ && !buffer_.empty() &&
+      fwrite(buffer_.data(), buffer_.size(), 1, file_) != 1) {
+    ok_ = false;
+    saved_errno_ = errno;
+  }
+  if (fclose(file_) != 0 && ok_) {
+    ok_ = false;
+    saved_errno_ = errno;
+  }
+  file_ = nullptr;
+  buffer_.clear();
+  if (!ok_) {
+    errno = saved_errno_;
+    *error = path_ + ": " + strerror(saved_errno_);
+  }
+  return ok_;
+}
+
+bool ReadAllocLog(const std::string &path, AllocLog *log,
+                  std::string *error) {
+  std::string contents;
+  if (!ReadFile(path, &contents)) {
+    *error = path + ": " + strerror(errno);
+    return false;
+  }
+  if (contents.size() < sizeof(kMagic) ||
+      contents.compare(0, sizeof(kMagic), kMagic, sizeof(kMagic)) != 0) {
+    return InvalidLog(path, "bad magic number", error);
+  }
+
+  log->records.clear();
+  log->stacks.assign(1, {});
+  log->num_frames = 0;
+  VarintReader r(contents, sizeof(kMagic));
+  uint64_t last_ptr = 0;
+  while (!r.done()) {
+    uint8_t tag;
+    r.ReadByte(&tag);
+    if (tag == kStackTag) {
+      uint64_t depth;
+      if (!r.Read(&depth) || depth > kMaxStackDepth) {
+        return InvalidLog(path, "bad stack", error);
+      }
+      std::vector<uint32_t> frames(depth);
+      for (uint32_t &frame : frames) {
+        if (!r.Read(&frame)) {
+          return InvalidLog(path, "bad stack", error);
+        }
+        log->num_frames = std::max(log->num_frames, frame + 1);
+      }
+      log->stacks.push_back(std::move(frames));
+      continue;
+    }
+    if (tag > static_cast<uint8_t>(AllocOp::kFree)) {
+      return InvalidLog(path, "bad record type", error);
+    }
+
+    AllocRecord record = {static_cast<AllocOp>(tag), 0, 0, 0, 0, kNoStack};
+    bool ok = r.Read(&record.thread) && r.ReadPointer(&last_ptr, &record.ptr);
+    if (ok && record.op == AllocOp::kRealloc) {
+      ok = r.ReadPointer(&last_ptr, &record.old_ptr);
+    }
+    if (ok && record.op != AllocOp::kFree) {
+      ok = r.Read(&record.size) && r.Read(&record.stack) &&
+           record.stack < log->stacks.size();
+    }
+    if (!ok) {
+      return InvalidLog(path, "bad record", error);
+    }
+    log->records.push_back(record);
+  }
+
+  return true;
+}
@@ -0,0 +1,89 @@
+// Copyright 2019 Timothy Palpant
+
+#ifndef MPROFILE_SRC_ALLOC_LOG_H_
+#define MPROFILE_SRC_ALLOC_LOG_H_
+
+#include <stdio.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// An AllocLog is the stream of allocations that a workload made through the
+// Python allocators, in order. It is recorded by StartAllocationLog (see
+// malloc_patch.h) so that the profiler's data structures can be benchmarked
+// on real addresses, sizes, free orders and stacks by replaying it (see
+// replay_bench.cc), rather than on synthetic ones.
+//
+// Stacks are recorded as lists of frame ids, where each id stands for a
+// distinct function location. The names and filenames themselves are not
+// recorded: a replay only needs the shape of the stacks.
+
+enum class AllocOp : uint8_t { kMalloc, kRealloc, kFree };
+
+// Id of the stack of allocations made without the GIL or a Python frame.
+const uint32_t kNoStack = 0;
+
+struct AllocRecord {
+  AllocOp op;
+  // Threads are numbered from 0 in the order of their first allocation.
+  uint32_t thread;
+  // The new block of a malloc or realloc, or the block that was freed.
+  uint64_t ptr;
+  // The original block of a realloc, which may be 0.
+  uint64_t old_ptr;
+  // The size of a malloc or realloc.
+  uint64_t size;
+  // The stack of a malloc or realloc.
+  uint32_t stack;
+};
+
+struct AllocLog {
+  std::vector<AllocRecord> records;
+  // The frame ids of each stack from the root down, indexed by stack id.
+  // stacks[kNoStack] is empty.
+  std::vector<std::vector<uint32_t>> stacks;
+  // The number of distinct frame ids, which are numbered from 0.
+  uint32_t num_frames = 0;
+};
+
+// AllocLogWriter writes an AllocLog to a file as it is recorded, buffering
+// the records in memory. It is not thread-safe.
+class AllocLogWriter {
+ public:
+  AllocLogWriter() : file_(nullptr), ok_(true), last_ptr_(0) {}
+  ~AllocLogWriter();
+  // Not copyable or assignable.
+  AllocLogWriter(const AllocLogWriter &) = delete;
+  AllocLogWriter &operator=(const AllocLogWriter &) = delete;
+
+  // Returns false, with an error message, if the file can't be created.
+  bool Open(const std::string &path, std::string *error);
+  // Stacks are numbered from 1 (after kNoStack) in the order they are
+  // added, and must be added before the first record that uses them.
+  void AddStack(const std::vector<uint32_t> &frames);
+  void Add(const AllocRecord &record);
+  // Returns false, with an error message, if any write failed.
+  bool Close(std::string *error);
+
+ private:
+  void PutVarint(uint64_t value);
+  void PutPointer(uint64_t ptr);
+  void MaybeFlush();
+
+  std::string path_;
+  FILE *file_;
+  bool ok_;
+  int saved_errno_ = 0;
+  std::string buffer_;
+  // Pointers are written as the difference from the last one, which is
+  // usually small since the allocators reuse nearby blocks.
+  uint64_t last_ptr_;
+};
+
+// Read the AllocLog in the given file. Returns false, with an error
+// message, if the file can't be read or is not a valid log. errno is set if
+// the file can't be read, or 0 if it is invalid.
+bool ReadAllocLog(const std::string &path, AllocLog *log, std::string *error);
+
+#endif  // MPROFILE_SRC_ALLOC_LOG_H_
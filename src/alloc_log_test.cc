@@ -0,0 +1,118 @@
+// Copyright 2019 Timothy Palpant
+//
+#include "alloc_log.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "gtest/gtest.h"
+#include "malloc_patch.h"
+#include "scoped_object.h"
+
+namespace {
+
+std::string TempPath(const char *name) {
+  return "/tmp/mprofile_alloc_log_test_" + std::to_string(getpid()) + "_" +
+         name;
+}
+
+}  // namespace
+
+TEST(AllocLog, WriteRead) {
+  const std::string path = TempPath("roundtrip");
+  std::string error;
+  AllocLogWriter writer;
+  ASSERT_TRUE(writer.Open(path, &error)) << error;
+  writer.AddStack({0, 1, 2});
+  writer.AddStack({0, 3});
+  const uint64_t base = 0x7f0000001000;
+  writer.Add({AllocOp::kMalloc, 0, base, 0, 24, 1});
+  writer.Add({AllocOp::kMalloc, 1, base - 64, 0, 1 << 20, kNoStack});
+  writer.Add({AllocOp::kRealloc, 0, 0x1000, base, 48, 2});
+  writer.Add({AllocOp::kFree, 1, base - 64, 0, 0, kNoStack});
+  ASSERT_TRUE(writer.Close(&error)) << error;
+
+  AllocLog log;
+  ASSERT_TRUE(ReadAllocLog(path, &log, &error)) << error;
+  unlink(path.c_str());
+  ASSERT_EQ(log.stacks.size(), 3);
+  EXPECT_TRUE(log.stacks[kNoStack].empty());
+  EXPECT_EQ(log.stacks[1], std::vector<uint32_t>({0, 1, 2}));
+  EXPECT_EQ(log.stacks[2], std::vector<uint32_t>({0, 3}));
+  EXPECT_EQ(log.num_frames, 4);
+
+  ASSERT_EQ(log.records.size(), 4);
+  const AllocRecord &realloc = log.records[2];
+  EXPECT_EQ(realloc.op, AllocOp::kRealloc);
+  EXPECT_EQ(realloc.thread, 0);
+  EXPECT_EQ(realloc.ptr, 0x1000);
+  EXPECT_EQ(realloc.old_ptr, base);
+  EXPECT_EQ(realloc.size, 48);
+  EXPECT_EQ(realloc.stack, 2);
+  const AllocRecord &free = log.records[3];
+  EXPECT_EQ(free.op, AllocOp::kFree);
+  EXPECT_EQ(free.thread, 1);
+  EXPECT_EQ(free.ptr, base - 64);
+  EXPECT_EQ(log.records[1].size, 1 << 20);
+}
+
+TEST(AllocLog, ReadErrors) {
+  AllocLog log;
+  std::string error;
+  EXPECT_FALSE(ReadAllocLog(TempPath("missing"), &log, &error));
+  EXPECT_EQ(errno, ENOENT);
+
+  const std::string path = TempPath("truncated");
+  AllocLogWriter writer;
+  ASSERT_TRUE(writer.Open(path, &error)) << error;
+  writer.AddStack({0});
+  writer.Add({AllocOp::kMalloc, 0, 0x7f0000001000, 0, 24, 1});
+  ASSERT_TRUE(writer.Close(&error)) << error;
+  // Cut the last varint of the malloc short.
+  ASSERT_EQ(truncate(path.c_str(), 14), 0);
+  EXPECT_FALSE(ReadAllocLog(path, &log, &error));
+  EXPECT_EQ(errno, 0);
+  unlink(path.c_str());
+}
+
+TEST(AllocLog, Record) {
+  const std::string path = TempPath("record");
+  std::string error;
+  // Code run from a "<string>" file would not have a stack.
+  PyObjectRef code(Py_CompileString(
+      "def f():\n"
+      "    return [str(i) * 100 for i in range(100)]\n"
+      "x = f()\n",
+      "record_test.py", Py_file_input));
+  ASSERT_NE(code, nullptr);
+  PyObjectRef globals(PyDict_New());
+  PyDict_SetItemString(globals.get(), "__builtins__", PyEval_GetBuiltins());
+
+  ASSERT_TRUE(StartAllocationLog(path, &error)) << error;
+  EXPECT_TRUE(IsAllocationLogActive());
+  PyObjectRef result(
+      PyEval_EvalCode(code.get(), globals.get(), globals.get()));
+  globals.reset(nullptr);
+  ASSERT_TRUE(StopAllocationLog(&error)) << error;
+  ASSERT_NE(result, nullptr);
+  EXPECT_FALSE(IsAllocationLogActive());
+
+  AllocLog log;
+  ASSERT_TRUE(ReadAllocLog(path, &log, &error)) << error;
+  unlink(path.c_str());
+  int mallocs = 0;
+  int frees = 0;
+  for (const AllocRecord &r : log.records) {
+    // The strings are allocated from f, called from the module.
+    if (r.op == AllocOp::kMalloc && r.size >= 100 &&
+        log.stacks[r.stack].size() >= 2) {
+      mallocs++;
+    } else if (r.op == AllocOp::kFree) {
+      frees++;
+    }
+  }
+  EXPECT_GE(mallocs, 100);
+  EXPECT_GE(frees, 100);
+}
@@ -0,0 +1,254 @@
+// Copyright 2019 Timothy Palpant
+
+#include "arena.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <mutex>
+
+namespace {
+
+const std::size_t kChunkSize = 256 * 1024;
+const std::size_t kHugePageSize = 2 * 1024 * 1024;
+// Blocks are aligned to (and size classes are multiples of) this.
+const std::size_t kAlignment = 16;
+// Header used by Malloc to remember the size of the block.
+const std::size_t kMallocHeaderSize = kAlignment;
+
+std::size_t RoundUp(std::size_t n, std::size_t align) {
+  return (n + align - 1) & ~(align - 1);
+}
+
+std::size_t PageSize() {
+  static const std::size_t page_size = sysconf(_SC_PAGESIZE);
+  return page_size;
+}
+
+}  // namespace
+
+// Header at the start of each chunk.
+struct Arena::Chunk {
+  Chunk *next;
+  std::size_t size;
+};
+
+// Header at the start of each individually mapped block.
+struct alignas(16) Arena::LargeBlock {
+  LargeBlock *prev;
+  LargeBlock *next;
+  std::size_t size;
+};
+
+Arena::Arena(bool huge_pages)
+    : huge_pages_(huge_pages),
+      chunk_size_(huge_pages ? kHugePageSize : kChunkSize),
+      max_small_size_(chunk_size_ / 4),
+      chunks_(nullptr),
+      chunk_pos_(nullptr),
+      chunk_end_(nullptr),
+      large_blocks_(nullptr),
+      free_lists_(),
+      mapped_bytes_(0) {}
+
+Arena::~Arena() { Reset(); }
+
+// Sizes up to 1KB are rounded up to a multiple of 16 bytes. Above that,
+// there are 8 size classes for every power of two, so at most 1/8th of a
+// block is wasted.
+int Arena::SizeClass(std::size_t size) {
+  if (size <= 1024) {
+    return (size == 0) ? 1 : (size + kAlignment - 1) / kAlignment;
+  }
+
+  const int lg = 63 - __builtin_clzll(size - 1);
+  const int sub = (size - 1 - (std::size_t(1) << lg)) >> (lg - 3);
+  return 64 + (lg - 10) * 8 + sub + 1;
+}
+
+std::size_t Arena::ClassSize(int size_class) {
+  if (size_class <= 64) {
+    return size_class * kAlignment;
+  }
+
+  const int k = size_class - 65;
+  const int lg = 10 + k / 8;
+  return (std::size_t(1) << lg) + (k % 8 + 1) * (std::size_t(1) << (lg - 3));
+}
+
+// Maps at least *size bytes, and updates *size to the size of the mapping.
+void *Arena::MapPages(std::size_t *size) {
+  if (!huge_pages_ || *size < kHugePageSize) {
+    *size = RoundUp(*size, PageSize());
+    void *p = mmap(nullptr, *size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (p == MAP_FAILED) ? nullptr : p;
+  }
+
+  // Transparent huge pages are only used for aligned regions, so map an
+  // extra huge page and trim the ends to align it.
+  *size = RoundUp(*size, kHugePageSize);
+  const std::size_t mapped_size = *size + kHugePageSize;
+  void *p = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return nullptr;
+  }
+
+  const uintptr_t start = reinterpret_cast<uintptr_t>(p);
+  const uintptr_t aligned = RoundUp(start, kHugePageSize);
+  if (aligned > start) {
+    munmap(p, aligned - start);
+  }
+  const uintptr_t end = aligned + *size;
+  if (start + mapped_size > end) {
+    munmap(reinterpret_cast<void *>(end), start + mapped_size - end);
+  }
+#ifdef MADV_HUGEPAGE
+  madvise(reinterpret_cast<void *>(aligned), *size, MADV_HUGEPAGE);
+#endif
+  return reinterpret_cast<void *>(aligned);
+}
+
+void Arena::UnmapPages(void *ptr, std::size_t size) { munmap(ptr, size); }
+
+void *Arena::Allocate(std::size_t size) {
+  std::lock_guard<SpinLock> lock(mu_);
+  if (size > max_small_size_) {
+    return AllocateLarge(size);
+  }
+
+  const int size_class = SizeClass(size);
+  FreeBlock *block = free_lists_[size_class];
+  if (block != nullptr) {
+    free_lists_[size_class] = block->next;
+    return block;
+  }
+
+  return AllocateFromChunk(ClassSize(size_class));
+}
+
+void Arena::Deallocate(void *ptr, std::size_t size) {
+  if (ptr == nullptr) {
+    return;
+  }
+
+  std::lock_guard<SpinLock> lock(mu_);
+  if (size > max_small_size_) {
+    DeallocateLarge(ptr);
+    return;
+  }
+
+  const int size_class = SizeClass(size);
+  FreeBlock *block = static_cast<FreeBlock *>(ptr);
+  block->next = free_lists_[size_class];
+  free_lists_[size_class] = block;
+}
+
+void *Arena::Malloc(std::size_t size) {
+  char *p = static_cast<char *>(Allocate(size + kMallocHeaderSize));
+  if (p == nullptr) {
+    return nullptr;
+  }
+
+  *reinterpret_cast<std::size_t *>(p) = size;
+  return p + kMallocHeaderSize;
+}
+
+void Arena::Free(void *ptr) {
+  if (ptr == nullptr) {
+    return;
+  }
+
+  char *p = static_cast<char *>(ptr) - kMallocHeaderSize;
+  Deallocate(p, *reinterpret_cast<std::size_t *>(p) + kMallocHeaderSize);
+}
+
+// mu_ must be held.
+void *Arena::AllocateLarge(std::size_t size) {
+  std::size_t mapped_size = size + sizeof(LargeBlock);
+  void *p = MapPages(&mapped_size);
+  if (p == nullptr) {
+    return nullptr;
+  }
+
+  LargeBlock *block = static_cast<LargeBlock *>(p);
+  block->prev = nullptr;
+  block->next = large_blocks_;
+  block->size = mapped_size;
+  if (large_blocks_ != nullptr) {
+    large_blocks_->prev = block;
+  }
+  large_blocks_ = block;
+  mapped_bytes_ += mapped_size;
+  return block + 1;
+}
+
+// mu_ must be held.
+void Arena::DeallocateLarge(void *ptr) {
+  LargeBlock *block = static_cast<LargeBlock *>(ptr) - 1;
+  if (block->prev != nullptr) {
+    block->prev->next = block->next;
+  } else {
+    large_blocks_ = block->next;
+  }
+  if (block->next != nullptr) {
+    block->next->prev = block->prev;
+  }
+  mapped_bytes_ -= block->size;
+  UnmapPages(block, block->size);
+}
+
+// mu_ must be held.
+void *Arena::AllocateFromChunk(std::size_t size) {
+  if (chunk_pos_ + size > chunk_end_) {
+    // The rest of the current chunk is left unused.
+    std::size_t mapped_size = chunk_size_;
+    void *p = MapPages(&mapped_size);
+    if (p == nullptr) {
+      return nullptr;
+    }
+
+    Chunk *chunk = static_cast<Chunk *>(p);
+    chunk->next = chunks_;
+    chunk->size = mapped_size;
+    chunks_ = chunk;
+    mapped_bytes_ += mapped_size;
+    chunk_pos_ = static_cast<char *>(p) + RoundUp(sizeof(Chunk), kAlignment);
+    chunk_end_ = static_cast<char *>(p) + mapped_size;
+  }
+
+  void *result = chunk_pos_;
+  chunk_pos_ += size;
+  return result;
+}
+
+void Arena::Reset() {
+  std::lock_guard<SpinLock> lock(mu_);
+  for (Chunk *chunk = chunks_; chunk != nullptr;) {
+    Chunk *next = chunk->next;
+    UnmapPages(chunk, chunk->size);
+    chunk = next;
+  }
+
+  for (LargeBlock *block = large_blocks_; block != nullptr;) {
+    LargeBlock *next = block->next;
+    UnmapPages(block, block->size);
+    block = next;
+  }
+
+  chunks_ = nullptr;
+  chunk_pos_ = nullptr;
+  chunk_end_ = nullptr;
+  large_blocks_ = nullptr;
+  for (auto &free_list : free_lists_) {
+    free_list = nullptr;
+  }
+  mapped_bytes_ = 0;
+}
+
+std::size_t Arena::MemoryUsage() {
+  std::lock_guard<SpinLock> lock(mu_);
+  return mapped_bytes_;
+}
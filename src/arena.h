@@ -0,0 +1,127 @@
+// Copyright 2019 Timothy Palpant
+
+#ifndef MPROFILE_SRC_ARENA_H_
+#define MPROFILE_SRC_ARENA_H_
+
+#include <stdlib.h>
+
+#include <cstddef>
+#include <new>
+
+#include "spinlock.h"
+
+// Arena is a thread-safe allocator for the profiler's own data structures
+// that gets its memory directly from the OS with mmap.
+//
+// Keeping profiler metadata out of the application heap means that it does
+// not fragment the heap being profiled, that its footprint can be measured
+// exactly, and that all of it can be returned to the OS at once with Reset().
+//
+// Small blocks are carved out of large chunks and recycled through
+// per-size-class free lists. Larger blocks are mapped individually and
+// unmapped as soon as they are freed.
+class Arena {
+ public:
+  // If huge_pages is true, chunks are aligned to and advised as transparent
+  // huge pages, where supported.
+  explicit Arena(bool huge_pages = false);
+  ~Arena();
+  // Not copyable or assignable.
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  // Allocate an uninitialized block of the given size, aligned to 16 bytes.
+  void *Allocate(std::size_t size);
+  // Free a block returned by Allocate. size must be the size it was
+  // allocated with.
+  void Deallocate(void *ptr, std::size_t size);
+
+  // Like Allocate/Deallocate, but remembers the size of the block so that
+  // it does not need to be passed to Free. This is for clients such as
+  // AddressMap that expect malloc/free.
+  void *Malloc(std::size_t size);
+  void Free(void *ptr);
+
+  // Release all memory back to the OS. Any blocks that were allocated from
+  // the arena are invalidated.
+  void Reset();
+
+  // The number of bytes currently mapped by the arena.
+  std::size_t MemoryUsage();
+
+  bool huge_pages() const { return huge_pages_; }
+
+ private:
+  struct Chunk;
+  struct LargeBlock;
+  struct FreeBlock {
+    FreeBlock *next;
+  };
+
+  static int SizeClass(std::size_t size);
+  static std::size_t ClassSize(int size_class);
+  static const int kNumSizeClasses = 145;
+
+  void *MapPages(std::size_t *size);
+  void UnmapPages(void *ptr, std::size_t size);
+  void *AllocateLarge(std::size_t size);
+  void DeallocateLarge(void *ptr);
+  void *AllocateFromChunk(std::size_t size);
+
+  const bool huge_pages_;
+  // Size of the chunks that small blocks are allocated from.
+  const std::size_t chunk_size_;
+  // Blocks larger than this are mapped individually.
+  const std::size_t max_small_size_;
+
+  // Guards all fields below.
+  SpinLock mu_;
+  // All chunks, so that they can be unmapped on Reset.
+  Chunk *chunks_;
+  // The unused part of the most recent chunk.
+  char *chunk_pos_;
+  char *chunk_end_;
+  // All individually mapped blocks.
+  LargeBlock *large_blocks_;
+  FreeBlock *free_lists_[kNumSizeClasses];
+  std::size_t mapped_bytes_;
+};
+
+// ArenaAllocator adapts an Arena for use with STL-style containers.
+template <class T>
+class ArenaAllocator {
+ public:
+  typedef T value_type;
+
+  explicit ArenaAllocator(Arena *arena) : arena_(arena) {}
+  template <class U>
+  ArenaAllocator(const ArenaAllocator<U> &other) : arena_(other.arena()) {}
+
+  T *allocate(std::size_t n) {
+    T *p = static_cast<T *>(arena_->Allocate(n * sizeof(T)));
+    if (p == nullptr) {
+      throw std::bad_alloc();
+    }
+    return p;
+  }
+  void deallocate(T *p, std::size_t n) {
+    arena_->Deallocate(p, n * sizeof(T));
+  }
+
+  Arena *arena() const { return arena_; }
+
+ private:
+  Arena *arena_;
+};
+
+template <class T, class U>
+bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+  return a.arena() == b.arena();
+}
+
+template <class T, class U>
+bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+  return a.arena() != b.arena();
+}
+
+#endif  // MPROFILE_SRC_ARENA_H_
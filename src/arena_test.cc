@@ -0,0 +1,93 @@
+// Copyright 2019 Timothy Palpant
+//
+#include "arena.h"
+
+#include <cstring>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "third_party/greg7mdp/parallel-hashmap/phmap.h"
+
+TEST(Arena, AllocateDeallocate) {
+  Arena arena;
+  EXPECT_EQ(arena.MemoryUsage(), 0);
+
+  std::vector<char *> blocks;
+  for (std::size_t size = 1; size <= 4096; size *= 3) {
+    char *p = static_cast<char *>(arena.Allocate(size));
+    ASSERT_NE(p, nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(p) % 16, 0);
+    std::memset(p, 0xab, size);
+    blocks.push_back(p);
+  }
+  EXPECT_GT(arena.MemoryUsage(), 0);
+
+  // Freed blocks are reused for allocations of the same size class.
+  arena.Deallocate(blocks[2], 9);
+  EXPECT_EQ(arena.Allocate(12), blocks[2]);
+}
+
+TEST(Arena, LargeBlocksAreUnmapped) {
+  Arena arena;
+  const std::size_t usage = arena.MemoryUsage();
+  const std::size_t size = 10 * 1024 * 1024;
+  char *p = static_cast<char *>(arena.Allocate(size));
+  ASSERT_NE(p, nullptr);
+  p[0] = 1;
+  p[size - 1] = 1;
+  EXPECT_GE(arena.MemoryUsage(), usage + size);
+
+  arena.Deallocate(p, size);
+  EXPECT_EQ(arena.MemoryUsage(), usage);
+}
+
+TEST(Arena, MallocFree) {
+  Arena arena;
+  std::vector<void *> blocks;
+  for (std::size_t size : {1, 100, 65560, 1 << 20}) {
+    void *p = arena.Malloc(size);
+    ASSERT_NE(p, nullptr);
+    std::memset(p, 0, size);
+    blocks.push_back(p);
+  }
+
+  for (void *p : blocks) {
+    arena.Free(p);
+  }
+}
+
+TEST(Arena, Reset) {
+  for (bool huge_pages : {false, true}) {
+    Arena arena(huge_pages);
+    for (int i = 0; i < 100000; i++) {
+      arena.Allocate(48);
+    }
+    arena.Allocate(1 << 22);
+    EXPECT_GE(arena.MemoryUsage(), 100000 * 48 + (1 << 22));
+
+    arena.Reset();
+    EXPECT_EQ(arena.MemoryUsage(), 0);
+    EXPECT_NE(arena.Allocate(48), nullptr);
+  }
+}
+
+TEST(ArenaAllocator, HashSet) {
+  Arena arena;
+  {
+    phmap::node_hash_set<int, phmap::Hash<int>, phmap::EqualTo<int>,
+                         ArenaAllocator<int>>
+        set(0, phmap::Hash<int>(), phmap::EqualTo<int>(),
+            ArenaAllocator<int>(&arena));
+    for (int i = 0; i < 100000; i++) {
+      set.insert(i);
+    }
+    EXPECT_EQ(set.size(), 100000);
+    EXPECT_GE(arena.MemoryUsage(), 100000 * sizeof(int));
+  }
+
+  // All of the set's memory was returned to the arena, but is not unmapped
+  // until it is reset.
+  EXPECT_GT(arena.MemoryUsage(), 0);
+  arena.Reset();
+  EXPECT_EQ(arena.MemoryUsage(), 0);
+}
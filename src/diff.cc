@@ -0,0 +1,137 @@
+// Copyright 2019 Timothy Palpant
+
+#include "diff.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <utility>
+
+namespace {
+
+// Returns the samples of a profile as (frame hash, sample index) pairs,
+// sorted by hash.
+std::vector<std::pair<uint64_t, uint32_t>> SortedSamples(
+    const Profile &profile) {
+  std::vector<std::pair<uint64_t, uint32_t>> sorted;
+  sorted.reserve(profile.samples.size());
+  for (uint32_t i = 0; i < profile.samples.size(); i++) {
+    sorted.emplace_back(profile.frames[profile.samples[i].frame].hash, i);
+  }
+  std::sort(sorted.begin(), sorted.end());
+  return sorted;
+}
+
+// Returns the frames of a stack from the root down, which is the order
+// that Traceback compares them in.
+std::vector<uint32_t> RootFirst(const Profile &profile, uint32_t leaf) {
+  std::vector<uint32_t> frames;
+  for (uint32_t f = leaf; f != kNoParentFrame; f = profile.frames[f].parent) {
+    frames.push_back(f);
+  }
+  std::reverse(frames.begin(), frames.end());
+  return frames;
+}
+
+// Compares two stacks like Python compares their frame tuples,
+// (name, filename, firstlineno, lineno). Comparing UTF-8 bytes gives the
+// same order as comparing code points.
+int CompareStacks(const StackDiff &a, const StackDiff &b) {
+  const std::vector<uint32_t> fa = RootFirst(*a.profile, a.frame);
+  const std::vector<uint32_t> fb = RootFirst(*b.profile, b.frame);
+  for (std::size_t i = 0; i < fa.size() && i < fb.size(); i++) {
+    const ProfileFrame &x = a.profile->frames[fa[i]];
+    const ProfileFrame &y = b.profile->frames[fb[i]];
+    int c = a.profile->strings[x.name].compare(b.profile->strings[y.name]);
+    if (c == 0) {
+      c = a.profile->strings[x.filename].compare(
+          b.profile->strings[y.filename]);
+    }
+    if (c != 0) {
+      return c;
+    }
+    if (x.firstlineno != y.firstlineno) {
+      return (x.firstlineno < y.firstlineno) ? -1 : 1;
+    }
+    if (x.lineno != y.lineno) {
+      return (x.lineno < y.lineno) ? -1 : 1;
+    }
+  }
+  if (fa.size() != fb.size()) {
+    return (fa.size() < fb.size()) ? -1 : 1;
+  }
+  return 0;
+}
+
+// Orders diffs like StatisticDiff._sort_key, largest first.
+bool LargerDiff(const StackDiff &a, const StackDiff &b) {
+  const int64_t abs_size_a = std::llabs(a.size_diff);
+  const int64_t abs_size_b = std::llabs(b.size_diff);
+  if (abs_size_a != abs_size_b) {
+    return abs_size_a > abs_size_b;
+  }
+  if (a.size != b.size) {
+    return a.size > b.size;
+  }
+  const int64_t abs_count_a = std::llabs(a.count_diff);
+  const int64_t abs_count_b = std::llabs(b.count_diff);
+  if (abs_count_a != abs_count_b) {
+    return abs_count_a > abs_count_b;
+  }
+  if (a.count != b.count) {
+    return a.count > b.count;
+  }
+  return CompareStacks(a, b) > 0;
+}
+
+}  // namespace
+
+std::vector<StackDiff> DiffProfiles(const Profile &new_profile,
+                                    const Profile &old_profile,
+                                    std::size_t limit) {
+  const auto new_sorted = SortedSamples(new_profile);
+  const auto old_sorted = SortedSamples(old_profile);
+
+  std::vector<StackDiff> diffs;
+  diffs.reserve(std::max(new_sorted.size(), old_sorted.size()));
+  auto n = new_sorted.begin();
+  auto o = old_sorted.begin();
+  while (n != new_sorted.end() || o != old_sorted.end()) {
+    if (o == old_sorted.end() ||
+        (n != new_sorted.end() && n->first < o->first)) {
+      const ProfileSample &sample = new_profile.samples[n->second];
+      const ProfileSample s = ScaleSample(sample, new_profile.sample_rate);
+      const int64_t size = s.size;
+      const int64_t count = s.count;
+      diffs.push_back({&new_profile, sample.frame, size, size, count, count});
+      ++n;
+    } else if (n == new_sorted.end() || o->first < n->first) {
+      const ProfileSample &sample = old_profile.samples[o->second];
+      const ProfileSample s = ScaleSample(sample, old_profile.sample_rate);
+      const int64_t size = s.size;
+      const int64_t count = s.count;
+      diffs.push_back({&old_profile, sample.frame, 0, -size, 0, -count});
+      ++o;
+    } else {
+      const ProfileSample &sample = new_profile.samples[n->second];
+      const ProfileSample s = ScaleSample(sample, new_profile.sample_rate);
+      const ProfileSample old = ScaleSample(old_profile.samples[o->second],
+                                            old_profile.sample_rate);
+      const int64_t size = s.size;
+      const int64_t count = s.count;
+      diffs.push_back({&new_profile, sample.frame, size,
+                       size - static_cast<int64_t>(old.size), count,
+                       count - static_cast<int64_t>(old.count)});
+      ++n;
+      ++o;
+    }
+  }
+
+  if (limit == 0 || limit >= diffs.size()) {
+    std::sort(diffs.begin(), diffs.end(), LargerDiff);
+  } else {
+    std::partial_sort(diffs.begin(), diffs.begin() + limit, diffs.end(),
+                      LargerDiff);
+    diffs.resize(limit);
+  }
+  return diffs;
+}
@@ -0,0 +1,35 @@
+// Copyright 2019 Timothy Palpant
+
+#ifndef MPROFILE_SRC_DIFF_H_
+#define MPROFILE_SRC_DIFF_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "profile.h"
+
+// The change in the (scaled) allocations of one stack between two
+// profiles, like a StatisticDiff.
+struct StackDiff {
+  // The profile and leaf frame that identify the stack. This is the newer
+  // profile, unless the stack is only in the older one.
+  const Profile *profile;
+  uint32_t frame;
+  int64_t size;
+  int64_t size_diff;
+  int64_t count;
+  int64_t count_diff;
+};
+
+// Diff the stacks in two profiles, which should each have one sample per
+// stack. Stacks are matched by their frame hash, in a sorted merge.
+//
+// Returns the largest limit differences (or all of them, if limit is 0),
+// in the order of Snapshot.compare_to: by descending absolute size
+// difference, size, absolute count difference, count and finally stack.
+std::vector<StackDiff> DiffProfiles(const Profile &new_profile,
+                                    const Profile &old_profile,
+                                    std::size_t limit);
+
+#endif  // MPROFILE_SRC_DIFF_H_
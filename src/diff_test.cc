@@ -0,0 +1,71 @@
+// Copyright 2019 Timothy Palpant
+//
+#include "diff.h"
+
+#include <string>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+// Adds a sample for the single-frame stack file:lineno.
+void AddSample(Profile *profile, const std::string &filename, int lineno,
+               uint64_t size, uint64_t count) {
+  ProfileBuilder builder(profile);
+  uint32_t name = builder.AddString("f", 1);
+  uint32_t file = builder.AddString(filename.data(), filename.size());
+  uint32_t frame = builder.AddFrame(kNoParentFrame, file, name, 1, lineno);
+  builder.AddSample(frame, size, count);
+}
+
+int Lineno(const StackDiff &d) { return d.profile->frames[d.frame].lineno; }
+
+const std::string &Filename(const StackDiff &d) {
+  return d.profile->strings[d.profile->frames[d.frame].filename];
+}
+
+}  // namespace
+
+TEST(DiffProfiles, SortedMerge) {
+  Profile old_profile;
+  AddSample(&old_profile, "a.py", 2, 30, 3);
+  AddSample(&old_profile, "b.py", 1, 66, 1);
+  Profile new_profile;
+  AddSample(&new_profile, "c.py", 578, 400, 1);
+  AddSample(&new_profile, "a.py", 2, 30, 3);
+  AddSample(&new_profile, "a.py", 5, 5002, 2);
+
+  auto diffs = DiffProfiles(new_profile, old_profile, 0);
+  ASSERT_EQ(diffs.size(), 4);
+  EXPECT_EQ(Lineno(diffs[0]), 5);
+  EXPECT_EQ(diffs[0].size_diff, 5002);
+  EXPECT_EQ(Lineno(diffs[1]), 578);
+  // Stacks that were freed come from the old profile.
+  EXPECT_EQ(diffs[2].profile, &old_profile);
+  EXPECT_EQ(diffs[2].size, 0);
+  EXPECT_EQ(diffs[2].size_diff, -66);
+  EXPECT_EQ(diffs[2].count_diff, -1);
+  EXPECT_EQ(Lineno(diffs[3]), 2);
+  EXPECT_EQ(diffs[3].size_diff, 0);
+  EXPECT_EQ(diffs[3].count, 3);
+
+  auto top = DiffProfiles(new_profile, old_profile, 2);
+  ASSERT_EQ(top.size(), 2);
+  EXPECT_EQ(Lineno(top[0]), 5);
+  EXPECT_EQ(Lineno(top[1]), 578);
+}
+
+TEST(DiffProfiles, TiesOrderedByStack) {
+  Profile old_profile;
+  Profile new_profile;
+  AddSample(&new_profile, "a.py", 1, 10, 1);
+  AddSample(&new_profile, "b.py", 1, 10, 1);
+  AddSample(&new_profile, "a.py", 2, 10, 1);
+
+  auto diffs = DiffProfiles(new_profile, old_profile, 0);
+  ASSERT_EQ(diffs.size(), 3);
+  // Descending, like sorted(..., reverse=True).
+  EXPECT_EQ(Filename(diffs[0]), "b.py");
+  EXPECT_EQ(Lineno(diffs[1]), 2);
+  EXPECT_EQ(Lineno(diffs[2]), 1);
+}
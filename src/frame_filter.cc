@@ -0,0 +1,59 @@
+// Copyright 2019 Timothy Palpant
+
+#include "frame_filter.h"
+
+#include <fnmatch.h>
+
+#include <utility>
+
+FrameFilter::FrameFilter(std::vector<std::string> include,
+                         std::vector<std::string> exclude,
+                         bool collapse_recursion, int root_frames)
+    : include_(std::move(include)),
+      exclude_(std::move(exclude)),
+      collapse_recursion_(collapse_recursion),
+      root_frames_(root_frames) {}
+
+FrameFilter::~FrameFilter() {
+  for (auto &entry : keep_file_) {
+    Py_DECREF(entry.first);
+  }
+}
+
+bool FrameFilter::KeepFileSlow(PyObject *filename) {
+  // This runs inside the allocation hooks, so any exception raised while
+  // encoding the filename must not clobber one that is already set.
+  PyObject *type, *value, *traceback;
+  PyErr_Fetch(&type, &value, &traceback);
+  // A filename that cannot be encoded matches no patterns.
+  const char *utf8 = PyUnicode_AsUTF8(filename);
+  const bool keep = (utf8 != nullptr) ? Matches(utf8) : include_.empty();
+  PyErr_Clear();
+  PyErr_Restore(type, value, traceback);
+
+  Py_INCREF(filename);
+  keep_file_.emplace(filename, keep);
+  return keep;
+}
+
+bool FrameFilter::Matches(const char *filename) const {
+  if (!include_.empty()) {
+    bool included = false;
+    for (const std::string &pattern : include_) {
+      if (fnmatch(pattern.c_str(), filename, 0) == 0) {
+        included = true;
+        break;
+      }
+    }
+    if (!included) {
+      return false;
+    }
+  }
+
+  for (const std::string &pattern : exclude_) {
+    if (fnmatch(pattern.c_str(), filename, 0) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
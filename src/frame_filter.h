@@ -0,0 +1,66 @@
+// Copyright 2019 Timothy Palpant
+
+#ifndef MPROFILE_SRC_FRAME_FILTER_H_
+#define MPROFILE_SRC_FRAME_FILTER_H_
+
+#include <Python.h>
+
+#include <string>
+#include <vector>
+
+#include "third_party/greg7mdp/parallel-hashmap/phmap.h"
+
+// FrameFilter decides which Python frames are captured in a stack trace,
+// so that deep framework stacks cost less to capture and to intern.
+//
+// Frames are kept if their filename matches one of the include patterns
+// (or there are none) and none of the exclude patterns. Patterns are
+// shell-style globs, like Filter.filename_pattern. Dropped frames are
+// skipped entirely, so their allocations are attributed to the nearest
+// kept caller.
+class FrameFilter {
+ public:
+  // If collapse_recursion is true, a run of frames of the same function
+  // keeps only the innermost one. If root_frames is positive, that many
+  // frames from the root of the stack are always kept, and the remaining
+  // max_frames are taken from the leaf; the frames in between are dropped.
+  FrameFilter(std::vector<std::string> include,
+              std::vector<std::string> exclude, bool collapse_recursion,
+              int root_frames);
+  // The GIL must be held.
+  ~FrameFilter();
+  // Not copyable or assignable.
+  FrameFilter(const FrameFilter &) = delete;
+  FrameFilter &operator=(const FrameFilter &) = delete;
+
+  bool collapse_recursion() const { return collapse_recursion_; }
+  int root_frames() const { return root_frames_; }
+
+  // Whether frames in the given file are kept. The result is cached for
+  // each filename object, so patterns are only matched once per file. The
+  // GIL must be held.
+  bool KeepFile(PyObject *filename) {
+    if (include_.empty() && exclude_.empty()) {
+      return true;
+    }
+    auto it = keep_file_.find(filename);
+    if (it != keep_file_.end()) {
+      return it->second;
+    }
+    return KeepFileSlow(filename);
+  }
+
+ private:
+  bool KeepFileSlow(PyObject *filename);
+  bool Matches(const char *filename) const;
+
+  const std::vector<std::string> include_;
+  const std::vector<std::string> exclude_;
+  const bool collapse_recursion_;
+  const int root_frames_;
+  // Holds a reference to each filename, so that its address is not reused
+  // by a different string.
+  phmap::flat_hash_map<PyObject *, bool> keep_file_;
+};
+
+#endif  // MPROFILE_SRC_FRAME_FILTER_H_
@@ -0,0 +1,40 @@
+// Copyright 2019 Timothy Palpant
+//
+#include "frame_filter.h"
+
+#include "gtest/gtest.h"
+#include "scoped_object.h"
+
+TEST(FrameFilter, IncludeExclude) {
+  FrameFilter filter({"/app/*"}, {"*/vendor/*"}, false, 0);
+  PyObjectRef app(PyUnicode_FromString("/app/views.py"));
+  PyObjectRef vendored(PyUnicode_FromString("/app/vendor/lib.py"));
+  PyObjectRef stdlib(PyUnicode_FromString("/usr/lib/python3/json.py"));
+
+  EXPECT_TRUE(filter.KeepFile(app.get()));
+  EXPECT_FALSE(filter.KeepFile(vendored.get()));
+  EXPECT_FALSE(filter.KeepFile(stdlib.get()));
+  // Cached.
+  EXPECT_TRUE(filter.KeepFile(app.get()));
+  EXPECT_FALSE(filter.KeepFile(stdlib.get()));
+}
+
+TEST(FrameFilter, KeepsAllWithoutPatterns) {
+  FrameFilter filter({}, {}, true, 2);
+  PyObjectRef filename(PyUnicode_FromString("x.py"));
+  EXPECT_TRUE(filter.KeepFile(filename.get()));
+  EXPECT_TRUE(filter.collapse_recursion());
+  EXPECT_EQ(filter.root_frames(), 2);
+}
+
+TEST(FrameFilter, KeepsPendingException) {
+  FrameFilter filter({}, {"*"}, false, 0);
+  // A lone surrogate cannot be encoded as UTF-8.
+  PyObjectRef filename(
+      PyUnicode_DecodeUTF8("\xed\xa0\x80", 3, "surrogatepass"));
+  ASSERT_NE(filename, nullptr);
+  PyErr_SetString(PyExc_KeyError, "pending");
+  EXPECT_TRUE(filter.KeepFile(filename.get()));
+  EXPECT_TRUE(PyErr_ExceptionMatches(PyExc_KeyError));
+  PyErr_Clear();
+}
@@ -1,10 +1,96 @@
 #include "heap.h"
 
-// Records the given pointer and size in the current set of live ptrs,
-// associated with the current stack trace. The GIL must be held.
-void HeapProfiler::RecordMalloc(void *ptr, size_t size) {
+#include <algorithm>
+#include <cmath>
+
+std::atomic<uint32_t> HeapProfiler::next_id_(0);
+std::atomic<Epoch> HeapProfiler::epoch_(0);
+
+Epoch HeapProfiler::Mark() {
+  Epoch epoch = epoch_.load();
+  do {
+    if (epoch + 1 == kMaxEpoch) {
+      return 0;
+    }
+  } while (!epoch_.compare_exchange_weak(epoch, epoch + 1));
+  return epoch + 1;
+}
+
+HeapProfiler::StagingBufferRef::~StagingBufferRef() {
+  if (buffer != nullptr) {
+    // Any pointers left in the buffer will be flushed by the profiler.
+    buffer->orphaned.store(true);
+    ThreadContext &context = CurrentThreadContext();
+    context.staging_owner_id = 0;
+    context.staging_buffer = nullptr;
+  }
+}
+
+// Returns the staging buffer of the current thread for this profiler,
+// registering a new one (or reusing one orphaned by an exited thread) if
+// necessary.
+HeapProfiler::StagingBuffer *HeapProfiler::GetStagingBuffer() {
+  ThreadContext &context = CurrentThreadContext();
+  if (LIKELY(context.staging_owner_id == id_)) {
+    return static_cast<StagingBuffer *>(context.staging_buffer);
+  }
+
+  // This thread was previously staging pointers for a different profiler.
+  // Anything left in that buffer will be flushed by its owner.
+  thread_local StagingBufferRef ref;
+  if (ref.buffer != nullptr) {
+    ref.buffer->orphaned.store(true);
+    ref.buffer.reset();
+  }
+
+  std::lock_guard<SpinLock> lock(staging_mu_);
+  for (auto &buf : staging_buffers_) {
+    bool orphaned = true;
+    if (buf->orphaned.compare_exchange_strong(orphaned, false)) {
+      ref.buffer = buf;
+      break;
+    }
+  }
+
+  if (ref.buffer == nullptr) {
+    ref.buffer = std::make_shared<StagingBuffer>();
+    staging_buffers_.push_back(ref.buffer);
+    const int n = num_staging_slots_.load(std::memory_order_relaxed);
+    if (n < kMaxStagingSlots) {
+      staging_slots_[n].store(ref.buffer.get(), std::memory_order_relaxed);
+      num_staging_slots_.store(n + 1, std::memory_order_release);
+    }
+  }
+
+  context.staging_owner_id = id_;
+  context.staging_buffer = ref.buffer.get();
+  return ref.buffer.get();
+}
+
+// Total size of the pointers staged by the current thread.
+std::size_t HeapProfiler::ThreadStagedBytes() const {
+  StagingBuffer *buf = ThreadStagingBuffer();
+  if (buf == nullptr) {
+    return 0;
+  }
+  return buf->bytes.load(std::memory_order_relaxed);
+}
+
+ProfilerVariant HeapProfiler::GetVariant() const {
+  // The Sampler samples every allocation of at least one byte with a
+  // period of 0, and snapshots don't scale samples with a rate of 1.
+  const int64_t period = Sampler::GetSamplePeriod();
+  if (weighted_ || (period != 0 && period != 1)) {
+    return ProfilerVariant::kGeneral;
+  }
+  const bool single_frame = max_frames_ == 1 && frame_filter_ == nullptr;
+  return single_frame ? ProfilerVariant::kUnsampledSingleFrame
+                      : ProfilerVariant::kUnsampled;
+}
+
+CallTraceSet::TraceHandle HeapProfiler::InternCurrentTrace() {
   CallTrace trace;
-  GetCurrentCallTrace(&trace, max_frames_);
+  GetCurrentCallTrace(&trace, max_frames_, frame_filter_.get());
   auto trace_handle = traces_.Intern(trace);
 
   for (int i = 0; i < trace.size(); i++) {
@@ -12,30 +98,250 @@ void HeapProfiler::RecordMalloc(void *ptr, size_t size) {
     Py_XDECREF(loc.filename);
     Py_XDECREF(loc.name);
   }
+  return trace_handle;
+}
 
-  std::lock_guard<SpinLock> lock(mu_);
-  LivePointer lp = {trace_handle, size};
-  live_set_.Insert(ptr, lp);
-  total_mem_traced_ += size;
-  if (total_mem_traced_ > peak_mem_traced_) {
-    peak_mem_traced_ = total_mem_traced_;
+// Records the given pointer and size in the current set of live ptrs,
+// associated with the current stack trace. The GIL must be held.
+template <bool SingleFrame>
+void HeapProfiler::RecordMalloc(void *ptr, size_t size) {
+  // The allocation may have been sampled by a thread that was waiting for
+  // the GIL while the profiler was paused.
+  if (UNLIKELY(paused_)) {
+    return;
+  }
+  size = LivePointer::ClampSize(size);
+
+  CallTraceSet::TraceHandle trace_handle = nullptr;
+  if (SingleFrame) {
+    FuncLoc loc;
+    if (GetCurrentFrame(&loc)) {
+      trace_handle = traces_.InternRoot(loc);
+    }
+  } else {
+    trace_handle = InternCurrentTrace();
+  }
+  if (UNLIKELY(traces_.size() >= next_collect_size_) &&
+      collect_traces_callback_ != nullptr) {
+    collect_traces_callback_();
+  }
+
+  // Read everything else the entry needs before taking the buffer's lock,
+  // which another thread may be waiting for.
+  const LivePointer value = {trace_handle, size, CurrentLabelSet(),
+                             CurrentRegion(), CurrentEpoch()};
+  StagingBuffer *buf = GetStagingBuffer();
+  std::lock_guard<SpinLock> lock(buf->mu);
+  const int n = buf->size.load(std::memory_order_relaxed);
+  if (n == 0) {
+    num_staged_buffers_.fetch_add(1);
+  }
+  buf->ptrs[n] = ptr;
+  buf->values[n] = value;
+  buf->size.store(n + 1, std::memory_order_relaxed);
+  buf->filter.store(buf->filter.load(std::memory_order_relaxed) |
+                        StagingBuffer::FilterBit(ptr),
+                    std::memory_order_relaxed);
+  const std::size_t bytes = buf->bytes.load(std::memory_order_relaxed) + size;
+  buf->bytes.store(bytes, std::memory_order_relaxed);
+  buf->peak = std::max(
+      buf->peak, total_mem_traced_.load(std::memory_order_relaxed) + bytes);
+
+  if (n + 1 == kStagingBufferSize) {
+    std::lock_guard<SpinLock> live_set_lock(mu_);
+    FlushLocked(buf);
   }
 }
 
-// Callback used to extract all pointers from AddressMap into a std::vector.
-template <class Value>
-void AppendToVector(const void *ptr, Value lp, std::vector<const void *> &v) {
-  v.push_back(ptr);
+template void HeapProfiler::RecordMalloc<false>(void *ptr, size_t size);
+template void HeapProfiler::RecordMalloc<true>(void *ptr, size_t size);
+
+void HeapProfiler::FlushLocked(StagingBuffer *buf) {
+  const int n = buf->size.load(std::memory_order_relaxed);
+  if (n == 0) {
+    return;
+  }
+
+  for (int i = 0; i < n; i++) {
+    const LivePointer &lp = buf->values[i];
+    live_set_.Insert(buf->ptrs[i], lp);
+    AddLiveTotalsLocked(lp);
+  }
+
+  const std::size_t total = total_mem_traced_.load(std::memory_order_relaxed) +
+                            buf->bytes.load(std::memory_order_relaxed);
+  total_mem_traced_.store(total, std::memory_order_relaxed);
+  peak_mem_traced_ = std::max({peak_mem_traced_, buf->peak, total});
+  MaybeCheckpointPeakLocked(total);
+  RecordTimelineLocked(total, std::max(buf->peak, total), n + buf->freed,
+                       buf->freed);
+  buf->freed = 0;
+  buf->size.store(0, std::memory_order_relaxed);
+  buf->bytes.store(0, std::memory_order_relaxed);
+  buf->filter.store(0, std::memory_order_relaxed);
+  buf->peak = 0;
+  num_staged_buffers_.fetch_sub(1);
+}
+
+void HeapProfiler::Pause() {
+  paused_ = true;
+  FlushStagingBuffers();
+}
+
+void HeapProfiler::FlushStagingBuffers() {
+  if (num_staged_buffers_.load() == 0) {
+    return;
+  }
+
+  std::lock_guard<SpinLock> lock(staging_mu_);
+  for (auto &buf : staging_buffers_) {
+    std::lock_guard<SpinLock> buf_lock(buf->mu);
+    std::lock_guard<SpinLock> live_set_lock(mu_);
+    FlushLocked(buf.get());
+  }
+}
+
+bool HeapProfiler::RemoveStagedSlow(StagingBuffer *buf, const void *ptr,
+                                    LivePointer *removed, bool moving,
+                                    bool owned) {
+  // Any thread may remove pointers from the buffer, so even its owner can
+  // only search it under the lock.
+  std::lock_guard<SpinLock> lock(buf->mu);
+  const int n = buf->size.load(std::memory_order_relaxed);
+  int i = n - 1;
+  for (; i >= 0; i--) {
+    if (buf->ptrs[i] == ptr) {
+      break;
+    }
+  }
+  if (i < 0) {
+    return false;
+  }
+
+  *removed = buf->values[i];
+  buf->ptrs[i] = buf->ptrs[n - 1];
+  buf->values[i] = buf->values[n - 1];
+  buf->size.store(n - 1, std::memory_order_relaxed);
+  buf->bytes.store(buf->bytes.load(std::memory_order_relaxed) - removed->size,
+                   std::memory_order_relaxed);
+  buf->freed++;
+  // Before the buffer can be seen to be empty, see CollectTraces.
+  if (moving) {
+    moves_in_flight_.fetch_add(1);
+  }
+  if (n == 1) {
+    buf->filter.store(0, std::memory_order_relaxed);
+    num_staged_buffers_.fetch_sub(1);
+    if (!owned) {
+      // Empty buffers are not flushed, and the owner may have exited, so
+      // account for the buffer's peak and frees now.
+      std::lock_guard<SpinLock> live_set_lock(mu_);
+      const std::size_t total =
+          total_mem_traced_.load(std::memory_order_relaxed);
+      peak_mem_traced_ = std::max(peak_mem_traced_, buf->peak);
+      RecordTimelineLocked(total, std::max(buf->peak, total), buf->freed,
+                           buf->freed);
+      buf->freed = 0;
+      buf->peak = 0;
+    }
+  }
+  return true;
 }
 
-std::vector<const void *> HeapProfiler::GetSnapshot() {
+// Removes ptr from the staging buffer of another thread, if it is there.
+// Only the buffers whose filters have ptr's bit are searched, so most
+// pointers that were never sampled are rejected without taking a lock,
+// and the other threads' buffers are left alone.
+bool HeapProfiler::FindAndRemoveSlow(const void *ptr, LivePointer *removed,
+                                     bool moving, const StagingBuffer *own) {
+  const uint64_t bit = StagingBuffer::FilterBit(ptr);
+  auto remove_staged = [&](StagingBuffer *buf) {
+    return buf != own &&
+           (buf->filter.load(std::memory_order_relaxed) & bit) != 0 &&
+           RemoveStagedSlow(buf, ptr, removed, moving, false);
+  };
+
+  const int n = num_staging_slots_.load(std::memory_order_acquire);
+  for (int i = 0; i < n; i++) {
+    StagingBuffer *buf = staging_slots_[i].load(std::memory_order_relaxed);
+    if (remove_staged(buf)) {
+      return true;
+    }
+  }
+  if (LIKELY(n < kMaxStagingSlots)) {
+    return false;
+  }
+
+  std::lock_guard<SpinLock> lock(staging_mu_);
+  for (std::size_t i = kMaxStagingSlots; i < staging_buffers_.size(); i++) {
+    StagingBuffer *buf = staging_buffers_[i].get();
+    if (remove_staged(buf)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Moves the live pointer oldptr to newptr with the given size, keeping its
+// trace. Returns false if oldptr was not sampled. Does not require the GIL.
+bool HeapProfiler::RecordRealloc(void *oldptr, void *newptr, size_t size,
+                                 size_t *old_size) {
+  LivePointer lp;
+  if (LIKELY(!FindAndRemove(oldptr, &lp, true))) {
+    return false;
+  }
+
+  *old_size = lp.size;
+  lp.size = LivePointer::ClampSize(size);
   std::lock_guard<SpinLock> lock(mu_);
-  std::vector<const void *> snap;
-  live_set_.Iterate<std::vector<const void *> &>(&AppendToVector, snap);
-  return snap;
+  live_set_.Insert(newptr, lp);
+  AddLiveTotalsLocked(lp);
+  moves_in_flight_.fetch_sub(1);
+  const std::size_t total =
+      total_mem_traced_.load(std::memory_order_relaxed) + lp.size;
+  total_mem_traced_.store(total, std::memory_order_relaxed);
+  const std::size_t peak = total + ThreadStagedBytes();
+  peak_mem_traced_ = std::max(peak_mem_traced_, peak);
+  MaybeCheckpointPeakLocked(total);
+  RecordTimelineLocked(total, peak, 1, 0);
+  return true;
+}
+
+namespace {
+
+struct FilteredSnapshot {
+  const std::vector<bool> *label_sets;
+  Epoch min_epoch;
+  Epoch max_epoch;
+  std::vector<HeapProfiler::SnapshotEntry> snap;
+};
+
+}  // namespace
+
+std::vector<HeapProfiler::SnapshotEntry> HeapProfiler::GetSnapshot(
+    const std::vector<bool> *label_sets, Epoch min_epoch, Epoch max_epoch) {
+  FlushStagingBuffers();
+  std::lock_guard<SpinLock> lock(mu_);
+  FilteredSnapshot filtered = {label_sets, min_epoch, max_epoch, {}};
+  live_set_.Iterate<FilteredSnapshot *>(
+      [](const void *ptr, LivePointer *lp, FilteredSnapshot *arg) {
+        if (lp->epoch < arg->min_epoch || lp->epoch >= arg->max_epoch) {
+          return;
+        }
+        if (arg->label_sets == nullptr ||
+            (lp->label_set < arg->label_sets->size() &&
+             (*arg->label_sets)[lp->label_set])) {
+          arg->snap.push_back({ptr, lp->trace_handle, lp->size,
+                               static_cast<LabelSetId>(lp->label_set),
+                               static_cast<RegionId>(lp->region)});
+        }
+      },
+      &filtered);
+  return std::move(filtered.snap);
 }
 
 std::vector<FuncLoc> HeapProfiler::GetTrace(const void *ptr) {
+  FlushStagingBuffers();
   std::lock_guard<SpinLock> lock(mu_);
   const LivePointer *lp = live_set_.Find(ptr);
   if (lp == nullptr) {
@@ -45,6 +351,7 @@ std::vector<FuncLoc> HeapProfiler::GetTrace(const void *ptr) {
 }
 
 std::size_t HeapProfiler::GetSize(const void *ptr) {
+  FlushStagingBuffers();
   std::lock_guard<SpinLock> lock(mu_);
   const LivePointer *lp = live_set_.Find(ptr);
   if (lp == nullptr) {
@@ -54,20 +361,319 @@ std::size_t HeapProfiler::GetSize(const void *ptr) {
   return lp->size;
 }
 
+LabelSetId HeapProfiler::GetLabelSet(const void *ptr) {
+  FlushStagingBuffers();
+  std::lock_guard<SpinLock> lock(mu_);
+  const LivePointer *lp = live_set_.Find(ptr);
+  if (lp == nullptr) {
+    return 0;
+  }
+
+  return lp->label_set;
+}
+
+RegionId HeapProfiler::GetRegion(const void *ptr) {
+  FlushStagingBuffers();
+  std::lock_guard<SpinLock> lock(mu_);
+  const LivePointer *lp = live_set_.Find(ptr);
+  if (lp == nullptr) {
+    return 0;
+  }
+
+  return lp->region;
+}
+
+std::vector<HeapProfiler::LabelTotals> HeapProfiler::GetLabelTotals() {
+  // Indexed by label set, since there are few of them.
+  std::vector<LabelTotals> by_id;
+  {
+    FlushStagingBuffers();
+    std::lock_guard<SpinLock> lock(mu_);
+    live_set_.Iterate<std::vector<LabelTotals> *>(
+        [](const void *ptr, LivePointer *lp, std::vector<LabelTotals> *arg) {
+          if (lp->label_set >= arg->size()) {
+            arg->resize(lp->label_set + 1, {0, 0, 0});
+          }
+          // Each pointer is scaled by its own size, like a Snapshot.
+          const ProfileSample scaled = ScaleSample(
+              {0, lp->size, 1}, PointerSampleRate(lp->size, lp->region));
+          LabelTotals &totals = (*arg)[lp->label_set];
+          totals.size += scaled.size;
+          totals.count += scaled.count;
+        },
+        &by_id);
+  }
+
+  std::vector<LabelTotals> result;
+  for (std::size_t i = 0; i < by_id.size(); i++) {
+    if (by_id[i].count > 0) {
+      result.push_back(
+          {static_cast<LabelSetId>(i), by_id[i].size, by_id[i].count});
+    }
+  }
+  return result;
+}
+
+HeapProfiler::StackTotals HeapProfiler::ToStackTotals(
+    CallTraceSet::TraceHandle h,
+    const CallTraceSet::LiveTotals &totals) const {
+  return {h, totals.size, totals.count,
+          static_cast<std::size_t>(std::llround(totals.scaled_size)),
+          static_cast<std::size_t>(std::llround(totals.scaled_count))};
+}
+
+std::vector<HeapProfiler::StackTotals> HeapProfiler::GetStackTotals() {
+  std::vector<StackTotals> result;
+  FlushStagingBuffers();
+  std::lock_guard<SpinLock> lock(mu_);
+  if (untraced_totals_.live()) {
+    result.push_back(ToStackTotals(nullptr, untraced_totals_));
+  }
+  traces_.ForEachLive([this, &result](CallTraceSet::TraceHandle h,
+                                      const CallTraceSet::LiveTotals &totals) {
+    result.push_back(ToStackTotals(h, totals));
+  });
+  return result;
+}
+
+void HeapProfiler::EnablePeakCheckpoints(std::size_t hysteresis) {
+  std::lock_guard<SpinLock> lock(mu_);
+  peak_checkpoints_ = true;
+  peak_hysteresis_ = hysteresis;
+}
+
+// Copies the totals of the stacks that have changed since the last
+// checkpoint, so the cost is proportional to the number of stacks that
+// were allocated from or freed in the meantime.
+void HeapProfiler::CheckpointPeakLocked(std::size_t total) {
+  for (CallTraceSet::TraceHandle h : peak_dirty_) {
+    const CallTraceSet::LiveTotals &totals =
+        (h != nullptr) ? CallTraceSet::Totals(h) : untraced_totals_;
+    if (!totals.live()) {
+      peak_totals_.erase(h);
+    } else {
+      peak_totals_[h] = totals;
+    }
+  }
+  peak_dirty_.clear();
+  peak_epoch_++;
+  peak_checkpoint_bytes_ = total;
+}
+
+std::vector<HeapProfiler::StackTotals> HeapProfiler::GetPeakStackTotals() {
+  std::vector<StackTotals> result;
+  // Staged pointers may take the traced memory to a new peak.
+  FlushStagingBuffers();
+  std::lock_guard<SpinLock> lock(mu_);
+  result.reserve(peak_totals_.size());
+  for (const auto &entry : peak_totals_) {
+    result.push_back(ToStackTotals(entry.first, entry.second));
+  }
+  return result;
+}
+
+// Discards the untraced totals, all peak checkpoints and the timeline.
+// mu_ must be held.
+void HeapProfiler::ResetStackTotalsLocked() {
+  untraced_totals_ = {0, 0, 0, 0, 0, 0};
+  peak_checkpoint_bytes_ = 0;
+  peak_epoch_++;
+  peak_dirty_.clear();
+  peak_totals_.clear();
+  if (timeline_ != nullptr) {
+    timeline_->Reset();
+  }
+}
+
+void HeapProfiler::EnableTimeline(std::size_t capacity,
+                                  uint64_t interval_ns) {
+  std::unique_ptr<MemoryTimeline> timeline(
+      new MemoryTimeline(capacity, interval_ns));
+  std::lock_guard<SpinLock> lock(mu_);
+  timeline_ = std::move(timeline);
+}
+
+std::vector<TimelinePoint> HeapProfiler::GetTimeline() {
+  FlushStagingBuffers();
+  std::lock_guard<SpinLock> lock(mu_);
+  if (timeline_ == nullptr) {
+    return {};
+  }
+  return timeline_->Points();
+}
+
+bool HeapProfiler::ExportProfile(Profile *profile) {
+  // Converting the strings may run code that collects the traces.
+  ScopedTracePin pin(this);
+  const std::vector<StackTotals> totals = GetStackTotals();
+  profile->sample_rate = SnapshotSampleRate();
+  profile->max_frames = max_frames_;
+  ProfileBuilder builder(profile);
+  // Traces share most of their frames and strings, so only convert each
+  // Python string once.
+  phmap::flat_hash_map<PyObject *, uint32_t> strings;
+  const uint32_t unknown_filename = builder.AddString("<unknown>", 9);
+  const char kUnknownName[] = "[Unknown - No Python thread state]";
+  const uint32_t unknown_name =
+      builder.AddString(kUnknownName, sizeof(kUnknownName) - 1);
+
+  for (const StackTotals &stack : totals) {
+    const std::vector<FuncLoc> trace = traces_.GetTrace(stack.trace_handle);
+    uint32_t frame = kNoParentFrame;
+    if (trace.empty()) {
+      frame = builder.AddFrame(frame, unknown_filename, unknown_name, 0, 0);
+    }
+    // Traces are stored leaf first, but frames are added from the root.
+    for (auto it = trace.rbegin(); it != trace.rend(); ++it) {
+      const int64_t filename = AddProfileString(it->filename, &builder,
+                                                &strings);
+      const int64_t name = AddProfileString(it->name, &builder, &strings);
+      if (filename < 0 || name < 0) {
+        return false;
+      }
+      frame = builder.AddFrame(frame, filename, name, it->firstlineno,
+                               it->lineno);
+    }
+    builder.AddSample(frame, stack.size, stack.count, stack.scaled_size,
+                      stack.scaled_count);
+  }
+
+  return true;
+}
+
+bool HeapProfiler::CollectTraces() {
+  if (trace_pins_ > 0) {
+    return false;
+  }
+
+  // Staged pointers are only counted in the live totals of their traces
+  // once they are flushed. Nothing can be staged in the meantime, since
+  // that takes the GIL.
+  FlushStagingBuffers();
+  std::size_t removed;
+  {
+    std::lock_guard<SpinLock> lock(mu_);
+    if (moves_in_flight_.load() > 0) {
+      return false;
+    }
+    // The next peak checkpoint reads the totals of the dirty traces, even
+    // if they have no live pointers left.
+    phmap::flat_hash_set<CallTraceSet::TraceHandle> pinned(
+        peak_dirty_.begin(), peak_dirty_.end());
+    for (const auto &entry : peak_totals_) {
+      pinned.insert(entry.first);
+    }
+    removed = traces_.RemoveUnreferenced(pinned);
+  }
+
+  if (removed > 0) {
+    traces_.ReleaseUnusedStrings();
+  }
+  next_collect_size_ = std::max(min_traces_to_collect_, 2 * traces_.size());
+  return true;
+}
+
 void HeapProfiler::Reset() {
+  {
+    // Staged pointers reference traces that are about to be cleared.
+    std::lock_guard<SpinLock> lock(staging_mu_);
+    for (auto &buf : staging_buffers_) {
+      std::lock_guard<SpinLock> buf_lock(buf->mu);
+      if (buf->size.load(std::memory_order_relaxed) > 0) {
+        num_staged_buffers_.fetch_sub(1);
+      }
+      buf->size.store(0, std::memory_order_relaxed);
+      buf->bytes.store(0, std::memory_order_relaxed);
+      buf->filter.store(0, std::memory_order_relaxed);
+      buf->peak = 0;
+      buf->freed = 0;
+    }
+  }
+
   std::lock_guard<SpinLock> lock(mu_);
   live_set_.Reset();
   total_mem_traced_ = 0;
   peak_mem_traced_ = 0;  // Matches tracemalloc behavior.
+  ResetStackTotalsLocked();
   traces_.Reset();
+  next_collect_size_ = min_traces_to_collect_;
 }
 
 std::size_t HeapProfiler::TotalMemoryTraced() {
+  FlushStagingBuffers();
   std::lock_guard<SpinLock> lock(mu_);
   return total_mem_traced_;
 }
 
 std::size_t HeapProfiler::PeakMemoryTraced() {
+  FlushStagingBuffers();
   std::lock_guard<SpinLock> lock(mu_);
   return peak_mem_traced_;
 }
+
+std::size_t HeapProfiler::MemoryUsage() {
+  std::size_t usage =
+      sizeof(*this) + live_set_.MemoryUsage() + traces_.MemoryUsage();
+  {
+    std::lock_guard<SpinLock> lock(mu_);
+    usage += peak_dirty_.capacity() * sizeof(peak_dirty_[0]) +
+             peak_totals_.capacity() * (sizeof(CallTraceSet::TraceHandle) +
+                                        sizeof(CallTraceSet::LiveTotals) + 1);
+    if (timeline_ != nullptr) {
+      usage += timeline_->MemoryUsage();
+    }
+  }
+  std::lock_guard<SpinLock> lock(staging_mu_);
+  usage += staging_buffers_.capacity() * sizeof(staging_buffers_[0]) +
+           staging_buffers_.size() * sizeof(StagingBuffer);
+  return usage;
+}
+
+void HeapProfiler::PrepareFork() {
+  staging_mu_.lock();
+  for (auto &buf : staging_buffers_) {
+    buf->mu.lock();
+  }
+  mu_.lock();
+}
+
+void HeapProfiler::ParentAfterFork() {
+  mu_.unlock();
+  for (auto &buf : staging_buffers_) {
+    buf->mu.unlock();
+  }
+  staging_mu_.unlock();
+}
+
+void HeapProfiler::ChildAfterFork() {
+  // Anything staged by the other threads will still be flushed, and their
+  // buffers can then be reused by new threads in the child.
+  StagingBuffer *own = ThreadStagingBuffer();
+  for (auto &buf : staging_buffers_) {
+    if (buf.get() != own) {
+      buf->orphaned.store(true);
+    }
+  }
+  // The pointers that other threads were moving are lost with them.
+  moves_in_flight_ = 0;
+
+  ParentAfterFork();
+}
+
+void HeapProfiler::ResetAfterFork() {
+  for (auto &buf : staging_buffers_) {
+    buf->size.store(0, std::memory_order_relaxed);
+    buf->bytes.store(0, std::memory_order_relaxed);
+    buf->filter.store(0, std::memory_order_relaxed);
+    buf->peak = 0;
+    buf->freed = 0;
+  }
+  num_staged_buffers_ = 0;
+
+  live_set_.Reset();
+  total_mem_traced_ = 0;
+  peak_mem_traced_ = 0;
+  ResetStackTotalsLocked();
+  traces_.Abandon();
+  next_collect_size_ = min_traces_to_collect_;
+}
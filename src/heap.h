@@ -6,74 +6,495 @@
 
 #include <stdlib.h>
 
+#include <atomic>
+#include <memory>
 #include <mutex>
+#include <utility>
 #include <vector>
 
+#include "labels.h"
+#include "live_set.h"
+#include "profile.h"
+#include "region.h"
+#include "sampling.h"
 #include "spinlock.h"
 #include "stacktraces.h"
-#include "third_party/google/tcmalloc/addressmap.h"
+#include "thread_context.h"
+#include "timeline.h"
 #include "third_party/google/tcmalloc/sampler.h"
 #include "third_party/greg7mdp/parallel-hashmap/phmap.h"
 
+// Number of sampled pointers that each thread stages before inserting
+// them into the live set in a batch.
+const int kStagingBufferSize = 16;
+
+// The allocations sampled between two marks share an epoch, see
+// HeapProfiler::Mark. kMaxEpoch is never reached, so that it can bound
+// every epoch from above.
+typedef uint32_t Epoch;
+const Epoch kMaxEpoch = UINT32_MAX;
+
+// The number of interned frames below which the profiler never collects
+// its unreferenced traces, see HeapProfiler::CollectTraces.
+const std::size_t kMinTracesToCollect = 1 << 14;
+
+// The specializations of the allocation hooks. The hooks are instantiated
+// for each one, and the profiler's configuration picks one when it is
+// attached (see HeapProfiler::GetVariant), so that each configuration only
+// pays for what it uses.
+enum class ProfilerVariant {
+  // Samples with the thread's Sampler, and captures up to max_frames.
+  kGeneral,
+  // Traces every allocation outside of a region, without the Sampler.
+  kUnsampled,
+  // Like kUnsampled, but captures only the innermost frame, which is
+  // interned directly as a root frame without building a CallTrace. When
+  // allocations are sampled, capturing the stack is too rare for this to
+  // matter.
+  kUnsampledSingleFrame,
+};
+
+constexpr bool IsUnsampled(ProfilerVariant v) {
+  return v == ProfilerVariant::kUnsampled ||
+         v == ProfilerVariant::kUnsampledSingleFrame;
+}
+
+constexpr bool IsSingleFrame(ProfilerVariant v) {
+  return v == ProfilerVariant::kUnsampledSingleFrame;
+}
+
 class HeapProfiler {
  public:
   HeapProfiler() : HeapProfiler(kMaxFramesToCapture) {}
-  explicit HeapProfiler(int max_frames)
-      : max_frames_(max_frames),
-        live_set_(malloc, free),
+  // If huge_pages is true, the profiler's own memory is backed by
+  // transparent huge pages where supported.
+  explicit HeapProfiler(int max_frames,
+                        LiveSetType live_set_type = LiveSetType::kAddressMap,
+                        bool huge_pages = false)
+      : id_(next_id_.fetch_add(1) + 1),
+        max_frames_(max_frames),
+        huge_pages_(huge_pages),
+        weighted_(GetSamplingMode() != SamplingMode::kBytes),
+        paused_(false),
+        num_staged_buffers_(0),
+        live_set_(live_set_type, huge_pages),
         total_mem_traced_(0),
-        peak_mem_traced_(0) {}
+        peak_mem_traced_(0),
+        untraced_totals_{0, 0, 0, 0, 0, 0},
+        peak_checkpoints_(false),
+        peak_hysteresis_(0),
+        peak_checkpoint_bytes_(0),
+        peak_epoch_(1),
+        moves_in_flight_(0),
+        collect_traces_callback_(nullptr),
+        min_traces_to_collect_(kMinTracesToCollect),
+        next_collect_size_(kMinTracesToCollect),
+        trace_pins_(0),
+        num_staging_slots_(0),
+        traces_(huge_pages) {}
   // Not copyable or assignable.
   HeapProfiler(const HeapProfiler &) = delete;
   HeapProfiler &operator=(const HeapProfiler &) = delete;
 
-  // These each require that ptr (newptr) not be nullptr.
-  void HandleMalloc(void *ptr, std::size_t size, bool is_raw);
-  void HandleRealloc(void *oldptr, void *newptr, std::size_t size, bool is_raw);
+  // HandleMalloc ignores a nullptr ptr, and HandleRealloc ignores a nullptr
+  // newptr (the original block is still live if realloc fails). The
+  // allocation hooks pass in the context of the calling thread, which they
+  // have already looked up, and call the variant returned by GetVariant.
+  void HandleMalloc(void *ptr, std::size_t size, bool is_raw) {
+    HandleMalloc(ptr, size, is_raw, &CurrentThreadContext());
+  }
+  template <ProfilerVariant V = ProfilerVariant::kGeneral>
+  void HandleMalloc(void *ptr, std::size_t size, bool is_raw,
+                    ThreadContext *context);
+  void HandleRealloc(void *oldptr, void *newptr, std::size_t size,
+                     bool is_raw) {
+    HandleRealloc(oldptr, newptr, size, is_raw, &CurrentThreadContext());
+  }
+  template <ProfilerVariant V = ProfilerVariant::kGeneral>
+  void HandleRealloc(void *oldptr, void *newptr, std::size_t size, bool is_raw,
+                     ThreadContext *context);
   void HandleFree(void *ptr);
+  // The most specialized variant of the hooks that is equivalent to
+  // kGeneral for this profiler, treating a sample period of 1 like 0 as
+  // snapshots do. This depends on the global sample period, the sampling
+  // mode and the frame filter, so it must be called once they are set.
+  ProfilerVariant GetVariant() const;
+
+  // While paused, no new allocations are sampled, but reallocs and frees of
+  // the sampled pointers are still tracked so that the live set stays
+  // correct. Pausing flushes every staging buffer, and nothing is staged
+  // until the profiler is resumed, so the paused handlers below only need
+  // to search the live set. The GIL must be held.
+  void Pause();
+  void Resume() { paused_ = false; }
+  bool IsPaused() const { return paused_; }
+  // Used in place of HandleRealloc and HandleFree while paused.
+  void HandleReallocPaused(void *oldptr, void *newptr, std::size_t size);
+  void HandleFreePaused(void *ptr);
 
-  std::vector<const void *> GetSnapshot();
+  // Starts a new epoch for the allocations sampled from now on, by any
+  // profiler, and returns it. Returns 0 if the epochs are exhausted.
+  static Epoch Mark();
+  // The epoch of the allocations sampled now.
+  static Epoch CurrentEpoch() {
+    return epoch_.load(std::memory_order_relaxed);
+  }
+
+  // A live pointer in a snapshot, with what was recorded when it was
+  // sampled. The trace handle can be passed to GetStackTrace while a
+  // ScopedTracePin is held.
+  struct SnapshotEntry {
+    const void *ptr;
+    CallTraceSet::TraceHandle trace_handle;
+    std::size_t size;
+    LabelSetId label_set;
+    RegionId region;
+  };
+  // If label_sets is not null, only the pointers allocated with one of
+  // the label sets it marks are included. Only the pointers allocated in
+  // the epochs from min_epoch up to (but excluding) max_epoch are included;
+  // a pointer that is moved by realloc keeps the epoch of its allocation.
+  // The pointers are filtered as the live set is walked.
+  std::vector<SnapshotEntry> GetSnapshot(
+      const std::vector<bool> *label_sets = nullptr, Epoch min_epoch = 0,
+      Epoch max_epoch = kMaxEpoch);
   int GetMaxFrames() const { return max_frames_; }
+  LiveSetType GetLiveSetType() const { return live_set_.type(); }
+  bool UsesHugePages() const { return huge_pages_; }
   std::vector<FuncLoc> GetTrace(const void *ptr);
+  // Only capture the frames kept by the given filter. This must be set
+  // before the profiler is attached.
+  void SetFrameFilter(std::shared_ptr<FrameFilter> filter) {
+    frame_filter_ = std::move(filter);
+  }
+  const std::shared_ptr<FrameFilter> &GetFrameFilter() const {
+    return frame_filter_;
+  }
   std::size_t GetSize(const void *ptr);
+  LabelSetId GetLabelSet(const void *ptr);
+  RegionId GetRegion(const void *ptr);
+  // The (estimated) live allocations with one set of labels.
+  struct LabelTotals {
+    LabelSetId label_set;
+    std::size_t size;
+    std::size_t count;
+  };
+  // The totals of every label set with live allocations, with each pointer
+  // scaled by its own size and sample rate (see PointerSampleRate), like a
+  // Snapshot. This walks the live set.
+  std::vector<LabelTotals> GetLabelTotals();
   std::size_t TotalMemoryTraced();
   std::size_t PeakMemoryTraced();
+  // The live allocations of one stack. size and count are sampled totals,
+  // to be scaled by SnapshotSampleRate() like a Snapshot. The allocations
+  // that were sampled at a rate of their own, in a region or when samples
+  // are weighted individually, are already estimated in scaled_size and
+  // scaled_count instead.
+  struct StackTotals {
+    CallTraceSet::TraceHandle trace_handle;
+    std::size_t size;
+    std::size_t count;
+    std::size_t scaled_size;
+    std::size_t scaled_count;
+  };
+  // The totals of every stack with live allocations. These are maintained
+  // as pointers are sampled and freed, so this takes time proportional to
+  // the number of stacks rather than walking the live set. The GIL must
+  // be held.
+  std::vector<StackTotals> GetStackTotals();
+  // Get the trace of a stack returned by GetStackTotals. The GIL must be
+  // held.
+  std::vector<FuncLoc> GetStackTrace(CallTraceSet::TraceHandle h) const {
+    return traces_.GetTrace(h);
+  }
+  // Record the per-stack composition of the heap at its peak. A new
+  // checkpoint is taken whenever the traced memory exceeds the previous
+  // one by more than hysteresis bytes, so the recorded composition is
+  // within hysteresis bytes of the true peak.
+  void EnablePeakCheckpoints(std::size_t hysteresis);
+  bool PeakCheckpointsEnabled() const { return peak_checkpoints_; }
+  std::size_t GetPeakHysteresis() const { return peak_hysteresis_; }
+  // The stack totals at the last peak checkpoint. The GIL must be held.
+  std::vector<StackTotals> GetPeakStackTotals();
+  // Record the traced memory in a ring buffer of the given number of
+  // points, at most once per interval. Points are recorded by the sampled
+  // allocations and frees themselves, so this needs no extra thread.
+  void EnableTimeline(std::size_t capacity, uint64_t interval_ns);
+  bool TimelineEnabled() const { return timeline_ != nullptr; }
+  std::size_t GetTimelineCapacity() const { return timeline_->capacity(); }
+  uint64_t GetTimelineInterval() const { return timeline_->interval_ns(); }
+  // The recorded points, oldest first.
+  std::vector<TimelinePoint> GetTimeline();
+  // Add the sampled live heap to the given profile, which should be empty.
+  // The GIL must be held. Returns false with a Python exception set if a
+  // filename or function name cannot be encoded.
+  bool ExportProfile(Profile *profile);
+  // The number of bytes used by the profiler itself. The GIL must be held.
+  std::size_t MemoryUsage();
+
+  // Removes the traces that no live pointer or peak checkpoint refers to
+  // any more, along with the strings that only they used, so that
+  // programs that generate code or churn through call sites don't grow
+  // the profiler without bound. Their memory is reused for new traces.
+  // The GIL must be held, and this must not be called from an allocation
+  // hook, since releasing the strings can run arbitrary code. Returns false
+  // if nothing could be collected because a trace handle is in use.
+  bool CollectTraces();
+  // Once the number of interned frames reaches min_traces, or twice the
+  // number left by the last collection, the next sampled allocation calls
+  // schedule, which should arrange for CollectTraces to be called outside
+  // of the hook. The GIL must be held.
+  void SetCollectTracesCallback(void (*schedule)(),
+                                std::size_t min_traces = kMinTracesToCollect) {
+    collect_traces_callback_ = schedule;
+    min_traces_to_collect_ = min_traces;
+    next_collect_size_ = min_traces;
+  }
+  // The number of interned frames. The GIL must be held.
+  std::size_t NumTraces() const { return traces_.size(); }
+
+  // Keeps every trace handle valid while it is in scope, for callers that
+  // hold the handles returned by GetStackTotals or GetPeakStackTotals, or
+  // the strings of a trace, across code that may call CollectTraces. The
+  // GIL must be held.
+  class ScopedTracePin {
+   public:
+    explicit ScopedTracePin(HeapProfiler *profiler) : profiler_(profiler) {
+      profiler_->trace_pins_++;
+    }
+    ~ScopedTracePin() { profiler_->trace_pins_--; }
+
+    ScopedTracePin(const ScopedTracePin &) = delete;
+    ScopedTracePin &operator=(const ScopedTracePin &) = delete;
+
+   private:
+    HeapProfiler *const profiler_;
+  };
   void Reset();
 
+  // Fork handlers. PrepareFork takes all of the profiler's locks so that
+  // its state is consistent in the child, and the others release them.
+  // ChildAfterFork also releases the staging buffers of all threads other
+  // than the forking one, since they do not exist in the child.
+  void PrepareFork();
+  void ParentAfterFork();
+  void ChildAfterFork();
+  // Cheaply discard all state in a forked child by unmapping it, without
+  // walking the inherited live set or touching any Python objects.
+  void ResetAfterFork();
+
  private:
+  template <bool SingleFrame>
   void RecordMalloc(void *ptr, size_t size);
+  // Intern the stack of the current thread.
+  CallTraceSet::TraceHandle InternCurrentTrace();
+  // The totals of a stack, weighted if the samples are.
+  StackTotals ToStackTotals(CallTraceSet::TraceHandle h,
+                            const CallTraceSet::LiveTotals &totals) const;
+  bool RecordRealloc(void *oldptr, void *newptr, size_t size,
+                     size_t *old_size);
 
   // The information we store for a live pointer.
   struct LivePointer {
     // The trace at which it was allocated.
     // This is a reference to an element in traces_.
     CallTraceSet::TraceHandle trace_handle;
-    // The size of the memory allocated.
-    std::size_t size;
+    // The size of the memory allocated. Packed with the label set and
+    // region, which leaves room for allocations of up to 16TB. Larger
+    // allocations are recorded, and counted in every total, as kMaxSize.
+    std::size_t size : 44;
+    // The labels that were current when it was allocated.
+    std::size_t label_set : 16;
+    // The region it was sampled in, see region.h.
+    std::size_t region : 4;
+    // The epoch in which it was allocated, see Mark.
+    Epoch epoch;
+
+    static const std::size_t kMaxSize = (std::size_t(1) << 44) - 1;
+    static std::size_t ClampSize(std::size_t size) {
+      return size < kMaxSize ? size : kMaxSize;
+    }
   };
 
+  // Add or remove a live pointer from the totals of its trace. mu_ must be
+  // held.
+  void AddLiveTotalsLocked(const LivePointer &lp);
+  void RemoveLiveTotalsLocked(const LivePointer &lp);
+
+  // StagingBuffer holds the pointers most recently sampled by one thread
+  // that have not yet been inserted into live_set_, so that sampled
+  // allocations only need to take mu_ once per batch.
+  //
+  // Only the owning thread adds pointers to its buffer, but any thread may
+  // flush it into live_set_. Lock ordering is staging_mu_, then
+  // StagingBuffer::mu, then mu_.
+  struct StagingBuffer {
+    // Guards the fields below, except where noted.
+    SpinLock mu;
+    // The number of staged pointers. The owning thread may read size and
+    // bytes without holding mu, since other threads only ever remove from
+    // the buffer.
+    std::atomic<int> size{0};
+    // Total size of the staged pointers.
+    std::atomic<std::size_t> bytes{0};
+    // Bloom filter of the staged pointers, so that most frees can skip
+    // searching the buffer. Bits are only cleared when it is emptied.
+    std::atomic<uint64_t> filter{0};
+    // The largest total_mem_traced_ + bytes seen since the last flush.
+    std::size_t peak = 0;
+    // The number of pointers that were freed while staged since the last
+    // flush, for the timeline.
+    int freed = 0;
+    // Set when the owning thread exits, so that the buffer can be reused.
+    std::atomic<bool> orphaned{false};
+    const void *ptrs[kStagingBufferSize];
+    LivePointer values[kStagingBufferSize];
+
+    static uint64_t FilterBit(const void *ptr) {
+      // Allocations are at least 8-byte aligned, so skip the low bits.
+      const uintptr_t p = reinterpret_cast<uintptr_t>(ptr);
+      return uint64_t(1) << (((p >> 3) ^ (p >> 9)) & 63);
+    }
+
+  };
+
+  // Keeps the current thread's staging buffer alive, and marks it as
+  // orphaned when the thread exits. The fast path finds the buffer through
+  // the ThreadContext instead, which is trivially destructible.
+  struct StagingBufferRef {
+    std::shared_ptr<StagingBuffer> buffer;
+    ~StagingBufferRef();
+  };
+
+  StagingBuffer *GetStagingBuffer();
+  // The current thread's staging buffer, if it belongs to this profiler.
+  StagingBuffer *ThreadStagingBuffer() const;
+  bool RemoveStaged(const void *ptr, LivePointer *removed, bool moving);
+  // Removes ptr from buf, if it is there. owned is whether buf belongs to
+  // the current thread.
+  bool RemoveStagedSlow(StagingBuffer *buf, const void *ptr,
+                        LivePointer *removed, bool moving, bool owned);
+  // Flush the given buffer into live_set_. buf->mu and mu_ must be held.
+  void FlushLocked(StagingBuffer *buf);
+  // Flush all staging buffers into live_set_. mu_ must not be held.
+  void FlushStagingBuffers();
+  // Remove ptr from the live set, including any staging buffers. If moving
+  // is true, the pointer is about to be inserted again by the caller, which
+  // must then decrement moves_in_flight_ under mu_.
+  bool FindAndRemove(const void *ptr, LivePointer *removed,
+                     bool moving = false);
+  // Remove ptr from the staging buffers of threads other than the owner of
+  // own, which has already been searched.
+  bool FindAndRemoveSlow(const void *ptr, LivePointer *removed, bool moving,
+                         const StagingBuffer *own);
+  bool RemoveLiveLocked(const void *ptr, LivePointer *removed);
+  // The live totals of the given trace, which are about to be modified.
+  // mu_ must be held.
+  CallTraceSet::LiveTotals &LiveTotalsLocked(CallTraceSet::TraceHandle h);
+  // Checkpoint the live totals if the traced memory has grown past the
+  // last checkpoint by at least the peak hysteresis. mu_ must be held.
+  void MaybeCheckpointPeakLocked(std::size_t total);
+  void CheckpointPeakLocked(std::size_t total);
+  void ResetStackTotalsLocked();
+  // Add the given sampled allocations and frees to the timeline, if it is
+  // enabled. mu_ must be held.
+  void RecordTimelineLocked(std::size_t total, std::size_t peak,
+                            uint64_t allocs, uint64_t frees);
+  std::size_t ThreadStagedBytes() const;
+
+  // Source of unique ids for profilers, so that threads can tell when
+  // their staging buffer belongs to a different profiler. These are 32
+  // bits to fit in the ThreadContext; a thread's id would only be reused
+  // after 2^32 more profilers were created.
+  static std::atomic<uint32_t> next_id_;
+  const uint32_t id_;
+  // The current epoch, shared by every profiler so that marks stay
+  // meaningful across a fork or a restart of the profiler.
+  static std::atomic<Epoch> epoch_;
+
   int max_frames_;
+  bool huge_pages_;
+  // Whether each sample is weighted by its own sample rate, rather than
+  // every stack being scaled by the global one. Set from the sampling mode
+  // when the profiler is created, see sampling.h.
+  const bool weighted_;
+  // Protected by the GIL, which RecordMalloc holds.
+  bool paused_;
+  // May be null. Protected by the GIL.
+  std::shared_ptr<FrameFilter> frame_filter_;
   // Guards access to live_set_.
   SpinLock mu_;
+  // The number of staging buffers that are not empty. This is checked on
+  // every free that misses the live set, so it is kept next to mu_.
+  std::atomic<int> num_staged_buffers_;
 
   // Map of live pointer -> trace + size of that pointer (if it was sampled).
+  // Protected by mu_, which also guards the LiveTotals of the traces, so
+  // that they always match the contents of live_set_.
+  LiveSet<LivePointer> live_set_;
+  // Total size of the pointers in live_set_. Only modified while holding
+  // mu_, but may be read without it.
+  std::atomic<std::size_t> total_mem_traced_;
   // Protected by mu_.
-  AddressMap<LivePointer> live_set_;
-  std::size_t total_mem_traced_;
   std::size_t peak_mem_traced_;
+  // Totals of the live pointers that were allocated without a Python
+  // stack, which have a null trace handle. Protected by mu_.
+  CallTraceSet::LiveTotals untraced_totals_;
+
+  // Peak checkpoints are a delta log: the stacks whose totals change are
+  // recorded (once per epoch) in peak_dirty_, and a checkpoint only copies
+  // those stacks into peak_totals_. All protected by mu_.
+  bool peak_checkpoints_;
+  std::size_t peak_hysteresis_;
+  // The traced memory at the last checkpoint.
+  std::size_t peak_checkpoint_bytes_;
+  uint64_t peak_epoch_;
+  std::vector<CallTraceSet::TraceHandle> peak_dirty_;
+  phmap::flat_hash_map<CallTraceSet::TraceHandle, CallTraceSet::LiveTotals>
+      peak_totals_;
+
+  // Protected by mu_. Null unless the timeline is enabled.
+  std::unique_ptr<MemoryTimeline> timeline_;
+
+  // The number of pointers that RecordRealloc has removed but not yet
+  // inserted again. Their traces are only referenced from its stack, so
+  // nothing is collected while this is not 0. Incremented under mu_ or the
+  // StagingBuffer::mu of the pointer, and decremented under mu_.
+  std::atomic<int> moves_in_flight_;
+  // See SetCollectTracesCallback. Protected by the GIL.
+  void (*collect_traces_callback_)();
+  std::size_t min_traces_to_collect_;
+  std::size_t next_collect_size_;
+  // The number of live ScopedTracePins. Protected by the GIL.
+  int trace_pins_;
+
+  // Guards staging_buffers_.
+  SpinLock staging_mu_;
+  // Staging buffers for all threads that have sampled an allocation.
+  std::vector<std::shared_ptr<StagingBuffer>> staging_buffers_;
+  // The first kMaxStagingSlots of staging_buffers_, so that frees can look
+  // for a pointer staged by another thread without taking staging_mu_.
+  // Slots are only set once, under staging_mu_, before num_staging_slots_
+  // is incremented, and the buffers live as long as the profiler.
+  static const int kMaxStagingSlots = 64;
+  std::atomic<StagingBuffer *> staging_slots_[kMaxStagingSlots];
+  std::atomic<int> num_staging_slots_;
 
   // Interned set of referenced stack traces.
   // Protected by the GIL.
   CallTraceSet traces_;
 };
 
+template <ProfilerVariant V>
 inline void HeapProfiler::HandleMalloc(void *ptr, std::size_t size,
-                                       bool is_raw) {
-  // NOTE: Only constant expressions are safe to use as thread_local
-  // initializers in a dynamic library. This is why the sample rate is
-  // set as a static variable on the Sampler class.
-  thread_local Sampler sampler;
-  if (LIKELY(sampler.RecordAllocation(size))) {
+                                       bool is_raw, ThreadContext *context) {
+  if (IsUnsampled(V) && LIKELY(context->region == 0)) {
+    // Like the Sampler with a period of 0, which never samples 0 bytes.
+    if (UNLIKELY(size == 0)) {
+      return;
+    }
+  } else if (LIKELY(context->sampler.RecordAllocation(
+                 SamplerBytes(size, context)))) {
     return;
   }
 
@@ -90,33 +511,196 @@ inline void HeapProfiler::HandleMalloc(void *ptr, std::size_t size,
     gil_state = PyGILState_Ensure();
   }
 
-  RecordMalloc(ptr, size);
+  RecordMalloc<IsSingleFrame(V)>(ptr, size);
 
   if (is_raw) {
     PyGILState_Release(gil_state);
   }
 }
 
+template <ProfilerVariant V>
 inline void HeapProfiler::HandleRealloc(void *oldptr, void *newptr,
-                                        std::size_t size, bool is_raw) {
-  assert(newptr != nullptr);
-  if (oldptr != nullptr) {
+                                        std::size_t size, bool is_raw,
+                                        ThreadContext *context) {
+  if (UNLIKELY(newptr == nullptr)) {
+    // Realloc failed and oldptr is still valid.
+    return;
+  }
+
+  // If the old block was sampled, it keeps its original allocation site
+  // and only the bytes it grew by are new to the sampler. We don't know
+  // the size of unsampled blocks, so those are treated as a new allocation.
+  // Weighted samples can't keep their weight at a new size, so those are
+  // also freed and sampled again.
+  std::size_t old_size;
+  if (UNLIKELY(weighted_)) {
     HandleFree(oldptr);
+  } else if (oldptr != nullptr &&
+             RecordRealloc(oldptr, newptr, size, &old_size)) {
+    if (size > old_size && !(IsUnsampled(V) && context->region == 0)) {
+      // The block is already sampled, so we only need to advance the
+      // sampler past the new bytes.
+      context->sampler.RecordAllocation(size - old_size);
+    }
+    return;
   }
 
-  HandleMalloc(newptr, size, is_raw);
+  HandleMalloc<V>(newptr, size, is_raw, context);
 }
 
 inline void HeapProfiler::HandleFree(void *ptr) {
+  LivePointer removed;
+  FindAndRemove(ptr, &removed);
+}
+
+inline void HeapProfiler::HandleReallocPaused(void *oldptr, void *newptr,
+                                              std::size_t size) {
+  // A sampled block keeps its allocation site, and nothing else is sampled.
+  // Weighted samples are dropped instead, as in HandleRealloc.
+  std::size_t old_size;
+  if (UNLIKELY(weighted_)) {
+    if (newptr != nullptr) {
+      HandleFreePaused(oldptr);
+    }
+  } else if (oldptr != nullptr && newptr != nullptr) {
+    RecordRealloc(oldptr, newptr, size, &old_size);
+  }
+}
+
+inline void HeapProfiler::HandleFreePaused(void *ptr) {
+  LivePointer removed;
+  std::lock_guard<SpinLock> lock(mu_);
+  RemoveLiveLocked(ptr, &removed);
+}
+
+inline HeapProfiler::StagingBuffer *HeapProfiler::ThreadStagingBuffer()
+    const {
+  const ThreadContext &context = CurrentThreadContext();
+  return (context.staging_owner_id == id_)
+             ? static_cast<StagingBuffer *>(context.staging_buffer)
+             : nullptr;
+}
+
+inline bool HeapProfiler::RemoveStaged(const void *ptr, LivePointer *removed,
+                                       bool moving) {
+  StagingBuffer *buf = ThreadStagingBuffer();
+  if (buf == nullptr || LIKELY((buf->filter.load(std::memory_order_relaxed) &
+                                StagingBuffer::FilterBit(ptr)) == 0)) {
+    return false;
+  }
+
+  return RemoveStagedSlow(buf, ptr, removed, moving, true);
+}
+
+// Removes ptr from live_set_. mu_ must be held.
+inline bool HeapProfiler::RemoveLiveLocked(const void *ptr,
+                                           LivePointer *removed) {
+  if (LIKELY(!live_set_.FindAndRemove(ptr, removed))) {
+    return false;
+  }
+
+  total_mem_traced_.store(
+      total_mem_traced_.load(std::memory_order_relaxed) - removed->size,
+      std::memory_order_relaxed);
+  RemoveLiveTotalsLocked(*removed);
+  RecordTimelineLocked(total_mem_traced_.load(std::memory_order_relaxed),
+                       0, 0, 1);
+  return true;
+}
+
+inline bool HeapProfiler::FindAndRemove(const void *ptr,
+                                        LivePointer *removed, bool moving) {
+  // Recently sampled pointers are usually freed by the thread that
+  // allocated them, so check its staging buffer first.
+  if (RemoveStaged(ptr, removed, moving)) {
+    return true;
+  }
+
   // We could use a reader-writer lock and only take the write lock
   // if the pointer is found in the live set. In practice this is a little
   // bit slower and likely not beneficial since Python is mostly
   // single-threaded anyway. The GIL cannot be held in HandleFree because
   // it would introduce a deadlock in PyThreadState_DeleteCurrent().
-  std::lock_guard<SpinLock> lock(mu_);
-  LivePointer removed;
-  if (UNLIKELY(live_set_.FindAndRemove(ptr, &removed))) {
-    total_mem_traced_ -= removed.size;
+  {
+    std::lock_guard<SpinLock> lock(mu_);
+    if (RemoveLiveLocked(ptr, removed)) {
+      if (UNLIKELY(moving)) {
+        moves_in_flight_.fetch_add(1);
+      }
+      return true;
+    }
+  }
+
+  // The pointer may still be staged by another thread.
+  int num_other_staged = num_staged_buffers_.load(std::memory_order_relaxed);
+  StagingBuffer *buf = ThreadStagingBuffer();
+  if (buf != nullptr && buf->size.load(std::memory_order_relaxed) > 0) {
+    num_other_staged--;
+  }
+  if (LIKELY(num_other_staged <= 0)) {
+    return false;
+  }
+
+  return FindAndRemoveSlow(ptr, removed, moving, buf);
+}
+
+inline CallTraceSet::LiveTotals &HeapProfiler::LiveTotalsLocked(
+    CallTraceSet::TraceHandle h) {
+  CallTraceSet::LiveTotals &totals =
+      (h != nullptr) ? CallTraceSet::Totals(h) : untraced_totals_;
+  if (UNLIKELY(peak_checkpoints_ && totals.epoch != peak_epoch_)) {
+    totals.epoch = peak_epoch_;
+    peak_dirty_.push_back(h);
+  }
+  return totals;
+}
+
+inline void HeapProfiler::AddLiveTotalsLocked(const LivePointer &lp) {
+  CallTraceSet::LiveTotals &totals = LiveTotalsLocked(lp.trace_handle);
+  // Pointers sampled at a rate of their own can't be scaled with the rest
+  // of their stack, so they are estimated one at a time.
+  if (UNLIKELY(weighted_ || lp.region != 0)) {
+    const double weight = PointerWeight(lp.size, lp.region);
+    totals.weighted_count++;
+    totals.scaled_size += weight * lp.size;
+    totals.scaled_count += weight;
+  } else {
+    totals.size += lp.size;
+    totals.count++;
+  }
+}
+
+inline void HeapProfiler::RemoveLiveTotalsLocked(const LivePointer &lp) {
+  CallTraceSet::LiveTotals &totals = LiveTotalsLocked(lp.trace_handle);
+  if (UNLIKELY(weighted_ || lp.region != 0)) {
+    if (--totals.weighted_count == 0) {
+      // Don't let rounding errors accumulate.
+      totals.scaled_size = 0;
+      totals.scaled_count = 0;
+    } else {
+      const double weight = PointerWeight(lp.size, lp.region);
+      totals.scaled_size -= weight * lp.size;
+      totals.scaled_count -= weight;
+    }
+  } else {
+    totals.size -= lp.size;
+    totals.count--;
+  }
+}
+
+inline void HeapProfiler::MaybeCheckpointPeakLocked(std::size_t total) {
+  if (UNLIKELY(peak_checkpoints_ &&
+               total > peak_checkpoint_bytes_ + peak_hysteresis_)) {
+    CheckpointPeakLocked(total);
+  }
+}
+
+inline void HeapProfiler::RecordTimelineLocked(std::size_t total,
+                                               std::size_t peak,
+                                               uint64_t allocs,
+                                               uint64_t frees) {
+  if (UNLIKELY(timeline_ != nullptr)) {
+    timeline_->Record(MonotonicNanos(), total, peak, allocs, frees);
   }
 }
 
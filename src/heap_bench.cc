@@ -1,5 +1,8 @@
 // Copyright 2019 Timothy Palpant
 
+#include <thread>
+#include <vector>
+
 #include "benchmark/benchmark.h"
 #include "heap.h"
 
@@ -40,6 +43,139 @@ static void BM_HandleFree(benchmark::State &state) {
   }
 }
 
+static void BM_HandleFreePaused(benchmark::State &state) {
+  Sampler::SetSamplePeriod(state.range(0));
+  HeapProfiler profiler;
+  int n = 100000;
+  for (int i = 0; i < n; i++) {
+    void *fake_ptr = reinterpret_cast<void *>((rand() % n) + 1);
+    std::size_t sz = rand() % (4 * 1024);
+    profiler.HandleMalloc(fake_ptr, sz, true);
+  }
+  auto gil_state = PyGILState_Ensure();
+  profiler.Pause();
+  PyGILState_Release(gil_state);
+
+  std::size_t i = 0;
+  for (auto _ : state) {
+    void *fake_ptr = reinterpret_cast<void *>((i++ % n) + 1);
+    profiler.HandleFreePaused(fake_ptr);
+  }
+}
+
+static void BM_HandleRealloc(benchmark::State &state) {
+  Sampler::SetSamplePeriod(state.range(0));
+  HeapProfiler profiler;
+  void *fake_ptr = reinterpret_cast<void *>(1234);
+  profiler.HandleMalloc(fake_ptr, 1024, true);
+  std::size_t size = 1024;
+  for (auto _ : state) {
+    // Grow in place, as with a bytearray or list that is being extended.
+    profiler.HandleRealloc(fake_ptr, fake_ptr, size + 64, true);
+    size = (size + 64) % (1024 * 1024);
+  }
+}
+
+static void BM_HandleMallocFree(benchmark::State &state) {
+  Sampler::SetSamplePeriod(state.range(0));
+  HeapProfiler profiler;
+  // Keep a window of live pointers, so that frees are not always of the
+  // most recently sampled pointer.
+  const std::size_t window = 1024;
+  std::size_t i = 0;
+  for (auto _ : state) {
+    void *fake_ptr = reinterpret_cast<void *>(16 * ((i % (4 * window)) + 1));
+    void *old_ptr =
+        reinterpret_cast<void *>(16 * (((i - window) % (4 * window)) + 1));
+    profiler.HandleMalloc(fake_ptr, 64, true);
+    if (i >= window) {
+      profiler.HandleFree(old_ptr);
+    }
+    i++;
+  }
+}
+
+// Each thread samples allocations into a shared profiler and frees them
+// shortly after, while they are still staged, along with a block that was
+// never sampled. Every thread has pointers staged at all times, so the
+// frees that miss must not disturb the other threads' buffers. The
+// argument is the sample period.
+static HeapProfiler *g_shared_profiler = nullptr;
+
+static void BM_HandleFreeThreads(benchmark::State &state) {
+  if (state.thread_index() == 0) {
+    Sampler::SetSamplePeriod(state.range(0));
+    g_shared_profiler = new HeapProfiler();
+  }
+  const uintptr_t base = uintptr_t(state.thread_index() + 1) << 32;
+  const std::size_t window = 8;
+  std::size_t i = 0;
+  for (auto _ : state) {
+    void *fake_ptr =
+        reinterpret_cast<void *>(base + 16 * ((i % (4 * window)) + 1));
+    void *old_ptr = reinterpret_cast<void *>(
+        base + 16 * (((i - window) % (4 * window)) + 1));
+    void *unsampled_ptr =
+        reinterpret_cast<void *>(base + 16 * (i % (4 * window)) + 8);
+    g_shared_profiler->HandleMalloc(fake_ptr, 64, true);
+    if (i >= window) {
+      g_shared_profiler->HandleFree(old_ptr);
+    }
+    g_shared_profiler->HandleFree(unsampled_ptr);
+    i++;
+  }
+  if (state.thread_index() == 0) {
+    delete g_shared_profiler;
+    g_shared_profiler = nullptr;
+  }
+}
+
+// Like BM_HandleFreeThreads, but interleaves the threads after every
+// iteration, as they would be on a machine with a core for each, by
+// switching a single thread between their staging buffers. The argument
+// is the number of threads.
+static void BM_HandleFreeInterleaved(benchmark::State &state) {
+  Sampler::SetSamplePeriod(0);
+  HeapProfiler profiler;
+  const int num_threads = state.range(0);
+  const std::size_t window = 8;
+  // Register this thread's buffer first, so that the threads below don't
+  // reuse it.
+  ThreadContext &context = CurrentThreadContext();
+  profiler.HandleMalloc(reinterpret_cast<void *>(8), 64, true);
+  profiler.HandleFree(reinterpret_cast<void *>(8));
+  std::vector<void *> buffers(num_threads);
+  for (int t = 0; t < num_threads; t++) {
+    std::thread([&profiler, &buffers, t] {
+      profiler.HandleMalloc(reinterpret_cast<void *>(8), 64, true);
+      profiler.HandleFree(reinterpret_cast<void *>(8));
+      buffers[t] = CurrentThreadContext().staging_buffer;
+    }).join();
+  }
+
+  void *own_buffer = context.staging_buffer;
+  std::size_t i = 0;
+  for (auto _ : state) {
+    const std::size_t t = i % num_threads;
+    const std::size_t j = i / num_threads;
+    const uintptr_t base = uintptr_t(t + 1) << 32;
+    void *fake_ptr =
+        reinterpret_cast<void *>(base + 16 * ((j % (4 * window)) + 1));
+    void *old_ptr = reinterpret_cast<void *>(
+        base + 16 * (((j - window) % (4 * window)) + 1));
+    void *unsampled_ptr =
+        reinterpret_cast<void *>(base + 16 * (j % (4 * window)) + 8);
+    context.staging_buffer = buffers[t];
+    profiler.HandleMalloc(fake_ptr, 64, true);
+    if (j >= window) {
+      profiler.HandleFree(old_ptr);
+    }
+    profiler.HandleFree(unsampled_ptr);
+    i++;
+  }
+  context.staging_buffer = own_buffer;
+}
+
 BENCHMARK(BM_HandleMalloc)
     ->Arg(0)
     ->Arg(128)
@@ -47,5 +183,16 @@ BENCHMARK(BM_HandleMalloc)
     ->Arg(32 * 1024)
     ->Arg(128 * 1024)
     ->Arg(512 * 1024);
+BENCHMARK(BM_HandleMallocFree)->Arg(0)->Arg(1024)->Arg(128 * 1024);
+BENCHMARK(BM_HandleRealloc)->Arg(0)->Arg(128 * 1024);
 BENCHMARK(BM_HandleRawMalloc)->Arg(128 * 1024)->Threads(2);
 BENCHMARK(BM_HandleFree)->Arg(0)->Arg(1024)->Arg(128 * 1024)->Arg(512 * 1024);
+BENCHMARK(BM_HandleFreePaused)->Arg(0)->Arg(128 * 1024);
+BENCHMARK(BM_HandleFreeThreads)
+    ->Arg(0)
+    ->Arg(1024)
+    ->Threads(1)
+    ->Threads(2)
+    ->Threads(4)
+    ->Threads(8);
+BENCHMARK(BM_HandleFreeInterleaved)->Arg(1)->Arg(2)->Arg(4)->Arg(8);
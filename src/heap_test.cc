@@ -2,9 +2,22 @@
 //
 #include "heap.h"
 
+#include <algorithm>
 #include <thread>
 
 #include "gtest/gtest.h"
+#include "scoped_object.h"
+
+// The sorted pointers of a snapshot.
+static std::vector<const void *> SnapshotPointers(
+    const std::vector<HeapProfiler::SnapshotEntry> &snap) {
+  std::vector<const void *> ptrs;
+  for (const HeapProfiler::SnapshotEntry &entry : snap) {
+    ptrs.push_back(entry.ptr);
+  }
+  std::sort(ptrs.begin(), ptrs.end());
+  return ptrs;
+}
 
 TEST(HeapProfiler, HandleMalloc) {
   Sampler::SetSamplePeriod(0);
@@ -30,8 +43,9 @@ TEST(HeapProfiler, HandleMalloc) {
   auto snap = p.GetSnapshot();
   EXPECT_EQ(snap.size(), 3);
   std::size_t total = 0;
-  for (const void *ptr : snap) {
-    total += p.GetSize(ptr);
+  for (const HeapProfiler::SnapshotEntry &entry : snap) {
+    EXPECT_EQ(entry.size, p.GetSize(entry.ptr));
+    total += entry.size;
   }
   EXPECT_EQ(total, 12 + 6 + 36);
 
@@ -58,8 +72,9 @@ TEST(HeapProfiler, HandleFree) {
   auto snap = p.GetSnapshot();
   EXPECT_EQ(snap.size(), 2);
   std::size_t total = 0;
-  for (const void *ptr : snap) {
-    total += p.GetSize(ptr);
+  for (const HeapProfiler::SnapshotEntry &entry : snap) {
+    EXPECT_EQ(entry.size, p.GetSize(entry.ptr));
+    total += entry.size;
   }
   EXPECT_EQ(total, 12 + 36);
 }
@@ -105,3 +120,620 @@ TEST(HeapProfiler, ConcurrencySafe) {
   }
   Py_END_ALLOW_THREADS
 }
+
+TEST(HeapProfiler, HandleRealloc) {
+  Sampler::SetSamplePeriod(0);
+  HeapProfiler p;
+
+  void *fake_ptr = reinterpret_cast<void *>(123);
+  void *fake_ptr2 = reinterpret_cast<void *>(456);
+
+  p.HandleMalloc(fake_ptr, 12, false);
+  // Grow in place.
+  p.HandleRealloc(fake_ptr, fake_ptr, 100, false);
+  EXPECT_EQ(p.GetSnapshot().size(), 1);
+  EXPECT_EQ(p.GetSize(fake_ptr), 100);
+  EXPECT_EQ(p.TotalMemoryTraced(), 100);
+  EXPECT_EQ(p.PeakMemoryTraced(), 100);
+
+  // Shrink and move.
+  p.HandleRealloc(fake_ptr, fake_ptr2, 50, false);
+  EXPECT_EQ(p.GetSnapshot().size(), 1);
+  EXPECT_EQ(p.GetSize(fake_ptr), 0);
+  EXPECT_EQ(p.GetSize(fake_ptr2), 50);
+  EXPECT_EQ(p.TotalMemoryTraced(), 50);
+  EXPECT_EQ(p.PeakMemoryTraced(), 100);
+
+  // Failed realloc leaves the old block alone.
+  p.HandleRealloc(fake_ptr2, nullptr, 1000, false);
+  EXPECT_EQ(p.GetSize(fake_ptr2), 50);
+
+  // Realloc of nullptr is a malloc.
+  p.HandleRealloc(nullptr, fake_ptr, 8, false);
+  EXPECT_EQ(p.GetSnapshot().size(), 2);
+  EXPECT_EQ(p.TotalMemoryTraced(), 50 + 8);
+}
+
+TEST(HeapProfiler, OversizedBlocks) {
+  Sampler::SetSamplePeriod(0);
+  HeapProfiler p;
+  void *fake_ptr = reinterpret_cast<void *>(123);
+  void *fake_ptr2 = reinterpret_cast<void *>(456);
+  // Sizes beyond 16TB are recorded as the largest that fits, everywhere.
+  const std::size_t max_size = (std::size_t(1) << 44) - 1;
+
+  p.HandleMalloc(fake_ptr, std::size_t(1) << 45, false);
+  EXPECT_EQ(p.GetSize(fake_ptr), max_size);
+  EXPECT_EQ(p.TotalMemoryTraced(), max_size);
+  auto snap = p.GetSnapshot();
+  ASSERT_EQ(snap.size(), 1);
+  EXPECT_EQ(snap[0].size, max_size);
+  auto stacks = p.GetStackTotals();
+  ASSERT_EQ(stacks.size(), 1);
+  EXPECT_EQ(stacks[0].size, max_size);
+
+  p.HandleRealloc(fake_ptr, fake_ptr2, (std::size_t(1) << 44) + 8, false);
+  EXPECT_EQ(p.GetSize(fake_ptr2), max_size);
+  EXPECT_EQ(p.TotalMemoryTraced(), max_size);
+
+  // Freeing them leaves nothing behind in the totals.
+  p.HandleFree(fake_ptr2);
+  EXPECT_EQ(p.TotalMemoryTraced(), 0);
+  EXPECT_EQ(p.PeakMemoryTraced(), max_size);
+  EXPECT_EQ(p.GetStackTotals().size(), 0);
+}
+
+TEST(HeapProfiler, Pause) {
+  Sampler::SetSamplePeriod(0);
+  HeapProfiler p;
+  void *fake_ptr = reinterpret_cast<void *>(123);
+  void *fake_ptr2 = reinterpret_cast<void *>(456);
+  void *fake_ptr3 = reinterpret_cast<void *>(789);
+  void *fake_ptr4 = reinterpret_cast<void *>(1011);
+  p.HandleMalloc(fake_ptr, 100, false);
+  p.HandleMalloc(fake_ptr2, 200, false);
+
+  // The staged pointers are still tracked once paused.
+  p.Pause();
+  EXPECT_TRUE(p.IsPaused());
+  p.HandleMalloc(fake_ptr3, 300, false);
+  EXPECT_EQ(p.GetSize(fake_ptr3), 0);
+  p.HandleFreePaused(fake_ptr);
+  p.HandleReallocPaused(fake_ptr2, fake_ptr4, 250);
+  EXPECT_EQ(p.GetSize(fake_ptr2), 0);
+  EXPECT_EQ(p.GetSize(fake_ptr4), 250);
+  EXPECT_EQ(p.TotalMemoryTraced(), 250);
+
+  p.Resume();
+  EXPECT_FALSE(p.IsPaused());
+  p.HandleMalloc(fake_ptr3, 300, false);
+  EXPECT_EQ(p.TotalMemoryTraced(), 250 + 300);
+  EXPECT_EQ(p.GetSnapshot().size(), 2);
+}
+
+TEST(HeapProfiler, GetStackTotals) {
+  Sampler::SetSamplePeriod(0);
+  HeapProfiler p;
+  EXPECT_EQ(p.GetStackTotals().size(), 0);
+
+  void *fake_ptr = reinterpret_cast<void *>(123);
+  void *fake_ptr2 = reinterpret_cast<void *>(456);
+  void *fake_ptr3 = reinterpret_cast<void *>(789);
+  p.HandleMalloc(fake_ptr, 12, false);
+  p.HandleMalloc(fake_ptr2, 6, false);
+  p.HandleMalloc(fake_ptr3, 36, false);
+  p.HandleFree(fake_ptr2);
+  p.HandleRealloc(fake_ptr3, fake_ptr2, 100, false);
+
+  // There is no Python thread state, so all of the pointers are attributed
+  // to the untraced stack.
+  auto stacks = p.GetStackTotals();
+  ASSERT_EQ(stacks.size(), 1);
+  EXPECT_EQ(stacks[0].trace_handle, nullptr);
+  EXPECT_EQ(stacks[0].size, 12 + 100);
+  EXPECT_EQ(stacks[0].count, 2);
+
+  // The totals still match after the pointers are flushed into the live set.
+  EXPECT_EQ(p.GetSnapshot().size(), 2);
+  p.HandleFree(fake_ptr);
+  stacks = p.GetStackTotals();
+  ASSERT_EQ(stacks.size(), 1);
+  EXPECT_EQ(stacks[0].size, 100);
+  EXPECT_EQ(stacks[0].count, 1);
+
+  p.Reset();
+  EXPECT_EQ(p.GetStackTotals().size(), 0);
+}
+
+TEST(HeapProfiler, PeakCheckpoints) {
+  Sampler::SetSamplePeriod(0);
+  HeapProfiler p;
+  void *fake_ptr = reinterpret_cast<void *>(123);
+  void *fake_ptr2 = reinterpret_cast<void *>(456);
+  void *fake_ptr3 = reinterpret_cast<void *>(789);
+  void *fake_ptr4 = reinterpret_cast<void *>(1011);
+  p.HandleMalloc(fake_ptr, 100, false);
+  EXPECT_EQ(p.GetPeakStackTotals().size(), 0);
+
+  p.EnablePeakCheckpoints(0);
+  p.HandleMalloc(fake_ptr2, 50, false);
+  auto peak = p.GetPeakStackTotals();
+  ASSERT_EQ(peak.size(), 1);
+  EXPECT_EQ(peak[0].size, 150);
+  EXPECT_EQ(peak[0].count, 2);
+
+  // Below the peak, the checkpoint is unchanged.
+  p.HandleFree(fake_ptr);
+  p.HandleMalloc(fake_ptr3, 20, false);
+  peak = p.GetPeakStackTotals();
+  ASSERT_EQ(peak.size(), 1);
+  EXPECT_EQ(peak[0].size, 150);
+
+  p.HandleMalloc(fake_ptr4, 200, false);
+  peak = p.GetPeakStackTotals();
+  ASSERT_EQ(peak.size(), 1);
+  EXPECT_EQ(peak[0].size, 50 + 20 + 200);
+  EXPECT_EQ(peak[0].count, 3);
+
+  p.Reset();
+  EXPECT_EQ(p.GetPeakStackTotals().size(), 0);
+}
+
+TEST(HeapProfiler, PeakHysteresis) {
+  Sampler::SetSamplePeriod(0);
+  HeapProfiler p;
+  p.EnablePeakCheckpoints(1000);
+  void *fake_ptr = reinterpret_cast<void *>(123);
+  void *fake_ptr2 = reinterpret_cast<void *>(456);
+  p.HandleMalloc(fake_ptr, 100, false);
+  EXPECT_EQ(p.GetPeakStackTotals().size(), 0);
+
+  p.HandleMalloc(fake_ptr2, 1000, false);
+  auto peak = p.GetPeakStackTotals();
+  ASSERT_EQ(peak.size(), 1);
+  EXPECT_EQ(peak[0].size, 1100);
+}
+
+TEST(HeapProfiler, Timeline) {
+  Sampler::SetSamplePeriod(0);
+  HeapProfiler p;
+  p.EnableTimeline(16, 0);
+  void *fake_ptr = reinterpret_cast<void *>(123);
+  void *fake_ptr2 = reinterpret_cast<void *>(456);
+  // Frees of staged pointers are counted when the buffer is flushed.
+  p.HandleMalloc(fake_ptr, 100, false);
+  p.HandleFree(fake_ptr);
+  p.HandleMalloc(fake_ptr2, 200, false);
+  EXPECT_EQ(p.GetTimeline().size(), 1);
+  p.HandleFree(fake_ptr2);
+
+  auto timeline = p.GetTimeline();
+  ASSERT_EQ(timeline.size(), 2);
+  EXPECT_EQ(timeline[0].traced, 200);
+  EXPECT_EQ(timeline[0].allocs, 2);
+  EXPECT_EQ(timeline[0].frees, 1);
+  EXPECT_EQ(timeline[1].traced, 0);
+  EXPECT_EQ(timeline[1].peak, 200);
+  EXPECT_EQ(timeline[1].frees, 1);
+  EXPECT_GE(timeline[1].time_ns, timeline[0].time_ns);
+
+  p.Reset();
+  EXPECT_EQ(p.GetTimeline().size(), 0);
+}
+
+TEST(HeapProfiler, LabelSets) {
+  Sampler::SetSamplePeriod(0);
+  HeapProfiler p;
+  void *fake_ptr = reinterpret_cast<void *>(123);
+  void *fake_ptr2 = reinterpret_cast<void *>(456);
+  p.HandleMalloc(fake_ptr, 100, false);
+  PyObjectRef token(SetLabelSet(3));
+  ASSERT_NE(token, nullptr);
+  p.HandleMalloc(fake_ptr2, 200, false);
+  ASSERT_TRUE(ResetLabelSet(token.get()));
+  EXPECT_EQ(CurrentLabelSet(), 0);
+
+  EXPECT_EQ(p.GetLabelSet(fake_ptr), 0);
+  EXPECT_EQ(p.GetLabelSet(fake_ptr2), 3);
+  std::vector<bool> label_sets(kMaxLabelSets);
+  label_sets[3] = true;
+  auto snap = p.GetSnapshot(&label_sets);
+  ASSERT_EQ(snap.size(), 1);
+  EXPECT_EQ(snap[0].ptr, fake_ptr2);
+  EXPECT_EQ(snap[0].label_set, 3);
+
+  auto totals = p.GetLabelTotals();
+  ASSERT_EQ(totals.size(), 2);
+  EXPECT_EQ(totals[0].label_set, 0);
+  EXPECT_EQ(totals[0].size, 100);
+  EXPECT_EQ(totals[1].label_set, 3);
+  EXPECT_EQ(totals[1].size, 200);
+  EXPECT_EQ(totals[1].count, 1);
+}
+
+TEST(HeapProfiler, Epochs) {
+  Sampler::SetSamplePeriod(0);
+  HeapProfiler p;
+  void *fake_ptr = reinterpret_cast<void *>(123);
+  void *fake_ptr2 = reinterpret_cast<void *>(456);
+  void *fake_ptr3 = reinterpret_cast<void *>(789);
+  void *fake_ptr4 = reinterpret_cast<void *>(1011);
+  p.HandleMalloc(fake_ptr, 100, false);
+  const Epoch first = HeapProfiler::Mark();
+  EXPECT_GT(first, 0);
+  EXPECT_EQ(HeapProfiler::CurrentEpoch(), first);
+  p.HandleMalloc(fake_ptr2, 200, false);
+  PyObjectRef token(SetLabelSet(3));
+  p.HandleMalloc(fake_ptr3, 300, false);
+  ASSERT_TRUE(ResetLabelSet(token.get()));
+  const Epoch second = HeapProfiler::Mark();
+  EXPECT_EQ(second, first + 1);
+  p.HandleMalloc(fake_ptr4, 400, false);
+  // A moved pointer keeps the epoch of its allocation.
+  p.HandleRealloc(fake_ptr, fake_ptr, 150, false);
+
+  EXPECT_EQ(SnapshotPointers(p.GetSnapshot(nullptr, first)),
+            std::vector<const void *>({fake_ptr2, fake_ptr3, fake_ptr4}));
+  EXPECT_EQ(SnapshotPointers(p.GetSnapshot(nullptr, first, second)),
+            std::vector<const void *>({fake_ptr2, fake_ptr3}));
+  EXPECT_EQ(SnapshotPointers(p.GetSnapshot(nullptr, 0, first)),
+            std::vector<const void *>({fake_ptr}));
+  EXPECT_EQ(p.GetSnapshot(nullptr, second + 1).size(), 0);
+
+  // Both filters apply at once.
+  std::vector<bool> label_sets(kMaxLabelSets);
+  label_sets[0] = true;
+  EXPECT_EQ(SnapshotPointers(p.GetSnapshot(&label_sets, first)),
+            std::vector<const void *>({fake_ptr2, fake_ptr4}));
+}
+
+TEST(HeapProfiler, Regions) {
+  Sampler::SetSamplePeriod(-1);
+  ThreadSampler().ResetSamplingPoint();
+  HeapProfiler p;
+  void *fake_ptr = reinterpret_cast<void *>(123);
+  void *fake_ptr2 = reinterpret_cast<void *>(456);
+  void *fake_ptr3 = reinterpret_cast<void *>(789);
+  const int all = InternRegion(0);
+  const int none = InternRegion(-1);
+  ASSERT_GT(all, 0);
+  ASSERT_GT(none, 0);
+  EXPECT_EQ(InternRegion(0), all);
+  EXPECT_EQ(RegionPeriod(none), -1);
+  EXPECT_EQ(RegionSampleRate(none), 0);
+
+  p.HandleMalloc(fake_ptr, 100, false);
+  EXPECT_EQ(SetThreadRegion(all), 0);
+  p.HandleMalloc(fake_ptr2, 200, false);
+  EXPECT_EQ(SetThreadRegion(none), all);
+  p.HandleMalloc(fake_ptr3, 300, false);
+  Sampler::SetSamplePeriod(0);
+  EXPECT_EQ(SetThreadRegion(0), none);
+  EXPECT_EQ(CurrentRegion(), 0);
+
+  auto snap = p.GetSnapshot();
+  ASSERT_EQ(snap.size(), 1);
+  EXPECT_EQ(snap[0].ptr, fake_ptr2);
+  EXPECT_EQ(snap[0].size, 200);
+  EXPECT_EQ(snap[0].region, all);
+  EXPECT_EQ(p.GetRegion(fake_ptr2), all);
+  // Samples from a region are scaled by its own period.
+  auto totals = p.GetLabelTotals();
+  ASSERT_EQ(totals.size(), 1);
+  EXPECT_EQ(totals[0].size, 200);
+  EXPECT_EQ(totals[0].count, 1);
+  // The stack totals keep them apart from the samples that are scaled by
+  // the global period.
+  auto stacks = p.GetStackTotals();
+  ASSERT_EQ(stacks.size(), 1);
+  EXPECT_EQ(stacks[0].count, 0);
+  EXPECT_EQ(stacks[0].scaled_size, 200);
+  EXPECT_EQ(stacks[0].scaled_count, 1);
+  p.HandleFree(fake_ptr2);
+  EXPECT_EQ(p.GetStackTotals().size(), 0);
+}
+
+// Samples each allocation of a million 8 byte allocations with probability
+// about 1/1000, in the given mode, and checks that the weighted totals are
+// close to the truth.
+static void CheckWeightedTotals(const SamplingConfig &config) {
+  Sampler::SetSamplePeriod(1000);
+  ThreadSampler().ResetSamplingPoint();
+  ASSERT_TRUE(SetSamplingConfig(config));
+  EXPECT_EQ(SnapshotSampleRate(), 0);
+  HeapProfiler p;
+  const std::size_t n = 1000000;
+  for (std::size_t i = 1; i <= n; i++) {
+    p.HandleMalloc(reinterpret_cast<void *>(i), 8, false);
+  }
+
+  const double weight = PointerWeight(8, 0);
+  const std::size_t sampled = p.GetSnapshot().size();
+  auto stacks = p.GetStackTotals();
+  ASSERT_EQ(stacks.size(), 1);
+  EXPECT_EQ(stacks[0].count, 0);
+  EXPECT_NEAR(stacks[0].scaled_count, sampled * weight, 1);
+  EXPECT_NEAR(stacks[0].scaled_size, sampled * weight * 8, 1);
+  EXPECT_NEAR(stacks[0].scaled_count, n, n * 0.15);
+
+  // Label totals weight each pointer the same way.
+  auto totals = p.GetLabelTotals();
+  ASSERT_EQ(totals.size(), 1);
+  EXPECT_NEAR(totals[0].count, stacks[0].scaled_count, sampled);
+
+  // Freeing every pointer takes the totals back to 0.
+  for (std::size_t i = 1; i <= n; i++) {
+    p.HandleFree(reinterpret_cast<void *>(i));
+  }
+  EXPECT_EQ(p.GetStackTotals().size(), 0);
+  ASSERT_TRUE(SetSamplingConfig(SamplingConfig()));
+  Sampler::SetSamplePeriod(0);
+  ThreadSampler().ResetSamplingPoint();
+}
+
+TEST(HeapProfiler, CountSampling) {
+  SamplingConfig config;
+  config.mode = SamplingMode::kCount;
+  CheckWeightedTotals(config);
+}
+
+TEST(HeapProfiler, StratifiedSampling) {
+  SamplingConfig config;
+  config.mode = SamplingMode::kStratified;
+  // 8 byte allocations are sampled at 1/125 of the global rate.
+  config.bands = {{8, 8000}, {64, 0}};
+  CheckWeightedTotals(config);
+
+  // Bands must be sorted.
+  Sampler::SetSamplePeriod(1000);
+  config.bands = {{8, 8000}, {8, 0}};
+  EXPECT_FALSE(SetSamplingConfig(config));
+  EXPECT_TRUE(PyErr_ExceptionMatches(PyExc_ValueError));
+  PyErr_Clear();
+  Sampler::SetSamplePeriod(0);
+
+  // A config can be checked against a period before it is set.
+  config.bands = {{8, 8000}, {64, 0}};
+  EXPECT_TRUE(CheckSamplingConfig(config, 1000));
+  EXPECT_FALSE(CheckSamplingConfig(config, 0));
+  EXPECT_TRUE(PyErr_ExceptionMatches(PyExc_ValueError));
+  PyErr_Clear();
+  EXPECT_EQ(Sampler::GetSamplePeriod(), 0);
+  EXPECT_EQ(GetSamplingMode(), SamplingMode::kBytes);
+}
+
+TEST(HeapProfiler, StratifiedCarry) {
+  // Each 8 byte allocation adds 2^-27 of a byte to the carry, which is too
+  // little to change a float once the carry reaches 1/2.
+  Sampler::SetSamplePeriod(1024);
+  SamplingConfig config;
+  config.mode = SamplingMode::kStratified;
+  config.bands = {{8, int64_t(1) << 40}};
+  ASSERT_TRUE(SetSamplingConfig(config));
+  ThreadContext *context = &CurrentThreadContext();
+  context->sampler_carry = 0;
+  EXPECT_EQ(SamplerBytes(std::size_t(1) << 29, context), 0);
+  for (int i = 0; i < (1 << 20); i++) {
+    EXPECT_EQ(SamplerBytes(8, context), 0);
+  }
+  EXPECT_EQ(context->sampler_carry, 0.5 + 1.0 / 128);
+  context->sampler_carry = 0;
+  ASSERT_TRUE(SetSamplingConfig(SamplingConfig()));
+  Sampler::SetSamplePeriod(0);
+}
+
+TEST(HeapProfiler, Variants) {
+  Sampler::SetSamplePeriod(0);
+  EXPECT_EQ(HeapProfiler().GetVariant(), ProfilerVariant::kUnsampled);
+  EXPECT_EQ(HeapProfiler(1).GetVariant(),
+            ProfilerVariant::kUnsampledSingleFrame);
+  HeapProfiler filtered(1);
+  filtered.SetFrameFilter(std::make_shared<FrameFilter>(
+      std::vector<std::string>(), std::vector<std::string>(), true, 0));
+  EXPECT_EQ(filtered.GetVariant(), ProfilerVariant::kUnsampled);
+  Sampler::SetSamplePeriod(1024);
+  EXPECT_EQ(HeapProfiler().GetVariant(), ProfilerVariant::kGeneral);
+  EXPECT_EQ(HeapProfiler(1).GetVariant(), ProfilerVariant::kGeneral);
+  Sampler::SetSamplePeriod(0);
+}
+
+TEST(HeapProfiler, UnsampledVariant) {
+  Sampler::SetSamplePeriod(1);
+  ThreadSampler().ResetSamplingPoint();
+  const ProfilerVariant kVariant = ProfilerVariant::kUnsampledSingleFrame;
+  HeapProfiler p(1);
+  ThreadContext *context = &CurrentThreadContext();
+  void *fake_ptr = reinterpret_cast<void *>(123);
+  void *fake_ptr2 = reinterpret_cast<void *>(456);
+  void *fake_ptr3 = reinterpret_cast<void *>(789);
+
+  // Every allocation of at least one byte is traced.
+  p.HandleMalloc<kVariant>(fake_ptr, 1, false, context);
+  p.HandleMalloc<kVariant>(fake_ptr2, 0, false, context);
+  p.HandleRealloc<kVariant>(fake_ptr, fake_ptr, 2, false, context);
+  EXPECT_EQ(p.GetSnapshot().size(), 1);
+  EXPECT_EQ(p.TotalMemoryTraced(), 2);
+
+  // Regions still use the Sampler.
+  const int none = InternRegion(-1);
+  ASSERT_GT(none, 0);
+  SetThreadRegion(none);
+  p.HandleMalloc<kVariant>(fake_ptr3, 1024, false, context);
+  SetThreadRegion(0);
+  EXPECT_EQ(p.GetSnapshot().size(), 1);
+  Sampler::SetSamplePeriod(0);
+}
+
+TEST(HeapProfiler, FreeFromOtherThread) {
+  Sampler::SetSamplePeriod(0);
+  HeapProfiler p;
+
+  // Enough to fill and flush a few staging buffers, with some left staged.
+  const std::size_t n = 3 * kStagingBufferSize + 5;
+  Py_BEGIN_ALLOW_THREADS;
+  std::thread t([&p]() {
+    for (std::size_t i = 1; i <= n; i++) {
+      p.HandleMalloc(reinterpret_cast<void *>(i), 8, true);
+    }
+  });
+  t.join();
+  Py_END_ALLOW_THREADS;
+
+  // Frees of pointers still staged by the other thread are not missed.
+  for (std::size_t i = 1; i <= n; i++) {
+    p.HandleFree(reinterpret_cast<void *>(i));
+  }
+  EXPECT_EQ(p.GetSnapshot().size(), 0);
+  EXPECT_EQ(p.TotalMemoryTraced(), 0);
+  EXPECT_EQ(p.PeakMemoryTraced(), 8 * n);
+}
+
+TEST(HeapProfiler, MemoryUsage) {
+  Sampler::SetSamplePeriod(0);
+  for (LiveSetType type :
+       {LiveSetType::kAddressMap, LiveSetType::kFlatHashMap}) {
+    HeapProfiler p(kMaxFramesToCapture, type);
+    // Register this thread's staging buffer.
+    p.HandleMalloc(reinterpret_cast<void *>(8), 8, false);
+    p.HandleFree(reinterpret_cast<void *>(8));
+    const std::size_t initial = p.MemoryUsage();
+    EXPECT_GT(initial, sizeof(HeapProfiler));
+
+    // Spread pointers over a few 1MB regions.
+    for (uintptr_t i = 1; i <= 10000; i++) {
+      p.HandleMalloc(reinterpret_cast<void *>(i << 12), 8, false);
+    }
+    p.GetSnapshot();
+    EXPECT_GT(p.MemoryUsage(), initial);
+
+    p.Reset();
+    EXPECT_LE(p.MemoryUsage(), initial);
+  }
+}
+
+TEST(HeapProfiler, ResetAfterFork) {
+  Sampler::SetSamplePeriod(0);
+  HeapProfiler p;
+  for (uintptr_t i = 1; i <= 100; i++) {
+    p.HandleMalloc(reinterpret_cast<void *>(i), 8, false);
+  }
+
+  // Simulate the handlers that run around fork in the child.
+  p.PrepareFork();
+  p.ChildAfterFork();
+  p.ResetAfterFork();
+  EXPECT_EQ(p.GetSnapshot().size(), 0);
+  EXPECT_EQ(p.TotalMemoryTraced(), 0);
+  EXPECT_EQ(p.PeakMemoryTraced(), 0);
+
+  p.HandleMalloc(reinterpret_cast<void *>(1), 16, false);
+  EXPECT_EQ(p.GetSize(reinterpret_cast<void *>(1)), 16);
+  p.HandleFree(reinterpret_cast<void *>(1));
+  EXPECT_EQ(p.TotalMemoryTraced(), 0);
+}
+
+namespace {
+
+// The profiler that alloc(i) samples a pointer of 8 bytes at i with, from
+// the caller's stack.
+HeapProfiler *g_collecting = nullptr;
+int g_collect_callbacks = 0;
+
+PyObject *CollectTestAlloc(PyObject *self, PyObject *arg) {
+  const Py_ssize_t i = PyLong_AsSsize_t(arg);
+  g_collecting->HandleMalloc(reinterpret_cast<void *>(i * 8), 8, false);
+  Py_RETURN_NONE;
+}
+
+PyMethodDef kCollectTestAllocDef = {"alloc", CollectTestAlloc, METH_O,
+                                    nullptr};
+
+// Allocates pointers 1 to n, each from a leaf function of its own, called
+// from run.
+void AllocFromLeaves(HeapProfiler *p, int n) {
+  // Code run from a "<string>" file would not have a stack.
+  PyObjectRef code(Py_CompileString(
+      "def run(alloc, n):\n"
+      "    src = ''.join(\n"
+      "        'def leaf_%d(i):\\n    alloc(i)\\n' % k for k in range(n))\n"
+      "    leaves = {'alloc': alloc}\n"
+      "    exec(compile(src, 'collect_test_leaves.py', 'exec'), leaves)\n"
+      "    for k in range(n):\n"
+      "        leaves['leaf_%d' % k](k + 1)\n",
+      "collect_test.py", Py_file_input));
+  ASSERT_NE(code, nullptr);
+  PyObjectRef globals(PyDict_New());
+  PyDict_SetItemString(globals.get(), "__builtins__", PyEval_GetBuiltins());
+  PyObjectRef result(
+      PyEval_EvalCode(code.get(), globals.get(), globals.get()));
+  ASSERT_NE(result, nullptr);
+  PyObjectRef alloc(PyCFunction_New(&kCollectTestAllocDef, nullptr));
+  g_collecting = p;
+  result.reset(PyObject_CallFunction(
+      PyDict_GetItemString(globals.get(), "run"), "Oi", alloc.get(), n));
+  g_collecting = nullptr;
+  ASSERT_NE(result, nullptr);
+}
+
+}  // namespace
+
+TEST(HeapProfiler, CollectTraces) {
+  Sampler::SetSamplePeriod(0);
+  HeapProfiler p;
+  g_collect_callbacks = 0;
+  p.SetCollectTracesCallback([] { g_collect_callbacks++; }, 8);
+  const int n = 32;
+  AllocFromLeaves(&p, n);
+  // Each leaf adds a frame below run.
+  EXPECT_EQ(p.NumTraces(), n + 1);
+  EXPECT_EQ(g_collect_callbacks, n + 1 - 7);
+
+  // A moved pointer keeps its trace.
+  p.HandleRealloc(reinterpret_cast<void *>(8), reinterpret_cast<void *>(4),
+                  8, false);
+  for (int i = 2; i <= n; i++) {
+    p.HandleFree(reinterpret_cast<void *>(i * 8));
+  }
+  {
+    HeapProfiler::ScopedTracePin pin(&p);
+    EXPECT_FALSE(p.CollectTraces());
+  }
+  EXPECT_TRUE(p.CollectTraces());
+  EXPECT_EQ(p.NumTraces(), 2);
+  auto stacks = p.GetStackTotals();
+  ASSERT_EQ(stacks.size(), 1);
+  EXPECT_EQ(stacks[0].count, 1);
+  auto trace = p.GetStackTrace(stacks[0].trace_handle);
+  ASSERT_EQ(trace.size(), 2);
+  EXPECT_STREQ(PyUnicode_AsUTF8(trace[0].name), "leaf_0");
+  EXPECT_STREQ(PyUnicode_AsUTF8(trace[1].name), "run");
+
+  // The stack that is left is reused, and the next collection waits for
+  // the minimum number of traces again.
+  g_collect_callbacks = 0;
+  AllocFromLeaves(&p, 4);
+  EXPECT_EQ(p.NumTraces(), 2 + 3);
+  EXPECT_EQ(g_collect_callbacks, 0);
+  p.Reset();
+}
+
+TEST(HeapProfiler, CollectTracesAtPeak) {
+  Sampler::SetSamplePeriod(0);
+  HeapProfiler p;
+  p.EnablePeakCheckpoints(0);
+  const int n = 16;
+  AllocFromLeaves(&p, n);
+  for (int i = 1; i <= n; i++) {
+    p.HandleFree(reinterpret_cast<void *>(i * 8));
+  }
+
+  // The stacks of the peak are kept while it is.
+  EXPECT_TRUE(p.CollectTraces());
+  EXPECT_EQ(p.NumTraces(), n + 1);
+  auto peak = p.GetPeakStackTotals();
+  ASSERT_EQ(peak.size(), n);
+  for (const HeapProfiler::StackTotals &stack : peak) {
+    EXPECT_EQ(p.GetStackTrace(stack.trace_handle).size(), 2);
+  }
+  p.Reset();
+}
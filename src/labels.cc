@@ -0,0 +1,115 @@
+// Copyright 2019 Timothy Palpant
+
+#include "labels.h"
+
+#include "thread_context.h"
+
+namespace {
+
+#if PY_VERSION_HEX >= 0x030700F0
+// Holds the current label set as a Python int. Created on first use, and
+// never freed.
+PyObject *g_label_set_var = nullptr;
+
+// Copies the label set of the current context into the thread's context.
+//
+// This runs inside the allocation hooks, which may be in the middle of a
+// ContextVar set or reset (of this variable or any other), so it must not
+// use PyContextVar_Get: that caches the value it finds in the variable,
+// and a value cached halfway through a reset outlives the reset. Instead
+// it looks the variable up in the Context mapping, which neither caches
+// nor allocates. A context that is being modified still holds its old
+// variables.
+LabelSetId RefreshLabelSet(ThreadContext *context, PyThreadState *ts) {
+  context->label_context_ver = ts->context_ver;
+  context->label_set = 0;
+  PyObject *ctx = ts->context;
+  if (ctx == nullptr || g_label_set_var == nullptr) {
+    // The context is created lazily, without a new context_ver.
+    context->label_context_ver = UINT64_MAX;
+  } else if (PySequence_Contains(ctx, g_label_set_var) == 1) {
+    PyObject *py_id = PyObject_GetItem(ctx, g_label_set_var);
+    if (py_id != nullptr) {
+      // Only SetLabelSet stores values, so this is always a valid id.
+      context->label_set = static_cast<LabelSetId>(PyLong_AsLong(py_id));
+      Py_DECREF(py_id);
+    }
+  }
+  return context->label_set;
+}
+#endif
+
+}  // namespace
+
+#if PY_VERSION_HEX >= 0x030700F0
+
+PyObject *SetLabelSet(LabelSetId id) {
+  if (g_label_set_var == nullptr) {
+    g_label_set_var = PyContextVar_New("mprofile.labels", nullptr);
+    if (g_label_set_var == nullptr) {
+      return nullptr;
+    }
+  }
+
+  PyObject *py_id = PyLong_FromLong(id);
+  if (py_id == nullptr) {
+    return nullptr;
+  }
+  PyObject *token = PyContextVar_Set(g_label_set_var, py_id);
+  Py_DECREF(py_id);
+  if (token != nullptr) {
+    RefreshLabelSet(&CurrentThreadContext(), PyThreadState_Get());
+  }
+  return token;
+}
+
+bool ResetLabelSet(PyObject *token) {
+  if (g_label_set_var == nullptr) {
+    PyErr_SetString(PyExc_ValueError, "invalid label token");
+    return false;
+  }
+  const bool ok = PyContextVar_Reset(g_label_set_var, token) == 0;
+  RefreshLabelSet(&CurrentThreadContext(), PyThreadState_Get());
+  return ok;
+}
+
+LabelSetId CurrentLabelSet() {
+  ThreadContext &context = CurrentThreadContext();
+  PyThreadState *ts = PyGILState_GetThisThreadState();
+  if (ts == nullptr || g_label_set_var == nullptr) {
+    return 0;
+  }
+  if (LIKELY(ts->context_ver == context.label_context_ver)) {
+    return context.label_set;
+  }
+  return RefreshLabelSet(&context, ts);
+}
+
+#else
+
+// contextvars is not available, so labels are per thread.
+
+PyObject *SetLabelSet(LabelSetId id) {
+  LabelSetId &label_set = CurrentThreadContext().label_set;
+  PyObject *token = PyLong_FromLong(label_set);
+  if (token != nullptr) {
+    label_set = id;
+  }
+  return token;
+}
+
+bool ResetLabelSet(PyObject *token) {
+  const long id = PyLong_AsLong(token);
+  if (id < 0 || id >= kMaxLabelSets) {
+    if (!PyErr_Occurred()) {
+      PyErr_SetString(PyExc_ValueError, "invalid label token");
+    }
+    return false;
+  }
+  CurrentThreadContext().label_set = static_cast<LabelSetId>(id);
+  return true;
+}
+
+LabelSetId CurrentLabelSet() { return CurrentThreadContext().label_set; }
+
+#endif
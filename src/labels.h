@@ -0,0 +1,32 @@
+// Copyright 2019 Timothy Palpant
+
+#ifndef MPROFILE_SRC_LABELS_H_
+#define MPROFILE_SRC_LABELS_H_
+
+#include <Python.h>
+
+#include <cstdint>
+
+// The id of a set of key/value labels, like pprof labels. The sets are
+// interned by mprofile.labels(), and only their ids are recorded with the
+// sampled pointers. The empty set is 0.
+typedef uint16_t LabelSetId;
+const int kMaxLabelSets = 1 << 16;
+
+// Make id the current label set of the calling thread, or of the current
+// contextvars context (and so asyncio task) since Python 3.7. Returns a
+// token to pass to ResetLabelSet, or nullptr with a Python exception set.
+// The GIL must be held.
+PyObject *SetLabelSet(LabelSetId id);
+
+// Restore the label set that was current before the SetLabelSet call that
+// returned token. Returns false with a Python exception set on error.
+bool ResetLabelSet(PyObject *token);
+
+// The current label set. This is read from a copy in the ThreadContext,
+// which is only refreshed when the thread has switched contexts since,
+// without calling into the contextvars API, so that it is safe to call
+// from the allocation hooks. The GIL must be held.
+LabelSetId CurrentLabelSet();
+
+#endif  // MPROFILE_SRC_LABELS_H_
@@ -0,0 +1,214 @@
+// Copyright 2019 Timothy Palpant
+
+#ifndef MPROFILE_SRC_LIVE_SET_H_
+#define MPROFILE_SRC_LIVE_SET_H_
+
+#include <stdlib.h>
+
+#include <memory>
+#include <new>
+#include <type_traits>
+
+#include "arena.h"
+#include "third_party/google/tcmalloc/addressmap.h"
+#include "third_party/greg7mdp/parallel-hashmap/phmap.h"
+
+// FlatAddressMap is a map from addresses to values with the same interface
+// as AddressMap, built on an open-addressing (SSE2-probed) flat hash map.
+//
+// AddressMap allocates a 64KB block array for every 1MB of address space
+// that contains a key, which is wasteful when the keys are a sparse sample
+// of a large heap. FlatAddressMap stores each entry inline in a single
+// table, so its memory usage is proportional to the number of entries
+// regardless of how they are spread, and a lookup is usually a single
+// probe rather than a walk of the cluster and block lists.
+template <class Value, class Alloc = std::allocator<
+                           std::pair<const void *const, Value>>>
+class FlatAddressMap {
+ public:
+  typedef const void *Key;
+
+  explicit FlatAddressMap(const Alloc &alloc = Alloc()) : map_(alloc) {}
+  // Not copyable or assignable.
+  FlatAddressMap(const FlatAddressMap &) = delete;
+  FlatAddressMap &operator=(const FlatAddressMap &) = delete;
+
+  // If the map contains an entry for "key", return it. Else return nullptr.
+  const Value *Find(Key key) const {
+    auto it = map_.find(key);
+    return (it == map_.end()) ? nullptr : &it->second;
+  }
+
+  Value *FindMutable(Key key) {
+    auto it = map_.find(key);
+    return (it == map_.end()) ? nullptr : &it->second;
+  }
+
+  // Insert <key,value> into the map.  Any old value associated
+  // with key is forgotten.
+  void Insert(Key key, Value value) { map_.insert_or_assign(key, value); }
+
+  // Remove any entry for key in the map.  If an entry was found
+  // and removed, stores the associated value in "*removed_value"
+  // and returns true.  Else returns false.
+  bool FindAndRemove(Key key, Value *removed_value) {
+    auto it = map_.find(key);
+    if (it == map_.end()) {
+      return false;
+    }
+
+    *removed_value = it->second;
+    map_.erase(it);
+    return true;
+  }
+
+  // Iterate over the map calling 'callback' for all stored key-value pairs
+  // and passing 'arg' to it.
+  template <class Type>
+  void Iterate(void (*callback)(Key, Value *, Type), Type arg) const {
+    for (auto &entry : map_) {
+      callback(entry.first, const_cast<Value *>(&entry.second), arg);
+    }
+  }
+
+  // Free all memory allocated by this map and reset it to an empty state.
+  void Reset() {
+    Map empty(map_.get_allocator());
+    std::swap(map_, empty);
+  }
+
+  std::size_t size() const { return map_.size(); }
+
+  // The number of bytes allocated for the table.
+  std::size_t MemoryUsage() const {
+    if (map_.capacity() == 0) {
+      return 0;
+    }
+    // One control byte per slot, plus a cloned group for probing.
+    return map_.capacity() * (sizeof(typename Map::slot_type) + 1) + 16;
+  }
+
+ private:
+  typedef phmap::flat_hash_map<Key, Value, phmap::Hash<Key>,
+                               phmap::EqualTo<Key>, Alloc>
+      Map;
+  Map map_;
+};
+
+// The implementations available for the live set of sampled pointers.
+enum class LiveSetType {
+  // tcmalloc's AddressMap, a chained hash of address clusters. This is
+  // fastest when the sampled pointers are densely clustered.
+  kAddressMap,
+  // FlatAddressMap, which is more compact for sparse samples of large
+  // heaps.
+  kFlatHashMap,
+};
+
+// LiveSet is a map from addresses to values that is backed by one of the
+// implementations above, chosen when it is created. All of its memory,
+// including the map itself, is allocated from a private Arena. Since Value
+// must be trivially destructible, the map never needs to be destroyed and
+// can be discarded by unmapping the arena.
+template <class Value>
+class LiveSet {
+  static_assert(std::is_trivially_destructible<Value>::value,
+                "LiveSet values must be trivially destructible");
+
+ public:
+  typedef const void *Key;
+
+  explicit LiveSet(LiveSetType type, bool huge_pages = false)
+      : type_(type), arena_(huge_pages) {
+    Init();
+  }
+  // Not copyable or assignable.
+  LiveSet(const LiveSet &) = delete;
+  LiveSet &operator=(const LiveSet &) = delete;
+
+  LiveSetType type() const { return type_; }
+
+  const Value *Find(Key key) const {
+    if (type_ == LiveSetType::kAddressMap) {
+      return address_map_->Find(key);
+    }
+    return flat_map_->Find(key);
+  }
+
+  Value *FindMutable(Key key) {
+    if (type_ == LiveSetType::kAddressMap) {
+      return address_map_->FindMutable(key);
+    }
+    return flat_map_->FindMutable(key);
+  }
+
+  void Insert(Key key, Value value) {
+    if (type_ == LiveSetType::kAddressMap) {
+      address_map_->Insert(key, value);
+    } else {
+      flat_map_->Insert(key, value);
+    }
+  }
+
+  bool FindAndRemove(Key key, Value *removed_value) {
+    if (type_ == LiveSetType::kAddressMap) {
+      return address_map_->FindAndRemove(key, removed_value);
+    }
+    return flat_map_->FindAndRemove(key, removed_value);
+  }
+
+  template <class Type>
+  void Iterate(void (*callback)(Key, Value *, Type), Type arg) const {
+    if (type_ == LiveSetType::kAddressMap) {
+      address_map_->template Iterate<Type>(callback, arg);
+    } else {
+      flat_map_->template Iterate<Type>(callback, arg);
+    }
+  }
+
+  // Remove all entries and return their memory to the OS. This only
+  // unmaps the arena, and does not touch the entries.
+  void Reset() {
+    arena_.Reset();
+    Init();
+  }
+
+  // The number of bytes allocated for the entries.
+  std::size_t MemoryUsage() { return arena_.MemoryUsage(); }
+
+ private:
+  typedef FlatAddressMap<
+      Value, ArenaAllocator<std::pair<const void *const, Value>>>
+      FlatMap;
+
+  static void *ArenaMalloc(void *arena, std::size_t size) {
+    return static_cast<Arena *>(arena)->Malloc(size);
+  }
+
+  static void ArenaFree(void *arena, void *ptr) {
+    static_cast<Arena *>(arena)->Free(ptr);
+  }
+
+  void Init() {
+    address_map_ = nullptr;
+    flat_map_ = nullptr;
+    if (type_ == LiveSetType::kAddressMap) {
+      void *p = arena_.Allocate(sizeof(AddressMap<Value>));
+      address_map_ =
+          new (p) AddressMap<Value>(&ArenaMalloc, &ArenaFree, &arena_);
+    } else {
+      void *p = arena_.Allocate(sizeof(FlatMap));
+      flat_map_ = new (p) FlatMap(
+          ArenaAllocator<std::pair<const void *const, Value>>(&arena_));
+    }
+  }
+
+  const LiveSetType type_;
+  Arena arena_;
+  // Exactly one of these is set, according to type_. Both are allocated
+  // from arena_.
+  AddressMap<Value> *address_map_;
+  FlatMap *flat_map_;
+};
+
+#endif  // MPROFILE_SRC_LIVE_SET_H_
@@ -0,0 +1,207 @@
+// Copyright 2019 Timothy Palpant
+//
+// Compares the live set implementations on address distributions like
+// those of a sampled Python heap.
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "live_set.h"
+
+namespace {
+
+// Same size as HeapProfiler::LivePointer.
+struct Value {
+  void *trace_handle;
+  std::size_t size;
+  uint32_t epoch;
+};
+
+// Bytes currently allocated by the maps under test.
+std::size_t g_allocated_bytes = 0;
+
+// AddressMap only passes the pointer to its deallocator, so we store the
+// size of each allocation in front of it.
+void *CountingMalloc(std::size_t size) {
+  std::size_t *p = static_cast<std::size_t *>(malloc(size + 16));
+  *p = size;
+  g_allocated_bytes += size;
+  return reinterpret_cast<char *>(p) + 16;
+}
+
+void CountingFree(void *ptr) {
+  std::size_t *p =
+      reinterpret_cast<std::size_t *>(static_cast<char *>(ptr) - 16);
+  g_allocated_bytes -= *p;
+  free(p);
+}
+
+template <class T>
+struct CountingAllocator {
+  typedef T value_type;
+
+  CountingAllocator() = default;
+  template <class U>
+  CountingAllocator(const CountingAllocator<U> &) {}
+
+  T *allocate(std::size_t n) {
+    return static_cast<T *>(CountingMalloc(n * sizeof(T)));
+  }
+  void deallocate(T *p, std::size_t n) { CountingFree(p); }
+
+  template <class U>
+  bool operator==(const CountingAllocator<U> &) const {
+    return true;
+  }
+  template <class U>
+  bool operator!=(const CountingAllocator<U> &) const {
+    return false;
+  }
+};
+
+typedef AddressMap<Value> TcmallocMap;
+typedef FlatAddressMap<
+    Value, CountingAllocator<std::pair<const void *const, Value>>>
+    FlatMap;
+
+template <class Map>
+Map *NewMap();
+
+template <>
+TcmallocMap *NewMap<TcmallocMap>() {
+  return new TcmallocMap(CountingMalloc, CountingFree);
+}
+
+template <>
+FlatMap *NewMap<FlatMap>() {
+  return new FlatMap();
+}
+
+// Consecutive small blocks in 256KB arenas, as pymalloc hands out when
+// every allocation is sampled.
+struct Dense {
+  static std::vector<const void *> Addresses(std::size_t n) {
+    std::vector<const void *> addrs;
+    const uintptr_t arena_size = 256 * 1024;
+    uintptr_t arena = 0x7f0000000000;
+    uintptr_t offset = 0;
+    std::mt19937_64 rng(1);
+    for (std::size_t i = 0; i < n; i++) {
+      offset += 16 * (1 + rng() % 4);
+      if (offset >= arena_size) {
+        arena += 16 * arena_size;
+        offset = 0;
+      }
+      addrs.push_back(reinterpret_cast<const void *>(arena + offset));
+    }
+    return addrs;
+  }
+};
+
+// Blocks spread uniformly over a 1TB address range, as left by sampling
+// 1 in every few thousand allocations of a large heap.
+struct Sparse {
+  static std::vector<const void *> Addresses(std::size_t n) {
+    std::vector<const void *> addrs;
+    std::mt19937_64 rng(1);
+    for (std::size_t i = 0; i < n; i++) {
+      uintptr_t offset = rng() % (uintptr_t(1) << 40);
+      uintptr_t addr = 0x7f0000000000 + (offset & ~uintptr_t(15));
+      addrs.push_back(reinterpret_cast<const void *>(addr));
+    }
+    return addrs;
+  }
+};
+
+template <class Map>
+void Fill(Map *map, const std::vector<const void *> &addrs) {
+  for (const void *addr : addrs) {
+    map->Insert(addr, {nullptr, 64});
+  }
+}
+
+// Addresses are looked up in a different order than they were inserted,
+// as objects are rarely freed in the order they were allocated.
+std::vector<const void *> Shuffled(std::vector<const void *> addrs) {
+  std::shuffle(addrs.begin(), addrs.end(), std::mt19937_64(2));
+  return addrs;
+}
+
+template <class Map, class Dist>
+void BM_Insert(benchmark::State &state) {
+  const auto addrs = Dist::Addresses(state.range(0));
+  std::unique_ptr<Map> map(NewMap<Map>());
+  for (auto _ : state) {
+    Fill(map.get(), addrs);
+    state.PauseTiming();
+    state.counters["bytes_per_entry"] =
+        double(g_allocated_bytes) / addrs.size();
+    map->Reset();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * addrs.size());
+}
+
+template <class Map, class Dist>
+void BM_FindHit(benchmark::State &state) {
+  const auto addrs = Dist::Addresses(state.range(0));
+  const auto lookups = Shuffled(addrs);
+  std::unique_ptr<Map> map(NewMap<Map>());
+  Fill(map.get(), addrs);
+  std::size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(map->Find(lookups[i++ % lookups.size()]));
+  }
+}
+
+template <class Map, class Dist>
+void BM_FindMiss(benchmark::State &state) {
+  const auto addrs = Dist::Addresses(state.range(0));
+  // Unsampled pointers are interleaved with the sampled ones.
+  auto lookups = Shuffled(addrs);
+  for (auto &addr : lookups) {
+    addr = static_cast<const char *>(addr) + 8;
+  }
+  std::unique_ptr<Map> map(NewMap<Map>());
+  Fill(map.get(), addrs);
+  std::size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(map->Find(lookups[i++ % lookups.size()]));
+  }
+}
+
+// Each iteration removes one entry and inserts it back, so that the map
+// stays the same size.
+template <class Map, class Dist>
+void BM_RemoveInsert(benchmark::State &state) {
+  const auto addrs = Dist::Addresses(state.range(0));
+  const auto lookups = Shuffled(addrs);
+  std::unique_ptr<Map> map(NewMap<Map>());
+  Fill(map.get(), addrs);
+  std::size_t i = 0;
+  for (auto _ : state) {
+    const void *addr = lookups[i++ % lookups.size()];
+    Value removed = {nullptr, 0};
+    map->FindAndRemove(addr, &removed);
+    map->Insert(addr, removed);
+  }
+}
+
+}  // namespace
+
+// AddressMap needs 64KB for every sparse address, so it is only run with
+// up to 4096 of them (256MB).
+#define LIVE_SET_BENCHMARK(bm)                                          \
+  BENCHMARK_TEMPLATE(bm, TcmallocMap, Dense)->Range(1 << 10, 1 << 20);  \
+  BENCHMARK_TEMPLATE(bm, FlatMap, Dense)->Range(1 << 10, 1 << 20);      \
+  BENCHMARK_TEMPLATE(bm, TcmallocMap, Sparse)->Range(1 << 10, 1 << 12); \
+  BENCHMARK_TEMPLATE(bm, FlatMap, Sparse)->Range(1 << 10, 1 << 20)
+
+LIVE_SET_BENCHMARK(BM_Insert);
+LIVE_SET_BENCHMARK(BM_FindHit);
+LIVE_SET_BENCHMARK(BM_FindMiss);
+LIVE_SET_BENCHMARK(BM_RemoveInsert);
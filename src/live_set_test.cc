@@ -0,0 +1,101 @@
+// Copyright 2019 Timothy Palpant
+//
+#include "live_set.h"
+
+#include <map>
+#include <random>
+
+#include "gtest/gtest.h"
+
+class LiveSetTest : public ::testing::TestWithParam<LiveSetType> {};
+
+void CountEntries(const void *ptr, int *value, int *count) { (*count)++; }
+
+TEST_P(LiveSetTest, InsertFindRemove) {
+  LiveSet<int> live_set(GetParam());
+  EXPECT_EQ(live_set.type(), GetParam());
+
+  const void *p1 = reinterpret_cast<const void *>(0x1000);
+  const void *p2 = reinterpret_cast<const void *>(0x1010);
+  EXPECT_EQ(live_set.Find(p1), nullptr);
+
+  live_set.Insert(p1, 1);
+  live_set.Insert(p2, 2);
+  ASSERT_NE(live_set.Find(p1), nullptr);
+  EXPECT_EQ(*live_set.Find(p1), 1);
+  EXPECT_EQ(*live_set.Find(p2), 2);
+
+  // Inserting an existing key replaces its value.
+  live_set.Insert(p1, 3);
+  EXPECT_EQ(*live_set.Find(p1), 3);
+  *live_set.FindMutable(p2) = 4;
+  EXPECT_EQ(*live_set.Find(p2), 4);
+
+  int removed = 0;
+  EXPECT_TRUE(live_set.FindAndRemove(p1, &removed));
+  EXPECT_EQ(removed, 3);
+  EXPECT_FALSE(live_set.FindAndRemove(p1, &removed));
+  EXPECT_EQ(live_set.Find(p1), nullptr);
+  EXPECT_EQ(*live_set.Find(p2), 4);
+
+  live_set.Reset();
+  EXPECT_EQ(live_set.Find(p2), nullptr);
+  int count = 0;
+  live_set.Iterate(&CountEntries, &count);
+  EXPECT_EQ(count, 0);
+}
+
+TEST_P(LiveSetTest, MatchesStdMap) {
+  LiveSet<int> live_set(GetParam());
+  std::map<const void *, int> expected;
+
+  // Mix nearby addresses with ones spread over a large address space.
+  std::mt19937_64 rng(42);
+  for (int i = 0; i < 100000; i++) {
+    uintptr_t addr = (rng() % 2 == 0) ? (0x10000 + 16 * (rng() % 4096))
+                                      : (rng() & 0x7ffffffffff0);
+    const void *ptr = reinterpret_cast<const void *>(addr);
+    if (rng() % 3 == 0) {
+      int removed = -1;
+      bool found = live_set.FindAndRemove(ptr, &removed);
+      auto it = expected.find(ptr);
+      ASSERT_EQ(found, it != expected.end());
+      if (found) {
+        EXPECT_EQ(removed, it->second);
+        expected.erase(it);
+      }
+    } else {
+      live_set.Insert(ptr, i);
+      expected[ptr] = i;
+    }
+  }
+
+  int count = 0;
+  live_set.Iterate(&CountEntries, &count);
+  EXPECT_EQ(count, expected.size());
+  for (const auto &entry : expected) {
+    const int *value = live_set.Find(entry.first);
+    ASSERT_NE(value, nullptr);
+    EXPECT_EQ(*value, entry.second);
+  }
+}
+
+INSTANTIATE_TEST_CASE_P(LiveSetTypes, LiveSetTest,
+                        ::testing::Values(LiveSetType::kAddressMap,
+                                          LiveSetType::kFlatHashMap));
+
+TEST(FlatAddressMap, MemoryUsage) {
+  FlatAddressMap<int> map;
+  EXPECT_EQ(map.MemoryUsage(), 0);
+
+  for (uintptr_t i = 1; i <= 1000; i++) {
+    map.Insert(reinterpret_cast<const void *>(i << 20), 0);
+  }
+  EXPECT_EQ(map.size(), 1000);
+  // AddressMap would need a 64KB block array for each of these clusters.
+  EXPECT_LT(map.MemoryUsage(), 64 * 1024);
+
+  map.Reset();
+  EXPECT_EQ(map.size(), 0);
+  EXPECT_EQ(map.MemoryUsage(), 0);
+}
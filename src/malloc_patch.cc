@@ -4,13 +4,28 @@
 #include "malloc_patch.h"
 
 #include <Python.h>
+#include <pthread.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <mutex>
+
+#include "alloc_log.h"
+#include "sampling.h"
 #include "scoped_object.h"
+#include "spinlock.h"
 
 namespace {
 
 // Our global profiler state.
 static std::unique_ptr<HeapProfiler> g_profiler;
+static ForkPolicy g_fork_policy = ForkPolicy::kInherit;
+// The state inherited from the parent process with ForkPolicy::kFreeze.
+// This is not attached to the malloc hooks, so it is never modified.
+static std::unique_ptr<HeapProfiler> g_baseline;
+// Whether CollectTracesPending has been scheduled and not yet run.
+// Protected by the GIL.
+static bool g_collect_traces_pending = false;
 
 // The underlying allocators that we're going to wrap. This gets filled in with
 // meaningful content during AttachProfiler.
@@ -29,65 +44,70 @@ struct {
 // ReentrantScope is a simple RAII-style scope guard to do this.
 class ReentrantScope {
  public:
-  ReentrantScope() : is_outer_scope_(!is_active_) {
-    if (is_outer_scope_) {
-      is_active_ = true;
-    }
+  explicit ReentrantScope(ThreadContext *context)
+      : context_(context), is_outer_scope_(!context->in_hook) {
+    context->in_hook = true;
   }
 
   ~ReentrantScope() {
     if (is_outer_scope_) {
-      is_active_ = false;
+      context_->in_hook = false;
     }
   }
 
   bool is_outer_scope() { return is_outer_scope_; }
 
  private:
+  ThreadContext *const context_;
   const bool is_outer_scope_;
-  static thread_local bool is_active_;
 };
 
-thread_local bool ReentrantScope::is_active_ = false;
-
 // The wrapped methods with which we will replace the standard malloc, etc. In
-// each case, ctx will be a pointer to the appropriate base allocator.
+// each case, ctx will be a pointer to the appropriate base allocator. They
+// are instantiated for each variant of the profiler, see ProfilerVariant.
 
+template <ProfilerVariant V>
 void *WrappedMalloc(void *ctx, size_t size) {
-  ReentrantScope scope;
+  ThreadContext &context = CurrentThreadContext();
+  ReentrantScope scope(&context);
   PyMemAllocatorEx *alloc = reinterpret_cast<PyMemAllocatorEx *>(ctx);
   void *ptr = alloc->malloc(alloc->ctx, size);
   if (scope.is_outer_scope()) {
     bool is_raw = alloc == &g_base_allocators.raw;
-    g_profiler->HandleMalloc(ptr, size, is_raw);
+    g_profiler->HandleMalloc<V>(ptr, size, is_raw, &context);
   }
   return ptr;
 }
 
+template <ProfilerVariant V>
 void *WrappedCalloc(void *ctx, size_t nelem, size_t elsize) {
-  ReentrantScope scope;
+  ThreadContext &context = CurrentThreadContext();
+  ReentrantScope scope(&context);
   PyMemAllocatorEx *alloc = reinterpret_cast<PyMemAllocatorEx *>(ctx);
   void *ptr = alloc->calloc(alloc->ctx, nelem, elsize);
   if (scope.is_outer_scope()) {
     bool is_raw = alloc == &g_base_allocators.raw;
-    g_profiler->HandleMalloc(ptr, nelem * elsize, is_raw);
+    g_profiler->HandleMalloc<V>(ptr, nelem * elsize, is_raw, &context);
   }
   return ptr;
 }
 
+template <ProfilerVariant V>
 void *WrappedRealloc(void *ctx, void *ptr, size_t new_size) {
-  ReentrantScope scope;
+  ThreadContext &context = CurrentThreadContext();
+  ReentrantScope scope(&context);
   PyMemAllocatorEx *alloc = reinterpret_cast<PyMemAllocatorEx *>(ctx);
   void *ptr2 = alloc->realloc(alloc->ctx, ptr, new_size);
   if (scope.is_outer_scope()) {
     bool is_raw = alloc == &g_base_allocators.raw;
-    g_profiler->HandleRealloc(ptr, ptr2, new_size, is_raw);
+    g_profiler->HandleRealloc<V>(ptr, ptr2, new_size, is_raw, &context);
   }
   return ptr2;
 }
 
 void WrappedFree(void *ctx, void *ptr) {
-  ReentrantScope scope;
+  ThreadContext &context = CurrentThreadContext();
+  ReentrantScope scope(&context);
   PyMemAllocatorEx *alloc = reinterpret_cast<PyMemAllocatorEx *>(ctx);
   // Remove from traced set before delegating to actual free to prevent possible
   // race if memory address is reused.
@@ -97,6 +117,257 @@ void WrappedFree(void *ctx, void *ptr) {
   alloc->free(alloc->ctx, ptr);
 }
 
+// The wrapped methods that are installed while the profiler is paused. New
+// allocations go straight to the base allocator, and only reallocs and
+// frees are checked against the sampled pointers.
+
+void *PausedMalloc(void *ctx, size_t size) {
+  PyMemAllocatorEx *alloc = reinterpret_cast<PyMemAllocatorEx *>(ctx);
+  return alloc->malloc(alloc->ctx, size);
+}
+
+void *PausedCalloc(void *ctx, size_t nelem, size_t elsize) {
+  PyMemAllocatorEx *alloc = reinterpret_cast<PyMemAllocatorEx *>(ctx);
+  return alloc->calloc(alloc->ctx, nelem, elsize);
+}
+
+void *PausedRealloc(void *ctx, void *ptr, size_t new_size) {
+  ThreadContext &context = CurrentThreadContext();
+  ReentrantScope scope(&context);
+  PyMemAllocatorEx *alloc = reinterpret_cast<PyMemAllocatorEx *>(ctx);
+  void *ptr2 = alloc->realloc(alloc->ctx, ptr, new_size);
+  if (scope.is_outer_scope()) {
+    g_profiler->HandleReallocPaused(ptr, ptr2, new_size);
+  }
+  return ptr2;
+}
+
+void PausedFree(void *ctx, void *ptr) {
+  ThreadContext &context = CurrentThreadContext();
+  ReentrantScope scope(&context);
+  PyMemAllocatorEx *alloc = reinterpret_cast<PyMemAllocatorEx *>(ctx);
+  if (scope.is_outer_scope()) {
+    g_profiler->HandleFreePaused(ptr);
+  }
+  alloc->free(alloc->ctx, ptr);
+}
+
+// Records the allocation stream of the process in an AllocLog, see
+// StartAllocationLog.
+class AllocationRecorder {
+ public:
+  AllocationRecorder() : id_(next_id_.fetch_add(1) + 1), num_threads_(0) {}
+  // Not copyable or assignable.
+  AllocationRecorder(const AllocationRecorder &) = delete;
+  AllocationRecorder &operator=(const AllocationRecorder &) = delete;
+
+  bool Open(const std::string &path, std::string *error) {
+    return writer_.Open(path, error);
+  }
+
+  bool Close(std::string *error) {
+    std::lock_guard<SpinLock> lock(mu_);
+    return writer_.Close(error);
+  }
+
+  void Record(AllocOp op, const void *ptr, const void *old_ptr,
+              std::size_t size) {
+    // Stacks can only be captured with the GIL held.
+    const bool has_stack = op != AllocOp::kFree && PyGILState_Check();
+    std::lock_guard<SpinLock> lock(mu_);
+    const AllocRecord record = {op,
+                                ThreadId(),
+                                reinterpret_cast<uintptr_t>(ptr),
+                                reinterpret_cast<uintptr_t>(old_ptr),
+                                size,
+                                has_stack ? CurrentStackLocked() : kNoStack};
+    writer_.Add(record);
+  }
+
+ private:
+  struct FrameKey {
+    PyObject *filename;
+    PyObject *name;
+    int firstlineno;
+    int lineno;
+
+    bool operator==(const FrameKey &other) const {
+      return filename == other.filename && name == other.name &&
+             firstlineno == other.firstlineno && lineno == other.lineno;
+    }
+  };
+
+  struct FrameKeyHash {
+    std::size_t operator()(const FrameKey &k) const {
+      return phmap::HashState().combine(0, k.filename, k.name, k.firstlineno,
+                                        k.lineno);
+    }
+  };
+
+  uint32_t ThreadId() {
+    // The id of the thread in the recorder with id recorder_id.
+    static thread_local struct {
+      uint64_t recorder_id;
+      uint32_t id;
+    } thread = {0, 0};
+    if (thread.recorder_id != id_) {
+      thread.recorder_id = id_;
+      thread.id = num_threads_++;
+    }
+    return thread.id;
+  }
+
+  // Interns the current stack, writing it to the log if it is new. The GIL
+  // must be held.
+  uint32_t CurrentStackLocked() {
+    CallTrace trace;
+    GetCurrentCallTrace(&trace, kMaxFramesToCapture);
+    const CallTraceSet::TraceHandle handle =
+        trace.size() > 0 ? traces_.Intern(trace) : nullptr;
+    for (int i = 0; i < trace.size(); i++) {
+      Py_XDECREF(trace.frames[i].filename);
+      Py_XDECREF(trace.frames[i].name);
+    }
+    if (handle == nullptr) {
+      return kNoStack;
+    }
+
+    auto it = stacks_.find(handle);
+    if (it != stacks_.end()) {
+      return it->second;
+    }
+    // The interned frames share their strings, so they can be compared by
+    // address.
+    const std::vector<FuncLoc> locs = traces_.GetTrace(handle);
+    std::vector<uint32_t> frames;
+    frames.reserve(locs.size());
+    for (auto loc = locs.rbegin(); loc != locs.rend(); ++loc) {
+      const FrameKey key = {loc->filename, loc->name, loc->firstlineno,
+                            loc->lineno};
+      frames.push_back(frames_.emplace(key, frames_.size()).first->second);
+    }
+    writer_.AddStack(frames);
+    const uint32_t id = stacks_.size() + 1;
+    stacks_.emplace(handle, id);
+    return id;
+  }
+
+  static std::atomic<uint64_t> next_id_;
+  const uint64_t id_;
+
+  SpinLock mu_;
+  AllocLogWriter writer_;
+  uint32_t num_threads_;
+  // The stacks and frames recorded so far, by the ids they were given.
+  CallTraceSet traces_;
+  phmap::flat_hash_map<CallTraceSet::TraceHandle, uint32_t> stacks_;
+  phmap::flat_hash_map<FrameKey, uint32_t, FrameKeyHash> frames_;
+};
+
+std::atomic<uint64_t> AllocationRecorder::next_id_(0);
+
+std::unique_ptr<AllocationRecorder> g_recorder;
+
+// The methods that are installed while an allocation log is recorded. Like
+// the wrapped methods, they only record the outermost call.
+
+void *RecordingMalloc(void *ctx, size_t size) {
+  ThreadContext &context = CurrentThreadContext();
+  ReentrantScope scope(&context);
+  PyMemAllocatorEx *alloc = reinterpret_cast<PyMemAllocatorEx *>(ctx);
+  void *ptr = alloc->malloc(alloc->ctx, size);
+  if (scope.is_outer_scope() && ptr != nullptr) {
+    g_recorder->Record(AllocOp::kMalloc, ptr, nullptr, size);
+  }
+  return ptr;
+}
+
+void *RecordingCalloc(void *ctx, size_t nelem, size_t elsize) {
+  ThreadContext &context = CurrentThreadContext();
+  ReentrantScope scope(&context);
+  PyMemAllocatorEx *alloc = reinterpret_cast<PyMemAllocatorEx *>(ctx);
+  void *ptr = alloc->calloc(alloc->ctx, nelem, elsize);
+  if (scope.is_outer_scope() && ptr != nullptr) {
+    g_recorder->Record(AllocOp::kMalloc, ptr, nullptr, nelem * elsize);
+  }
+  return ptr;
+}
+
+void *RecordingRealloc(void *ctx, void *ptr, size_t new_size) {
+  ThreadContext &context = CurrentThreadContext();
+  ReentrantScope scope(&context);
+  PyMemAllocatorEx *alloc = reinterpret_cast<PyMemAllocatorEx *>(ctx);
+  void *ptr2 = alloc->realloc(alloc->ctx, ptr, new_size);
+  if (scope.is_outer_scope() && ptr2 != nullptr) {
+    g_recorder->Record(AllocOp::kRealloc, ptr2, ptr, new_size);
+  }
+  return ptr2;
+}
+
+void RecordingFree(void *ctx, void *ptr) {
+  ThreadContext &context = CurrentThreadContext();
+  ReentrantScope scope(&context);
+  PyMemAllocatorEx *alloc = reinterpret_cast<PyMemAllocatorEx *>(ctx);
+  // Recorded before the block can be reused, as in WrappedFree.
+  if (scope.is_outer_scope() && ptr != nullptr) {
+    g_recorder->Record(AllocOp::kFree, ptr, nullptr, 0);
+  }
+  alloc->free(alloc->ctx, ptr);
+}
+
+const PyMemAllocatorEx kRecordingAllocator = {
+    nullptr, RecordingMalloc, RecordingCalloc, RecordingRealloc,
+    RecordingFree};
+
+// Point the Python allocators at the given wrapped methods. The base
+// allocators must already have been saved in g_base_allocators.
+void InstallAllocators(PyMemAllocatorEx alloc) {
+  alloc.ctx = &g_base_allocators.raw;
+  PyMem_SetAllocator(PYMEM_DOMAIN_RAW, &alloc);
+
+  alloc.ctx = &g_base_allocators.mem;
+  PyMem_SetAllocator(PYMEM_DOMAIN_MEM, &alloc);
+
+  alloc.ctx = &g_base_allocators.obj;
+  PyMem_SetAllocator(PYMEM_DOMAIN_OBJ, &alloc);
+}
+
+void SaveBaseAllocators() {
+  PyMem_GetAllocator(PYMEM_DOMAIN_RAW, &g_base_allocators.raw);
+  PyMem_GetAllocator(PYMEM_DOMAIN_MEM, &g_base_allocators.mem);
+  PyMem_GetAllocator(PYMEM_DOMAIN_OBJ, &g_base_allocators.obj);
+}
+
+void RestoreBaseAllocators() {
+  PyMem_SetAllocator(PYMEM_DOMAIN_RAW, &g_base_allocators.raw);
+  PyMem_SetAllocator(PYMEM_DOMAIN_MEM, &g_base_allocators.mem);
+  PyMem_SetAllocator(PYMEM_DOMAIN_OBJ, &g_base_allocators.obj);
+}
+
+template <ProfilerVariant V>
+PyMemAllocatorEx WrappedAllocator() {
+  return {nullptr, WrappedMalloc<V>, WrappedCalloc<V>, WrappedRealloc<V>,
+          WrappedFree};
+}
+
+// The wrapped methods of the given variant.
+PyMemAllocatorEx WrappedAllocator(ProfilerVariant variant) {
+  switch (variant) {
+    case ProfilerVariant::kUnsampled:
+      return WrappedAllocator<ProfilerVariant::kUnsampled>();
+    case ProfilerVariant::kUnsampledSingleFrame:
+      return WrappedAllocator<ProfilerVariant::kUnsampledSingleFrame>();
+    default:
+      return WrappedAllocator<ProfilerVariant::kGeneral>();
+  }
+}
+
+// The wrapped methods of the attached profiler's variant, which are
+// reinstalled by ResumeHeapProfiler.
+PyMemAllocatorEx g_wrapped_allocator;
+const PyMemAllocatorEx kPausedAllocator = {
+    nullptr, PausedMalloc, PausedCalloc, PausedRealloc, PausedFree};
+
 PyObjectRef NewPyTrace(const std::vector<FuncLoc> &trace) {
   // Build the key as a Python tuple of tuples of frames:
   // ((func_name, filename, start_line, line_num), ...).
@@ -125,7 +396,27 @@ PyObjectRef NewPyTrace(const std::vector<FuncLoc> &trace) {
   return py_frames;
 }
 
-PyObjectRef NewPyTraces(const std::vector<const void *> &snap) {
+// Like NewPyTrace, but an empty trace (for allocations made without a
+// Python thread state) is given a placeholder frame.
+PyObjectRef NewPyTraceOrUnknown(std::vector<FuncLoc> trace) {
+  PyObjectRef unknown_filename;
+  PyObjectRef unknown_name;
+  if (trace.size() == 0) {
+    unknown_filename.reset(PyUnicode_InternFromString("<unknown>"));
+    unknown_name.reset(
+        PyUnicode_InternFromString("[Unknown - No Python thread state]"));
+    trace.push_back({
+        .filename = unknown_filename.get(),
+        .name = unknown_name.get(),
+    });
+  }
+
+  return NewPyTrace(trace);
+}
+
+// The traces of snap must be pinned.
+PyObjectRef NewPyTraces(HeapProfiler *profiler,
+                        const std::vector<HeapProfiler::SnapshotEntry> &snap) {
   // Asserts that GIL is held in debug mode.
   assert(PyGILState_Check());
 
@@ -140,22 +431,12 @@ PyObjectRef NewPyTraces(const std::vector<const void *> &snap) {
     return nullptr;
   }
 
+  const uint64_t snapshot_sample_rate = SnapshotSampleRate();
   std::size_t i = 0;
-  for (const void *ptr : snap) {
+  for (const HeapProfiler::SnapshotEntry &entry : snap) {
     // Build the Trace value as a Python tuple (size, traceback).
-    auto trace = g_profiler->GetTrace(ptr);
-    PyObjectRef unknown_filename;
-    PyObjectRef unknown_name;
-    if (trace.size() == 0) {
-      unknown_filename.reset(PyUnicode_InternFromString("<unknown>"));
-      unknown_name.reset(PyUnicode_InternFromString("[Unknown - No Python thread state]"));
-      trace.push_back({
-          .filename = unknown_filename.get(),
-          .name = unknown_name.get(),
-      });
-    }
-
-    PyObjectRef py_frames(NewPyTrace(trace));
+    PyObjectRef py_frames(
+        NewPyTraceOrUnknown(profiler->GetStackTrace(entry.trace_handle)));
 
     // Dedupe traceback tuples to reduce memory usage.
     PyObject *py_traceback =
@@ -173,8 +454,24 @@ PyObjectRef NewPyTraces(const std::vector<const void *> &snap) {
       return nullptr;
     }
 
-    std::size_t size = g_profiler->GetSize(ptr);
-    PyObject *py_trace = Py_BuildValue("(iO)", size, py_frames.get());
+    // Labeled pointers are (size, traceback, 1, label_set), and pointers
+    // sampled in a region or at a rate of their own (see sampling.h) are
+    // (size, traceback, 1, label_set, sample_rate).
+    const std::size_t size = entry.size;
+    const LabelSetId label_set = entry.label_set;
+    const RegionId region = entry.region;
+    const uint64_t sample_rate = PointerSampleRate(size, region);
+    PyObject *py_trace;
+    if (region != 0 || sample_rate != snapshot_sample_rate) {
+      py_trace = Py_BuildValue("(iOiIK)", size, py_frames.get(), 1,
+                               static_cast<unsigned int>(label_set),
+                               (unsigned long long)sample_rate);
+    } else if (label_set != 0) {
+      py_trace = Py_BuildValue("(iOiI)", size, py_frames.get(), 1,
+                               static_cast<unsigned int>(label_set));
+    } else {
+      py_trace = Py_BuildValue("(iO)", size, py_frames.get());
+    }
     if (py_trace == nullptr) {
       return nullptr;
     }
@@ -186,58 +483,386 @@ PyObjectRef NewPyTraces(const std::vector<const void *> &snap) {
   return py_traces;
 }
 
+// Collects the unreferenced traces of the profiler. This runs from the
+// eval loop of the main thread rather than from the allocation hook that
+// found too many traces, since releasing their strings can run arbitrary
+// code (and reenter the hooks).
+int CollectTracesPending(void *arg) {
+  g_collect_traces_pending = false;
+  if (g_profiler != nullptr) {
+    g_profiler->CollectTraces();
+  }
+  return 0;
+}
+
+// Called by the profiler from an allocation hook, with the GIL held. If
+// the queue of pending calls is full, the next sampled allocation will try
+// again.
+void ScheduleCollectTraces() {
+  if (!g_collect_traces_pending &&
+      Py_AddPendingCall(CollectTracesPending, nullptr) == 0) {
+    g_collect_traces_pending = true;
+  }
+}
+
+// Fork handlers, installed with pthread_atfork. These run for every fork,
+// including the ones in subprocess that are immediately followed by exec,
+// so the work they do in the child is kept to a minimum.
+
+void PrepareFork() {
+  if (g_profiler != nullptr) {
+    g_profiler->PrepareFork();
+  }
+  if (g_baseline != nullptr) {
+    g_baseline->PrepareFork();
+  }
+}
+
+void ParentAfterFork() {
+  if (g_baseline != nullptr) {
+    g_baseline->ParentAfterFork();
+  }
+  if (g_profiler != nullptr) {
+    g_profiler->ParentAfterFork();
+  }
+}
+
+void ChildAfterFork() {
+  if (g_recorder != nullptr) {
+    // The child's allocations would be interleaved with the parent's in
+    // the same file, so the child stops recording.
+    RestoreBaseAllocators();
+    // What is buffered belongs to the parent, and another thread may have
+    // held the recorder's lock, so it is leaked without touching it.
+    g_recorder.release();
+  }
+  if (g_baseline != nullptr) {
+    g_baseline->ChildAfterFork();
+  }
+  if (g_profiler == nullptr) {
+    return;
+  }
+
+  g_profiler->ChildAfterFork();
+  // Only the forking thread exists in the child. Reseed its sampler so
+  // that the parent and child sample different allocations.
+  Sampler &sampler = ThreadSampler();
+  sampler.Reseed((static_cast<uint64_t>(getpid()) << 32) ^
+                 reinterpret_cast<uintptr_t>(&sampler));
+
+  switch (g_fork_policy) {
+    case ForkPolicy::kInherit:
+      break;
+    case ForkPolicy::kReset:
+      g_profiler->ResetAfterFork();
+      break;
+    case ForkPolicy::kFreeze: {
+      if (g_baseline != nullptr) {
+        // Discard the grandparent's state without touching Python objects.
+        g_baseline->ResetAfterFork();
+      }
+      std::unique_ptr<HeapProfiler> profiler(new HeapProfiler(
+          g_profiler->GetMaxFrames(), g_profiler->GetLiveSetType(),
+          g_profiler->UsesHugePages()));
+      // The filter is shared with the baseline, which never captures.
+      profiler->SetFrameFilter(g_profiler->GetFrameFilter());
+      if (g_profiler->PeakCheckpointsEnabled()) {
+        profiler->EnablePeakCheckpoints(g_profiler->GetPeakHysteresis());
+      }
+      if (g_profiler->TimelineEnabled()) {
+        profiler->EnableTimeline(g_profiler->GetTimelineCapacity(),
+                                 g_profiler->GetTimelineInterval());
+      }
+      profiler->SetCollectTracesCallback(ScheduleCollectTraces);
+      // The paused allocators stay installed.
+      if (g_profiler->IsPaused()) {
+        profiler->Pause();
+      }
+      g_baseline = std::move(g_profiler);
+      g_profiler = std::move(profiler);
+      break;
+    }
+  }
+}
+
+void InstallForkHandlers() {
+  static bool fork_handlers_installed = false;
+  if (!fork_handlers_installed) {
+    pthread_atfork(PrepareFork, ParentAfterFork, ChildAfterFork);
+    fork_handlers_installed = true;
+  }
+}
+
 }  // namespace
 
 /* Our API */
 
-void AttachHeapProfiler(std::unique_ptr<HeapProfiler> profiler) {
+void AttachHeapProfiler(std::unique_ptr<HeapProfiler> profiler,
+                        ForkPolicy fork_policy) {
+  InstallForkHandlers();
   g_profiler = std::move(profiler);
-
-  PyMemAllocatorEx alloc;
-  alloc.malloc = WrappedMalloc;
-  alloc.calloc = WrappedCalloc;
-  alloc.realloc = WrappedRealloc;
-  alloc.free = WrappedFree;
+  g_profiler->SetCollectTracesCallback(ScheduleCollectTraces);
+  g_fork_policy = fork_policy;
 
   // Grab the base allocators
-  PyMem_GetAllocator(PYMEM_DOMAIN_RAW, &g_base_allocators.raw);
-  PyMem_GetAllocator(PYMEM_DOMAIN_MEM, &g_base_allocators.mem);
-  PyMem_GetAllocator(PYMEM_DOMAIN_OBJ, &g_base_allocators.obj);
+  SaveBaseAllocators();
 
   // And repoint allocation at our wrapped methods!
-  alloc.ctx = &g_base_allocators.raw;
-  PyMem_SetAllocator(PYMEM_DOMAIN_RAW, &alloc);
+  g_wrapped_allocator = WrappedAllocator(g_profiler->GetVariant());
+  InstallAllocators(g_wrapped_allocator);
+}
 
-  alloc.ctx = &g_base_allocators.mem;
-  PyMem_SetAllocator(PYMEM_DOMAIN_MEM, &alloc);
+bool PauseHeapProfiler() {
+  if (!IsHeapProfilerAttached()) {
+    PyErr_SetString(PyExc_RuntimeError, "The heap profiler is not started.");
+    return false;
+  }
 
-  alloc.ctx = &g_base_allocators.obj;
-  PyMem_SetAllocator(PYMEM_DOMAIN_OBJ, &alloc);
+  if (!g_profiler->IsPaused()) {
+    InstallAllocators(kPausedAllocator);
+    g_profiler->Pause();
+  }
+  return true;
+}
+
+bool ResumeHeapProfiler() {
+  if (!IsHeapProfilerAttached()) {
+    PyErr_SetString(PyExc_RuntimeError, "The heap profiler is not started.");
+    return false;
+  }
+
+  if (g_profiler->IsPaused()) {
+    g_profiler->Resume();
+    InstallAllocators(g_wrapped_allocator);
+  }
+  return true;
+}
+
+bool IsHeapProfilerPaused() {
+  return IsHeapProfilerAttached() && g_profiler->IsPaused();
 }
 
 void DetachHeapProfiler() {
   if (IsHeapProfilerAttached()) {
-    PyMem_SetAllocator(PYMEM_DOMAIN_RAW, &g_base_allocators.raw);
-    PyMem_SetAllocator(PYMEM_DOMAIN_MEM, &g_base_allocators.mem);
-    PyMem_SetAllocator(PYMEM_DOMAIN_OBJ, &g_base_allocators.obj);
-
+    RestoreBaseAllocators();
     g_profiler.reset(nullptr);
   }
+  g_baseline.reset(nullptr);
 }
 
 bool IsHeapProfilerAttached() { return g_profiler != nullptr; }
 
+bool StartAllocationLog(const std::string &path, std::string *error) {
+  std::unique_ptr<AllocationRecorder> recorder(new AllocationRecorder());
+  if (!recorder->Open(path, error)) {
+    return false;
+  }
+
+  InstallForkHandlers();
+  g_recorder = std::move(recorder);
+  SaveBaseAllocators();
+  InstallAllocators(kRecordingAllocator);
+  return true;
+}
+
+bool StopAllocationLog(std::string *error) {
+  if (!IsAllocationLogActive()) {
+    return true;
+  }
+
+  RestoreBaseAllocators();
+  const bool ok = g_recorder->Close(error);
+  g_recorder.reset(nullptr);
+  return ok;
+}
+
+bool IsAllocationLogActive() { return g_recorder != nullptr; }
+
 // Returns a new reference.
-PyObject *GetHeapProfile() {
+PyObject *GetHeapProfile(const std::vector<bool> *label_sets,
+                         Epoch min_epoch, Epoch max_epoch) {
   if (!IsHeapProfilerAttached()) {
     return nullptr;
   }
 
-  auto snap = g_profiler->GetSnapshot();
-  auto py_snap = NewPyTraces(snap);
+  HeapProfiler::ScopedTracePin pin(g_profiler.get());
+  auto snap = g_profiler->GetSnapshot(label_sets, min_epoch, max_epoch);
+  auto py_snap = NewPyTraces(g_profiler.get(), snap);
   return py_snap.release();
 }
 
+// Returns a new reference.
+PyObject *GetBaselineHeapProfile() {
+  if (g_baseline == nullptr) {
+    return nullptr;
+  }
+
+  HeapProfiler::ScopedTracePin pin(g_baseline.get());
+  auto snap = g_baseline->GetSnapshot();
+  auto py_snap = NewPyTraces(g_baseline.get(), snap);
+  return py_snap.release();
+}
+
+// Returns a new reference.
+PyObject *GetHeapLabelTotals() {
+  if (!IsHeapProfilerAttached()) {
+    return nullptr;
+  }
+
+  const std::vector<HeapProfiler::LabelTotals> totals =
+      g_profiler->GetLabelTotals();
+  PyObjectRef py_totals(PyList_New(totals.size()));
+  if (py_totals == nullptr) {
+    return nullptr;
+  }
+  for (std::size_t i = 0; i < totals.size(); i++) {
+    PyObject *py_entry = Py_BuildValue(
+        "(IKK)", static_cast<unsigned int>(totals[i].label_set),
+        (unsigned long long)totals[i].size,
+        (unsigned long long)totals[i].count);
+    if (py_entry == nullptr) {
+      return nullptr;
+    }
+    PyList_SET_ITEM(py_totals.get(), i, py_entry);
+  }
+
+  return py_totals.release();
+}
+
+// Returns a new reference.
+PyObject *GetTopHeapStacks(std::size_t n) {
+  if (!IsHeapProfilerAttached()) {
+    return nullptr;
+  }
+
+  HeapProfiler::ScopedTracePin pin(g_profiler.get());
+  // Rank the stacks by their estimated, rather than sampled, totals.
+  std::vector<HeapProfiler::StackTotals> stacks =
+      g_profiler->GetStackTotals();
+  const uint64_t sample_rate = SnapshotSampleRate();
+  for (HeapProfiler::StackTotals &stack : stacks) {
+    const ProfileSample scaled = ScaleSample(
+        {0, stack.size, stack.count, stack.scaled_size, stack.scaled_count},
+        sample_rate);
+    stack.size = scaled.size;
+    stack.count = scaled.count;
+  }
+
+  auto larger = [](const HeapProfiler::StackTotals &a,
+                   const HeapProfiler::StackTotals &b) {
+    return (a.size != b.size) ? a.size > b.size : a.count > b.count;
+  };
+  if (n < stacks.size()) {
+    std::partial_sort(stacks.begin(), stacks.begin() + n, stacks.end(),
+                      larger);
+    stacks.resize(n);
+  } else {
+    std::sort(stacks.begin(), stacks.end(), larger);
+  }
+
+  PyObjectRef py_stacks(PyList_New(stacks.size()));
+  if (py_stacks == nullptr) {
+    return nullptr;
+  }
+  for (std::size_t i = 0; i < stacks.size(); i++) {
+    PyObjectRef py_frames(NewPyTraceOrUnknown(
+        g_profiler->GetStackTrace(stacks[i].trace_handle)));
+    if (py_frames == nullptr) {
+      return nullptr;
+    }
+    PyObject *py_stack = Py_BuildValue("(OKK)", py_frames.get(),
+                                       (unsigned long long)stacks[i].size,
+                                       (unsigned long long)stacks[i].count);
+    if (py_stack == nullptr) {
+      return nullptr;
+    }
+    PyList_SET_ITEM(py_stacks.get(), i, py_stack);
+  }
+
+  return py_stacks.release();
+}
+
+// Returns a new reference.
+PyObject *GetPeakHeapProfile() {
+  if (!IsHeapProfilerAttached() || !g_profiler->PeakCheckpointsEnabled()) {
+    return nullptr;
+  }
+
+  HeapProfiler::ScopedTracePin pin(g_profiler.get());
+  std::vector<HeapProfiler::StackTotals> stacks =
+      g_profiler->GetPeakStackTotals();
+  PyObjectRef py_traces(PyList_New(0));
+  if (py_traces == nullptr) {
+    return nullptr;
+  }
+  for (const HeapProfiler::StackTotals &stack : stacks) {
+    PyObjectRef py_frames(
+        NewPyTraceOrUnknown(g_profiler->GetStackTrace(stack.trace_handle)));
+    if (py_frames == nullptr) {
+      return nullptr;
+    }
+    // The part that is already estimated is a trace of its own, with a
+    // sample rate of 1 so that it is not scaled again.
+    PyObjectRef py_trace;
+    if (stack.count > 0) {
+      py_trace.reset(Py_BuildValue("(KOK)", (unsigned long long)stack.size,
+                                   py_frames.get(),
+                                   (unsigned long long)stack.count));
+      if (py_trace == nullptr ||
+          PyList_Append(py_traces.get(), py_trace.get()) < 0) {
+        return nullptr;
+      }
+    }
+    if (stack.scaled_count > 0) {
+      py_trace.reset(Py_BuildValue(
+          "(KOKIK)", (unsigned long long)stack.scaled_size, py_frames.get(),
+          (unsigned long long)stack.scaled_count, 0u, 1ull));
+      if (py_trace == nullptr ||
+          PyList_Append(py_traces.get(), py_trace.get()) < 0) {
+        return nullptr;
+      }
+    }
+  }
+
+  return py_traces.release();
+}
+
+// Returns a new reference.
+PyObject *GetHeapTimeline() {
+  if (!IsHeapProfilerAttached() || !g_profiler->TimelineEnabled()) {
+    return nullptr;
+  }
+
+  const std::vector<TimelinePoint> points = g_profiler->GetTimeline();
+  const std::size_t n = points.size();
+  PyObject *py_timeline = PyBytes_FromStringAndSize(
+      nullptr, n * kTimelineFields * sizeof(uint64_t));
+  if (py_timeline == nullptr) {
+    return nullptr;
+  }
+  // Stored by column, so that each field can be plotted as an array.
+  uint64_t *columns = reinterpret_cast<uint64_t *>(
+      PyBytes_AS_STRING(py_timeline));
+  for (std::size_t i = 0; i < n; i++) {
+    columns[i] = points[i].time_ns;
+    columns[n + i] = points[i].traced;
+    columns[2 * n + i] = points[i].peak;
+    columns[3 * n + i] = points[i].allocs;
+    columns[4 * n + i] = points[i].frees;
+  }
+
+  return py_timeline;
+}
+
+bool ExportHeapProfile(Profile *profile) {
+  if (!IsHeapProfilerAttached()) {
+    PyErr_SetString(PyExc_RuntimeError, "The heap profiler is not started.");
+    return false;
+  }
+
+  return g_profiler->ExportProfile(profile);
+}
+
 int GetMaxFrames() {
   if (!IsHeapProfilerAttached()) {
     return -1;
@@ -251,6 +876,7 @@ PyObject *GetTrace(void *ptr) {
     return nullptr;
   }
 
+  HeapProfiler::ScopedTracePin pin(g_profiler.get());
   auto trace = g_profiler->GetTrace(ptr);
   auto py_trace = NewPyTrace(trace);
   return py_trace.release();
@@ -267,12 +893,20 @@ void ResetHeapProfiler() {
   g_profiler->Reset();
 }
 
+bool CollectHeapProfilerTraces() {
+  if (!IsHeapProfilerAttached()) {
+    return false;
+  }
+
+  return g_profiler->CollectTraces();
+}
+
 std::size_t GetHeapProfilerMemUsage() {
   if (!IsHeapProfilerAttached()) {
     return 0;
   }
 
-  return 0;  // Not yet implemented.
+  return g_profiler->MemoryUsage();
 }
 
 std::pair<std::size_t, std::size_t> GetHeapProfilerTracedMemory() {
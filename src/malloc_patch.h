@@ -6,23 +6,92 @@
 #include <Python.h>
 
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "heap.h"
 
+// What happens to the profiler in a child process when the process forks.
+enum class ForkPolicy {
+  // The child keeps profiling with a copy of the parent's state, so the
+  // parent's live allocations are reported by the child too.
+  kInherit,
+  // The child discards the parent's state and profiles only its own
+  // allocations.
+  kReset,
+  // Like kReset, but the parent's state is kept as a read-only baseline
+  // (see GetBaselineHeapProfile).
+  kFreeze,
+};
+
 // Attach a profiler to the malloc hooks and start profiling. This function
 // takes ownership of the profiler state; it will be deleted when it is
 // detached.
-void AttachHeapProfiler(std::unique_ptr<HeapProfiler> profiler);
+void AttachHeapProfiler(std::unique_ptr<HeapProfiler> profiler,
+                        ForkPolicy fork_policy = ForkPolicy::kInherit);
 
 // Detach the profiler from the malloc hooks and stop profiling. It is not an
-// error to call this if there is no active profiling.
+// error to call this if there is no active profiling. This also discards
+// any baseline.
 void DetachHeapProfiler();
 
 // Test if profiling is active.
 bool IsHeapProfilerAttached();
 
-// Get the current snapshot of all profiled heap allocations.
-PyObject *GetHeapProfile();
+// Record every allocation made through the Python allocators, with its
+// stack if it is made with the GIL held, in an allocation log at the given
+// path (see alloc_log.h) until StopAllocationLog. The heap profiler must
+// not be attached while recording. Both return false, with an error
+// message, if the log can't be written.
+bool StartAllocationLog(const std::string &path, std::string *error);
+bool StopAllocationLog(std::string *error);
+
+// Test if an allocation log is being recorded.
+bool IsAllocationLogActive();
+
+// Stop sampling new allocations, while still tracking the frees of the
+// sampled ones, until ResumeHeapProfiler. Both return false with a Python
+// exception set if profiling is not active, and are no-ops if the profiler
+// is already paused (or running).
+bool PauseHeapProfiler();
+bool ResumeHeapProfiler();
+
+// Test if profiling is active but paused.
+bool IsHeapProfilerPaused();
+
+// Get the current snapshot of all profiled heap allocations. If label_sets
+// is not null, only the allocations with the label sets it marks are
+// included, and only those allocated in the epochs from min_epoch up to
+// max_epoch (see HeapProfiler::Mark).
+PyObject *GetHeapProfile(const std::vector<bool> *label_sets = nullptr,
+                         Epoch min_epoch = 0, Epoch max_epoch = kMaxEpoch);
+
+// Get the snapshot of the heap allocations inherited from the parent
+// process with ForkPolicy::kFreeze, or nullptr if there is none.
+PyObject *GetBaselineHeapProfile();
+
+// Get the traces of the heap at its last peak checkpoint, as a tuple of
+// (size, traceback, count) tuples, or nullptr if peak checkpoints are not
+// enabled.
+PyObject *GetPeakHeapProfile();
+
+// Get the timeline of the traced memory as a bytes object holding the
+// kTimelineFields columns of a TimelinePoint, each an array of uint64_t,
+// or nullptr if the timeline is not enabled.
+PyObject *GetHeapTimeline();
+
+// Get the (estimated) live memory of each label set, as a list of
+// (label_set, size, count) tuples.
+PyObject *GetHeapLabelTotals();
+
+// Get the n stacks with the most (estimated) live bytes, largest first, as
+// a list of (traceback, size, count) tuples.
+PyObject *GetTopHeapStacks(std::size_t n);
+
+// Add the current heap profile to the given Profile, for writing to disk
+// and merging with the profiles of other processes. Returns false, with a
+// Python exception set, on failure.
+bool ExportHeapProfile(Profile *profile);
 
 // Get the current traceback limit for number of frames to save.
 int GetMaxFrames();
@@ -33,6 +102,11 @@ PyObject *GetTrace(void *ptr);
 // Clear all traced memory blocks from the current heap profiler.
 void ResetHeapProfiler();
 
+// Collect the traces that no live allocation refers to any more, which
+// the profiler otherwise does on its own as they accumulate. Returns false
+// if profiling is not active or the traces are in use.
+bool CollectHeapProfilerTraces();
+
 // Get an estimate of the memory used by the heap profiler.
 std::size_t GetHeapProfilerMemUsage();
 
@@ -0,0 +1,68 @@
+// Copyright 2019 Timothy Palpant
+//
+// Measures the cost that the allocation hooks add to the real Python
+// allocators, compared to the same allocators without a profiler.
+
+#include <Python.h>
+
+#include "benchmark/benchmark.h"
+#include "malloc_patch.h"
+
+namespace {
+
+// Allocates and frees a small block with the given allocator. The first
+// argument is the sample period, or 0 to measure the unhooked allocator,
+// the second is non-zero to pause the profiler, and the third is the
+// number of frames to capture. A period of 1 traces every allocation with
+// the unsampled variants of the hooks.
+template <void *(*Malloc)(size_t), void (*Free)(void *)>
+void BM_Allocator(benchmark::State &state) {
+  auto gil_state = PyGILState_Ensure();
+  const int period = state.range(0);
+  if (period > 0) {
+    Sampler::SetSamplePeriod(period);
+    ThreadSampler().ResetSamplingPoint();
+    AttachHeapProfiler(
+        std::unique_ptr<HeapProfiler>(new HeapProfiler(state.range(2))));
+    if (state.range(1) != 0) {
+      PauseHeapProfiler();
+    }
+  }
+
+  for (auto _ : state) {
+    void *ptr = Malloc(64);
+    benchmark::DoNotOptimize(ptr);
+    Free(ptr);
+  }
+
+  DetachHeapProfiler();
+  PyGILState_Release(gil_state);
+}
+
+void BM_PyMemMalloc(benchmark::State &state) {
+  BM_Allocator<PyMem_Malloc, PyMem_Free>(state);
+}
+
+void BM_PyObjectMalloc(benchmark::State &state) {
+  BM_Allocator<PyObject_Malloc, PyObject_Free>(state);
+}
+
+void BM_PyMemRawMalloc(benchmark::State &state) {
+  BM_Allocator<PyMem_RawMalloc, PyMem_RawFree>(state);
+}
+
+}  // namespace
+
+BENCHMARK(BM_PyMemMalloc)
+    ->Args({0, 0, 128})
+    ->Args({128 * 1024, 0, 128})
+    ->Args({512 * 1024, 0, 128})
+    ->Args({512 * 1024, 1, 128})
+    ->Args({1, 0, 128})
+    ->Args({1, 0, 1});
+BENCHMARK(BM_PyObjectMalloc)
+    ->Args({0, 0, 128})
+    ->Args({128 * 1024, 0, 128})
+    ->Args({512 * 1024, 0, 128})
+    ->Args({512 * 1024, 1, 128});
+BENCHMARK(BM_PyMemRawMalloc)->Args({0, 0, 128})->Args({512 * 1024, 0, 128});
@@ -0,0 +1,466 @@
+// Copyright 2019 Timothy Palpant
+
+#include "profile.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "sampling.h"
+
+namespace {
+
+// File format
+// -----------
+// A profile is written as a fixed-size header followed by columns of
+// native-endian integers, each starting at a multiple of 8 bytes so that
+// the file can be used in place when it is mmapped:
+//
+//   uint64 string_offsets[num_strings + 1]  (into string_data)
+//   char   string_data[string_data_size]    (UTF-8)
+//   uint64 frame_hash[num_frames]
+//   uint32 frame_parent[num_frames]
+//   uint32 frame_filename[num_frames]
+//   uint32 frame_name[num_frames]
+//   int32  frame_firstlineno[num_frames]
+//   int32  frame_lineno[num_frames]
+//   uint32 sample_frame[num_samples]
+//   uint64 sample_size[num_samples]
+//   uint64 sample_count[num_samples]
+//   uint64 sample_scaled_size[num_samples]   (since version 2)
+//   uint64 sample_scaled_count[num_samples]  (since version 2)
+const char kMagic[8] = {'M', 'P', 'R', 'O', 'F', 'I', 'L', 'E'};
+const uint32_t kByteOrderMark = 0x01020304;
+const uint32_t kFormatVersion = 2;
+// Version 1 profiles have no scaled part.
+const uint32_t kMinFormatVersion = 1;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t version;
+  uint64_t sample_rate;
+  uint32_t max_frames;
+  uint32_t reserved;
+  uint64_t num_strings;
+  uint64_t string_data_size;
+  uint64_t num_frames;
+  uint64_t num_samples;
+};
+
+static_assert(sizeof(FileHeader) == 64, "FileHeader must be 64 bytes");
+
+const uint64_t kFnvOffsetBasis = 14695981039346656037ULL;
+const uint64_t kFnvPrime = 1099511628211ULL;
+
+// FNV-1a, which unlike std::hash is the same in every process.
+uint64_t Fnv1a(uint64_t h, const void *data, std::size_t size) {
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  for (std::size_t i = 0; i < size; i++) {
+    h = (h ^ p[i]) * kFnvPrime;
+  }
+  return h;
+}
+
+template <class T>
+uint64_t Fnv1a(uint64_t h, T value) {
+  return Fnv1a(h, &value, sizeof(value));
+}
+
+std::size_t Padding(std::size_t size) { return (8 - size % 8) % 8; }
+
+// Writes columns to a file, padding each to a multiple of 8 bytes.
+class ColumnWriter {
+ public:
+  explicit ColumnWriter(FILE *f) : f_(f), ok_(true) {}
+
+  void Write(const void *data, std::size_t size) {
+    static const char zeros[8] = {0};
+    ok_ = ok_ && (size == 0 || fwrite(data, size, 1, f_) == 1);
+    const std::size_t padding = Padding(size);
+    ok_ = ok_ && (padding == 0 || fwrite(zeros, padding, 1, f_) == 1);
+  }
+
+  template <class T, class F>
+  void WriteColumn(const std::vector<T> &rows, F field) {
+    typedef decltype(field(rows[0])) Field;
+    std::vector<Field> column;
+    column.reserve(rows.size());
+    for (const auto &row : rows) {
+      column.push_back(field(row));
+    }
+    Write(column.data(), column.size() * sizeof(Field));
+  }
+
+  bool ok() const { return ok_; }
+
+ private:
+  FILE *f_;
+  bool ok_;
+};
+
+// Reads columns from a buffer, checking that they are in bounds.
+class ColumnReader {
+ public:
+  ColumnReader(const char *data, std::size_t size)
+      : data_(data), size_(size), pos_(0), failed_(false) {}
+
+  // Returns a pointer to the next n values of type T, or nullptr if the
+  // buffer is too short. Once a read fails, every later read fails too.
+  template <class T>
+  const T *Read(uint64_t n) {
+    if (failed_ || n > (size_ - pos_) / sizeof(T)) {
+      failed_ = true;
+      return nullptr;
+    }
+    const T *result = reinterpret_cast<const T *>(data_ + pos_);
+    const std::size_t size = n * sizeof(T);
+    pos_ += size + Padding(size);
+    if (pos_ > size_) {
+      pos_ = size_;
+    }
+    return result;
+  }
+
+  bool done() const { return pos_ == size_; }
+
+ private:
+  const char *data_;
+  std::size_t size_;
+  std::size_t pos_;
+  bool failed_;
+};
+
+bool ReadFile(const std::string &path, std::string *contents) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if (f == nullptr) {
+    return false;
+  }
+
+  char buf[64 * 1024];
+  std::size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    contents->append(buf, n);
+  }
+  const bool ok = !ferror(f);
+  fclose(f);
+  return ok;
+}
+
+bool InvalidProfile(const std::string &path, const char *reason,
+                    std::string *error) {
+  errno = 0;
+  *error = path + ": invalid profile: " + reason;
+  return false;
+}
+
+}  // namespace
+
+ProfileBuilder::ProfileBuilder(Profile *profile) : profile_(profile) {
+  for (uint32_t i = 0; i < profile_->strings.size(); i++) {
+    const std::string &s = profile_->strings[i];
+    strings_.emplace(s, i);
+    string_hashes_.push_back(Fnv1a(kFnvOffsetBasis, s.data(), s.size()));
+  }
+  for (uint32_t i = 0; i < profile_->frames.size(); i++) {
+    const ProfileFrame &f = profile_->frames[i];
+    frames_.emplace(
+        FrameKey{f.parent, f.filename, f.name, f.firstlineno, f.lineno}, i);
+  }
+  for (uint32_t i = 0; i < profile_->samples.size(); i++) {
+    samples_.emplace(profile_->samples[i].frame, i);
+  }
+}
+
+uint32_t ProfileBuilder::AddString(const char *data, std::size_t size) {
+  auto it = strings_.emplace(std::string(data, size), profile_->strings.size());
+  if (it.second) {
+    profile_->strings.push_back(it.first->first);
+    string_hashes_.push_back(Fnv1a(kFnvOffsetBasis, data, size));
+  }
+  return it.first->second;
+}
+
+uint32_t ProfileBuilder::AddFrame(uint32_t parent, uint32_t filename,
+                                  uint32_t name, int32_t firstlineno,
+                                  int32_t lineno) {
+  const FrameKey key{parent, filename, name, firstlineno, lineno};
+  auto it = frames_.emplace(key, profile_->frames.size());
+  if (it.second) {
+    uint64_t h = kFnvOffsetBasis;
+    if (parent != kNoParentFrame) {
+      h = Fnv1a(h, profile_->frames[parent].hash);
+    }
+    h = Fnv1a(h, string_hashes_[filename]);
+    h = Fnv1a(h, string_hashes_[name]);
+    h = Fnv1a(h, firstlineno);
+    h = Fnv1a(h, lineno);
+    profile_->frames.push_back(
+        {h, parent, filename, name, firstlineno, lineno});
+  }
+  return it.first->second;
+}
+
+void ProfileBuilder::AddSample(uint32_t frame, uint64_t size, uint64_t count,
+                               uint64_t scaled_size, uint64_t scaled_count) {
+  auto it = samples_.emplace(frame, profile_->samples.size());
+  if (it.second) {
+    profile_->samples.push_back(
+        {frame, size, count, scaled_size, scaled_count});
+  } else {
+    ProfileSample &sample = profile_->samples[it.first->second];
+    sample.size += size;
+    sample.count += count;
+    sample.scaled_size += scaled_size;
+    sample.scaled_count += scaled_count;
+  }
+}
+
+void ProfileBuilder::Merge(const Profile &other) {
+  std::vector<uint32_t> string_ids;
+  string_ids.reserve(other.strings.size());
+  for (const std::string &s : other.strings) {
+    string_ids.push_back(AddString(s.data(), s.size()));
+  }
+
+  // Parents come before their children, so they have already been mapped.
+  std::vector<uint32_t> frame_ids;
+  frame_ids.reserve(other.frames.size());
+  for (const ProfileFrame &f : other.frames) {
+    const uint32_t parent =
+        (f.parent == kNoParentFrame) ? kNoParentFrame : frame_ids[f.parent];
+    frame_ids.push_back(AddFrame(parent, string_ids[f.filename],
+                                 string_ids[f.name], f.firstlineno,
+                                 f.lineno));
+  }
+
+  for (const ProfileSample &sample : other.samples) {
+    AddSample(frame_ids[sample.frame], sample.size, sample.count,
+              sample.scaled_size, sample.scaled_count);
+  }
+}
+
+int64_t AddProfileString(PyObject *s, ProfileBuilder *builder,
+                         phmap::flat_hash_map<PyObject *, uint32_t> *memo) {
+  auto it = memo->find(s);
+  if (it != memo->end()) {
+    return it->second;
+  }
+
+  Py_ssize_t size;
+  const char *data = PyUnicode_AsUTF8AndSize(s, &size);
+  if (data == nullptr) {
+    return -1;
+  }
+  const uint32_t id = builder->AddString(data, size);
+  memo->emplace(s, id);
+  return id;
+}
+
+ProfileSample ScaleSample(const ProfileSample &sample, uint64_t sample_rate) {
+  ProfileSample scaled = {sample.frame, sample.size, sample.count, 0, 0};
+  if (sample.count != 0 && sample.size != 0 && sample_rate > 1) {
+    const double avg_size = static_cast<double>(sample.size) / sample.count;
+    const double scale = SampleWeight(avg_size, sample_rate);
+    scaled.size = static_cast<uint64_t>(scale * sample.size);
+    scaled.count = static_cast<uint64_t>(scale * sample.count);
+  }
+  scaled.size += sample.scaled_size;
+  scaled.count += sample.scaled_count;
+  return scaled;
+}
+
+bool MergeProfiles(const std::vector<const Profile *> &profiles, Profile *out,
+                   std::string *error) {
+  for (const Profile *profile : profiles) {
+    if (profile->sample_rate != profiles[0]->sample_rate) {
+      *error = "cannot merge profiles with different sample rates (" +
+               std::to_string(profiles[0]->sample_rate) + " and " +
+               std::to_string(profile->sample_rate) + ")";
+      return false;
+    }
+  }
+
+  ProfileBuilder builder(out);
+  for (const Profile *profile : profiles) {
+    out->sample_rate = profile->sample_rate;
+    out->max_frames = std::max(out->max_frames, profile->max_frames);
+    builder.Merge(*profile);
+  }
+  return true;
+}
+
+bool WriteProfile(const Profile &profile, const std::string &path,
+                  std::string *error) {
+  FileHeader header;
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.byte_order = kByteOrderMark;
+  header.version = kFormatVersion;
+  header.sample_rate = profile.sample_rate;
+  header.max_frames = profile.max_frames;
+  header.reserved = 0;
+  header.num_strings = profile.strings.size();
+  header.num_frames = profile.frames.size();
+  header.num_samples = profile.samples.size();
+
+  std::vector<uint64_t> string_offsets;
+  string_offsets.reserve(profile.strings.size() + 1);
+  string_offsets.push_back(0);
+  for (const std::string &s : profile.strings) {
+    string_offsets.push_back(string_offsets.back() + s.size());
+  }
+  header.string_data_size = string_offsets.back();
+
+  // Write to a temporary file and rename it into place, so that readers
+  // (such as a merge of many workers' profiles) never see a partial file.
+  const std::string tmp_path = path + ".tmp." + std::to_string(getpid());
+  FILE *file = fopen(tmp_path.c_str(), "wb");
+  if (file == nullptr) {
+    *error = tmp_path + ": " + strerror(errno);
+    return false;
+  }
+
+  ColumnWriter w(file);
+  w.Write(&header, sizeof(header));
+  w.Write(string_offsets.data(), string_offsets.size() * sizeof(uint64_t));
+  std::string string_data;
+  string_data.reserve(header.string_data_size);
+  for (const std::string &s : profile.strings) {
+    string_data += s;
+  }
+  w.Write(string_data.data(), string_data.size());
+
+  const auto &frames = profile.frames;
+  w.WriteColumn(frames, [](const ProfileFrame &f) { return f.hash; });
+  w.WriteColumn(frames, [](const ProfileFrame &f) { return f.parent; });
+  w.WriteColumn(frames, [](const ProfileFrame &f) { return f.filename; });
+  w.WriteColumn(frames, [](const ProfileFrame &f) { return f.name; });
+  w.WriteColumn(frames, [](const ProfileFrame &f) { return f.firstlineno; });
+  w.WriteColumn(frames, [](const ProfileFrame &f) { return f.lineno; });
+
+  const auto &samples = profile.samples;
+  w.WriteColumn(samples, [](const ProfileSample &s) { return s.frame; });
+  w.WriteColumn(samples, [](const ProfileSample &s) { return s.size; });
+  w.WriteColumn(samples, [](const ProfileSample &s) { return s.count; });
+  w.WriteColumn(samples,
+                [](const ProfileSample &s) { return s.scaled_size; });
+  w.WriteColumn(samples,
+                [](const ProfileSample &s) { return s.scaled_count; });
+
+  bool ok = w.ok() && !ferror(file);
+  ok = (fclose(file) == 0) && ok;
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    const int saved_errno = errno;
+    *error = path + ": " + strerror(saved_errno);
+    unlink(tmp_path.c_str());
+    errno = saved_errno;
+    return false;
+  }
+  return true;
+}
+
+bool ReadProfile(const std::string &path, Profile *profile,
+                 std::string *error) {
+  std::string contents;
+  if (!ReadFile(path, &contents)) {
+    *error = path + ": " + strerror(errno);
+    return false;
+  }
+
+  ColumnReader r(contents.data(), contents.size());
+  const FileHeader *header = r.Read<FileHeader>(1);
+  if (header == nullptr ||
+      std::memcmp(header->magic, kMagic, sizeof(kMagic)) != 0) {
+    return InvalidProfile(path, "bad magic number", error);
+  }
+  if (header->byte_order != kByteOrderMark) {
+    return InvalidProfile(path, "written on a machine of different byte order",
+                          error);
+  }
+  if (header->version < kMinFormatVersion ||
+      header->version > kFormatVersion) {
+    return InvalidProfile(path, "unsupported version", error);
+  }
+
+  const uint64_t num_strings = header->num_strings;
+  const uint64_t num_frames = header->num_frames;
+  const uint64_t num_samples = header->num_samples;
+  if (num_strings >= kNoParentFrame || num_frames >= kNoParentFrame) {
+    return InvalidProfile(path, "too many strings or frames", error);
+  }
+
+  const uint64_t *string_offsets = r.Read<uint64_t>(num_strings + 1);
+  const char *string_data = r.Read<char>(header->string_data_size);
+  const uint64_t *frame_hash = r.Read<uint64_t>(num_frames);
+  const uint32_t *frame_parent = r.Read<uint32_t>(num_frames);
+  const uint32_t *frame_filename = r.Read<uint32_t>(num_frames);
+  const uint32_t *frame_name = r.Read<uint32_t>(num_frames);
+  const int32_t *frame_firstlineno = r.Read<int32_t>(num_frames);
+  const int32_t *frame_lineno = r.Read<int32_t>(num_frames);
+  const uint32_t *sample_frame = r.Read<uint32_t>(num_samples);
+  const uint64_t *sample_size = r.Read<uint64_t>(num_samples);
+  const uint64_t *sample_count = r.Read<uint64_t>(num_samples);
+  const uint64_t *sample_scaled_size = nullptr;
+  const uint64_t *sample_scaled_count = nullptr;
+  if (header->version >= 2) {
+    sample_scaled_size = r.Read<uint64_t>(num_samples);
+    sample_scaled_count = r.Read<uint64_t>(num_samples);
+  }
+  if (string_offsets == nullptr || string_data == nullptr ||
+      frame_hash == nullptr || frame_parent == nullptr ||
+      frame_filename == nullptr || frame_name == nullptr ||
+      frame_firstlineno == nullptr || frame_lineno == nullptr ||
+      sample_frame == nullptr || sample_size == nullptr ||
+      sample_count == nullptr ||
+      (header->version >= 2 &&
+       (sample_scaled_size == nullptr || sample_scaled_count == nullptr)) ||
+      !r.done()) {
+    return InvalidProfile(path, "wrong file size", error);
+  }
+
+  profile->sample_rate = header->sample_rate;
+  profile->max_frames = header->max_frames;
+  profile->strings.clear();
+  profile->strings.reserve(num_strings);
+  for (uint64_t i = 0; i < num_strings; i++) {
+    const uint64_t start = string_offsets[i];
+    const uint64_t end = string_offsets[i + 1];
+    if (start > end || end > header->string_data_size) {
+      return InvalidProfile(path, "bad string offset", error);
+    }
+    profile->strings.emplace_back(string_data + start, end - start);
+  }
+
+  profile->frames.clear();
+  profile->frames.reserve(num_frames);
+  for (uint64_t i = 0; i < num_frames; i++) {
+    if ((frame_parent[i] >= i && frame_parent[i] != kNoParentFrame) ||
+        frame_filename[i] >= num_strings || frame_name[i] >= num_strings) {
+      return InvalidProfile(path, "bad frame", error);
+    }
+    profile->frames.push_back({frame_hash[i], frame_parent[i],
+                               frame_filename[i], frame_name[i],
+                               frame_firstlineno[i], frame_lineno[i]});
+  }
+
+  profile->samples.clear();
+  profile->samples.reserve(num_samples);
+  for (uint64_t i = 0; i < num_samples; i++) {
+    if (sample_frame[i] >= num_frames) {
+      return InvalidProfile(path, "bad sample", error);
+    }
+    ProfileSample sample = {sample_frame[i], sample_size[i], sample_count[i],
+                            0, 0};
+    if (sample_scaled_count != nullptr) {
+      sample.scaled_size = sample_scaled_size[i];
+      sample.scaled_count = sample_scaled_count[i];
+    }
+    profile->samples.push_back(sample);
+  }
+
+  return true;
+}
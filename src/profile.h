@@ -0,0 +1,144 @@
+// Copyright 2019 Timothy Palpant
+
+#ifndef MPROFILE_SRC_PROFILE_H_
+#define MPROFILE_SRC_PROFILE_H_
+
+#include <Python.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "third_party/greg7mdp/parallel-hashmap/phmap.h"
+
+// A Profile is a compact, self-contained summary of the live heap that can
+// be written to disk (or shared memory) and merged with profiles from other
+// processes.
+//
+// Unlike CallTraceSet, which identifies stacks by pointer, a Profile
+// identifies every stack by a hash of its contents (the function names,
+// filenames and line numbers from the root down). The same stack has the
+// same hash in every process, so profiles from many workers can be merged
+// in linear time.
+
+// Index of a frame that has no parent.
+const uint32_t kNoParentFrame = 0xffffffff;
+
+struct ProfileFrame {
+  // Content hash of the stack ending at this frame. This is a stable
+  // identifier for the stack across processes.
+  uint64_t hash;
+  // Index of the calling frame, or kNoParentFrame for a root frame.
+  // Parents always come before their children.
+  uint32_t parent;
+  // Indices into the string table.
+  uint32_t filename;
+  uint32_t name;
+  int32_t firstlineno;
+  int32_t lineno;
+};
+
+// The (sampled) live allocations for one stack.
+struct ProfileSample {
+  // Index of the leaf frame of the stack.
+  uint32_t frame;
+  // Total size and number of the sampled allocations, to be scaled by the
+  // sample rate of the profile.
+  uint64_t size;
+  uint64_t count;
+  // The estimated size and number of the allocations that were sampled at
+  // a rate of their own (in a region, for example), which are already
+  // scaled.
+  uint64_t scaled_size;
+  uint64_t scaled_count;
+};
+
+struct Profile {
+  // The sample rate the profile was collected with, see Snapshot.
+  uint64_t sample_rate = 0;
+  // The traceback limit the profile was collected with.
+  uint32_t max_frames = 0;
+  std::vector<std::string> strings;
+  std::vector<ProfileFrame> frames;
+  std::vector<ProfileSample> samples;
+};
+
+// ProfileBuilder adds strings, frames and samples to a Profile, merging
+// duplicates.
+class ProfileBuilder {
+ public:
+  // The profile must outlive the builder.
+  explicit ProfileBuilder(Profile *profile);
+  // Not copyable or assignable.
+  ProfileBuilder(const ProfileBuilder &) = delete;
+  ProfileBuilder &operator=(const ProfileBuilder &) = delete;
+
+  uint32_t AddString(const char *data, std::size_t size);
+  uint32_t AddFrame(uint32_t parent, uint32_t filename, uint32_t name,
+                    int32_t firstlineno, int32_t lineno);
+  // Adds to the sample for the given leaf frame.
+  void AddSample(uint32_t frame, uint64_t size, uint64_t count,
+                 uint64_t scaled_size = 0, uint64_t scaled_count = 0);
+
+  // Adds all of the frames and samples in other to the profile.
+  void Merge(const Profile &other);
+
+ private:
+  struct FrameKey {
+    uint32_t parent;
+    uint32_t filename;
+    uint32_t name;
+    int32_t firstlineno;
+    int32_t lineno;
+
+    bool operator==(const FrameKey &o) const {
+      return parent == o.parent && filename == o.filename && name == o.name &&
+             firstlineno == o.firstlineno && lineno == o.lineno;
+    }
+  };
+
+  struct FrameKeyHash {
+    std::size_t operator()(const FrameKey &k) const {
+      return phmap::HashState().combine(0, k.parent, k.filename, k.name,
+                                        k.firstlineno, k.lineno);
+    }
+  };
+
+  Profile *profile_;
+  // Hashes of the strings in the string table.
+  std::vector<uint64_t> string_hashes_;
+  phmap::flat_hash_map<std::string, uint32_t> strings_;
+  phmap::flat_hash_map<FrameKey, uint32_t, FrameKeyHash> frames_;
+  // Index of the sample for each leaf frame.
+  phmap::flat_hash_map<uint32_t, uint32_t> samples_;
+};
+
+// Returns the index of the given Python string in the builder's string
+// table, or -1 with a Python exception set. Each string object is only
+// converted once, since memo maps them to their indices.
+int64_t AddProfileString(PyObject *s, ProfileBuilder *builder,
+                         phmap::flat_hash_map<PyObject *, uint32_t> *memo);
+
+// Scale a sample to estimate the total size and number of allocations,
+// given the rate it was sampled at, and add the part that is already
+// estimated. The result has no scaled part. This matches Snapshot._group_by.
+ProfileSample ScaleSample(const ProfileSample &sample, uint64_t sample_rate);
+
+// Merges the given profiles into out, which should be empty. Returns false
+// and sets error if they were collected with different sample rates.
+bool MergeProfiles(const std::vector<const Profile *> &profiles, Profile *out,
+                   std::string *error);
+
+// Write the profile to the given path. The file is replaced atomically, so
+// readers never see a partially written profile. Returns false and sets
+// error (and errno) on failure.
+bool WriteProfile(const Profile &profile, const std::string &path,
+                  std::string *error);
+
+// Read a profile written by WriteProfile. Returns false and sets error if
+// the file cannot be read, in which case errno is set, or if it is not a
+// valid profile, in which case errno is 0.
+bool ReadProfile(const std::string &path, Profile *profile,
+                 std::string *error);
+
+#endif  // MPROFILE_SRC_PROFILE_H_
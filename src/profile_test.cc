@@ -0,0 +1,203 @@
+// Copyright 2019 Timothy Palpant
+//
+#include "profile.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <string>
+
+#include "gtest/gtest.h"
+
+namespace {
+
+// Adds the stack main -> f -> leaf with the given sample to the profile.
+void AddStack(Profile *profile, const std::string &leaf, uint64_t size,
+              uint64_t count, uint64_t scaled_size = 0,
+              uint64_t scaled_count = 0) {
+  ProfileBuilder builder(profile);
+  uint32_t filename = builder.AddString("test.py", 7);
+  uint32_t frame = kNoParentFrame;
+  for (const std::string &name :
+       {std::string("main"), std::string("f"), leaf}) {
+    uint32_t name_id = builder.AddString(name.data(), name.size());
+    frame = builder.AddFrame(frame, filename, name_id, 1, 2);
+  }
+  builder.AddSample(frame, size, count, scaled_size, scaled_count);
+}
+
+std::string TempPath(const char *name) {
+  return "/tmp/mprofile_profile_test_" + std::to_string(getpid()) + "_" +
+         name;
+}
+
+}  // namespace
+
+TEST(ProfileBuilder, MergesDuplicates) {
+  Profile profile;
+  AddStack(&profile, "g", 10, 1);
+  AddStack(&profile, "g", 20, 2);
+  AddStack(&profile, "h", 5, 1);
+
+  EXPECT_EQ(profile.strings.size(), 5);
+  EXPECT_EQ(profile.frames.size(), 4);
+  ASSERT_EQ(profile.samples.size(), 2);
+  EXPECT_EQ(profile.samples[0].size, 30);
+  EXPECT_EQ(profile.samples[0].count, 3);
+  EXPECT_EQ(profile.frames[0].parent, kNoParentFrame);
+  EXPECT_NE(profile.frames[2].hash, profile.frames[3].hash);
+}
+
+TEST(Profile, WriteRead) {
+  Profile profile;
+  profile.sample_rate = 1024;
+  profile.max_frames = 64;
+  AddStack(&profile, "g", 10, 1);
+  AddStack(&profile, "h\xc3\xa9", 5, 2, 4000, 100);
+
+  const std::string path = TempPath("roundtrip");
+  std::string error;
+  ASSERT_TRUE(WriteProfile(profile, path, &error)) << error;
+
+  Profile read;
+  ASSERT_TRUE(ReadProfile(path, &read, &error)) << error;
+  unlink(path.c_str());
+
+  EXPECT_EQ(read.sample_rate, 1024);
+  EXPECT_EQ(read.max_frames, 64);
+  EXPECT_EQ(read.strings, profile.strings);
+  ASSERT_EQ(read.frames.size(), profile.frames.size());
+  for (std::size_t i = 0; i < read.frames.size(); i++) {
+    EXPECT_EQ(read.frames[i].hash, profile.frames[i].hash);
+    EXPECT_EQ(read.frames[i].parent, profile.frames[i].parent);
+    EXPECT_EQ(read.frames[i].lineno, profile.frames[i].lineno);
+  }
+  ASSERT_EQ(read.samples.size(), 2);
+  EXPECT_EQ(read.samples[1].size, 5);
+  EXPECT_EQ(read.samples[1].count, 2);
+  EXPECT_EQ(read.samples[1].scaled_size, 4000);
+  EXPECT_EQ(read.samples[1].scaled_count, 100);
+}
+
+TEST(Profile, Merge) {
+  // The same stacks are interned in a different order in each process.
+  Profile a;
+  a.sample_rate = 1024;
+  AddStack(&a, "g", 10, 1);
+  AddStack(&a, "h", 5, 1);
+  Profile b;
+  b.sample_rate = 1024;
+  b.max_frames = 16;
+  AddStack(&b, "h", 7, 2);
+  AddStack(&b, "k", 3, 1);
+
+  Profile merged;
+  std::string error;
+  ASSERT_TRUE(MergeProfiles({&a, &b}, &merged, &error)) << error;
+  EXPECT_EQ(merged.sample_rate, 1024);
+  EXPECT_EQ(merged.max_frames, 16);
+  ASSERT_EQ(merged.samples.size(), 3);
+  EXPECT_EQ(merged.samples[1].size, 12);
+  EXPECT_EQ(merged.samples[1].count, 3);
+  // Stacks are identified by the same hash in each profile.
+  EXPECT_EQ(merged.frames[merged.samples[1].frame].hash,
+            b.frames[b.samples[0].frame].hash);
+}
+
+TEST(Profile, MergeDifferentSampleRates) {
+  Profile a;
+  a.sample_rate = 1024;
+  Profile b;
+  b.sample_rate = 2048;
+
+  Profile merged;
+  std::string error;
+  EXPECT_FALSE(MergeProfiles({&a, &b}, &merged, &error));
+  EXPECT_NE(error.find("sample rates"), std::string::npos);
+}
+
+TEST(Profile, ReadErrors) {
+  Profile profile;
+  std::string error;
+  EXPECT_FALSE(ReadProfile(TempPath("missing"), &profile, &error));
+  EXPECT_EQ(errno, ENOENT);
+
+  AddStack(&profile, "g", 10, 1);
+  const std::string path = TempPath("truncated");
+  ASSERT_TRUE(WriteProfile(profile, path, &error)) << error;
+  ASSERT_EQ(truncate(path.c_str(), 100), 0);
+  EXPECT_FALSE(ReadProfile(path, &profile, &error));
+  EXPECT_EQ(errno, 0);
+  unlink(path.c_str());
+}
+
+TEST(Profile, ReadTruncated) {
+  Profile profile;
+  AddStack(&profile, "g", 10, 1, 400, 4);
+  AddStack(&profile, "h", 5, 2);
+  const std::string path = TempPath("truncated_columns");
+  std::string error;
+  ASSERT_TRUE(WriteProfile(profile, path, &error)) << error;
+  FILE *f = fopen(path.c_str(), "rb");
+  ASSERT_NE(f, nullptr);
+  std::string contents;
+  int c;
+  while ((c = fgetc(f)) != EOF) {
+    contents.push_back(c);
+  }
+  fclose(f);
+
+  // Every column, cut anywhere, is an error rather than a crash.
+  for (std::size_t size = 0; size < contents.size(); size++) {
+    f = fopen(path.c_str(), "wb");
+    ASSERT_NE(f, nullptr);
+    fwrite(contents.data(), 1, size, f);
+    fclose(f);
+    Profile read;
+    EXPECT_FALSE(ReadProfile(path, &read, &error)) << size;
+  }
+
+  // So is a header that claims more strings than the file holds, with the
+  // string data grown to cover the old offsets so that the file size
+  // still adds up. The header's num_strings and string_data_size are at
+  // offsets 32 and 40.
+  std::string crafted = contents;
+  uint64_t num_strings, string_data_size;
+  memcpy(&num_strings, &crafted[32], sizeof(num_strings));
+  memcpy(&string_data_size, &crafted[40], sizeof(string_data_size));
+  string_data_size += (num_strings + 1) * sizeof(uint64_t);
+  num_strings = 1000000;
+  memcpy(&crafted[32], &num_strings, sizeof(num_strings));
+  memcpy(&crafted[40], &string_data_size, sizeof(string_data_size));
+  f = fopen(path.c_str(), "wb");
+  ASSERT_NE(f, nullptr);
+  fwrite(crafted.data(), 1, crafted.size(), f);
+  fclose(f);
+  Profile read;
+  EXPECT_FALSE(ReadProfile(path, &read, &error));
+  EXPECT_NE(error.find("wrong file size"), std::string::npos) << error;
+  unlink(path.c_str());
+}
+
+TEST(ScaleSample, MatchesSnapshot) {
+  ProfileSample sample = {0, 1024, 2};
+  ProfileSample unscaled = ScaleSample(sample, 1);
+  EXPECT_EQ(unscaled.size, 1024);
+  EXPECT_EQ(unscaled.count, 2);
+
+  // scale = 1 / (1 - exp(-512 / 1024)) = 2.541...
+  ProfileSample scaled = ScaleSample(sample, 1024);
+  EXPECT_EQ(scaled.size, 2602);
+  EXPECT_EQ(scaled.count, 5);
+
+  // The part sampled at a rate of its own is already an estimate.
+  sample.scaled_size = 20000;
+  sample.scaled_count = 1000;
+  scaled = ScaleSample(sample, 1024);
+  EXPECT_EQ(scaled.size, 2602 + 20000);
+  EXPECT_EQ(scaled.count, 5 + 1000);
+  EXPECT_EQ(scaled.scaled_size, 0);
+  EXPECT_EQ(scaled.scaled_count, 0);
+}
@@ -0,0 +1,52 @@
+// Copyright 2019 Timothy Palpant
+
+#include "region.h"
+
+#include "thread_context.h"
+
+namespace {
+
+// The periods of the interned regions. Entry 0 is unused, since region 0
+// uses the global period. Protected by the GIL.
+int64_t g_region_periods[kMaxRegions];
+int g_num_regions = 1;
+
+}  // namespace
+
+int InternRegion(int64_t period) {
+  for (int i = 1; i < g_num_regions; i++) {
+    if (g_region_periods[i] == period) {
+      return i;
+    }
+  }
+  if (g_num_regions == kMaxRegions) {
+    return -1;
+  }
+  g_region_periods[g_num_regions] = period;
+  return g_num_regions++;
+}
+
+int64_t RegionPeriod(RegionId id) {
+  return (id == 0) ? Sampler::GetSamplePeriod() : g_region_periods[id];
+}
+
+uint64_t RegionSampleRate(RegionId id) {
+  const int64_t period = RegionPeriod(id);
+  return (period < 0) ? 0 : period;
+}
+
+bool IsValidRegion(int id) { return id >= 0 && id < g_num_regions; }
+
+RegionId SetThreadRegion(RegionId id) {
+  ThreadContext &context = CurrentThreadContext();
+  const RegionId previous = context.region;
+  context.region = id;
+  if (id == 0) {
+    context.sampler.ClearPeriodOverride();
+  } else {
+    context.sampler.SetPeriodOverride(g_region_periods[id]);
+  }
+  return previous;
+}
+
+RegionId CurrentRegion() { return CurrentThreadContext().region; }
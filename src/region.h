@@ -0,0 +1,40 @@
+// Copyright 2019 Timothy Palpant
+
+#ifndef MPROFILE_SRC_REGION_H_
+#define MPROFILE_SRC_REGION_H_
+
+#include <cstdint>
+
+// A region samples the allocations of one thread with a different period
+// than the rest of the process, or not at all. The periods of regions are
+// interned, so that each sampled pointer can record the region it was
+// sampled in with a few bits and be scaled by its period. Region 0 uses
+// the global sample period.
+typedef uint8_t RegionId;
+const int kMaxRegions = 16;
+
+// The id of the region that samples with the given period, which is
+// negative to sample nothing. Returns -1 if there are already kMaxRegions
+// distinct periods. The GIL must be held.
+int InternRegion(int64_t period);
+
+// The sample period of the given region, or the global sample period for
+// region 0. The period of a region never changes once it is interned, so
+// this does not need the GIL for an id returned by InternRegion.
+int64_t RegionPeriod(RegionId id);
+
+// The rate that samples of the given region are scaled by: its period, or
+// 0 (no scaling) if it samples nothing.
+uint64_t RegionSampleRate(RegionId id);
+
+// Whether id is a region returned by InternRegion (or 0).
+bool IsValidRegion(int id);
+
+// Make id the region of the calling thread, and return the previous one.
+// The thread's sampler picks its next sampling point with the new period.
+RegionId SetThreadRegion(RegionId id);
+
+// The region of the calling thread.
+RegionId CurrentRegion();
+
+#endif  // MPROFILE_SRC_REGION_H_
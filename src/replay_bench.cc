@@ -0,0 +1,306 @@
+// Copyright 2019 Timothy Palpant
+//
+// Replays a recorded allocation log (see alloc_log.h) through the
+// profiler's data structures, so that they are measured on the addresses,
+// sizes, free order and stacks of a real workload. The log is read from
+// the file named by MPROFILE_REPLAY_LOG, as written by
+// `python -m mprofile.record`, or else recorded from a built-in workload
+// when the benchmarks start.
+//
+// Replays are single-threaded, in the order of the log, so that every run
+// sees the same stream.
+
+#include <Python.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "alloc_log.h"
+#include "benchmark/benchmark.h"
+#include "heap.h"
+#include "live_set.h"
+#include "malloc_patch.h"
+#include "scoped_object.h"
+#include "stacktraces.h"
+
+namespace {
+
+// A churn of objects of many sizes and lifetimes, allocated from a few
+// levels of functions.
+const char kWorkload[] = R"(
+import random
+
+random.seed(1)
+
+
+class Node:
+    def __init__(self, key, children):
+        self.key = key
+        self.children = children
+
+
+def tree(depth):
+    if depth == 0:
+        return Node(str(random.random()), [])
+    return Node(depth, [tree(depth - 1) for _ in range(random.randrange(4))])
+
+
+def churn(n):
+    cache = {}
+    for i in range(n):
+        key = "k%d" % random.randrange(n // 4)
+        cache[key] = [str(j) * random.randrange(1, 64) for j in range(i % 16)]
+        if i % 7 == 0:
+            cache[key].append(bytearray(random.randrange(1 << 12)))
+        if len(cache) > 2000:
+            del cache[next(iter(cache))]
+    return cache
+
+
+def workload():
+    kept = []
+    for i in range(20):
+        kept.append(churn(5000))
+        kept.append(tree(6))
+        if len(kept) > 8:
+            del kept[random.randrange(len(kept))]
+
+
+workload()
+)";
+
+// The stream to replay, with the addresses as pointers.
+struct ReplayOp {
+  AllocOp op;
+  void *ptr;
+  void *old_ptr;
+  std::size_t size;
+  uint32_t stack;
+};
+
+struct Replay {
+  std::vector<ReplayOp> ops;
+  AllocLog log;
+};
+
+// Records kWorkload in a temporary log. The GIL must be held.
+bool RecordWorkload(AllocLog *log, std::string *error) {
+  char path[] = "/tmp/mprofile-replay-XXXXXX";
+  const int fd = mkstemp(path);
+  if (fd < 0) {
+    *error = "mkstemp failed";
+    return false;
+  }
+  close(fd);
+
+  // Code run from a "<string>" file would not have a stack.
+  PyObjectRef code(
+      Py_CompileString(kWorkload, "replay_workload.py", Py_file_input));
+  PyObjectRef globals(PyDict_New());
+  if (code == nullptr || globals == nullptr ||
+      PyDict_SetItemString(globals.get(), "__builtins__",
+                           PyEval_GetBuiltins()) < 0) {
+    PyErr_Print();
+    *error = "failed to compile the workload";
+    return false;
+  }
+
+  bool ok = StartAllocationLog(path, error);
+  if (ok) {
+    PyObjectRef result(
+        PyEval_EvalCode(code.get(), globals.get(), globals.get()));
+    if (result == nullptr) {
+      PyErr_Print();
+    }
+    globals.reset(nullptr);
+    ok = StopAllocationLog(error) && ReadAllocLog(path, log, error);
+  }
+  unlink(path);
+  return ok;
+}
+
+// Blocks that were live when recording started can be freed in the log,
+// which the profiler has to look up like any other free. A block that is
+// reused before its free is recorded (when another thread frees it without
+// the GIL) is freed first, so that every malloc is of a free address.
+void AddOps(const AllocLog &log, std::vector<ReplayOp> *ops) {
+  phmap::flat_hash_set<uint64_t> live;
+  for (const AllocRecord &r : log.records) {
+    void *ptr = reinterpret_cast<void *>(r.ptr);
+    void *old_ptr = reinterpret_cast<void *>(r.old_ptr);
+    if (r.op == AllocOp::kFree) {
+      live.erase(r.ptr);
+      ops->push_back({r.op, ptr, nullptr, 0, kNoStack});
+      continue;
+    }
+    if (r.op == AllocOp::kRealloc) {
+      live.erase(r.old_ptr);
+    }
+    if (!live.insert(r.ptr).second) {
+      ops->push_back({AllocOp::kFree, ptr, nullptr, 0, kNoStack});
+    }
+    ops->push_back({r.op, ptr, old_ptr, r.size, r.stack});
+  }
+}
+
+const Replay &GetReplay() {
+  static const Replay *replay = [] {
+    Replay *r = new Replay();
+    std::string error;
+    const char *path = getenv("MPROFILE_REPLAY_LOG");
+    bool ok;
+    if (path != nullptr && *path != '\0') {
+      ok = ReadAllocLog(path, &r->log, &error);
+    } else {
+      auto gil_state = PyGILState_Ensure();
+      ok = RecordWorkload(&r->log, &error);
+      PyGILState_Release(gil_state);
+    }
+    if (!ok) {
+      fprintf(stderr, "replay_bench: %s\n", error.c_str());
+      abort();
+    }
+    AddOps(r->log, &r->ops);
+    return r;
+  }();
+  return *replay;
+}
+
+void SetReplayCounters(benchmark::State &state, const Replay &replay) {
+  state.SetItemsProcessed(state.iterations() * replay.ops.size());
+  state.counters["stacks"] = replay.log.stacks.size() - 1;
+}
+
+// The argument is the sample period.
+void BM_ReplayHeapProfiler(benchmark::State &state) {
+  const Replay &replay = GetReplay();
+  auto gil_state = PyGILState_Ensure();
+  Sampler::SetSamplePeriod(state.range(0));
+  ThreadSampler().ResetSamplingPoint();
+  for (auto _ : state) {
+    state.PauseTiming();
+    std::unique_ptr<HeapProfiler> profiler(new HeapProfiler());
+    state.ResumeTiming();
+    for (const ReplayOp &op : replay.ops) {
+      switch (op.op) {
+        case AllocOp::kMalloc:
+          profiler->HandleMalloc(op.ptr, op.size, false);
+          break;
+        case AllocOp::kRealloc:
+          profiler->HandleRealloc(op.old_ptr, op.ptr, op.size, false);
+          break;
+        case AllocOp::kFree:
+          profiler->HandleFree(op.ptr);
+          break;
+      }
+    }
+    state.PauseTiming();
+    state.counters["memory"] = profiler->MemoryUsage();
+    state.counters["traced"] = profiler->TotalMemoryTraced();
+    profiler.reset(nullptr);
+    state.ResumeTiming();
+  }
+  SetReplayCounters(state, replay);
+  PyGILState_Release(gil_state);
+}
+
+// A stand-in for HeapProfiler::LivePointer.
+struct Value {
+  const void *trace_handle;
+  std::size_t size;
+  uint32_t epoch;
+};
+
+// Replays the live set alone, for the pointers sampled at the period of
+// the second argument. Unlike the profiler, a realloc of a sampled block is
+// sampled again rather than moved.
+void BM_ReplayLiveSet(benchmark::State &state) {
+  const Replay &replay = GetReplay();
+  const LiveSetType type = static_cast<LiveSetType>(state.range(0));
+  Sampler::SetSamplePeriod(state.range(1));
+  for (auto _ : state) {
+    state.PauseTiming();
+    std::unique_ptr<LiveSet<Value>> live_set(new LiveSet<Value>(type));
+    Sampler sampler;
+    sampler.Reseed(1);
+    state.ResumeTiming();
+    for (const ReplayOp &op : replay.ops) {
+      Value removed;
+      if (op.op != AllocOp::kMalloc) {
+        void *freed = (op.op == AllocOp::kFree) ? op.ptr : op.old_ptr;
+        live_set->FindAndRemove(freed, &removed);
+      }
+      if (op.op != AllocOp::kFree && !sampler.RecordAllocation(op.size)) {
+        live_set->Insert(op.ptr, {nullptr, op.size});
+      }
+    }
+    state.PauseTiming();
+    state.counters["memory"] = live_set->MemoryUsage();
+    live_set.reset(nullptr);
+    state.ResumeTiming();
+  }
+  SetReplayCounters(state, replay);
+}
+
+// Interns the stack of every allocation in the log, with a distinct
+// location for every frame id.
+void BM_ReplayCallTraceSet(benchmark::State &state) {
+  const Replay &replay = GetReplay();
+  auto gil_state = PyGILState_Ensure();
+
+  std::vector<PyObjectRef> strings;
+  std::vector<FuncLoc> locs;
+  for (uint32_t i = 0; i < replay.log.num_frames; i++) {
+    // About ten functions in each file.
+    strings.emplace_back(PyUnicode_FromFormat("file%u.py", i / 10));
+    strings.emplace_back(PyUnicode_FromFormat("func%u", i));
+    locs.push_back({strings[strings.size() - 2].get(),
+                    strings[strings.size() - 1].get(), static_cast<int>(i),
+                    static_cast<int>(i)});
+  }
+  std::vector<std::unique_ptr<CallTrace>> traces;
+  for (const std::vector<uint32_t> &frames : replay.log.stacks) {
+    std::unique_ptr<CallTrace> trace(new CallTrace());
+    trace->num_frames = 0;
+    // From the leaf, as GetCurrentCallTrace captures them.
+    for (auto it = frames.rbegin();
+         it != frames.rend() && trace->size() < kMaxFramesToCapture; ++it) {
+      trace->push_back(locs[*it]);
+    }
+    traces.push_back(std::move(trace));
+  }
+
+  std::size_t interned = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    std::unique_ptr<CallTraceSet> set(new CallTraceSet());
+    state.ResumeTiming();
+    for (const ReplayOp &op : replay.ops) {
+      if (op.op != AllocOp::kFree && op.stack != kNoStack) {
+        benchmark::DoNotOptimize(set->Intern(*traces[op.stack]));
+        interned++;
+      }
+    }
+    state.PauseTiming();
+    state.counters["memory"] = set->MemoryUsage();
+    set.reset(nullptr);
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(interned);
+  state.counters["stacks"] = replay.log.stacks.size() - 1;
+  PyGILState_Release(gil_state);
+}
+
+}  // namespace
+
+BENCHMARK(BM_ReplayHeapProfiler)->Arg(0)->Arg(4096)->Arg(512 * 1024)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_ReplayLiveSet)
+    ->ArgsProduct({{static_cast<int>(LiveSetType::kAddressMap),
+                    static_cast<int>(LiveSetType::kFlatHashMap)},
+                   {0, 4096, 512 * 1024}})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_ReplayCallTraceSet)->Unit(benchmark::kMillisecond);
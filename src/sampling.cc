@@ -0,0 +1,153 @@
+// Copyright 2019 Timothy Palpant
+
+#include "sampling.h"
+
+#include <Python.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "third_party/google/tcmalloc/sampler.h"
+
+namespace sampling_internal {
+
+SamplingMode g_mode = SamplingMode::kBytes;
+
+}  // namespace sampling_internal
+
+using sampling_internal::g_mode;
+
+namespace {
+
+// The bands of kStratified mode. Only changed while the hooks are not
+// installed.
+SizeBand g_bands[kMaxSizeBands];
+int g_num_bands = 0;
+// The number of sampler bytes that each byte of an allocation in a band
+// counts for: the global period over the rate of the band.
+double g_band_scales[kMaxSizeBands];
+
+// More bytes than any sampling point, so that the allocation is sampled.
+const std::size_t kAlwaysSample = std::numeric_limits<ssize_t>::max();
+
+// The band of an allocation of size bytes, or -1 if it is smaller than
+// every band.
+int FindBand(std::size_t size) {
+  int band = -1;
+  while (band + 1 < g_num_bands && g_bands[band + 1].min_size <= size) {
+    band++;
+  }
+  return band;
+}
+
+}  // namespace
+
+bool CheckSamplingConfig(const SamplingConfig &config, int64_t period) {
+  if (config.mode == SamplingMode::kStratified) {
+    if (period <= 0) {
+      PyErr_SetString(PyExc_ValueError,
+                      "stratified sampling needs a positive sample_rate");
+      return false;
+    }
+    if (config.bands.size() > kMaxSizeBands) {
+      PyErr_Format(PyExc_ValueError, "there can be at most %d strata",
+                   kMaxSizeBands);
+      return false;
+    }
+    for (std::size_t i = 0; i < config.bands.size(); i++) {
+      if (i > 0 && config.bands[i].min_size <= config.bands[i - 1].min_size) {
+        PyErr_SetString(PyExc_ValueError,
+                        "strata must be sorted by increasing size");
+        return false;
+      }
+    }
+  } else if (!config.bands.empty()) {
+    PyErr_SetString(PyExc_ValueError,
+                    "strata are only used by stratified sampling");
+    return false;
+  }
+  return true;
+}
+
+bool SetSamplingConfig(const SamplingConfig &config) {
+  const int64_t period = Sampler::GetSamplePeriod();
+  if (!CheckSamplingConfig(config, period)) {
+    return false;
+  }
+
+  g_num_bands = config.bands.size();
+  for (int i = 0; i < g_num_bands; i++) {
+    const SizeBand &band = config.bands[i];
+    g_bands[i] = band;
+    if (band.sample_rate < 0) {
+      g_band_scales[i] = 0;
+    } else if (band.sample_rate == 0) {
+      g_band_scales[i] = std::numeric_limits<double>::infinity();
+    } else {
+      g_band_scales[i] = static_cast<double>(period) / band.sample_rate;
+    }
+  }
+  g_mode = config.mode;
+  return true;
+}
+
+SamplingMode GetSamplingMode() { return g_mode; }
+
+std::size_t sampling_internal::SamplerBytesSlow(std::size_t size,
+                                                ThreadContext *context) {
+  if (g_mode == SamplingMode::kCount) {
+    // Like kBytes, allocations of 0 bytes are never sampled.
+    return (size != 0) ? 1 : 0;
+  }
+
+  const int band = FindBand(size);
+  if (size == 0 || context->region != 0 || band < 0) {
+    return size;
+  }
+  // Carry the fractions of a byte over to the next allocation, so that
+  // small allocations in sparsely sampled bands still add up.
+  const double bytes = size * g_band_scales[band] + context->sampler_carry;
+  if (bytes >= kAlwaysSample) {
+    return kAlwaysSample;
+  }
+  const double whole = std::floor(bytes);
+  context->sampler_carry = bytes - whole;
+  return static_cast<std::size_t>(whole);
+}
+
+uint64_t PointerSampleRate(std::size_t size, RegionId region) {
+  const uint64_t rate = RegionSampleRate(region);
+  switch (g_mode) {
+    case SamplingMode::kBytes:
+      break;
+    case SamplingMode::kCount:
+      if (size != 0 && rate > std::numeric_limits<uint64_t>::max() / size) {
+        return std::numeric_limits<uint64_t>::max();
+      }
+      return size * rate;
+    case SamplingMode::kStratified: {
+      const int band = FindBand(size);
+      if (region == 0 && band >= 0) {
+        return std::max<int64_t>(g_bands[band].sample_rate, 0);
+      }
+      break;
+    }
+  }
+  return rate;
+}
+
+uint64_t SnapshotSampleRate() {
+  return (g_mode == SamplingMode::kBytes) ? RegionSampleRate(0) : 0;
+}
+
+double PointerWeight(std::size_t size, RegionId region) {
+  return SampleWeight(size, PointerSampleRate(size, region));
+}
+
+double SampleWeight(double size, uint64_t rate) {
+  if (size <= 0 || rate <= 1) {
+    return 1;
+  }
+  return 1.0 / (1.0 - std::exp(-size / rate));
+}
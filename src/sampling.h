@@ -0,0 +1,88 @@
+// Copyright 2019 Timothy Palpant
+
+#ifndef MPROFILE_SRC_SAMPLING_H_
+#define MPROFILE_SRC_SAMPLING_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "region.h"
+#include "thread_context.h"
+
+// How the allocation hooks decide which allocations to sample. Every mode
+// uses the thread's Sampler, and only changes how many of its bytes an
+// allocation counts for:
+//
+// - kBytes: each byte is sampled with probability 1/sample_rate, so an
+//   allocation of size bytes is sampled with probability
+//   1 - exp(-size/sample_rate).
+// - kCount: each allocation counts for one byte, so that every allocation
+//   is sampled with probability 1 - exp(-1/sample_rate) regardless of its
+//   size.
+// - kStratified: like kBytes, but the allocations in each size band are
+//   sampled at the rate of their band. A band with a rate of 0 samples
+//   every allocation, and one with a negative rate none of them.
+//
+// Allocations made in a region are sampled at the rate of the region,
+// counting bytes or (in kCount mode) allocations.
+enum class SamplingMode { kBytes, kCount, kStratified };
+
+// The allocations of at least min_size bytes (and less than the min_size
+// of the next band) are sampled at the given rate.
+struct SizeBand {
+  std::size_t min_size;
+  int64_t sample_rate;
+};
+const int kMaxSizeBands = 8;
+
+struct SamplingConfig {
+  SamplingMode mode = SamplingMode::kBytes;
+  // The bands of kStratified mode, sorted by min_size. Allocations smaller
+  // than every band are sampled at the global rate.
+  std::vector<SizeBand> bands;
+};
+
+// Returns false with a Python exception set if the config is invalid with
+// the given global sample period.
+bool CheckSamplingConfig(const SamplingConfig &config, int64_t period);
+// Use the given config for the allocation hooks. This must be called after
+// the global sample period is set, and while the hooks are not installed.
+// Returns false with a Python exception set if the config is invalid.
+bool SetSamplingConfig(const SamplingConfig &config);
+SamplingMode GetSamplingMode();
+
+// The rate that an allocation of size bytes sampled in the given region
+// should be scaled by, as with ScaleSample: the estimated number of
+// allocations it represents is 1 / (1 - exp(-size/rate)), or 1 if the rate
+// is at most 1. In kCount mode this is size times the number of
+// allocations per sample. Since the config only changes while the hooks
+// are not installed, and region periods never change once interned, this
+// does not need the GIL.
+uint64_t PointerSampleRate(std::size_t size, RegionId region);
+
+// The rate that snapshots scale the traces that have no rate of their own
+// by. This is 0 outside of kBytes mode, where every trace has its own.
+uint64_t SnapshotSampleRate();
+
+// The estimated number of allocations that a sampled allocation of size
+// bytes represents, see PointerSampleRate.
+double PointerWeight(std::size_t size, RegionId region);
+// The same for an allocation sampled at the given rate, which is how
+// snapshots, saved profiles and ScaleSample scale their samples.
+double SampleWeight(double size, uint64_t rate);
+
+namespace sampling_internal {
+extern SamplingMode g_mode;
+std::size_t SamplerBytesSlow(std::size_t size, ThreadContext *context);
+}  // namespace sampling_internal
+
+// The number of bytes that an allocation of size bytes counts for in the
+// Sampler of the given thread.
+inline std::size_t SamplerBytes(std::size_t size, ThreadContext *context) {
+  if (LIKELY(sampling_internal::g_mode == SamplingMode::kBytes)) {
+    return size;
+  }
+  return sampling_internal::SamplerBytesSlow(size, context);
+}
+
+#endif  // MPROFILE_SRC_SAMPLING_H_
@@ -0,0 +1,308 @@
+// Copyright 2019 Timothy Palpant
+//
+// Measures taking a snapshot of a large profile: walking the live set
+// (GetSnapshot), and building the Python traces of a snapshot from it
+// (GetHeapProfile). The arguments of each benchmark are the number of
+// sampled pointers, the number of distinct stacks they are spread over,
+// and the depth of those stacks.
+//
+// A snapshot holds the profiler's lock while it walks the live set, which
+// stalls every sampled allocation and free. Each benchmark then takes one
+// more snapshot while another thread frees pointers, and reports the
+// longest of those frees as max_free_stall_us.
+
+#include <Python.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "benchmark/benchmark.h"
+#include "heap.h"
+#include "malloc_patch.h"
+#include "scoped_object.h"
+
+namespace {
+
+// The stacks are those of a leaf function, of which there is one for
+// each stack, called through a chain of depth - 1 frames.
+const char kPopulate[] = R"(
+def descend(depth, leaf, n):
+    if depth > 1:
+        return descend(depth - 1, leaf, n)
+    leaf(n)
+
+
+def populate(alloc, num_pointers, num_stacks, depth):
+    src = "".join(
+        "def leaf_%d(n):\n    alloc(n)\n" % k for k in range(num_stacks))
+    leaves = {"alloc": alloc}
+    exec(compile(src, "snapshot_bench_leaves.py", "exec"), leaves)
+    for k in range(num_stacks):
+        n = num_pointers // num_stacks + (k < num_pointers % num_stacks)
+        descend(depth - 1, leaves["leaf_%d" % k], n)
+)";
+
+// The profiler being populated, and the next fake address to sample.
+HeapProfiler *g_populating = nullptr;
+uintptr_t g_next_ptr = 0;
+
+// Well away from the real heap, since the profiler of BM_GetHeapProfile is
+// attached to the Python allocators.
+const uintptr_t kFirstPtr = 0x100000000000;
+
+// alloc(n) samples n allocations of 64 bytes at the caller's stack.
+PyObject *Alloc(PyObject *self, PyObject *arg) {
+  const Py_ssize_t n = PyLong_AsSsize_t(arg);
+  if (n < 0) {
+    return nullptr;
+  }
+  for (Py_ssize_t i = 0; i < n; i++) {
+    g_populating->HandleMalloc(reinterpret_cast<void *>(g_next_ptr), 64,
+                               false);
+    g_next_ptr += 64;
+  }
+  Py_RETURN_NONE;
+}
+
+PyMethodDef kAllocDef = {"alloc", Alloc, METH_O, nullptr};
+
+// Creates a profiler with every pointer sampled as described above. The
+// GIL must be held.
+std::unique_ptr<HeapProfiler> NewPopulatedProfiler(
+    const benchmark::State &state) {
+  Sampler::SetSamplePeriod(0);
+  ThreadSampler().ResetSamplingPoint();
+  std::unique_ptr<HeapProfiler> profiler(new HeapProfiler());
+  g_populating = profiler.get();
+  g_next_ptr = kFirstPtr;
+
+  // Code run from a "<string>" file would not have a stack.
+  PyObjectRef code(
+      Py_CompileString(kPopulate, "snapshot_bench.py", Py_file_input));
+  PyObjectRef globals(PyDict_New());
+  PyDict_SetItemString(globals.get(), "__builtins__", PyEval_GetBuiltins());
+  PyObjectRef result(
+      PyEval_EvalCode(code.get(), globals.get(), globals.get()));
+  PyObjectRef alloc(PyCFunction_New(&kAllocDef, nullptr));
+  PyObject *populate = PyDict_GetItemString(globals.get(), "populate");
+  result.reset(PyObject_CallFunction(
+      populate, "Onnn", alloc.get(), Py_ssize_t(state.range(0)),
+      Py_ssize_t(state.range(1)), Py_ssize_t(state.range(2))));
+  if (result == nullptr) {
+    PyErr_Print();
+    abort();
+  }
+  g_populating = nullptr;
+
+  // Nothing else is sampled while the benchmark runs.
+  Sampler::SetSamplePeriod(int64_t{1} << 40);
+  ThreadSampler().ResetSamplingPoint();
+  return profiler;
+}
+
+// Frees a pointer that was never sampled, so that the profiler is not
+// changed, in a loop until it is stopped.
+class FreeStallMonitor {
+ public:
+  explicit FreeStallMonitor(HeapProfiler *profiler)
+      : profiler_(profiler),
+        started_(false),
+        stop_(false),
+        max_stall_ns_(0),
+        thread_(&FreeStallMonitor::Run, this) {
+    while (!started_.load()) {
+      std::this_thread::yield();
+    }
+  }
+
+  // Stops the thread, and returns the longest free in microseconds.
+  double Stop() {
+    stop_ = true;
+    thread_.join();
+    return max_stall_ns_ / 1e3;
+  }
+
+ private:
+  void Run() {
+    void *ptr = reinterpret_cast<void *>(kFirstPtr - 64);
+    started_ = true;
+    while (!stop_.load(std::memory_order_relaxed)) {
+      const auto start = std::chrono::steady_clock::now();
+      profiler_->HandleFree(ptr);
+      const auto elapsed = std::chrono::steady_clock::now() - start;
+      max_stall_ns_ = std::max<int64_t>(
+          max_stall_ns_,
+          std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+              .count());
+    }
+  }
+
+  HeapProfiler *const profiler_;
+  std::atomic<bool> started_;
+  std::atomic<bool> stop_;
+  int64_t max_stall_ns_;
+  std::thread thread_;
+};
+
+// Runs f once more while the monitor frees pointers, after the timed
+// iterations so that the monitor does not slow them down. With a single
+// CPU the stalls would measure the scheduler instead, so they are skipped.
+template <class F>
+void SetMaxFreeStall(benchmark::State &state, HeapProfiler *profiler, F f) {
+  if (std::thread::hardware_concurrency() < 2) {
+    return;
+  }
+  FreeStallMonitor monitor(profiler);
+  f();
+  state.counters["max_free_stall_us"] = monitor.Stop();
+}
+
+void SetPopulationCounters(benchmark::State &state) {
+  state.counters["pointers"] = state.range(0);
+  state.counters["stacks"] = state.range(1);
+  state.counters["depth"] = state.range(2);
+}
+
+void BM_GetSnapshot(benchmark::State &state) {
+  auto gil_state = PyGILState_Ensure();
+  std::unique_ptr<HeapProfiler> profiler(NewPopulatedProfiler(state));
+  std::size_t snapshot_bytes = 0;
+  for (auto _ : state) {
+    std::vector<HeapProfiler::SnapshotEntry> snap = profiler->GetSnapshot();
+    snapshot_bytes = snap.capacity() * sizeof(snap[0]);
+    benchmark::DoNotOptimize(snap.data());
+  }
+  SetMaxFreeStall(state, profiler.get(), [&] { profiler->GetSnapshot(); });
+  state.counters["snapshot_bytes"] = snapshot_bytes;
+  SetPopulationCounters(state);
+  profiler.reset(nullptr);
+  PyGILState_Release(gil_state);
+}
+
+// The bytes allocated through the Python allocators while it is installed,
+// on top of whatever allocators were installed before.
+class PyMemCounter {
+ public:
+  PyMemCounter() {
+    current_ = 0;
+    peak_ = 0;
+    PyMem_GetAllocator(PYMEM_DOMAIN_MEM, &base_mem_);
+    PyMem_GetAllocator(PYMEM_DOMAIN_OBJ, &base_obj_);
+    PyMemAllocatorEx alloc = {&base_mem_, Malloc, Calloc, Realloc, Free};
+    PyMem_SetAllocator(PYMEM_DOMAIN_MEM, &alloc);
+    alloc.ctx = &base_obj_;
+    PyMem_SetAllocator(PYMEM_DOMAIN_OBJ, &alloc);
+  }
+
+  ~PyMemCounter() {
+    PyMem_SetAllocator(PYMEM_DOMAIN_MEM, &base_mem_);
+    PyMem_SetAllocator(PYMEM_DOMAIN_OBJ, &base_obj_);
+  }
+
+  // The most bytes that were allocated at once, since the last reset.
+  std::size_t peak() const { return peak_; }
+  void ResetPeak() { peak_ = current_; }
+
+ private:
+  // The GIL is held for every allocation in these domains.
+  static std::unordered_map<void *, std::size_t> sizes_;
+  static std::size_t current_;
+  static std::size_t peak_;
+
+  static void Add(void *ptr, std::size_t size) {
+    if (ptr != nullptr) {
+      sizes_[ptr] = size;
+      current_ += size;
+      peak_ = std::max(peak_, current_);
+    }
+  }
+
+  static void Remove(void *ptr) {
+    auto it = sizes_.find(ptr);
+    if (it != sizes_.end()) {
+      current_ -= it->second;
+      sizes_.erase(it);
+    }
+  }
+
+  static void *Malloc(void *ctx, size_t size) {
+    PyMemAllocatorEx *alloc = static_cast<PyMemAllocatorEx *>(ctx);
+    void *ptr = alloc->malloc(alloc->ctx, size);
+    Add(ptr, size);
+    return ptr;
+  }
+
+  static void *Calloc(void *ctx, size_t nelem, size_t elsize) {
+    PyMemAllocatorEx *alloc = static_cast<PyMemAllocatorEx *>(ctx);
+    void *ptr = alloc->calloc(alloc->ctx, nelem, elsize);
+    Add(ptr, nelem * elsize);
+    return ptr;
+  }
+
+  static void *Realloc(void *ctx, void *ptr, size_t new_size) {
+    PyMemAllocatorEx *alloc = static_cast<PyMemAllocatorEx *>(ctx);
+    void *ptr2 = alloc->realloc(alloc->ctx, ptr, new_size);
+    if (ptr2 != nullptr) {
+      Remove(ptr);
+      Add(ptr2, new_size);
+    }
+    return ptr2;
+  }
+
+  static void Free(void *ctx, void *ptr) {
+    PyMemAllocatorEx *alloc = static_cast<PyMemAllocatorEx *>(ctx);
+    Remove(ptr);
+    alloc->free(alloc->ctx, ptr);
+  }
+
+  PyMemAllocatorEx base_mem_;
+  PyMemAllocatorEx base_obj_;
+};
+
+std::unordered_map<void *, std::size_t> PyMemCounter::sizes_;
+std::size_t PyMemCounter::current_;
+std::size_t PyMemCounter::peak_;
+
+// Builds the Python traces of a snapshot, as take_snapshot() does, and
+// reports the most memory that they used at once as peak_py_bytes.
+void BM_GetHeapProfile(benchmark::State &state) {
+  auto gil_state = PyGILState_Ensure();
+  std::unique_ptr<HeapProfiler> populated(NewPopulatedProfiler(state));
+  HeapProfiler *profiler = populated.get();
+  AttachHeapProfiler(std::move(populated));
+  std::size_t peak_bytes = 0;
+  {
+    PyMemCounter counter;
+    for (auto _ : state) {
+      counter.ResetPeak();
+      PyObjectRef traces(GetHeapProfile());
+      benchmark::DoNotOptimize(traces.get());
+      peak_bytes = std::max(peak_bytes, counter.peak());
+    }
+  }
+  SetMaxFreeStall(state, profiler,
+                  [] { PyObjectRef traces(GetHeapProfile()); });
+  state.counters["peak_py_bytes"] = peak_bytes;
+  SetPopulationCounters(state);
+  DetachHeapProfiler();
+  PyGILState_Release(gil_state);
+}
+
+}  // namespace
+
+BENCHMARK(BM_GetSnapshot)
+    ->ArgsProduct({{10000, 100000, 1000000, 10000000}, {1000}, {16}})
+    ->Args({1000000, 10, 16})
+    ->Args({1000000, 100000, 16})
+    ->Args({1000000, 1000, 64})
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_GetHeapProfile)
+    ->ArgsProduct({{10000, 100000, 1000000}, {1000}, {16}})
+    ->Args({1000000, 10, 16})
+    ->Args({1000000, 100000, 16})
+    ->Args({1000000, 1000, 64})
+    ->Unit(benchmark::kMillisecond);
@@ -17,6 +17,9 @@
 #include <Python.h>
 #include <frameobject.h>
 
+#include <algorithm>
+#include <new>
+
 #include "third_party/greg7mdp/parallel-hashmap/phmap_utils.h"
 
 namespace {
@@ -36,12 +39,24 @@ bool SkipFrame(PyCodeObject *f_code) {
 
 }  // namespace
 
-void GetCurrentCallTrace(CallTrace *trace, int max_frames) {
+void GetCurrentCallTrace(CallTrace *trace, int max_frames,
+                         FrameFilter *filter) {
   trace->num_frames = 0;
   if (max_frames > kMaxFramesToCapture) {
     max_frames = kMaxFramesToCapture;
   }
 
+  const bool collapse_recursion =
+      (filter != nullptr) && filter->collapse_recursion();
+  const int root_frames =
+      (filter != nullptr) ? std::min(filter->root_frames(), max_frames) : 0;
+  // The frames nearest the leaf fill the trace first. The rest of it is a
+  // ring buffer of the last root_frames frames seen, which are only
+  // referenced once the root is reached.
+  const int leaf_frames = max_frames - root_frames;
+  int num_root_seen = 0;
+  const PyCodeObject *last_code = nullptr;
+
   PyThreadState *ts = PyGILState_GetThisThreadState();
   if (ts == nullptr) {
     return;
@@ -53,22 +68,32 @@ void GetCurrentCallTrace(CallTrace *trace, int max_frames) {
   PyFrameObject *pyframe = ts->frame;
 #endif
 
-  while (pyframe != nullptr && trace->size() < max_frames) {
+  while (pyframe != nullptr &&
+         (trace->size() < leaf_frames || root_frames > 0)) {
 #if PY_VERSION_HEX >= 0x030900B1
     PyCodeObject *f_code = PyFrame_GetCode(pyframe);
 #else
     PyCodeObject *f_code = pyframe->f_code;
 #endif
 
-    if (!SkipFrame(f_code)) {
-      Py_XINCREF(f_code->co_filename);
-      Py_XINCREF(f_code->co_name);
-      trace->push_back(FuncLoc{
+    if (!SkipFrame(f_code) &&
+        (filter == nullptr || filter->KeepFile(f_code->co_filename)) &&
+        !(collapse_recursion && f_code == last_code)) {
+      last_code = f_code;
+      const FuncLoc loc = {
         .filename = f_code->co_filename,
         .name = f_code->co_name,
         .firstlineno = f_code->co_firstlineno,
         .lineno = PyFrame_GetLineNumber(pyframe)
-      });
+      };
+      if (trace->size() < leaf_frames) {
+        Py_XINCREF(loc.filename);
+        Py_XINCREF(loc.name);
+        trace->push_back(loc);
+      } else {
+        trace->frames[leaf_frames + num_root_seen % root_frames] = loc;
+        num_root_seen++;
+      }
     }
 
 #if PY_VERSION_HEX >= 0x030900B1
@@ -84,6 +109,70 @@ void GetCurrentCallTrace(CallTrace *trace, int max_frames) {
 #if PY_VERSION_HEX >= 0x030900B1
   Py_XDECREF(pyframe);
 #endif
+
+  if (num_root_seen == 0) {
+    return;
+  }
+  // Put the ring buffer back in order from the leaf to the root.
+  auto root_begin = trace->frames.begin() + leaf_frames;
+  if (num_root_seen > root_frames) {
+    std::rotate(root_begin, root_begin + num_root_seen % root_frames,
+                root_begin + root_frames);
+  }
+  const int num_root = std::min(num_root_seen, root_frames);
+  for (int i = 0; i < num_root; i++) {
+    Py_XINCREF(root_begin[i].filename);
+    Py_XINCREF(root_begin[i].name);
+  }
+  trace->num_frames = leaf_frames + num_root;
+}
+
+bool GetCurrentFrame(FuncLoc *loc) {
+  PyThreadState *ts = PyGILState_GetThisThreadState();
+  if (ts == nullptr) {
+    return false;
+  }
+
+#if PY_VERSION_HEX >= 0x030900B1
+  PyFrameObject *pyframe = PyThreadState_GetFrame(ts);
+#else
+  PyFrameObject *pyframe = ts->frame;
+#endif
+
+  bool found = false;
+  while (pyframe != nullptr && !found) {
+#if PY_VERSION_HEX >= 0x030900B1
+    PyCodeObject *f_code = PyFrame_GetCode(pyframe);
+#else
+    PyCodeObject *f_code = pyframe->f_code;
+#endif
+
+    // The strings are kept alive by the code object, which the frame
+    // references.
+    if (!SkipFrame(f_code)) {
+      *loc = {
+        .filename = f_code->co_filename,
+        .name = f_code->co_name,
+        .firstlineno = f_code->co_firstlineno,
+        .lineno = PyFrame_GetLineNumber(pyframe)
+      };
+      found = true;
+    }
+
+#if PY_VERSION_HEX >= 0x030900B1
+    PyFrameObject *prev_frame = pyframe;
+    pyframe = found ? nullptr : PyFrame_GetBack(pyframe);
+    Py_XDECREF(f_code);
+    Py_XDECREF(prev_frame);
+#else
+    pyframe = pyframe->f_back;
+#endif
+  }
+
+#if PY_VERSION_HEX >= 0x030900B1
+  Py_XDECREF(pyframe);
+#endif
+  return found;
 }
 
 void FreeCallTrace(const CallTrace &trace) {
@@ -125,12 +214,27 @@ const CallTraceSet::TraceHandle CallTraceSet::Intern(const CallTrace &trace) {
 
     CallFrame frame{parent, loc};
     auto it = trace_leaves_.emplace(frame);
+    if (it.second && parent != nullptr) {
+      parent->children++;
+    }
     parent = &(*it.first);
   }
 
   return parent;
 }
 
+const CallTraceSet::TraceHandle CallTraceSet::InternRoot(const FuncLoc &loc) {
+  auto it = trace_leaves_.find(CallFrame{nullptr, loc});
+  if (it != trace_leaves_.end()) {
+    return &(*it);
+  }
+
+  FuncLoc interned = loc;
+  interned.filename = InternString(loc.filename);
+  interned.name = InternString(loc.name);
+  return &(*trace_leaves_.emplace(CallFrame{nullptr, interned}).first);
+}
+
 std::vector<FuncLoc> CallTraceSet::GetTrace(
     const CallTraceSet::TraceHandle h) const {
   std::vector<FuncLoc> result;
@@ -152,14 +256,76 @@ std::vector<FuncLoc> CallTraceSet::GetTrace(
   return result;
 }
 
+std::size_t CallTraceSet::RemoveUnreferenced(
+    const phmap::flat_hash_set<TraceHandle> &pinned) {
+  auto unreferenced = [&pinned](const CallFrame &frame) {
+    return !frame.totals.live() && frame.children == 0 &&
+           pinned.count(&frame) == 0;
+  };
+  std::vector<const CallFrame *> dead;
+  for (const CallFrame &frame : trace_leaves_) {
+    if (unreferenced(frame)) {
+      dead.push_back(&frame);
+    }
+  }
+
+  // Removing the last child of a frame can leave it unreferenced in turn,
+  // so whole dead subtrees are removed from the leaves up.
+  std::size_t removed = 0;
+  while (!dead.empty()) {
+    const CallFrame *frame = dead.back();
+    dead.pop_back();
+    const CallFrame *parent = frame->parent;
+    trace_leaves_.erase(CallFrame{parent, frame->loc});
+    removed++;
+    if (parent != nullptr && --parent->children == 0 &&
+        unreferenced(*parent)) {
+      dead.push_back(parent);
+    }
+  }
+  return removed;
+}
+
+void CallTraceSet::ReleaseUnusedStrings() {
+  phmap::flat_hash_set<PyObject *> used;
+  for (const CallFrame &frame : trace_leaves_) {
+    used.insert(frame.loc.filename);
+    used.insert(frame.loc.name);
+  }
+  std::vector<PyObject *> unused;
+  for (PyObject *s : string_table_) {
+    if (used.count(s) == 0) {
+      unused.push_back(s);
+    }
+  }
+  // Deallocating a string can't reach the table once they are all out of
+  // it.
+  for (PyObject *s : unused) {
+    string_table_.erase(s);
+  }
+  for (PyObject *s : unused) {
+    Py_DECREF(s);
+  }
+}
+
 void CallTraceSet::Reset() {
   for (auto &o : string_table_) {
     Py_DECREF(o);
   }
 
-  phmap::flat_hash_set<PyObject *, PyObjectHash, PyObjectStringEqual>
-      empty_string_table;
-  std::swap(string_table_, empty_string_table);
-  phmap::node_hash_set<CallFrame, TraceHash, TraceEqual> empty_trace_leaves;
-  std::swap(trace_leaves_, empty_trace_leaves);
+  ReleaseMemory();
+}
+
+void CallTraceSet::Abandon() { ReleaseMemory(); }
+
+void CallTraceSet::ReleaseMemory() {
+  // All of the containers' memory is in arena_, so rather than destroying
+  // them (which would touch every node) we unmap the arena and construct
+  // new containers in their place.
+  arena_.Reset();
+  new (&trace_leaves_) TraceLeafSet(0, TraceHash(), TraceEqual(),
+                                    ArenaAllocator<CallFrame>(&arena_));
+  new (&string_table_)
+      StringTable(0, PyObjectHash(), PyObjectStringEqual(),
+                  ArenaAllocator<PyObject *>(&arena_));
 }
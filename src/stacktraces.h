@@ -20,6 +20,8 @@
 
 #include <vector>
 
+#include "arena.h"
+#include "frame_filter.h"
 #include "third_party/greg7mdp/parallel-hashmap/phmap.h"
 
 inline bool EqualPyString(PyObject *p1, PyObject *p2) {
@@ -77,16 +79,22 @@ struct CallTrace {
 
 // Extract the current call stack trace for this Python thread.
 // Populate the result in the first N frames of the provided CallTrace, up to
-// max_frames.
+// max_frames. If filter is not null, only the frames it keeps are captured.
 //
 // Note: The CallTrace is populated with strong references to the
 // filename and name in the FuncLoc objects. The caller is responsible
 // for freeing these by calling FreeCallTrace().
-void GetCurrentCallTrace(CallTrace *trace, int max_frames);
+void GetCurrentCallTrace(CallTrace *trace, int max_frames,
+                         FrameFilter *filter = nullptr);
 
 // Free any references in the given CallTrace.
 void FreeCallTrace(CallTrace *trace);
 
+// Like GetCurrentCallTrace with a max_frames of 1 and no filter, but the
+// frame is populated with borrowed references, which stay valid while the
+// GIL is held. Returns false if the thread has no Python frame.
+bool GetCurrentFrame(FuncLoc *loc);
+
 // CallTraceSet maintains an interned set of call traces, allowing
 // for O(1) lookup while also minimizing memory usage.
 //
@@ -94,7 +102,29 @@ void FreeCallTrace(CallTrace *trace);
 // to any parent stack. Since we expect a large fraction of parent stacks
 // from the root of the program to often be reused, this helps reduce
 // memory usage to store stacks that differ only in the final leaf frames.
+// All of the frames are allocated from a private Arena.
 class CallTraceSet {
+ public:
+  // The live allocations attributed to a stack. These are maintained by
+  // the HeapProfiler under its own lock, rather than the GIL.
+  struct LiveTotals {
+    // The sampled allocations, to be scaled by the snapshot sample rate.
+    std::size_t size;
+    std::size_t count;
+    // The peak checkpoint epoch in which the totals last changed, see
+    // HeapProfiler::CheckpointPeakLocked.
+    uint64_t epoch;
+    // The number of live allocations that were sampled at a rate of their
+    // own, in a region or when samples are weighted individually (see
+    // sampling.h), and the estimated size and number of the allocations
+    // that they represent.
+    std::size_t weighted_count;
+    double scaled_size;
+    double scaled_count;
+
+    bool live() const { return count != 0 || weighted_count != 0; }
+  };
+
  private:
   struct CallFrame {
     // Pointer to parent frame in the call stack, which must be another
@@ -103,10 +133,21 @@ class CallTraceSet {
     const CallFrame *parent;
     // The location of this call frame.
     const FuncLoc loc;
+    // Totals of the live allocations whose trace ends at this frame. These
+    // are not part of the key, so they can be updated in place.
+    mutable LiveTotals totals;
+    // The number of frames interned with this one as their parent. Along
+    // with the live totals, this is the frame's reference count.
+    mutable uint32_t children;
   };
 
  public:
-  CallTraceSet() {}
+  explicit CallTraceSet(bool huge_pages = false)
+      : arena_(huge_pages),
+        trace_leaves_(0, TraceHash(), TraceEqual(),
+                      ArenaAllocator<CallFrame>(&arena_)),
+        string_table_(0, PyObjectHash(), PyObjectStringEqual(),
+                      ArenaAllocator<PyObject *>(&arena_)) {}
   ~CallTraceSet() {
     for (auto &o : string_table_) {
       Py_DECREF(o);
@@ -122,16 +163,52 @@ class CallTraceSet {
   // Intern the given CallTrace in the set, and return a handle that can be
   // used to retrieve the trace from the set later.
   const TraceHandle Intern(const CallTrace &trace);
+  // Intern a trace of the single given frame. This is a single lookup,
+  // without the CallTrace that Intern walks.
+  const TraceHandle InternRoot(const FuncLoc &loc);
   // Get the trace associated with the given handle.
   std::vector<FuncLoc> GetTrace(const TraceHandle h) const;
 
+  // The live totals of the trace with the given handle.
+  static LiveTotals &Totals(const TraceHandle h) { return h->totals; }
+  // Calls f(handle, totals) for every trace with live allocations. This
+  // takes time proportional to the number of interned frames, rather than
+  // the number of live allocations.
+  template <class F>
+  void ForEachLive(F f) const {
+    for (const CallFrame &frame : trace_leaves_) {
+      if (frame.totals.live()) {
+        f(&frame, frame.totals);
+      }
+    }
+  }
+
+  // Removes the frames that nothing refers to any more: those without live
+  // allocations (see LiveTotals::live) or frames interned below them,
+  // unless they are in pinned. The caller must hold the lock that guards
+  // the live totals. Returns the number of frames removed.
+  std::size_t RemoveUnreferenced(
+      const phmap::flat_hash_set<TraceHandle> &pinned);
+  // Drops the references held to strings that no frame uses any more, as
+  // after RemoveUnreferenced. This may deallocate them, which can run
+  // arbitrary code, so it must not be called from an allocation hook.
+  void ReleaseUnusedStrings();
+
   // The number of distinct call stacks currently in the CallTraceSet.
   std::size_t size() const { return trace_leaves_.size(); }
-  // Clear all traces and interned strings.
+  // Clear all traces and interned strings, and return their memory to
+  // the OS.
   void Reset();
+  // Like Reset, but leaks the references held to interned strings rather
+  // than touching any Python objects. This is used in forked children.
+  void Abandon();
+  // The number of bytes allocated for the traces and string table.
+  std::size_t MemoryUsage() { return arena_.MemoryUsage(); }
 
  private:
   PyObject *InternString(PyObject *s);
+  // Discard the containers and unmap all of their memory.
+  void ReleaseMemory();
 
   struct TraceEqual {
     bool operator()(const CallFrame &f1, const CallFrame &f2) const {
@@ -147,9 +224,15 @@ class CallTraceSet {
     }
   };
 
+  // Must be declared before (and so destroyed after) the containers below.
+  Arena arena_;
+
   // TraceHandle relies on reference stability, so we need to use node_hash_set
   // and can't use a flat_hash_set.
-  phmap::node_hash_set<CallFrame, TraceHash, TraceEqual> trace_leaves_;
+  typedef phmap::node_hash_set<CallFrame, TraceHash, TraceEqual,
+                               ArenaAllocator<CallFrame>>
+      TraceLeafSet;
+  TraceLeafSet trace_leaves_;
 
   struct PyObjectHash {
     std::size_t operator()(PyObject *p) const { return PyObject_Hash(p); }
@@ -162,8 +245,10 @@ class CallTraceSet {
   };
 
   // Interned set of strings referenced by CallFrames in trace_leaves_.
-  phmap::flat_hash_set<PyObject *, PyObjectHash, PyObjectStringEqual>
-      string_table_;
+  typedef phmap::flat_hash_set<PyObject *, PyObjectHash, PyObjectStringEqual,
+                               ArenaAllocator<PyObject *>>
+      StringTable;
+  StringTable string_table_;
 };
 
 inline PyObject *CallTraceSet::InternString(PyObject *s) {
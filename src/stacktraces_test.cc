@@ -118,3 +118,92 @@ TEST(CallTraceSet, Intern) {
   cts.Reset();
   EXPECT_EQ(cts.size(), 0);
 }
+
+TEST(CallTraceSet, InternRoot) {
+  PyObjectRef filename(PyUnicode_FromString("file.py"));
+  PyObjectRef name(PyUnicode_FromString("main"));
+  FuncLoc f = {
+      .filename = filename.get(),
+      .name = name.get(),
+      .firstlineno = 1,
+      .lineno = 2,
+  };
+  CallTrace trace = {{f}, 1};
+
+  // A root frame is the same trace whichever way it is interned.
+  CallTraceSet cts;
+  auto handle = cts.InternRoot(f);
+  EXPECT_EQ(cts.InternRoot(f), handle);
+  EXPECT_EQ(cts.Intern(trace), handle);
+  EXPECT_EQ(cts.size(), 1);
+  auto result = cts.GetTrace(handle);
+  ASSERT_EQ(result.size(), 1);
+  EXPECT_EQ(result[0], f);
+  cts.Reset();
+}
+
+TEST(CallTraceSet, RemoveUnreferenced) {
+  PyObjectRef filename1(PyUnicode_FromString("file1.py"));
+  PyObjectRef name1(PyUnicode_FromString("do_stuff"));
+  FuncLoc f1 = {
+      .filename = filename1.get(),
+      .name = name1.get(),
+      .firstlineno = 3,
+      .lineno = 4,
+  };
+  PyObjectRef filename2(PyUnicode_FromString("file2.py"));
+  PyObjectRef name2(PyUnicode_FromString("sleep"));
+  FuncLoc f2 = {
+      .filename = filename2.get(),
+      .name = name2.get(),
+      .firstlineno = 7,
+      .lineno = 8,
+  };
+  PyObjectRef name3(PyUnicode_FromString("main"));
+  FuncLoc f3 = {
+      .filename = filename2.get(),
+      .name = name3.get(),
+      .firstlineno = 11,
+      .lineno = 12,
+  };
+
+  CallTraceSet cts;
+  auto leaf = cts.Intern(CallTrace{{f1, f2, f3}, 3});
+  auto parent = cts.Intern(CallTrace{{f2, f3}, 2});
+  auto root = cts.InternRoot(f2);
+  EXPECT_EQ(cts.size(), 4);
+  EXPECT_EQ(Py_REFCNT(name1.get()), 2);
+
+  // Frames with live allocations, or below which there are any, are kept.
+  CallTraceSet::Totals(leaf).count = 1;
+  EXPECT_EQ(cts.RemoveUnreferenced({root}), 0);
+  EXPECT_EQ(cts.size(), 4);
+
+  // Then the whole stack goes once the leaf does.
+  CallTraceSet::Totals(leaf).count = 0;
+  CallTraceSet::Totals(root).count = 1;
+  EXPECT_EQ(cts.RemoveUnreferenced({parent}), 1);
+  EXPECT_EQ(cts.size(), 3);
+  EXPECT_EQ(cts.RemoveUnreferenced({}), 2);
+  EXPECT_EQ(cts.size(), 1);
+  auto result = cts.GetTrace(root);
+  ASSERT_EQ(result.size(), 1);
+  EXPECT_EQ(result[0], f2);
+
+  // Only the strings of the remaining frames are still referenced.
+  cts.ReleaseUnusedStrings();
+  EXPECT_EQ(Py_REFCNT(name1.get()), 1);
+  EXPECT_EQ(Py_REFCNT(filename1.get()), 1);
+  EXPECT_EQ(Py_REFCNT(name3.get()), 1);
+  EXPECT_EQ(Py_REFCNT(name2.get()), 2);
+  EXPECT_EQ(Py_REFCNT(filename2.get()), 2);
+
+  // The removed frames can be interned again.
+  leaf = cts.Intern(CallTrace{{f1, f2, f3}, 3});
+  EXPECT_EQ(cts.size(), 4);
+  EXPECT_EQ(cts.GetTrace(leaf).size(), 3);
+  CallTraceSet::Totals(root).count = 0;
+  EXPECT_EQ(cts.RemoveUnreferenced({}), 4);
+  EXPECT_EQ(cts.size(), 0);
+  cts.Reset();
+}
@@ -0,0 +1,67 @@
+// Copyright 2019 Timothy Palpant
+
+#ifndef MPROFILE_SRC_THREAD_CONTEXT_H_
+#define MPROFILE_SRC_THREAD_CONTEXT_H_
+
+#include <cstdint>
+
+#include "labels.h"
+#include "region.h"
+#include "third_party/google/tcmalloc/sampler.h"
+
+// The allocation hooks run on every allocation, so all of the state that
+// they keep per thread is kept in one ThreadContext, in one cache line.
+//
+// In a shared library, thread_local variables use the general-dynamic TLS
+// model by default, where each access may be a call to __tls_get_addr. The
+// initial-exec model is a single load relative to the thread pointer,
+// using some of the surplus static TLS space that the dynamic loader
+// reserves for libraries that are loaded later, which is plenty for one
+// cache line. Define MPROFILE_DYNAMIC_TLS to use the default model.
+#if defined(__GNUC__) && !defined(MPROFILE_DYNAMIC_TLS)
+#define MPROFILE_INITIAL_EXEC_TLS __attribute__((tls_model("initial-exec")))
+#else
+#define MPROFILE_INITIAL_EXEC_TLS
+#endif
+
+struct alignas(64) ThreadContext {
+  // Decides which of this thread's allocations are sampled.
+  Sampler sampler;
+  // The buffer is a HeapProfiler::StagingBuffer, which is private to the
+  // profiler, and staging_owner_id is the id of the HeapProfiler that it
+  // belongs to, see HeapProfiler::ThreadStagingBuffer.
+  void *staging_buffer;
+  uint32_t staging_owner_id;
+  // Set while this thread is inside one of the allocation hooks, so that
+  // nested calls between the Python allocators are not traced twice.
+  bool in_hook;
+  // The region of this thread, see region.h.
+  RegionId region;
+  // The current label set of this thread. With contextvars, this is a copy
+  // of the label set of the thread's current context, which was current
+  // when the thread state's context_ver was label_context_ver.
+  LabelSetId label_set;
+  // The fraction of a byte that the sampler is owed by the allocations in
+  // scaled size bands, see sampling.h. This needs a double: the bands of
+  // small allocations can have scales so small that each one adds less
+  // than a float can resolve next to the carry.
+  double sampler_carry;
+  uint64_t label_context_ver;
+};
+static_assert(sizeof(ThreadContext) == 64,
+              "the thread context should fit in one cache line");
+
+// The context of the calling thread.
+inline ThreadContext &CurrentThreadContext() {
+  // NOTE: Only constant expressions are safe to use as thread_local
+  // initializers in a dynamic library, which also means that the context
+  // is accessed without any guard variable.
+  static thread_local ThreadContext context MPROFILE_INITIAL_EXEC_TLS = {
+      {}, nullptr, 0, false, 0, 0, 0, 0};
+  return context;
+}
+
+// The sampler for the current thread.
+inline Sampler &ThreadSampler() { return CurrentThreadContext().sampler; }
+
+#endif  // MPROFILE_SRC_THREAD_CONTEXT_H_
@@ -0,0 +1,24 @@
+// Copyright 2019 Timothy Palpant
+//
+#include "thread_context.h"
+
+#include <thread>
+
+#include "gtest/gtest.h"
+
+TEST(ThreadContext, PerThread) {
+  ThreadContext *context = &CurrentThreadContext();
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(context) % 64, 0);
+  EXPECT_EQ(&ThreadSampler(), &context->sampler);
+  EXPECT_EQ(&CurrentThreadContext(), context);
+
+  ThreadContext *other = nullptr;
+  std::thread t([&other]() {
+    other = &CurrentThreadContext();
+    EXPECT_FALSE(other->in_hook);
+    EXPECT_EQ(other->staging_buffer, nullptr);
+    EXPECT_EQ(other->region, 0);
+  });
+  t.join();
+  EXPECT_NE(other, context);
+}
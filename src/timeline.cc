@@ -0,0 +1,55 @@
+// Copyright 2019 Timothy Palpant
+
+#include "timeline.h"
+
+MemoryTimeline::MemoryTimeline(std::size_t capacity, uint64_t interval_ns)
+    : interval_ns_(interval_ns),
+      points_(capacity),
+      next_(0),
+      size_(0),
+      next_ns_(0),
+      window_peak_(0),
+      pending_allocs_(0),
+      pending_frees_(0) {}
+
+void MemoryTimeline::Append(uint64_t now_ns, std::size_t traced) {
+  if (points_.empty()) {
+    return;
+  }
+
+  points_[next_] = {now_ns, traced, window_peak_, pending_allocs_,
+                    pending_frees_};
+  next_ = (next_ + 1) % points_.size();
+  if (size_ < points_.size()) {
+    size_++;
+  }
+  next_ns_ = now_ns + interval_ns_;
+  // The next window starts at the current level.
+  window_peak_ = traced;
+  pending_allocs_ = 0;
+  pending_frees_ = 0;
+}
+
+std::vector<TimelinePoint> MemoryTimeline::Points() const {
+  std::vector<TimelinePoint> result;
+  if (size_ == 0) {
+    return result;
+  }
+
+  result.reserve(size_);
+  std::size_t i = (next_ + points_.size() - size_) % points_.size();
+  for (std::size_t n = 0; n < size_; n++) {
+    result.push_back(points_[i]);
+    i = (i + 1) % points_.size();
+  }
+  return result;
+}
+
+void MemoryTimeline::Reset() {
+  next_ = 0;
+  size_ = 0;
+  next_ns_ = 0;
+  window_peak_ = 0;
+  pending_allocs_ = 0;
+  pending_frees_ = 0;
+}
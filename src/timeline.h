@@ -0,0 +1,89 @@
+// Copyright 2019 Timothy Palpant
+
+#ifndef MPROFILE_SRC_TIMELINE_H_
+#define MPROFILE_SRC_TIMELINE_H_
+
+#include <time.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// One point of a MemoryTimeline.
+struct TimelinePoint {
+  // CLOCK_MONOTONIC, which is also the clock of time.monotonic_ns().
+  uint64_t time_ns;
+  // The traced memory at time_ns.
+  uint64_t traced;
+  // The largest traced memory since the previous point, so that spikes
+  // between points are not lost.
+  uint64_t peak;
+  // The number of sampled allocations and frees since the previous point.
+  uint64_t allocs;
+  uint64_t frees;
+};
+
+// The number of uint64_t fields in a TimelinePoint.
+const int kTimelineFields = 5;
+
+// A fixed-size ring buffer of the traced memory over time, which keeps the
+// most recent points. Points are recorded as sampled allocations and frees
+// happen, at most once per interval, so there are no points while nothing
+// is sampled.
+//
+// Not thread-safe: the heap profiler only updates it while holding its
+// live set lock.
+class MemoryTimeline {
+ public:
+  MemoryTimeline(std::size_t capacity, uint64_t interval_ns);
+
+  std::size_t capacity() const { return points_.size(); }
+  uint64_t interval_ns() const { return interval_ns_; }
+
+  // Record that the traced memory is now traced bytes, after the given
+  // number of sampled allocations and frees. peak is the largest traced
+  // memory since the last call, which may exceed traced.
+  void Record(uint64_t now_ns, std::size_t traced, std::size_t peak,
+              uint64_t allocs, uint64_t frees) {
+    pending_allocs_ += allocs;
+    pending_frees_ += frees;
+    if (peak > window_peak_) {
+      window_peak_ = peak;
+    }
+    if (now_ns >= next_ns_) {
+      Append(now_ns, traced);
+    }
+  }
+
+  // The recorded points, oldest first.
+  std::vector<TimelinePoint> Points() const;
+  // Discard all points.
+  void Reset();
+  std::size_t MemoryUsage() const {
+    return sizeof(*this) + points_.capacity() * sizeof(TimelinePoint);
+  }
+
+ private:
+  void Append(uint64_t now_ns, std::size_t traced);
+
+  const uint64_t interval_ns_;
+  // The ring buffer, of which the size_ points ending before next_ are
+  // in use.
+  std::vector<TimelinePoint> points_;
+  std::size_t next_;
+  std::size_t size_;
+  // The earliest time of the next point.
+  uint64_t next_ns_;
+  // Accumulated since the last point.
+  uint64_t window_peak_;
+  uint64_t pending_allocs_;
+  uint64_t pending_frees_;
+};
+
+inline uint64_t MonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+#endif  // MPROFILE_SRC_TIMELINE_H_
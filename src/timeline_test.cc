@@ -0,0 +1,43 @@
+// Copyright 2019 Timothy Palpant
+//
+#include "timeline.h"
+
+#include "gtest/gtest.h"
+
+TEST(MemoryTimeline, RecordsAtMostOncePerInterval) {
+  MemoryTimeline timeline(8, 100);
+  timeline.Record(1000, 10, 10, 1, 0);
+  timeline.Record(1050, 50, 60, 2, 1);
+  timeline.Record(1080, 20, 20, 0, 1);
+  timeline.Record(1100, 30, 30, 1, 0);
+
+  auto points = timeline.Points();
+  ASSERT_EQ(points.size(), 2);
+  EXPECT_EQ(points[0].time_ns, 1000);
+  EXPECT_EQ(points[0].traced, 10);
+  EXPECT_EQ(points[0].allocs, 1);
+  EXPECT_EQ(points[1].time_ns, 1100);
+  EXPECT_EQ(points[1].traced, 30);
+  // The spike to 60 bytes between the points is kept.
+  EXPECT_EQ(points[1].peak, 60);
+  EXPECT_EQ(points[1].allocs, 3);
+  EXPECT_EQ(points[1].frees, 2);
+}
+
+TEST(MemoryTimeline, KeepsMostRecentPoints) {
+  MemoryTimeline timeline(3, 0);
+  for (uint64_t t = 1; t <= 5; t++) {
+    timeline.Record(t, t * 10, t * 10, 1, 0);
+  }
+
+  auto points = timeline.Points();
+  ASSERT_EQ(points.size(), 3);
+  EXPECT_EQ(points[0].time_ns, 3);
+  EXPECT_EQ(points[2].time_ns, 5);
+  EXPECT_EQ(points[2].peak, 50);
+
+  timeline.Reset();
+  EXPECT_TRUE(timeline.Points().empty());
+  timeline.Record(6, 5, 5, 1, 0);
+  ASSERT_EQ(timeline.Points().size(), 1);
+}
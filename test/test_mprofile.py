@@ -63,6 +63,19 @@ class TestMProfiler(unittest.TestCase):
         self.assertEqual(len(snap.traces), 1)
         self.assertEqual(len(snap.traces[0].traceback), 1)
 
+    def test_profile_1frame_sampled(self):
+        mprofile.start(max_frames=1, sample_rate=128)
+        objs = alloc_in_loop()
+        snap = mprofile.take_snapshot()
+        mprofile.stop()
+
+        for stat in snap.statistics("lineno"):
+            if stat.traceback[0].name == "alloc_in_loop":
+                break
+        else:
+            self.fail("no allocations in alloc_in_loop")
+        self.assertGreater(stat.size, 8000)
+
     def test_profile_sampler(self):
         n = 100000
         mprofile.start(sample_rate=1024)
@@ -79,6 +92,728 @@ class TestMProfiler(unittest.TestCase):
         self.assertGreaterEqual(stats[0].count, len(snap.traces))
         self.assertGreaterEqual(stats[0].size, sum(t.size for t in snap.traces))
 
+    def test_profile_realloc(self):
+        mprofile.start()
+        buf = bytearray(1024)
+        grow_buffer(buf, 256)
+        snap = mprofile.take_snapshot()
+        mprofile.stop()
+
+        # The grown buffer keeps the traceback where it was first allocated.
+        large = [t for t in snap.traces if t.size >= 256 * 1024]
+        self.assertEqual(len(large), 1)
+        self.assertEqual(large[0].traceback[-1].name, "test_profile_realloc")
+
+    def test_profile_flat_hash_map(self):
+        n = 10000
+        mprofile.start(live_set="flat_hash_map")
+        alloc_obj = [object() for _ in range(n)]
+        snap = mprofile.take_snapshot()
+        del alloc_obj
+        mprofile.stop()
+
+        self.assertGreaterEqual(len(snap.traces), n)
+
+    def test_profile_huge_pages(self):
+        mprofile.start(huge_pages=True)
+        alloc_obj = [object() for _ in range(1000)]
+        snap = mprofile.take_snapshot()
+        size = mprofile.get_tracemalloc_memory()
+        mprofile.clear_traces()
+        size2 = mprofile.get_tracemalloc_memory()
+        mprofile.stop()
+
+        self.assertGreaterEqual(len(snap.traces), 1000)
+        self.assertGreater(size, 0)
+        self.assertLess(size2, size)
+        self.assertEqual(mprofile.get_tracemalloc_memory(), 0)
+
+    def test_fork_policy(self):
+        for policy in ("inherit", "reset", "freeze"):
+            with self.subTest(fork_policy=policy):
+                mprofile.start(fork_policy=policy)
+                parent_obj = alloc_in_parent()
+                result = run_in_child(check_fork_child)
+                mprofile.stop()
+
+                self.assertEqual(result["in_snapshot"], policy == "inherit")
+                self.assertEqual(result["in_baseline"], policy == "freeze")
+
+    def test_dump_merge_profiles(self):
+        import os
+        import tempfile
+        from mprofile import merge
+
+        mprofile.start()
+        parent_obj = alloc_in_parent()
+        with tempfile.TemporaryDirectory() as tmp:
+            paths = [os.path.join(tmp, "worker%d.mprof" % i) for i in range(2)]
+            for path in paths:
+                mprofile.dump_profile(path)
+            mprofile.stop()
+            merged_path = os.path.join(tmp, "merged.mprof")
+            self.assertEqual(merge.main(["-o", merged_path] + paths), 0)
+
+            one = mprofile.load_profile(paths[0])
+            merged = mprofile.load_profile(merged_path)
+            with self.assertRaises(OSError):
+                mprofile.load_profile(os.path.join(tmp, "missing.mprof"))
+
+        one_stats = parent_alloc_stats(one)
+        merged_stats = parent_alloc_stats(merged)
+        self.assertGreaterEqual(one_stats.count, 1000)
+        self.assertEqual(merged_stats.count, 2 * one_stats.count)
+        self.assertEqual(merged_stats.size, 2 * one_stats.size)
+        self.assertEqual(merged.sample_rate, one.sample_rate)
+
+    def test_record(self):
+        import os
+        import tempfile
+        from mprofile import record
+
+        with tempfile.TemporaryDirectory() as tmp:
+            script = os.path.join(tmp, "workload.py")
+            with open(script, "w") as f:
+                f.write("objs = [object() for _ in range(1000)]\n")
+            log = os.path.join(tmp, "workload.alog")
+            self.assertEqual(record.main(["-o", log, script]), 0)
+            with open(log, "rb") as f:
+                self.assertEqual(f.read(8), b"MPALLOC1")
+            # A few bytes for each allocation and free.
+            self.assertGreater(os.path.getsize(log), 2000)
+
+    def test_record_while_profiling(self):
+        from mprofile import _profiler
+
+        mprofile.start()
+        with self.assertRaises(RuntimeError):
+            _profiler._start_recording("/dev/null")
+        mprofile.stop()
+
+    def test_snapshot_dump_load(self):
+        import os
+        import tempfile
+
+        mprofile.start()
+        parent_obj = alloc_in_parent()
+        snap = mprofile.take_snapshot()
+        mprofile.stop()
+
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, "snapshot.mprof")
+            snap.dump(path)
+            loaded = mprofile.Snapshot.load(path)
+            self.assertEqual(loaded.sample_rate, snap.sample_rate)
+            self.assertEqual(loaded.traceback_limit, snap.traceback_limit)
+            self.assertEqual(
+                loaded.statistics("traceback"), snap.statistics("traceback")
+            )
+            self.assertEqual(
+                loaded.statistics("filename", cumulative=True),
+                snap.statistics("filename", cumulative=True),
+            )
+
+            stats = parent_alloc_stats(loaded)
+            self.assertEqual(stats, parent_alloc_stats(snap))
+            trace = loaded.traces[-1]
+            self.assertGreaterEqual(trace.count, 1)
+            filtered = loaded.filter_traces([mprofile.Filter(True, __file__)])
+            self.assertEqual(parent_alloc_stats(filtered), stats)
+
+            with open(path, "r+b") as f:
+                f.truncate(100)
+            with self.assertRaises(ValueError):
+                mprofile.Snapshot.load(path)
+
+    def test_compare_to_limit(self):
+        old = mprofile.Snapshot(
+            [
+                (10, (("f", "a.py", 1, 2), ("main", "b.py", 1, 4))),
+                (66, (("g", "b.py", 1, 1),)),
+            ],
+            2,
+            sample_rate=64,
+        )
+        new = mprofile.Snapshot(
+            [
+                (10, (("f", "a.py", 1, 2), ("main", "b.py", 1, 4))),
+                (500, (("f", "a.py", 1, 5), ("main", "b.py", 1, 4)), 2),
+                (400, (("h", "c.py", 1, 578),)),
+            ],
+            2,
+            sample_rate=128,
+        )
+
+        for key_type, cumulative in (
+            ("traceback", False),
+            ("lineno", False),
+            ("filename", False),
+            ("lineno", True),
+            ("filename", True),
+        ):
+            with self.subTest(key_type=key_type, cumulative=cumulative):
+                expected = python_compare_to(new, old, key_type, cumulative)
+                diff = new.compare_to(old, key_type, cumulative)
+                self.assertEqual(diff, expected)
+                top = new.compare_to(old, key_type, cumulative, limit=2)
+                self.assertEqual(top, expected[:2])
+                self.assertEqual(new.compare_to(old, key_type, limit=0), [])
+
+        with self.assertRaises(ValueError):
+            new.compare_to(old, "lineno", limit=-1)
+        with self.assertRaises(ValueError):
+            new.compare_to(old, "traceback", cumulative=True)
+
+    def test_statistic_interval(self):
+        import math
+
+        traceback = (("f", "a.py", 1, 2),)
+        # Each block is sampled with probability 1 - exp(-1).
+        sampled = mprofile.Snapshot([(1000, traceback)] * 100, 1, sample_rate=1000)
+        (stat,) = sampled.statistics("lineno")
+        p = 1 - math.exp(-1)
+        self.assertEqual(stat.size, int(100000 / p))
+        self.assertAlmostEqual(stat.count_stderr, math.sqrt(100 * (1 - p)) / p)
+        self.assertAlmostEqual(stat.size_stderr, 1000 * stat.count_stderr)
+        low, high = stat.size_interval()
+        self.assertAlmostEqual(low, stat.size - 1.959964 * stat.size_stderr, 0)
+        self.assertAlmostEqual(high, stat.size + 1.959964 * stat.size_stderr, 0)
+        low99, high99 = stat.size_interval(0.99)
+        self.assertLess(low99, low)
+        self.assertGreater(high99, high)
+        with self.assertRaises(ValueError):
+            stat.count_interval(1)
+
+        # Blocks sampled in a region are estimated one at a time, to the
+        # same interval.
+        region = mprofile.Snapshot([(1000, traceback, 1, 0, 1000)] * 100, 1)
+        (region_stat,) = region.statistics("lineno", cumulative=True)
+        self.assertAlmostEqual(region_stat.size_stderr, stat.size_stderr)
+        self.assertAlmostEqual(region_stat.count_stderr, stat.count_stderr)
+
+        # Nothing is estimated without sampling.
+        (exact,) = mprofile.Snapshot([(1000, traceback)] * 100, 1).statistics(
+            "traceback"
+        )
+        self.assertEqual(exact.size_interval(), (100000, 100000))
+        self.assertEqual(exact.count_interval(), (100, 100))
+
+    def test_top(self):
+        mprofile.start()
+        parent_obj = alloc_in_parent()
+        top = mprofile.top(1)
+        stats = mprofile.take_snapshot().statistics("traceback")
+        mprofile.stop()
+
+        self.assertEqual(len(top), 1)
+        self.assertEqual(top[0], stats[0])
+        self.assertEqual(top, [parent_alloc_stats(stats)])
+        with self.assertRaises(RuntimeError):
+            mprofile.top()
+
+    def test_peak_snapshot(self):
+        mprofile.start(peak_hysteresis=0)
+        parent_obj = alloc_in_parent()
+        at_peak = parent_alloc_stats(mprofile.take_snapshot())
+        del parent_obj
+        peak = mprofile.get_peak_snapshot()
+        current = mprofile.take_snapshot()
+        mprofile.stop()
+
+        self.assertIsNone(parent_alloc_stats(current))
+        self.assertEqual(parent_alloc_stats(peak), at_peak)
+
+        mprofile.start()
+        with self.assertRaises(RuntimeError):
+            mprofile.get_peak_snapshot()
+        mprofile.stop()
+        with self.assertRaises(ValueError):
+            mprofile.start(peak_hysteresis=-1)
+        self.assertFalse(mprofile.is_tracing())
+
+    def test_timeline(self):
+        mprofile.start(timeline_interval=0, timeline_size=1000)
+        parent_obj = alloc_in_parent()
+        traced, peak = mprofile.get_traced_memory()
+        del parent_obj
+        timeline = mprofile.get_timeline()
+        mprofile.stop()
+
+        n = len(timeline.time_ns)
+        self.assertGreater(n, 0)
+        self.assertLessEqual(n, 1000)
+        for column in timeline:
+            self.assertEqual(len(column), n)
+        self.assertEqual(list(timeline.time_ns), sorted(timeline.time_ns))
+        self.assertLessEqual(max(timeline.peak), peak)
+        self.assertGreater(sum(timeline.allocs), 0)
+        self.assertGreater(sum(timeline.frees), 0)
+        for point_traced, point_peak in zip(timeline.traced, timeline.peak):
+            self.assertLessEqual(point_traced, point_peak)
+
+        mprofile.start()
+        with self.assertRaises(RuntimeError):
+            mprofile.get_timeline()
+        mprofile.stop()
+        with self.assertRaises(ValueError):
+            mprofile.start(timeline_interval=0, timeline_size=0)
+        self.assertFalse(mprofile.is_tracing())
+
+    def test_exclude_frames(self):
+        mprofile.start(exclude=[__file__])
+        parent_obj = alloc_in_parent()
+        excluded = mprofile.take_snapshot()
+        mprofile.stop()
+        mprofile.start(include=[__file__])
+        parent_obj = alloc_in_parent()
+        included = mprofile.take_snapshot()
+        mprofile.stop()
+        mprofile.start(exclude=mprofile.library_patterns())
+        parent_obj = alloc_in_parent()
+        application = mprofile.take_snapshot()
+        mprofile.stop()
+
+        def filenames(snap):
+            return set(f.filename for t in snap.traces for f in t.traceback)
+
+        self.assertNotIn(__file__, filenames(excluded))
+        self.assertIn(__file__, filenames(included))
+        self.assertLessEqual(filenames(included), {__file__, "<unknown>"})
+        # Allocations in the standard library are attributed to their caller.
+        self.assertNotIn(unittest.__file__, filenames(application))
+        self.assertGreaterEqual(parent_alloc_stats(application).count, 1000)
+
+        with self.assertRaises(TypeError):
+            mprofile.start(include="*.py")
+        self.assertFalse(mprofile.is_tracing())
+
+    def test_collapse_recursion(self):
+        for collapse in (False, True):
+            mprofile.start(collapse_recursion=collapse)
+            parent_obj = recurse(10, alloc_in_parent)
+            snap = mprofile.take_snapshot()
+            mprofile.stop()
+
+            names = [f.name for f in parent_alloc_stats(snap).traceback]
+            self.assertEqual(names.count("recurse"), 1 if collapse else 11)
+
+    def test_root_frames(self):
+        mprofile.start()
+        parent_obj = recurse(20, alloc_in_parent)
+        full = parent_alloc_stats(mprofile.take_snapshot()).traceback
+        mprofile.stop()
+        mprofile.start(max_frames=6, root_frames=2)
+        parent_obj = recurse(20, alloc_in_parent)
+        truncated = parent_alloc_stats(mprofile.take_snapshot()).traceback
+        mprofile.stop()
+
+        self.assertEqual(len(truncated), 6)
+        self.assertEqual(list(truncated[:2]), list(full[:2]))
+        self.assertEqual(list(truncated[2:]), list(full[-4:]))
+
+        with self.assertRaises(ValueError):
+            mprofile.start(max_frames=6, root_frames=7)
+        self.assertFalse(mprofile.is_tracing())
+
+    def test_labels(self):
+        mprofile.start()
+        with mprofile.labels(endpoint="/search"):
+            with mprofile.labels(user="a"):
+                self.assertEqual(
+                    mprofile.get_labels(), {"endpoint": "/search", "user": "a"}
+                )
+                labeled_obj = alloc_in_parent()
+        self.assertEqual(mprofile.get_labels(), {})
+        parent_obj = alloc_in_parent()
+        labeled = mprofile.take_snapshot(labels={"endpoint": "/search"})
+        snap = mprofile.take_snapshot()
+        by_endpoint = mprofile.label_statistics("endpoint")
+        by_labels = mprofile.label_statistics()
+        mprofile.stop()
+
+        labeled_stats = parent_alloc_stats(labeled)
+        self.assertGreaterEqual(labeled_stats.count, 1000)
+        self.assertGreaterEqual(len(snap.traces), len(labeled.traces) + 1000)
+        for trace in labeled.traces:
+            self.assertEqual(trace.labels["endpoint"], "/search")
+        self.assertIn({}, [t.labels for t in snap.traces])
+
+        totals = dict(
+            (tuple(stat.labels.items()), stat.count) for stat in by_endpoint
+        )
+        self.assertGreaterEqual(totals[(("endpoint", "/search"),)], 1000)
+        self.assertIn((), totals)
+        self.assertIn(
+            {"endpoint": "/search", "user": "a"}, [s.labels for s in by_labels]
+        )
+
+        with self.assertRaises(TypeError):
+            with mprofile.labels(endpoint=1):
+                pass
+
+    def test_labels_asyncio(self):
+        import asyncio
+
+        async def handle(endpoint, results):
+            with mprofile.labels(endpoint=endpoint):
+                await asyncio.sleep(0)
+                results.append((endpoint, mprofile.get_labels()))
+
+        async def serve():
+            results = []
+            await asyncio.gather(handle("/a", results), handle("/b", results))
+            return results
+
+        for endpoint, labels in asyncio.run(serve()):
+            self.assertEqual(labels, {"endpoint": endpoint})
+
+    def test_region(self):
+        # Nothing is sampled outside of a region.
+        mprofile.start(sample_rate=-1)
+        parent_obj = alloc_in_parent()
+        with mprofile.region(sample_rate=1):
+            region_obj = recurse(1, alloc_in_parent)
+            with mprofile.region(enabled=False):
+                disabled_obj = recurse(3, alloc_in_parent)
+        self.assertEqual(mprofile.get_sample_rate(), -1)
+        snap = mprofile.take_snapshot()
+        mprofile.stop()
+
+        depths = set()
+        for trace in snap.traces:
+            names = [frame.name for frame in trace.traceback]
+            if "alloc_in_parent" in names:
+                depths.add(names.count("recurse"))
+                self.assertEqual(trace._trace[4], 1)
+        self.assertEqual(depths, {2})
+        stats = parent_alloc_stats(snap)
+        self.assertGreaterEqual(stats.count, 1000)
+        self.assertLess(stats.count, 1100)
+
+        with self.assertRaises(ValueError):
+            with mprofile.region(sample_rate=-2):
+                pass
+
+    def test_pause(self):
+        mprofile.start()
+        parent_obj = alloc_in_parent()
+        mprofile.pause()
+        self.assertTrue(mprofile.is_paused())
+        self.assertTrue(mprofile.is_tracing())
+        paused_obj = recurse(1, alloc_in_parent)
+        # Frees are still tracked while paused.
+        del parent_obj
+        paused = mprofile.take_snapshot()
+        mprofile.resume()
+        self.assertFalse(mprofile.is_paused())
+        resumed_obj = alloc_in_parent()
+        resumed = mprofile.take_snapshot()
+        mprofile.stop()
+
+        self.assertIsNone(parent_alloc_stats(paused))
+        stats = parent_alloc_stats(resumed)
+        self.assertGreaterEqual(stats.count, 1000)
+        self.assertNotIn("recurse", [frame.name for frame in stats.traceback])
+
+        self.assertFalse(mprofile.is_paused())
+        with self.assertRaises(RuntimeError):
+            mprofile.pause()
+
+    def test_large_sample_rate(self):
+        # Sample rates do not need to fit in 32 bits.
+        mprofile.start(sample_rate=1 << 40)
+        self.assertEqual(mprofile.get_sample_rate(), 1 << 40)
+        with mprofile.region(sample_rate=1 << 33):
+            obj = alloc_in_parent()
+        mprofile.stop()
+
+    def test_count_sampling(self):
+        # Every allocation is sampled with probability about 1/100, so the
+        # many small objects are estimated as well as the large list.
+        import os
+        import tempfile
+
+        mprofile.start(sample_rate=100, sampling="count")
+        objs = alloc_many()
+        self.assertEqual(mprofile._snapshot_sample_rate(), 0)
+        snap = mprofile.take_snapshot()
+        with tempfile.TemporaryDirectory() as tmp:
+            path = os.path.join(tmp, "heap.mprof")
+            mprofile.dump_profile(path)
+            mprofile.stop()
+            loaded = many_alloc_stats(mprofile.load_profile(path))
+
+        for trace in snap.traces:
+            self.assertEqual(trace._trace[4], 100 * trace.size)
+        stats = many_alloc_stats(snap)
+        self.assertGreater(stats.count, 80000)
+        self.assertLess(stats.count, 120000)
+        low, high = stats.count_interval(0.999)
+        self.assertLess(low, 100000)
+        self.assertGreater(high, 100000)
+        # Saved profiles keep the estimates.
+        self.assertLess(abs(loaded.count - stats.count), 0.05 * stats.count)
+
+    def test_stratified_sampling(self):
+        # Nothing is sampled at the global rate, but the small objects are
+        # sampled at a rate of their own.
+        mprofile.start(
+            sample_rate=1 << 40,
+            sampling="stratified",
+            strata=[(1, 1600), (4096, 1 << 40)],
+        )
+        objs = alloc_many()
+        snap = mprofile.take_snapshot()
+        mprofile.stop()
+
+        stats = many_alloc_stats(snap)
+        self.assertGreater(stats.count, 80000)
+        self.assertLess(stats.count, 120000)
+        # The snapshot can be dumped and diffed like any other.
+        diff = snap.compare_to(snap, "traceback")
+        self.assertTrue(all(d.size_diff == 0 for d in diff))
+
+    def test_start_invalid_sampling(self):
+        with self.assertRaises(ValueError):
+            mprofile.start(sampling="random")
+        with self.assertRaises(ValueError):
+            mprofile.start(strata=[(1, 1600)])
+        with self.assertRaises(ValueError):
+            mprofile.start(sampling="stratified", strata=[(1, 1600)])
+        with self.assertRaises(ValueError):
+            mprofile.start(
+                sample_rate=1024, sampling="stratified", strata=[(64, 1), (8, 1)]
+            )
+        with self.assertRaises(TypeError):
+            mprofile.start(sample_rate=1024, sampling="stratified", strata=[64])
+        self.assertFalse(mprofile.is_tracing())
+
+    def test_start_invalid_fork_policy(self):
+        with self.assertRaises(ValueError):
+            mprofile.start(fork_policy="spoon")
+        self.assertFalse(mprofile.is_tracing())
+
+    def test_start_invalid_live_set(self):
+        with self.assertRaises(ValueError):
+            mprofile.start(live_set="btree")
+        self.assertFalse(mprofile.is_tracing())
+
+    def test_collect_stacks(self):
+        import sys
+        from mprofile._profiler import _collect_stacks
+
+        name = sys.intern("collected_leaf")
+        leaves = {}
+        exec(
+            compile(
+                "def collected_leaf():\n    return [object()]\n",
+                "collected_leaves.py",
+                "exec",
+            ),
+            leaves,
+        )
+        refs = sys.getrefcount(name)
+        mprofile.start()
+        obj = leaves["collected_leaf"]()
+        # The profiler holds the names of the stacks it has seen.
+        self.assertEqual(sys.getrefcount(name), refs + 1)
+        self.assertTrue(_collect_stacks())
+        self.assertEqual(sys.getrefcount(name), refs + 1)
+        del obj
+        self.assertTrue(_collect_stacks())
+        self.assertEqual(sys.getrefcount(name), refs)
+        mprofile.stop()
+        self.assertFalse(_collect_stacks())
+
+    def test_mark(self):
+        mprofile.start()
+        parent_obj = alloc_in_parent()
+        since = mprofile.mark()
+        loop_objs = alloc_in_loop()
+        until = mprofile.mark()
+        buf = bytearray()
+        grow_buffer(buf, 10)
+        after = mprofile.take_snapshot(since=since)
+        between = mprofile.take_snapshot(since=since, until=until)
+        before = mprofile.take_snapshot(until=since)
+        mprofile.stop()
+
+        self.assertGreater(until, since)
+        self.assertFalse(has_parent_allocs(after))
+        self.assertIsNotNone(alloc_stats(after, "alloc_in_loop"))
+        self.assertIsNotNone(alloc_stats(after, "grow_buffer"))
+        self.assertFalse(has_parent_allocs(between))
+        self.assertEqual(
+            alloc_stats(between, "alloc_in_loop"),
+            alloc_stats(after, "alloc_in_loop"),
+        )
+        self.assertIsNone(alloc_stats(between, "grow_buffer"))
+        self.assertIsNotNone(parent_alloc_stats(before))
+        self.assertIsNone(alloc_stats(before, "alloc_in_loop"))
+
+        mprofile.start()
+        with self.assertRaises(ValueError):
+            mprofile.take_snapshot(since=-1)
+        mprofile.stop()
+
+    def test_labels_other_context_var(self):
+        import contextvars
+
+        var = contextvars.ContextVar("other")
+        var.set(1)
+        mprofile.start()
+        with mprofile.labels(endpoint="/s"):
+            self.assertEqual(mprofile.get_labels(), {"endpoint": "/s"})
+            inner = contextvars.copy_context()
+            var.set(2)
+        self.assertEqual(mprofile.get_labels(), {})
+        self.assertEqual(inner.run(mprofile.get_labels), {"endpoint": "/s"})
+        self.assertEqual(mprofile.get_labels(), {})
+        mprofile.stop()
+
+    def test_region_estimates(self):
+        import os
+        import tempfile
+
+        # Blocks sampled in a region are scaled by its rate, rather than the
+        # global one, everywhere that they are estimated.
+        mprofile.start(sample_rate=512 * 1024, peak_hysteresis=0)
+        with mprofile.region(sample_rate=1):
+            parent_obj = alloc_in_parent()
+        snap = mprofile.take_snapshot()
+        top = parent_alloc_stats(mprofile.top(1000))
+        peak = parent_alloc_stats(mprofile.get_peak_snapshot())
+        mprofile.stop()
+
+        stats = parent_alloc_stats(snap)
+        self.assertGreaterEqual(stats.count, 1000)
+        self.assertLess(stats.count, 1100)
+        expected = (stats.size, stats.count)
+        self.assertEqual((top.size, top.count), expected)
+        # The peak may be checkpointed while the list is being resized.
+        self.assertAlmostEqual(peak.size, stats.size, delta=stats.size / 10)
+        self.assertAlmostEqual(peak.count, stats.count, delta=10)
+        diff = parent_alloc_stats(
+            snap.compare_to(mprofile.Snapshot([], 1), "traceback")
+        )
+        self.assertEqual((diff.size_diff, diff.count_diff), expected)
+        with tempfile.TemporaryDirectory() as tmpdir:
+            path = os.path.join(tmpdir, "region.mprof")
+            snap.dump(path)
+            loaded = parent_alloc_stats(mprofile.Snapshot.load(path))
+        self.assertEqual((loaded.size, loaded.count), expected)
+
+
+def grow_buffer(buf, n):
+    for _ in range(n):
+        buf.extend(b"x" * 1024)
+
+
+def alloc_in_parent():
+    return [object() for _ in range(1000)]
+
+
+def alloc_in_loop():
+    objs = []
+    for _ in range(1000):
+        objs.append(object())
+    return objs
+
+
+def alloc_many():
+    return [object() for _ in range(100000)]
+
+
+def many_alloc_stats(snap):
+    for stat in snap.statistics("traceback"):
+        if any(frame.name == "alloc_many" for frame in stat.traceback):
+            return stat
+
+
+def alloc_stats(snap, name):
+    for stat in snap.statistics("traceback"):
+        if any(frame.name == name for frame in stat.traceback):
+            return stat
+
+
+def has_parent_allocs(snap):
+    return any(
+        frame.name == "alloc_in_parent"
+        for trace in snap.traces
+        for frame in trace.traceback
+    )
+
+
+def parent_alloc_stats(snap):
+    stats = snap if isinstance(snap, list) else snap.statistics("traceback")
+    for stat in stats:
+        if any(frame.name == "alloc_in_parent" for frame in stat.traceback):
+            return stat
+
+
+def python_compare_to(new, old, key_type, cumulative):
+    """Reference implementation of Snapshot.compare_to."""
+    old_group = old._group_by(key_type, cumulative)
+    stats = []
+    for traceback, stat in new._group_by(key_type, cumulative).items():
+        previous = old_group.pop(traceback, None)
+        old_size, old_count = (0, 0) if previous is None else (
+            previous.size,
+            previous.count,
+        )
+        stats.append(
+            mprofile.StatisticDiff(
+                traceback,
+                stat.size,
+                stat.size - old_size,
+                stat.count,
+                stat.count - old_count,
+            )
+        )
+    for traceback, stat in old_group.items():
+        stats.append(mprofile.StatisticDiff(traceback, 0, -stat.size, 0, -stat.count))
+    stats.sort(reverse=True, key=mprofile.StatisticDiff._sort_key)
+    return stats
+
+
+def recurse(n, f):
+    if n == 0:
+        return f()
+    return recurse(n - 1, f)
+
+
+def check_fork_child():
+    result = {"in_snapshot": has_parent_allocs(mprofile.take_snapshot())}
+    try:
+        baseline = mprofile.take_baseline_snapshot()
+        result["in_baseline"] = has_parent_allocs(baseline)
+    except RuntimeError:
+        result["in_baseline"] = False
+    return result
+
+
+def run_in_child(fn):
+    """Runs fn in a forked child and returns its JSON-encodable result."""
+    import json
+    import os
+
+    r, w = os.pipe()
+    pid = os.fork()
+    if pid == 0:
+        os.close(r)
+        try:
+            data = json.dumps(fn())
+        except BaseException as e:
+            data = json.dumps({"error": repr(e)})
+        os.write(w, data.encode())
+        os._exit(0)
+
+    os.close(w)
+    with os.fdopen(r) as f:
+        data = f.read()
+    os.waitpid(pid, 0)
+    return json.loads(data)
+
 
 if __name__ == "__main__":
     unittest.main()
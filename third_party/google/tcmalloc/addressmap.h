@@ -103,12 +103,17 @@ class AddressMap {
  public:
   typedef void* (*Allocator)(std::size_t size);
   typedef void  (*DeAllocator)(void* ptr);
+  // Allocator/deallocator that take an extra context argument.
+  typedef void* (*ArgAllocator)(void* arg, std::size_t size);
+  typedef void  (*ArgDeAllocator)(void* arg, void* ptr);
   typedef const void* Key;
 
   // Create an AddressMap that uses the specified allocator/deallocator.
   // The allocator/deallocator should behave like malloc/free.
   // For instance, the allocator does not need to return initialized memory.
   AddressMap(Allocator alloc, DeAllocator dealloc);
+  // As above, but arg is passed to every call of alloc and dealloc.
+  AddressMap(ArgAllocator alloc, ArgDeAllocator dealloc, void* arg);
   ~AddressMap();
   // Not copyable or assignable.
   AddressMap(const AddressMap &) = delete;
@@ -254,13 +259,29 @@ class AddressMap {
 
   Allocator     alloc_;                 // The allocator
   DeAllocator   dealloc_;               // The deallocator
+  ArgAllocator  arg_alloc_;             // The allocator, if arg_ is used
+  ArgDeAllocator arg_dealloc_;          // The deallocator, if arg_ is used
+  void*         arg_;                   // Argument for arg_alloc_/dealloc_
   Object*       allocated_;             // List of allocated objects
 
+  void* Allocate(std::size_t size) {
+    return (arg_alloc_ != nullptr) ? (*arg_alloc_)(arg_, size)
+                                   : (*alloc_)(size);
+  }
+
+  void Deallocate(void* ptr) {
+    if (arg_dealloc_ != nullptr) {
+      (*arg_dealloc_)(arg_, ptr);
+    } else {
+      (*dealloc_)(ptr);
+    }
+  }
+
   // Allocates a zeroed array of T with length "num".  Also inserts
   // the allocated block into a linked list so it can be deallocated
   // when we are all done.
   template <class T> T* New(int num) {
-    void* ptr = (*alloc_)(sizeof(Object) + num*sizeof(T));
+    void* ptr = Allocate(sizeof(Object) + num*sizeof(T));
     std::memset(ptr, 0, sizeof(Object) + num*sizeof(T));
     Object* obj = reinterpret_cast<Object*>(ptr);
     obj->next = allocated_;
@@ -276,6 +297,22 @@ AddressMap<Value>::AddressMap(Allocator alloc, DeAllocator dealloc)
   : free_(nullptr),
     alloc_(alloc),
     dealloc_(dealloc),
+    arg_alloc_(nullptr),
+    arg_dealloc_(nullptr),
+    arg_(nullptr),
+    allocated_(nullptr) {
+  hashtable_ = New<Cluster*>(kHashSize);
+}
+
+template <class Value>
+AddressMap<Value>::AddressMap(ArgAllocator alloc, ArgDeAllocator dealloc,
+                              void* arg)
+  : free_(nullptr),
+    alloc_(nullptr),
+    dealloc_(nullptr),
+    arg_alloc_(alloc),
+    arg_dealloc_(dealloc),
+    arg_(arg),
     allocated_(nullptr) {
   hashtable_ = New<Cluster*>(kHashSize);
 }
@@ -285,7 +322,7 @@ AddressMap<Value>::~AddressMap() {
   // De-allocate all of the objects we allocated
   for (Object* obj = allocated_; obj != nullptr; /**/) {
     Object* next = obj->next;
-    (*dealloc_)(obj);
+    Deallocate(obj);
     obj = next;
   }
 }
@@ -295,7 +332,7 @@ void AddressMap<Value>::Reset() {
   // De-allocate all of the objects we allocated
   for (Object* obj = allocated_; obj != nullptr; /**/) {
     Object* next = obj->next;
-    (*dealloc_)(obj);
+    Deallocate(obj);
     obj = next;
   }
 
@@ -35,12 +35,73 @@
 
 #include "sampler.h"
 
-#include <algorithm>  // For min()
 #include <math.h>
 
-using std::min;
+std::atomic<int64_t> Sampler::sampling_rate_{0};
+std::atomic<uint32_t> Sampler::sampling_epoch_{0};
+const ssize_t Sampler::kMaxSamplingInterval;
 
-int Sampler::sampling_rate_ = 0;
+const float kSamplerLog2Table[257] = {
+    0.0f, 0.00562454919f, 0.0112272554f, 0.0168082877f, 0.022367813f,
+    0.0279059966f, 0.0334230015f, 0.0389189893f, 0.0443941194f, 0.0498485495f,
+    0.0552824355f, 0.0606959317f, 0.0660891905f, 0.0714623626f, 0.0768155971f,
+    0.0821490414f, 0.0874628413f, 0.0927571409f, 0.098032083f, 0.103287808f,
+    0.108524457f, 0.113742166f, 0.118941073f, 0.124121312f, 0.129283017f,
+    0.13442632f, 0.139551352f, 0.144658243f, 0.14974712f, 0.154818109f,
+    0.159871337f, 0.164906927f, 0.169925001f, 0.174925683f, 0.17990909f,
+    0.184875343f, 0.189824559f, 0.194756854f, 0.199672345f, 0.204571144f,
+    0.209453366f, 0.214319121f, 0.21916852f, 0.224001674f, 0.22881869f,
+    0.233619677f, 0.238404739f, 0.243173983f, 0.247927513f, 0.252665432f,
+    0.257387843f, 0.262094845f, 0.266786541f, 0.271463028f, 0.276124405f,
+    0.28077077f, 0.285402219f, 0.290018847f, 0.294620749f, 0.299208018f,
+    0.303780748f, 0.30833903f, 0.312882955f, 0.317412614f, 0.321928095f,
+    0.326429487f, 0.330916878f, 0.335390355f, 0.339850003f, 0.344295908f,
+    0.348728154f, 0.353146825f, 0.357552005f, 0.361943774f, 0.366322214f,
+    0.370687407f, 0.375039431f, 0.379378367f, 0.383704292f, 0.388017285f,
+    0.392317423f, 0.396604781f, 0.400879436f, 0.405141463f, 0.409390936f,
+    0.413627929f, 0.417852515f, 0.422064766f, 0.426264755f, 0.430452552f,
+    0.434628228f, 0.438791853f, 0.442943496f, 0.447083226f, 0.451211112f,
+    0.45532722f, 0.459431619f, 0.463524373f, 0.46760555f, 0.471675214f,
+    0.475733431f, 0.479780264f, 0.483815777f, 0.487840034f, 0.491853096f,
+    0.495855027f, 0.499845887f, 0.503825738f, 0.50779464f, 0.511752654f,
+    0.515699838f, 0.519636253f, 0.523561956f, 0.527477006f, 0.531381461f,
+    0.535275377f, 0.539158811f, 0.54303182f, 0.54689446f, 0.550746785f,
+    0.554588852f, 0.558420713f, 0.562242424f, 0.566054038f, 0.569855608f,
+    0.573647187f, 0.577428828f, 0.581200582f, 0.584962501f, 0.588714636f,
+    0.592457037f, 0.596189756f, 0.599912842f, 0.603626345f, 0.607330314f,
+    0.611024797f, 0.614709844f, 0.618385502f, 0.622051819f, 0.625708843f,
+    0.62935662f, 0.632995197f, 0.636624621f, 0.640244936f, 0.64385619f,
+    0.647458426f, 0.651051691f, 0.654636029f, 0.658211483f, 0.661778098f,
+    0.665335917f, 0.668884984f, 0.672425342f, 0.675957033f, 0.6794801f,
+    0.682994584f, 0.686500527f, 0.689997971f, 0.693486957f, 0.696967526f,
+    0.700439718f, 0.703903573f, 0.707359132f, 0.710806434f, 0.714245518f,
+    0.717676423f, 0.721099189f, 0.724513853f, 0.727920455f, 0.731319031f,
+    0.73470962f, 0.73809226f, 0.741466986f, 0.744833837f, 0.74819285f,
+    0.751544059f, 0.754887502f, 0.758223215f, 0.761551232f, 0.764871591f,
+    0.768184325f, 0.77148947f, 0.77478706f, 0.77807713f, 0.781359714f,
+    0.784634846f, 0.787902559f, 0.791162889f, 0.794415866f, 0.797661526f,
+    0.8008999f, 0.804131021f, 0.807354922f, 0.810571635f, 0.813781191f,
+    0.816983623f, 0.820178962f, 0.82336724f, 0.826548487f, 0.829722735f,
+    0.832890014f, 0.836050355f, 0.839203788f, 0.842350343f, 0.845490051f,
+    0.84862294f, 0.851749041f, 0.854868383f, 0.857980995f, 0.861086906f,
+    0.864186145f, 0.86727874f, 0.87036472f, 0.873444113f, 0.876516947f,
+    0.87958325f, 0.882643049f, 0.885696373f, 0.888743249f, 0.891783703f,
+    0.894817763f, 0.897845456f, 0.900866808f, 0.903881846f, 0.906890596f,
+    0.909893084f, 0.912889336f, 0.915879379f, 0.918863237f, 0.921840937f,
+    0.924812504f, 0.927777962f, 0.930737338f, 0.933690655f, 0.936637939f,
+    0.939579214f, 0.942514505f, 0.945443836f, 0.948367232f, 0.951284715f,
+    0.95419631f, 0.957102042f, 0.960001932f, 0.962896005f, 0.965784285f,
+    0.968666793f, 0.971543554f, 0.97441459f, 0.977279923f, 0.980139578f,
+    0.982993575f, 0.985841937f, 0.988684687f, 0.991521846f, 0.994353437f,
+    0.997179481f, 1.0f,
+};
+
+void Sampler::SetSamplePeriod(int64_t sampling_rate) {
+  sampling_rate_.store(sampling_rate, std::memory_order_relaxed);
+  // Release, so that a sampler that sees the new epoch also sees the new
+  // period.
+  sampling_epoch_.fetch_add(1, std::memory_order_release);
+}
 
 // Run this before using your sampler
 void Sampler::Init(uint64_t seed) {
@@ -56,8 +117,6 @@ void Sampler::Init(uint64_t seed) {
   bytes_until_sample_ = PickNextSamplingPoint();
 }
 
-#define MAX_SSIZE (static_cast<ssize_t>(static_cast<size_t>(static_cast<ssize_t>(-1)) >> 1))
-
 // Generates a geometric variable with the specified mean (512K by default).
 // This is done by generating a random number between 0 and 1 and applying
 // the inverse cumulative distribution function for an exponential.
@@ -68,47 +127,95 @@ void Sampler::Init(uint64_t seed) {
 // log_e(q) = -mx
 // -log_e(q)/m = x
 // log_2(q) * (-log_e(2) * 1/m) = x
-// In the code, q is actually in the range 1 to 2**26, hence the -26 below
+// In the code, q is actually in the range 1 to 2**26, hence the -26 below.
+// log_2 is computed with a table rather than libm, since this runs once
+// per sample.
+double Sampler::NextInterval(int64_t period) {
+  rnd_ = NextRandom(rnd_);
+  // Take the top 26 bits as the random number, which bounds the interval
+  // at 26 * log(2), or about 18, times the period. Callers cap it further
+  // at kMaxSamplingInterval (see SetSamplingPoint), and a capped point
+  // draws the interval again in RecordAllocationSlow.
+  const uint64_t prng_mod_power = 48;  // Number of bits in prng
+  const uint32_t q = static_cast<uint32_t>(rnd_ >> (prng_mod_power - 26)) + 1;
+  // Put the computed p-value through the CDF of a geometric.
+  return (26 - FastLog2(q)) * (log(2.0) * period);
+}
+
+void Sampler::SetSamplingPoint(double interval) {
+  capped_ = interval > kMaxSamplingInterval;
+  bytes_until_sample_ =
+      capped_ ? kMaxSamplingInterval : static_cast<ssize_t>(interval);
+}
+
 ssize_t Sampler::PickNextSamplingPoint() {
-  if (sampling_rate_ < 0) {
+  epoch_ = sampling_epoch_.load(std::memory_order_acquire);
+  const int64_t sampling_rate = period();
+  if (sampling_rate < 0) {
     // In this case, we don't want to sample ever, and the larger a
     // value we put here, the longer until we hit the slow path
     // again. However, we have to support the flag changing at
     // runtime, so pick something reasonably large (to keep overhead
     // low) but small enough that we'll eventually start to sample
     // again.
-    return 16 << 20;
-  } else if (sampling_rate_ == 0) {
-    return 0;
+    capped_ = true;
+    return kMaxSamplingInterval;
   }
+  SetSamplingPoint(NextInterval(sampling_rate));
+  return bytes_until_sample_;
+}
 
-  rnd_ = NextRandom(rnd_);
-  // Take the top 26 bits as the random number
-  // (This plus the 1<<58 sampling bound give a max possible step of
-  // 5194297183973780480 bytes.)
-  const uint64_t prng_mod_power = 48;  // Number of bits in prng
-  // The uint32_t cast is to prevent a (hard-to-reproduce) NAN
-  // under piii debug for some binaries.
-  double q = static_cast<uint32_t>(rnd_ >> (prng_mod_power - 26)) + 1.0;
-  // Put the computed p-value through the CDF of a geometric.
-  double interval =
-      (log2(q) - 26) * (-log(2.0) * sampling_rate_);
+bool Sampler::RecordAllocationSlow(size_t k) {
+  if (!initialized_) {
+    initialized_ = true;
+    Init(reinterpret_cast<uintptr_t>(this));
+  } else if (epoch_ != sampling_epoch_.load(std::memory_order_relaxed)) {
+    // The sampling point was picked with an old period, so pick it again
+    // as if this allocation was the first.
+    bytes_until_sample_ = PickNextSamplingPoint();
+  }
+  if (static_cast<size_t>(bytes_until_sample_) >= k) {
+    bytes_until_sample_ -= k;
+    return true;
+  }
+  if (!capped_) {
+    bytes_until_sample_ = PickNextSamplingPoint();
+    return false;
+  }
+
+  // No byte is marked before a capped sampling point, so draw the distance
+  // from there to the next marked byte again.
+  k -= bytes_until_sample_;
+  const int64_t sampling_rate = period();
+  if (sampling_rate < 0) {
+    bytes_until_sample_ = PickNextSamplingPoint();
+    return true;
+  }
+  const double interval = NextInterval(sampling_rate);
+  if (interval < k) {
+    bytes_until_sample_ = PickNextSamplingPoint();
+    return false;
+  }
+  SetSamplingPoint(interval - k);
+  return true;
+}
 
-  // Very large values of interval overflow ssize_t. If we happen to
-  // hit such improbable condition, we simply cheat and clamp interval
-  // to largest supported value.
-  return static_cast<ssize_t>(std::min<double>(interval, MAX_SSIZE));
+void Sampler::SetPeriodOverride(int64_t sampling_rate) {
+  has_period_override_ = true;
+  period_override_ = sampling_rate;
+  ResetSamplingPoint();
 }
 
-bool Sampler::RecordAllocationSlow(size_t k) {
+void Sampler::ClearPeriodOverride() {
+  has_period_override_ = false;
+  ResetSamplingPoint();
+}
+
+void Sampler::ResetSamplingPoint() {
   if (!initialized_) {
     initialized_ = true;
     Init(reinterpret_cast<uintptr_t>(this));
-    if (static_cast<size_t>(bytes_until_sample_) >= k) {
-      bytes_until_sample_ -= k;
-      return true;
-    }
+  } else {
+    bytes_until_sample_ = PickNextSamplingPoint();
   }
-  bytes_until_sample_ = PickNextSamplingPoint();
-  return sampling_rate_ < 0;
 }
@@ -36,6 +36,7 @@
 #define PYPPROF_SRC_SAMPLER_H_
 
 #include <assert.h>
+#include <atomic>
 #include <cstdint>
 #include <sys/types.h>
 #include <unistd.h>
@@ -94,6 +95,13 @@
 // allocation until the next marked byte. This ensures that
 // very large allocations which would intersect many marked bytes
 // only result in a single call to PickNextSamplingPoint.
+//
+// Sampling points further away than kMaxSamplingInterval are capped
+// there, and the slow path at a capped point draws the distance to
+// the marked byte again rather than sampling. By the memoryless
+// property this does not change which allocations are sampled, but it
+// bounds how far a thread allocates before it notices that the sample
+// period has changed.
 //-------------------------------------------------------------------
 
 class Sampler {
@@ -101,6 +109,14 @@ class Sampler {
   // Initialize this sampler.
   void Init(uint64_t seed);
 
+  // Initialize this sampler with a new seed, discarding any current state.
+  // This is used so that a forked child does not make the same sampling
+  // decisions as its parent.
+  void Reseed(uint64_t seed) {
+    initialized_ = true;
+    Init(seed);
+  }
+
   // Record allocation of "k" bytes.  Return true if no further work
   // is need, and false if allocation needed to be sampled.
   bool RecordAllocation(size_t k);
@@ -115,19 +131,55 @@ class Sampler {
   // "escalate" to fuller and slower logic only if necessary.
   bool TryRecordAllocationFast(size_t k);
 
-  // Generate a geometric with mean 512K (or FLAG_tcmalloc_sample_parameter)
+  // Generate a geometric with mean 512K (or FLAG_tcmalloc_sample_parameter),
+  // capped at kMaxSamplingInterval.
   ssize_t PickNextSamplingPoint();
 
-  static void SetSamplePeriod(int sampling_rate) { sampling_rate_ = sampling_rate; }
-  static int GetSamplePeriod() { return sampling_rate_; }
+  // Set the period of every sampler that has no override (negative to
+  // never sample). This may be called while other threads allocate: each
+  // of them picks a new sampling point with the new period at its next
+  // slow path, which is at most kMaxSamplingInterval bytes away.
+  static void SetSamplePeriod(int64_t sampling_rate);
+  static int64_t GetSamplePeriod() {
+    return sampling_rate_.load(std::memory_order_relaxed);
+  }
+
+  // Sample this thread's allocations with the given period rather than the
+  // global one (negative to never sample), until ClearPeriodOverride. The
+  // next sampling point is picked again, so this takes effect immediately.
+  // The fast path is unchanged: the period is only read when a new
+  // sampling point is picked.
+  void SetPeriodOverride(int64_t sampling_rate);
+  void ClearPeriodOverride();
+
+  // Pick the next sampling point with the current period, initializing
+  // the sampler first if needed.
+  void ResetSamplingPoint();
+
+  // The largest sampling point that is picked, and the one picked when
+  // sampling is disabled.
+  static const ssize_t kMaxSamplingInterval = 16 << 20;
 
   // The following are public for the purposes of testing
   static uint64_t NextRandom(uint64_t rnd_);  // Returns the next prng value
 
+  // Returns log2(q) for 1 <= q < 2**32, to within 4e-6.
+  static double FastLog2(uint32_t q);
+
  private:
   bool RecordAllocationSlow(size_t k);
+  int64_t period() const {
+    return has_period_override_ ? period_override_ : GetSamplePeriod();
+  }
+  // An exponential with mean period, or 0 if period is 0.
+  double NextInterval(int64_t period);
+  // Sample after interval more bytes, capping it at kMaxSamplingInterval.
+  void SetSamplingPoint(double interval);
 
-  static int sampling_rate_;
+  static std::atomic<int64_t> sampling_rate_;
+  // Incremented by SetSamplePeriod, so that a sampler can tell that its
+  // sampling point was picked with an old period.
+  static std::atomic<uint32_t> sampling_epoch_;
 
   // Bytes until we sample next.
   //
@@ -139,7 +191,13 @@ class Sampler {
   // DecrementFast{,Finish}, so casting to size_t is ok.
   ssize_t bytes_until_sample_{};
   uint64_t rnd_{};  // Cheap random number generator
+  int64_t period_override_{};
+  uint32_t epoch_{};  // The sampling_epoch_ of the last sampling point
   bool initialized_{};
+  bool has_period_override_{};
+  // Whether bytes_until_sample_ was capped, so that no byte is marked
+  // before it.
+  bool capped_{};
 };
 
 inline bool Sampler::RecordAllocation(size_t k) {
@@ -206,4 +264,19 @@ inline uint64_t Sampler::NextRandom(uint64_t rnd) {
   return (prng_mult * rnd + prng_add) & prng_mod_mask;
 }
 
+// log2(1 + i/256) for i in [0, 256].
+extern const float kSamplerLog2Table[257];
+
+inline double Sampler::FastLog2(uint32_t q) {
+  const float *table = kSamplerLog2Table;
+  assert(q != 0);
+  // Normalize q to 1.f * 2**e, with the 8 bits of f after the point
+  // indexing the table and the rest interpolating between entries.
+  const int e = 31 - __builtin_clz(q);
+  const uint32_t m = q << (31 - e);
+  const uint32_t i = (m >> 23) & 0xff;
+  const double t = (m & 0x7fffff) * (1.0 / (1 << 23));
+  return e + table[i] + (table[i + 1] - table[i]) * t;
+}
+
 #endif   // PYPPROF_SRC_SAMPLER_H_
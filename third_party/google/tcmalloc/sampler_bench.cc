@@ -1,10 +1,15 @@
 // Copyright 2019 Timothy Palpant
 
+#include <math.h>
+
 #include "benchmark/benchmark.h"
 
 #include "sampler.h"
 
+// The argument of each benchmark is the sample period.
+
 static void BM_RecordAllocation(benchmark::State& state) {
+    Sampler::SetSamplePeriod(state.range(0));
     Sampler s;
     for (auto _ : state) {
         s.RecordAllocation(10);
@@ -12,6 +17,7 @@ static void BM_RecordAllocation(benchmark::State& state) {
 }
 
 static void BM_TryRecordAllocationFast(benchmark::State& state) {
+    Sampler::SetSamplePeriod(state.range(0));
     Sampler s;
     for (auto _ : state) {
         if(!s.TryRecordAllocationFast(10)) {
@@ -20,5 +26,48 @@ static void BM_TryRecordAllocationFast(benchmark::State& state) {
     }
 }
 
-BENCHMARK(BM_RecordAllocation);
-BENCHMARK(BM_TryRecordAllocationFast);
+// The slow path, which runs once per sample.
+static void BM_PickNextSamplingPoint(benchmark::State& state) {
+    Sampler::SetSamplePeriod(state.range(0));
+    Sampler s;
+    s.Init(1);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(s.PickNextSamplingPoint());
+    }
+}
+
+// The logarithm of PickNextSamplingPoint, compared to libm below.
+static void BM_FastLog2(benchmark::State& state) {
+    uint64_t x = 1;
+    for (auto _ : state) {
+        x = Sampler::NextRandom(x);
+        benchmark::DoNotOptimize(Sampler::FastLog2((x >> 22) + 1));
+    }
+}
+
+static void BM_Log2(benchmark::State& state) {
+    uint64_t x = 1;
+    for (auto _ : state) {
+        x = Sampler::NextRandom(x);
+        benchmark::DoNotOptimize(log2(static_cast<double>((x >> 22) + 1)));
+    }
+}
+
+// Allocations on several threads while the period keeps changing.
+static void BM_RecordAllocationWithPeriodChanges(benchmark::State& state) {
+    Sampler s;
+    int64_t i = 0;
+    for (auto _ : state) {
+        if (state.thread_index() == 0 && (++i & 0xffff) == 0) {
+            Sampler::SetSamplePeriod((i & 0x10000) ? 1024 : 512 * 1024);
+        }
+        s.RecordAllocation(10);
+    }
+}
+
+BENCHMARK(BM_RecordAllocation)->Arg(0)->Arg(512 * 1024);
+BENCHMARK(BM_TryRecordAllocationFast)->Arg(0)->Arg(512 * 1024);
+BENCHMARK(BM_PickNextSamplingPoint)->Arg(512 * 1024)->Arg(int64_t{1} << 40);
+BENCHMARK(BM_FastLog2);
+BENCHMARK(BM_Log2);
+BENCHMARK(BM_RecordAllocationWithPeriodChanges)->Threads(1)->Threads(4);
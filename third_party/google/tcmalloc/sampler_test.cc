@@ -39,6 +39,8 @@
 #include <sys/types.h>
 #include <iostream>
 #include <algorithm>
+#include <atomic>
+#include <thread>
 #include <vector>
 #include <string>
 #include <math.h>
@@ -85,6 +87,19 @@ template<typename T> class scoped_array {
 static const double kSigmas = 4;
 static const size_t kSamplingInterval = 512*1024;
 
+// Sets the global sample period for the lifetime of the object.
+class ScopedSamplePeriod {
+ public:
+  explicit ScopedSamplePeriod(int64_t period)
+      : old_period_(Sampler::GetSamplePeriod()) {
+    Sampler::SetSamplePeriod(period);
+  }
+  ~ScopedSamplePeriod() { Sampler::SetSamplePeriod(old_period_); }
+
+ private:
+  const int64_t old_period_;
+};
+
 // Tests of the quality of the random numbers generated
 // This uses the Anderson Darling test for uniformity.
 // See "Evaluating the Anderson-Darling Distribution" by Marsaglia
@@ -225,10 +240,11 @@ TEST(Sampler, TestNextRandom_MultipleValues) {
 // First converts to uniforms then applied the
 // Anderson-Darling test for uniformity.
 void TestPickNextSample(int n) {
+  ScopedSamplePeriod period(kSamplingInterval);
   Sampler sampler;
   sampler.Init(1);
   scoped_array<uint64_t> int_random_sample(new uint64_t[n]);
-  int sample_period = sampler.GetSamplePeriod();
+  int64_t sample_period = sampler.GetSamplePeriod();
   int ones_count = 0;
   for (int i = 0; i < n; i++) {
     int_random_sample[i] = sampler.PickNextSamplingPoint();
@@ -288,6 +304,7 @@ void TestLRand64Spread() {
 // Futher tests
 
 bool CheckMean(size_t mean, int num_samples) {
+  ScopedSamplePeriod period(mean);
   Sampler sampler;
   sampler.Init(1);
   size_t total = 0;
@@ -321,6 +338,7 @@ double StandardDeviationsErrorInSample(
 }
 
 TEST(Sampler, LargeAndSmallAllocs_CombinedTest) {
+  ScopedSamplePeriod period(kSamplingInterval);
   Sampler sampler;
   sampler.Init(1);
   int counter_big = 0;
@@ -573,6 +591,139 @@ TEST(Sampler, arithmetic_2) {
 }
 
 
+// A period override takes effect immediately, and only for its sampler.
+TEST(Sampler, PeriodOverride) {
+  const int64_t old_period = Sampler::GetSamplePeriod();
+  Sampler::SetSamplePeriod(-1);
+  Sampler sampler;
+  sampler.Init(1);
+  Sampler other;
+  other.Init(2);
+  EXPECT_TRUE(sampler.RecordAllocation(100));
+
+  // Period 0 samples every allocation.
+  sampler.SetPeriodOverride(0);
+  for (int i = 0; i < 100; i++) {
+    EXPECT_FALSE(sampler.RecordAllocation(8));
+  }
+  EXPECT_TRUE(other.RecordAllocation(8));
+
+  // A negative period samples nothing, even with a small global period.
+  Sampler::SetSamplePeriod(1);
+  sampler.SetPeriodOverride(-1);
+  for (int i = 0; i < 100; i++) {
+    EXPECT_TRUE(sampler.RecordAllocation(1 << 20));
+  }
+
+  Sampler::SetSamplePeriod(0);
+  sampler.ClearPeriodOverride();
+  EXPECT_FALSE(sampler.RecordAllocation(8));
+  Sampler::SetSamplePeriod(old_period);
+}
+
+// FastLog2 is close enough to log2 that the sampling points it gives
+// cannot be told apart from exact ones.
+TEST(Sampler, FastLog2) {
+  for (int e = 0; e < 32; e++) {
+    const uint32_t q = static_cast<uint32_t>(1) << e;
+    EXPECT_EQ(Sampler::FastLog2(q), e);
+  }
+  uint64_t x = 1;
+  for (int i = 0; i < 100000; i++) {
+    x = Sampler::NextRandom(x);
+    const uint32_t q = static_cast<uint32_t>(x >> 16) | 1;
+    EXPECT_NEAR(Sampler::FastLog2(q), log2(q), 4e-6) << q;
+  }
+}
+
+// Counts how many of n allocations of size bytes are sampled.
+int CountSampled(Sampler *sampler, int n, size_t size) {
+  int sampled = 0;
+  for (int i = 0; i < n; i++) {
+    if (!sampler->RecordAllocation(size)) {
+      sampled++;
+    }
+  }
+  return sampled;
+}
+
+// The number of standard deviations between the number of sampled
+// allocations and the expected number.
+double SampledErrorInSds(int n, int sampled, size_t size, int64_t period) {
+  const double p = 1 - exp(-static_cast<double>(size) / period);
+  return (sampled - n * p) / sqrt(p * (1 - p) * n);
+}
+
+// Periods and sampling points beyond 32 bits, where the sampling points
+// are capped and drawn again at the cap.
+TEST(Sampler, LargePeriods) {
+  const int64_t period = static_cast<int64_t>(1) << 33;
+  ScopedSamplePeriod scoped_period(period);
+  Sampler sampler;
+  sampler.Init(1);
+  const int n = 4000;
+  const size_t size = 1 << 30;
+  const int sampled = CountSampled(&sampler, n, size);
+  EXPECT_LE(fabs(SampledErrorInSds(n, sampled, size, period)), kSigmas);
+}
+
+// Capping sampling points does not change which small allocations are
+// sampled.
+TEST(Sampler, CappedSamplingPoints) {
+  const int64_t period = 4 * Sampler::kMaxSamplingInterval;
+  ScopedSamplePeriod scoped_period(period);
+  Sampler sampler;
+  sampler.Init(1);
+  const int n = 40000;
+  const size_t size = 1 << 20;
+  const int sampled = CountSampled(&sampler, n, size);
+  EXPECT_LE(fabs(SampledErrorInSds(n, sampled, size, period)), kSigmas);
+}
+
+// A sampler picks up a new period within kMaxSamplingInterval bytes, even
+// if its sampling point was picked with a much larger one.
+TEST(Sampler, PeriodChange) {
+  ScopedSamplePeriod scoped_period(static_cast<int64_t>(1) << 40);
+  Sampler sampler;
+  sampler.Init(1);
+  EXPECT_TRUE(sampler.RecordAllocation(8));
+
+  Sampler::SetSamplePeriod(0);
+  const size_t size = 1 << 20;
+  int allocations = 1;
+  while (sampler.RecordAllocation(size)) {
+    allocations++;
+    ASSERT_LE(allocations, Sampler::kMaxSamplingInterval / size + 1);
+  }
+  for (int i = 0; i < 100; i++) {
+    EXPECT_FALSE(sampler.RecordAllocation(8));
+  }
+
+  // And when the period goes back up, sampling points are picked with it.
+  Sampler::SetSamplePeriod(kSamplingInterval);
+  const int n = 100000;
+  const int sampled = CountSampled(&sampler, n, 1024);
+  EXPECT_LE(fabs(SampledErrorInSds(n, sampled, 1024, kSamplingInterval)),
+            kSigmas);
+}
+
+// The period may be changed while other threads allocate.
+TEST(Sampler, SetSamplePeriodWhileAllocating) {
+  ScopedSamplePeriod scoped_period(kSamplingInterval);
+  std::atomic<bool> done(false);
+  std::thread setter([&done] {
+    for (int64_t i = 0; !done.load(); i++) {
+      Sampler::SetSamplePeriod((i % 2 == 0) ? 1024 : kSamplingInterval);
+    }
+  });
+  Sampler sampler;
+  sampler.Init(1);
+  const int sampled = CountSampled(&sampler, 1000000, 64);
+  done.store(true);
+  setter.join();
+  EXPECT_GT(sampled, 0);
+}
+
 // It's not really a test, but it's good to know
 TEST(Sample, size_of_class) {
   Sampler sampler;